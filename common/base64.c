@@ -11,28 +11,28 @@
 
 #include "common/cs_dbg.h"
 
-/* ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/ */
+#if !CS_BASE64_DISABLE_SIMD && (defined(__clang__) || __GNUC__ >= 5) && \
+    (defined(__x86_64__) || defined(__i386__))
+#define CS_BASE64_SSSE3 1
+#include <immintrin.h>
+#endif
+
+#if !CS_BASE64_DISABLE_SIMD && defined(__aarch64__) && defined(__ARM_NEON)
+#define CS_BASE64_NEON 1
+#include <arm_neon.h>
+#endif
+
+static const char s_b64_chars[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
 
-#define NUM_UPPERCASES ('Z' - 'A' + 1)
-#define NUM_LETTERS (NUM_UPPERCASES * 2)
-#define NUM_DIGITS ('9' - '0' + 1)
 
 /*
  * Emit a base64 code char.
  *
- * Doesn't use memory, thus it's safe to use to safely dump memory in crashdumps
+ * Doesn't allocate memory, thus it's safe to use to dump memory in crashdumps
  */
 static void cs_base64_emit_code(struct cs_base64_ctx *ctx, int v) {
-  if (v < NUM_UPPERCASES) {
-    ctx->b64_putc(v + 'A', ctx->user_data);
-  } else if (v < (NUM_LETTERS)) {
-    ctx->b64_putc(v - NUM_UPPERCASES + 'a', ctx->user_data);
-  } else if (v < (NUM_LETTERS + NUM_DIGITS)) {
-    ctx->b64_putc(v - NUM_LETTERS + '0', ctx->user_data);
-  } else {
-    ctx->b64_putc(v - NUM_LETTERS - NUM_DIGITS == 0 ? '+' : '/',
-                  ctx->user_data);
-  }
+  ctx->b64_putc(s_b64_chars[v], ctx->user_data);
 }
 
 static void cs_base64_emit_chunk(struct cs_base64_ctx *ctx) {
@@ -82,6 +82,121 @@ void cs_base64_finish(struct cs_base64_ctx *ctx) {
   }
 }
 
+#ifdef CS_BASE64_SSSE3
+/*
+ * 12 input bytes -> 16 output chars per iteration. See Wojciech Mula,
+ * "Base64 encoding with SIMD instructions".
+ */
+__attribute__((target("ssse3"))) static size_t cs_base64_encode_ssse3(
+    const unsigned char *src, size_t len, char *dst) {
+  const __m128i shuf =
+      _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1);
+  const __m128i lut = _mm_setr_epi8(65, 71, -4, -4, -4, -4, -4, -4, -4, -4, -4,
+                                    -4, -19, -16, 0, 0);
+  size_t n = 0;
+  /* Loads are 16 bytes wide, only 12 are consumed. */
+  while (len - n >= 16) {
+    __m128i in = _mm_loadu_si128((const __m128i *) (src + n)), t0, t1, idx;
+    /* Split 3 bytes into 4 6-bit indices, one per output byte. */
+    in = _mm_shuffle_epi8(in, shuf);
+    t0 = _mm_mulhi_epu16(_mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00)),
+                         _mm_set1_epi32(0x04000040));
+    t1 = _mm_mullo_epi16(_mm_and_si128(in, _mm_set1_epi32(0x003f03f0)),
+                         _mm_set1_epi32(0x01000010));
+    in = _mm_or_si128(t0, t1);
+    /* Map indices to ASCII by adding a per-range offset. */
+    idx = _mm_subs_epu8(in, _mm_set1_epi8(51));
+    idx = _mm_sub_epi8(idx, _mm_cmpgt_epi8(in, _mm_set1_epi8(25)));
+    in = _mm_add_epi8(in, _mm_shuffle_epi8(lut, idx));
+    _mm_storeu_si128((__m128i *) dst, in);
+    dst += 16;
+    n += 12;
+  }
+  return n;
+}
+
+static int cs_base64_have_ssse3(void) {
+  static int s_have = -1;
+  if (s_have < 0) {
+    __builtin_cpu_init();
+    s_have = __builtin_cpu_supports("ssse3");
+  }
+  return s_have;
+}
+#endif /* CS_BASE64_SSSE3 */
+
+#ifdef CS_BASE64_NEON
+/* 48 input bytes -> 64 output chars per iteration. */
+static size_t cs_base64_encode_neon(const unsigned char *src, size_t len,
+                                    char *dst) {
+  const uint8x16_t mask = vdupq_n_u8(0x3F);
+  uint8x16x4_t tbl, out;
+  size_t n = 0;
+  tbl.val[0] = vld1q_u8((const uint8_t *) s_b64_chars);
+  tbl.val[1] = vld1q_u8((const uint8_t *) s_b64_chars + 16);
+  tbl.val[2] = vld1q_u8((const uint8_t *) s_b64_chars + 32);
+  tbl.val[3] = vld1q_u8((const uint8_t *) s_b64_chars + 48);
+  while (len - n >= 48) {
+    uint8x16x3_t in = vld3q_u8(src + n);
+    out.val[0] = vshrq_n_u8(in.val[0], 2);
+    out.val[1] = vandq_u8(
+        vorrq_u8(vshrq_n_u8(in.val[1], 4), vshlq_n_u8(in.val[0], 4)), mask);
+    out.val[2] = vandq_u8(
+        vorrq_u8(vshrq_n_u8(in.val[2], 6), vshlq_n_u8(in.val[1], 2)), mask);
+    out.val[3] = vandq_u8(in.val[2], mask);
+    out.val[0] = vqtbl4q_u8(tbl, out.val[0]);
+    out.val[1] = vqtbl4q_u8(tbl, out.val[1]);
+    out.val[2] = vqtbl4q_u8(tbl, out.val[2]);
+    out.val[3] = vqtbl4q_u8(tbl, out.val[3]);
+    vst4q_u8((uint8_t *) dst, out);
+    dst += 64;
+    n += 48;
+  }
+  return n;
+}
+#endif /* CS_BASE64_NEON */
+
+size_t cs_base64_encode_block(const unsigned char *src, size_t src_len,
+                              char *dst) {
+  char *p = dst;
+  size_t i = 0;
+
+#if defined(CS_BASE64_SSSE3)
+  if (src_len >= 16 && cs_base64_have_ssse3()) {
+    i = cs_base64_encode_ssse3(src, src_len, p);
+    p += i / 3 * 4;
+  }
+#elif defined(CS_BASE64_NEON)
+  i = cs_base64_encode_neon(src, src_len, p);
+  p += i / 3 * 4;
+#endif
+
+  for (; i + 3 <= src_len; i += 3) {
+    uint32_t v = (uint32_t) src[i] << 16 | (uint32_t) src[i + 1] << 8 |
+                 src[i + 2];
+    p[0] = s_b64_chars[v >> 18];
+    p[1] = s_b64_chars[(v >> 12) & 63];
+    p[2] = s_b64_chars[(v >> 6) & 63];
+    p[3] = s_b64_chars[v & 63];
+    p += 4;
+  }
+  if (i < src_len) {
+    uint32_t v = (uint32_t) src[i] << 16 |
+                 (i + 1 < src_len ? (uint32_t) src[i + 1] << 8 : 0);
+    p[0] = s_b64_chars[v >> 18];
+    p[1] = s_b64_chars[(v >> 12) & 63];
+    p[2] = (i + 1 < src_len ? s_b64_chars[(v >> 6) & 63] : '=');
+    p[3] = '=';
+    p += 4;
+  }
+
+  return p - dst;
+}
+
+void cs_base64_encode(const unsigned char *src, int src_len, char *dst) {
+  dst[cs_base64_encode_block(src, src_len, dst)] = '\0';
+}
+
 #define BASE64_ENCODE_BODY                                                \
   static const char *b64 =                                                \
       "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/"; \
@@ -107,23 +222,6 @@ void cs_base64_finish(struct cs_base64_ctx *ctx) {
   }                                                                       \
   BASE64_FLUSH()
 
-#define BASE64_OUT(ch) \
-  do {                 \
-    dst[j++] = (ch);   \
-  } while (0)
-
-#define BASE64_FLUSH() \
-  do {                 \
-    dst[j++] = '\0';   \
-  } while (0)
-
-void cs_base64_encode(const unsigned char *src, int src_len, char *dst) {
-  BASE64_ENCODE_BODY;
-}
-
-#undef BASE64_OUT
-#undef BASE64_FLUSH
-
 #if CS_ENABLE_STDIO
 #define BASE64_OUT(ch)      \
   do {                      \
@@ -141,65 +239,110 @@ void cs_fprint_base64(FILE *f, const unsigned char *src, int src_len) {
 #undef BASE64_FLUSH
 #endif /* CS_ENABLE_STDIO */
 
-/* Convert one byte of encoded base64 input stream to 6-bit chunk */
-static unsigned char from_b64(unsigned char ch) {
-  /* Inverse lookup map */
-  static const unsigned char tab[128] = {
-      255, 255, 255, 255,
-      255, 255, 255, 255, /*  0 */
-      255, 255, 255, 255,
-      255, 255, 255, 255, /*  8 */
-      255, 255, 255, 255,
-      255, 255, 255, 255, /*  16 */
-      255, 255, 255, 255,
-      255, 255, 255, 255, /*  24 */
-      255, 255, 255, 255,
-      255, 255, 255, 255, /*  32 */
-      255, 255, 255, 62,
-      255, 255, 255, 63, /*  40 */
-      52,  53,  54,  55,
-      56,  57,  58,  59, /*  48 */
-      60,  61,  255, 255,
-      255, 200, 255, 255, /*  56   '=' is 200, on index 61 */
-      255, 0,   1,   2,
-      3,   4,   5,   6, /*  64 */
-      7,   8,   9,   10,
-      11,  12,  13,  14, /*  72 */
-      15,  16,  17,  18,
-      19,  20,  21,  22, /*  80 */
-      23,  24,  25,  255,
-      255, 255, 255, 255, /*  88 */
-      255, 26,  27,  28,
-      29,  30,  31,  32, /*  96 */
-      33,  34,  35,  36,
-      37,  38,  39,  40, /*  104 */
-      41,  42,  43,  44,
-      45,  46,  47,  48, /*  112 */
-      49,  50,  51,  255,
-      255, 255, 255, 255, /*  120 */
-  };
-  return tab[ch & 127];
+/*
+ * Inverse lookup map: 6-bit value of a base64 char, 200 for '=' and 255 for
+ * anything else.
+ */
+static const unsigned char s_b64_rev[256] = {
+      255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+      255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+      255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,  62, 255, 255, 255,  63,
+       52,  53,  54,  55,  56,  57,  58,  59,  60,  61, 255, 255, 255, 200, 255, 255,
+      255,   0,   1,   2,   3,   4,   5,   6,   7,   8,   9,  10,  11,  12,  13,  14,
+       15,  16,  17,  18,  19,  20,  21,  22,  23,  24,  25, 255, 255, 255, 255, 255,
+      255,  26,  27,  28,  29,  30,  31,  32,  33,  34,  35,  36,  37,  38,  39,  40,
+       41,  42,  43,  44,  45,  46,  47,  48,  49,  50,  51, 255, 255, 255, 255, 255,
+      255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+      255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+      255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+      255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+      255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+      255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+      255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+      255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+};
+
+#ifdef CS_BASE64_SSSE3
+/*
+ * 16 input chars -> 12 output bytes per iteration; stops at the first block
+ * that contains anything but the 64 base64 chars, which is then left to the
+ * scalar loop. See Wojciech Mula, "Base64 decoding with SIMD instructions".
+ */
+__attribute__((target("ssse3"))) static size_t cs_base64_decode_ssse3(
+    const unsigned char *s, size_t len, char *dst) {
+  const __m128i lut_lo = _mm_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+                                       0x11, 0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B,
+                                       0x1B, 0x1A);
+  const __m128i lut_hi = _mm_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04,
+                                       0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+                                       0x10, 0x10);
+  const __m128i lut_roll =
+      _mm_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+  const __m128i mask_2f = _mm_set1_epi8(0x2f);
+  const __m128i pack = _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1,
+                                     -1, -1, -1);
+  size_t n = 0;
+  /*
+   * Stores are 16 bytes wide, only 12 are produced; the 8 chars required to
+   * follow guarantee there's room for the extra 4 in the output.
+   */
+  while (len - n >= 24) {
+    __m128i in = _mm_loadu_si128((const __m128i *) (s + n));
+    __m128i hi_nibbles = _mm_and_si128(_mm_srli_epi32(in, 4), mask_2f);
+    __m128i lo = _mm_shuffle_epi8(lut_lo, _mm_and_si128(in, mask_2f));
+    __m128i hi = _mm_shuffle_epi8(lut_hi, hi_nibbles);
+    __m128i roll = _mm_shuffle_epi8(
+        lut_roll, _mm_add_epi8(_mm_cmpeq_epi8(in, mask_2f), hi_nibbles));
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(lo, hi),
+                                         _mm_setzero_si128())) != 0xFFFF) {
+      break;
+    }
+    in = _mm_add_epi8(in, roll);
+    /* Pack 4 6-bit values into 3 bytes. */
+    in = _mm_maddubs_epi16(in, _mm_set1_epi32(0x01400140));
+    in = _mm_madd_epi16(in, _mm_set1_epi32(0x00011000));
+    _mm_storeu_si128((__m128i *) dst, _mm_shuffle_epi8(in, pack));
+    dst += 12;
+    n += 16;
+  }
+  return n;
 }
+#endif /* CS_BASE64_SSSE3 */
 
-int cs_base64_decode(const unsigned char *s, int len, char *dst, int *dec_len) {
+size_t cs_base64_decode_block(const unsigned char *s, size_t len, char *dst,
+                              size_t *dec_len) {
   unsigned char a, b, c, d;
-  int orig_len = len;
-  char *orig_dst = dst;
-  while (len >= 4 && (a = from_b64(s[0])) != 255 &&
-         (b = from_b64(s[1])) != 255 && (c = from_b64(s[2])) != 255 &&
-         (d = from_b64(s[3])) != 255) {
-    s += 4;
-    len -= 4;
+  size_t i = 0;
+  char *p = dst;
+
+#ifdef CS_BASE64_SSSE3
+  if (len >= 24 && cs_base64_have_ssse3()) {
+    i = cs_base64_decode_ssse3(s, len, p);
+    p += i / 4 * 3;
+  }
+#endif
+
+  while (len - i >= 4 && (a = s_b64_rev[s[i]]) != 255 &&
+         (b = s_b64_rev[s[i + 1]]) != 255 &&
+         (c = s_b64_rev[s[i + 2]]) != 255 &&
+         (d = s_b64_rev[s[i + 3]]) != 255) {
+    i += 4;
     if (a == 200 || b == 200) break; /* '=' can't be there */
-    *dst++ = a << 2 | b >> 4;
+    *p++ = a << 2 | b >> 4;
     if (c == 200) break;
-    *dst++ = b << 4 | c >> 2;
+    *p++ = b << 4 | c >> 2;
     if (d == 200) break;
-    *dst++ = c << 6 | d;
+    *p++ = c << 6 | d;
   }
-  *dst = 0;
-  if (dec_len != NULL) *dec_len = (dst - orig_dst);
-  return orig_len - len;
+  if (dec_len != NULL) *dec_len = p - dst;
+  return i;
+}
+
+int cs_base64_decode(const unsigned char *s, int len, char *dst, int *dec_len) {
+  size_t n, consumed = cs_base64_decode_block(s, len, dst, &n);
+  dst[n] = '\0';
+  if (dec_len != NULL) *dec_len = (int) n;
+  return (int) consumed;
 }
 
 #endif /* EXCLUDE_COMMON */
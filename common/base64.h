@@ -10,9 +10,20 @@
 #define DISABLE_BASE64 0
 #endif
 
+/* Set to 1 to not use SSSE3 or NEON code even if available. */
+#ifndef CS_BASE64_DISABLE_SIMD
+#define CS_BASE64_DISABLE_SIMD 0
+#endif
+
 #if !DISABLE_BASE64
 
 #include <stdio.h>
+#include <stddef.h>
+
+/* Length of base64 encoding of n bytes, without the terminating NUL. */
+#define CS_BASE64_ENCODED_LEN(n) (((n) + 2) / 3 * 4)
+/* Upper bound of the length of n decoded base64 chars. */
+#define CS_BASE64_DECODED_MAX_LEN(n) ((n) / 4 * 3)
 
 #ifdef __cplusplus
 extern "C" {
@@ -37,6 +48,24 @@ void cs_base64_encode(const unsigned char *src, int src_len, char *dst);
 void cs_fprint_base64(FILE *f, const unsigned char *src, int src_len);
 int cs_base64_decode(const unsigned char *s, int len, char *dst, int *dec_len);
 
+/*
+ * Encodes `src_len` bytes into `dst`, which must have room for
+ * `CS_BASE64_ENCODED_LEN(src_len)` chars. The output is padded but not
+ * NUL-terminated. Returns the number of chars written.
+ */
+size_t cs_base64_encode_block(const unsigned char *src, size_t src_len,
+                              char *dst);
+
+/*
+ * Decodes `len` base64 chars into `dst`, which must have room for
+ * `CS_BASE64_DECODED_MAX_LEN(len)` bytes. Decoding stops at the first
+ * invalid char or after padding. The output is not NUL-terminated, its length
+ * is stored in `dec_len` unless it is NULL. Returns the number of chars
+ * consumed, same as `cs_base64_decode()`.
+ */
+size_t cs_base64_decode_block(const unsigned char *s, size_t len, char *dst,
+                              size_t *dec_len);
+
 #ifdef __cplusplus
 }
 #endif
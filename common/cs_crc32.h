@@ -7,6 +7,29 @@
 
 #include <inttypes.h>
 
+#include "common/platform.h"
+
+/*
+ * Set to 1 to use the compact 64-byte table (two lookups per byte) instead of
+ * the 8 KB slicing-by-8 tables and CPU-specific code. Defaults to 1 on
+ * embedded targets, where 8 KB of constants may end up in RAM.
+ */
+#ifndef CS_CRC32_SMALL
+#if CS_PLATFORM == CS_P_UNIX || CS_PLATFORM == CS_P_WINDOWS
+#define CS_CRC32_SMALL 0
+#else
+#define CS_CRC32_SMALL 1
+#endif
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
 uint32_t cs_crc32(uint32_t crc, const void *data, uint32_t len);
 
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
 #endif /* CS_COMMON_CS_CRC32_H_ */
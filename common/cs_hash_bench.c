@@ -0,0 +1,102 @@
+/*
+ * Copyright (c) 2014-2017 Cesanta Software Limited
+ * All rights reserved
+ *
+ * Throughput of the checksum and hash kernels, in MB/s.
+ * Build and run with `make cs_hash_bench`.
+ */
+
+#define CS_HASH_BENCH 1
+
+/* Kernels are static, so the sources are included directly. */
+#include "common/cs_crc32.c"
+#include "common/cs_md5.c"
+#include "common/cs_sha1.c"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "common/cs_time.h"
+
+#define BUF_SIZE (64 * 1024)
+#define MIN_TIME 0.5
+
+static unsigned char s_buf[BUF_SIZE];
+static volatile uint32_t s_sink;
+
+typedef void (*kernel_t)(size_t len);
+
+static void bench(const char *name, kernel_t k, size_t len) {
+  double start = cs_time(), elapsed;
+  size_t total = 0;
+  do {
+    k(len);
+    total += len;
+  } while ((elapsed = cs_time() - start) < MIN_TIME);
+  printf("%-14s %6u bytes: %8.1f MB/s\n", name, (unsigned) len,
+         total / elapsed / 1e6);
+}
+
+static void crc32_small(size_t len) {
+  s_sink ^= cs_crc32_small(s_sink, s_buf, len);
+}
+
+#if !CS_CRC32_SMALL
+static void crc32_slice8(size_t len) {
+  s_sink ^= cs_crc32_slice8(s_sink, s_buf, len);
+}
+#endif
+
+static void crc32_dispatch(size_t len) {
+  s_sink ^= cs_crc32(s_sink, s_buf, len);
+}
+
+static void sha1_dispatch(size_t len) {
+  unsigned char digest[20];
+  cs_sha1_ctx ctx;
+  cs_sha1_init(&ctx);
+  cs_sha1_update(&ctx, s_buf, len);
+  cs_sha1_final(digest, &ctx);
+  s_sink ^= digest[0];
+}
+
+static void sha1_scalar(size_t len) {
+  s_sha1_force_scalar = 1;
+  sha1_dispatch(len);
+  s_sha1_force_scalar = 0;
+}
+
+static void md5(size_t len) {
+  unsigned char digest[16];
+  cs_md5_ctx ctx;
+  cs_md5_init(&ctx);
+  cs_md5_update(&ctx, s_buf, len);
+  cs_md5_final(digest, &ctx);
+  s_sink ^= digest[0];
+}
+
+int main(void) {
+  static const size_t sizes[] = {64, 1024, BUF_SIZE};
+  size_t i;
+
+  for (i = 0; i < sizeof(s_buf); i++) s_buf[i] = (unsigned char) rand();
+
+#ifdef CS_CRC32_PCLMUL
+  printf("crc32: pclmul %s\n", cs_crc32_have_pclmul() ? "yes" : "no");
+#endif
+#ifdef CS_SHA1_SHANI
+  printf("sha1: sha-ni %s\n", cs_sha1_have_shani() ? "yes" : "no");
+#endif
+  for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+    bench("crc32 small", crc32_small, sizes[i]);
+#if !CS_CRC32_SMALL
+    bench("crc32 slice8", crc32_slice8, sizes[i]);
+#endif
+    bench("crc32", crc32_dispatch, sizes[i]);
+    bench("sha1 scalar", sha1_scalar, sizes[i]);
+    bench("sha1", sha1_dispatch, sizes[i]);
+    bench("md5", md5, sizes[i]);
+  }
+
+  return 0;
+}
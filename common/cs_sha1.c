@@ -12,6 +12,16 @@
 #include "common/solarisfixes.h"
 #endif
 
+#if !CS_DISABLE_SHA1_ACCEL && (defined(__clang__) || __GNUC__ >= 5) && \
+    (defined(__x86_64__) || defined(__i386__))
+#define CS_SHA1_SHANI 1
+#include <cpuid.h>
+#include <immintrin.h>
+#elif !CS_DISABLE_SHA1_ACCEL && defined(__ARM_FEATURE_CRYPTO)
+#define CS_SHA1_ARM 1
+#include <arm_neon.h>
+#endif
+
 union char64long16 {
   unsigned char c[64];
   uint32_t l[16];
@@ -162,6 +172,319 @@ void cs_sha1_transform(uint32_t state[5], const unsigned char buffer[64]) {
   (void) e;
 }
 
+#ifdef CS_SHA1_SHANI
+/* SHA extensions (SHA-NI), 4 rounds per sha1rnds4. */
+__attribute__((target("sha,ssse3,sse4.1"))) static void cs_sha1_blocks_shani(
+    uint32_t state[5], const unsigned char *data, uint32_t num_blocks) {
+  const __m128i mask =
+      _mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+  __m128i abcd, abcd_save, e0, e0_save, e1, msg0, msg1, msg2, msg3;
+
+  abcd = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) state), 0x1B);
+  e0 = _mm_set_epi32((int) state[4], 0, 0, 0);
+
+  while (num_blocks-- > 0) {
+    abcd_save = abcd;
+    e0_save = e0;
+    msg0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) data), mask);
+    msg1 =
+        _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (data + 16)), mask);
+    msg2 =
+        _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (data + 32)), mask);
+    msg3 =
+        _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (data + 48)), mask);
+    e0 = _mm_add_epi32(e0, msg0);
+    e1 = abcd;
+    abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+    e1 = _mm_sha1nexte_epu32(e1, msg1);
+    e0 = abcd;
+    abcd = _mm_sha1rnds4_epu32(abcd, e1, 0);
+    msg0 = _mm_sha1msg1_epu32(msg0, msg1);
+    e0 = _mm_sha1nexte_epu32(e0, msg2);
+    e1 = abcd;
+    abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+    msg1 = _mm_sha1msg1_epu32(msg1, msg2);
+    msg0 = _mm_xor_si128(msg0, msg2);
+    e1 = _mm_sha1nexte_epu32(e1, msg3);
+    e0 = abcd;
+    msg0 = _mm_sha1msg2_epu32(msg0, msg3);
+    abcd = _mm_sha1rnds4_epu32(abcd, e1, 0);
+    msg2 = _mm_sha1msg1_epu32(msg2, msg3);
+    msg1 = _mm_xor_si128(msg1, msg3);
+    e0 = _mm_sha1nexte_epu32(e0, msg0);
+    e1 = abcd;
+    msg1 = _mm_sha1msg2_epu32(msg1, msg0);
+    abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+    msg3 = _mm_sha1msg1_epu32(msg3, msg0);
+    msg2 = _mm_xor_si128(msg2, msg0);
+    e1 = _mm_sha1nexte_epu32(e1, msg1);
+    e0 = abcd;
+    msg2 = _mm_sha1msg2_epu32(msg2, msg1);
+    abcd = _mm_sha1rnds4_epu32(abcd, e1, 1);
+    msg0 = _mm_sha1msg1_epu32(msg0, msg1);
+    msg3 = _mm_xor_si128(msg3, msg1);
+    e0 = _mm_sha1nexte_epu32(e0, msg2);
+    e1 = abcd;
+    msg3 = _mm_sha1msg2_epu32(msg3, msg2);
+    abcd = _mm_sha1rnds4_epu32(abcd, e0, 1);
+    msg1 = _mm_sha1msg1_epu32(msg1, msg2);
+    msg0 = _mm_xor_si128(msg0, msg2);
+    e1 = _mm_sha1nexte_epu32(e1, msg3);
+    e0 = abcd;
+    msg0 = _mm_sha1msg2_epu32(msg0, msg3);
+    abcd = _mm_sha1rnds4_epu32(abcd, e1, 1);
+    msg2 = _mm_sha1msg1_epu32(msg2, msg3);
+    msg1 = _mm_xor_si128(msg1, msg3);
+    e0 = _mm_sha1nexte_epu32(e0, msg0);
+    e1 = abcd;
+    msg1 = _mm_sha1msg2_epu32(msg1, msg0);
+    abcd = _mm_sha1rnds4_epu32(abcd, e0, 1);
+    msg3 = _mm_sha1msg1_epu32(msg3, msg0);
+    msg2 = _mm_xor_si128(msg2, msg0);
+    e1 = _mm_sha1nexte_epu32(e1, msg1);
+    e0 = abcd;
+    msg2 = _mm_sha1msg2_epu32(msg2, msg1);
+    abcd = _mm_sha1rnds4_epu32(abcd, e1, 1);
+    msg0 = _mm_sha1msg1_epu32(msg0, msg1);
+    msg3 = _mm_xor_si128(msg3, msg1);
+    e0 = _mm_sha1nexte_epu32(e0, msg2);
+    e1 = abcd;
+    msg3 = _mm_sha1msg2_epu32(msg3, msg2);
+    abcd = _mm_sha1rnds4_epu32(abcd, e0, 2);
+    msg1 = _mm_sha1msg1_epu32(msg1, msg2);
+    msg0 = _mm_xor_si128(msg0, msg2);
+    e1 = _mm_sha1nexte_epu32(e1, msg3);
+    e0 = abcd;
+    msg0 = _mm_sha1msg2_epu32(msg0, msg3);
+    abcd = _mm_sha1rnds4_epu32(abcd, e1, 2);
+    msg2 = _mm_sha1msg1_epu32(msg2, msg3);
+    msg1 = _mm_xor_si128(msg1, msg3);
+    e0 = _mm_sha1nexte_epu32(e0, msg0);
+    e1 = abcd;
+    msg1 = _mm_sha1msg2_epu32(msg1, msg0);
+    abcd = _mm_sha1rnds4_epu32(abcd, e0, 2);
+    msg3 = _mm_sha1msg1_epu32(msg3, msg0);
+    msg2 = _mm_xor_si128(msg2, msg0);
+    e1 = _mm_sha1nexte_epu32(e1, msg1);
+    e0 = abcd;
+    msg2 = _mm_sha1msg2_epu32(msg2, msg1);
+    abcd = _mm_sha1rnds4_epu32(abcd, e1, 2);
+    msg0 = _mm_sha1msg1_epu32(msg0, msg1);
+    msg3 = _mm_xor_si128(msg3, msg1);
+    e0 = _mm_sha1nexte_epu32(e0, msg2);
+    e1 = abcd;
+    msg3 = _mm_sha1msg2_epu32(msg3, msg2);
+    abcd = _mm_sha1rnds4_epu32(abcd, e0, 2);
+    msg1 = _mm_sha1msg1_epu32(msg1, msg2);
+    msg0 = _mm_xor_si128(msg0, msg2);
+    e1 = _mm_sha1nexte_epu32(e1, msg3);
+    e0 = abcd;
+    msg0 = _mm_sha1msg2_epu32(msg0, msg3);
+    abcd = _mm_sha1rnds4_epu32(abcd, e1, 3);
+    msg2 = _mm_sha1msg1_epu32(msg2, msg3);
+    msg1 = _mm_xor_si128(msg1, msg3);
+    e0 = _mm_sha1nexte_epu32(e0, msg0);
+    e1 = abcd;
+    msg1 = _mm_sha1msg2_epu32(msg1, msg0);
+    abcd = _mm_sha1rnds4_epu32(abcd, e0, 3);
+    msg3 = _mm_sha1msg1_epu32(msg3, msg0);
+    msg2 = _mm_xor_si128(msg2, msg0);
+    e1 = _mm_sha1nexte_epu32(e1, msg1);
+    e0 = abcd;
+    msg2 = _mm_sha1msg2_epu32(msg2, msg1);
+    abcd = _mm_sha1rnds4_epu32(abcd, e1, 3);
+    msg3 = _mm_xor_si128(msg3, msg1);
+    e0 = _mm_sha1nexte_epu32(e0, msg2);
+    e1 = abcd;
+    msg3 = _mm_sha1msg2_epu32(msg3, msg2);
+    abcd = _mm_sha1rnds4_epu32(abcd, e0, 3);
+    e1 = _mm_sha1nexte_epu32(e1, msg3);
+    e0 = abcd;
+    abcd = _mm_sha1rnds4_epu32(abcd, e1, 3);
+    e0 = _mm_sha1nexte_epu32(e0, e0_save);
+    abcd = _mm_add_epi32(abcd, abcd_save);
+    data += 64;
+  }
+
+  _mm_storeu_si128((__m128i *) state, _mm_shuffle_epi32(abcd, 0x1B));
+  state[4] = (uint32_t) _mm_extract_epi32(e0, 3);
+}
+
+static int cs_sha1_have_shani(void) {
+  static int s_have = -1;
+  if (s_have < 0) {
+    unsigned int eax, ebx = 0, ecx, edx;
+    /* CPUID leaf 7: EBX bit 29 is SHA. */
+    if (__get_cpuid_max(0, NULL) >= 7) {
+      __cpuid_count(7, 0, eax, ebx, ecx, edx);
+    }
+    (void) eax;
+    (void) ecx;
+    (void) edx;
+    __builtin_cpu_init();
+    s_have = ((ebx >> 29) & 1) && __builtin_cpu_supports("sse4.1");
+  }
+  return s_have;
+}
+#endif /* CS_SHA1_SHANI */
+
+#ifdef CS_SHA1_ARM
+/* ARMv8 Cryptography Extensions. */
+static void cs_sha1_blocks_arm(uint32_t state[5], const unsigned char *data,
+                               uint32_t num_blocks) {
+  const uint32x4_t k0 = vdupq_n_u32(0x5A827999);
+  const uint32x4_t k1 = vdupq_n_u32(0x6ED9EBA1);
+  const uint32x4_t k2 = vdupq_n_u32(0x8F1BBCDC);
+  const uint32x4_t k3 = vdupq_n_u32(0xCA62C1D6);
+  uint32x4_t abcd, abcd_save, tmp0, tmp1, msg0, msg1, msg2, msg3;
+  uint32_t e0, e0_save, e1;
+
+  abcd = vld1q_u32(state);
+  e0 = state[4];
+
+  while (num_blocks-- > 0) {
+    abcd_save = abcd;
+    e0_save = e0;
+    msg0 = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data)));
+    msg1 = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data + 16)));
+    msg2 = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data + 32)));
+    msg3 = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data + 48)));
+    tmp0 = vaddq_u32(msg0, k0);
+    tmp1 = vaddq_u32(msg1, k0);
+    e1 = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+    abcd = vsha1cq_u32(abcd, e0, tmp0);
+    tmp0 = vaddq_u32(msg2, k0);
+    msg0 = vsha1su0q_u32(msg0, msg1, msg2);
+    e0 = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+    abcd = vsha1cq_u32(abcd, e1, tmp1);
+    tmp1 = vaddq_u32(msg3, k0);
+    msg0 = vsha1su1q_u32(msg0, msg3);
+    msg1 = vsha1su0q_u32(msg1, msg2, msg3);
+    e1 = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+    abcd = vsha1cq_u32(abcd, e0, tmp0);
+    tmp0 = vaddq_u32(msg0, k0);
+    msg1 = vsha1su1q_u32(msg1, msg0);
+    msg2 = vsha1su0q_u32(msg2, msg3, msg0);
+    e0 = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+    abcd = vsha1cq_u32(abcd, e1, tmp1);
+    tmp1 = vaddq_u32(msg1, k1);
+    msg2 = vsha1su1q_u32(msg2, msg1);
+    msg3 = vsha1su0q_u32(msg3, msg0, msg1);
+    e1 = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+    abcd = vsha1cq_u32(abcd, e0, tmp0);
+    tmp0 = vaddq_u32(msg2, k1);
+    msg3 = vsha1su1q_u32(msg3, msg2);
+    msg0 = vsha1su0q_u32(msg0, msg1, msg2);
+    e0 = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+    abcd = vsha1pq_u32(abcd, e1, tmp1);
+    tmp1 = vaddq_u32(msg3, k1);
+    msg0 = vsha1su1q_u32(msg0, msg3);
+    msg1 = vsha1su0q_u32(msg1, msg2, msg3);
+    e1 = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+    abcd = vsha1pq_u32(abcd, e0, tmp0);
+    tmp0 = vaddq_u32(msg0, k1);
+    msg1 = vsha1su1q_u32(msg1, msg0);
+    msg2 = vsha1su0q_u32(msg2, msg3, msg0);
+    e0 = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+    abcd = vsha1pq_u32(abcd, e1, tmp1);
+    tmp1 = vaddq_u32(msg1, k1);
+    msg2 = vsha1su1q_u32(msg2, msg1);
+    msg3 = vsha1su0q_u32(msg3, msg0, msg1);
+    e1 = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+    abcd = vsha1pq_u32(abcd, e0, tmp0);
+    tmp0 = vaddq_u32(msg2, k2);
+    msg3 = vsha1su1q_u32(msg3, msg2);
+    msg0 = vsha1su0q_u32(msg0, msg1, msg2);
+    e0 = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+    abcd = vsha1pq_u32(abcd, e1, tmp1);
+    tmp1 = vaddq_u32(msg3, k2);
+    msg0 = vsha1su1q_u32(msg0, msg3);
+    msg1 = vsha1su0q_u32(msg1, msg2, msg3);
+    e1 = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+    abcd = vsha1mq_u32(abcd, e0, tmp0);
+    tmp0 = vaddq_u32(msg0, k2);
+    msg1 = vsha1su1q_u32(msg1, msg0);
+    msg2 = vsha1su0q_u32(msg2, msg3, msg0);
+    e0 = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+    abcd = vsha1mq_u32(abcd, e1, tmp1);
+    tmp1 = vaddq_u32(msg1, k2);
+    msg2 = vsha1su1q_u32(msg2, msg1);
+    msg3 = vsha1su0q_u32(msg3, msg0, msg1);
+    e1 = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+    abcd = vsha1mq_u32(abcd, e0, tmp0);
+    tmp0 = vaddq_u32(msg2, k2);
+    msg3 = vsha1su1q_u32(msg3, msg2);
+    msg0 = vsha1su0q_u32(msg0, msg1, msg2);
+    e0 = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+    abcd = vsha1mq_u32(abcd, e1, tmp1);
+    tmp1 = vaddq_u32(msg3, k3);
+    msg0 = vsha1su1q_u32(msg0, msg3);
+    msg1 = vsha1su0q_u32(msg1, msg2, msg3);
+    e1 = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+    abcd = vsha1mq_u32(abcd, e0, tmp0);
+    tmp0 = vaddq_u32(msg0, k3);
+    msg1 = vsha1su1q_u32(msg1, msg0);
+    msg2 = vsha1su0q_u32(msg2, msg3, msg0);
+    e0 = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+    abcd = vsha1pq_u32(abcd, e1, tmp1);
+    tmp1 = vaddq_u32(msg1, k3);
+    msg2 = vsha1su1q_u32(msg2, msg1);
+    msg3 = vsha1su0q_u32(msg3, msg0, msg1);
+    e1 = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+    abcd = vsha1pq_u32(abcd, e0, tmp0);
+    tmp0 = vaddq_u32(msg2, k3);
+    msg3 = vsha1su1q_u32(msg3, msg2);
+    e0 = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+    abcd = vsha1pq_u32(abcd, e1, tmp1);
+    tmp1 = vaddq_u32(msg3, k3);
+    e1 = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+    abcd = vsha1pq_u32(abcd, e0, tmp0);
+    e0 = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+    abcd = vsha1pq_u32(abcd, e1, tmp1);
+    e0 += e0_save;
+    abcd = vaddq_u32(abcd, abcd_save);
+    data += 64;
+  }
+
+  vst1q_u32(state, abcd);
+  state[4] = e0;
+}
+#endif /* CS_SHA1_ARM */
+
+static void cs_sha1_blocks_scalar(uint32_t state[5], const unsigned char *data,
+                                  uint32_t num_blocks) {
+  while (num_blocks-- > 0) {
+    cs_sha1_transform(state, data);
+    data += 64;
+  }
+}
+
+#ifdef CS_HASH_BENCH
+/* Lets the benchmark time the portable kernel through the full API. */
+static int s_sha1_force_scalar;
+#endif
+
+/* Processes num_blocks consecutive 64-byte blocks. */
+static void cs_sha1_blocks(uint32_t state[5], const unsigned char *data,
+                           uint32_t num_blocks) {
+#ifdef CS_HASH_BENCH
+  if (s_sha1_force_scalar) {
+    cs_sha1_blocks_scalar(state, data, num_blocks);
+    return;
+  }
+#endif
+#if defined(CS_SHA1_SHANI)
+  if (cs_sha1_have_shani()) {
+    cs_sha1_blocks_shani(state, data, num_blocks);
+    return;
+  }
+#elif defined(CS_SHA1_ARM)
+  cs_sha1_blocks_arm(state, data, num_blocks);
+  return;
+#endif
+  cs_sha1_blocks_scalar(state, data, num_blocks);
+}
+
 void cs_sha1_init(cs_sha1_ctx *context) {
   context->state[0] = 0x67452301;
   context->state[1] = 0xEFCDAB89;
@@ -181,10 +504,9 @@ void cs_sha1_update(cs_sha1_ctx *context, const unsigned char *data,
   j = (j >> 3) & 63;
   if ((j + len) > 63) {
     memcpy(&context->buffer[j], data, (i = 64 - j));
-    cs_sha1_transform(context->state, context->buffer);
-    for (; i + 63 < len; i += 64) {
-      cs_sha1_transform(context->state, &data[i]);
-    }
+    cs_sha1_blocks(context->state, context->buffer, 1);
+    cs_sha1_blocks(context->state, &data[i], (len - i) / 64);
+    i += (len - i) & ~63U;
     j = 0;
   } else
     i = 0;
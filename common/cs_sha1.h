@@ -10,6 +10,11 @@
 #define CS_DISABLE_SHA1 0
 #endif
 
+/* Set to 1 to not use SHA-NI or ARMv8 SHA1 instructions even if available. */
+#ifndef CS_DISABLE_SHA1_ACCEL
+#define CS_DISABLE_SHA1_ACCEL 0
+#endif
+
 #if !CS_DISABLE_SHA1
 
 #include "common/platform.h"
@@ -7,6 +7,8 @@
 
 #include "common/json_utils.h"
 
+#include "common/base64.h"
+
 void mg_json_emit_str(struct mbuf *b, const struct mg_str s, int quote) WEAK;
 void mg_json_emit_str(struct mbuf *b, const struct mg_str s, int quote) {
   struct json_out out = JSON_OUT_MBUF(b);
@@ -20,3 +22,12 @@ int mg_json_printer_mbuf(struct json_out *out, const char *buf, size_t len) {
   mbuf_append((struct mbuf *) out->u.data, buf, len);
   return len;
 }
+
+#if !DISABLE_BASE64
+/* Frozen decodes %V one char at a time, use the block codec instead. */
+int json_base64_decode(const char *src, int len, char *dst) {
+  size_t n = 0;
+  cs_base64_decode_block((const unsigned char *) src, len, dst, &n);
+  return (int) n;
+}
+#endif
@@ -15,17 +15,36 @@
 #include "common/mg_rpc/mg_rpc_channel.h"
 #include "mongoose/mongoose.h"
 
+#if CS_ENABLE_UBJSON
+#include "common/ubjson.h"
+#endif
+
 #define MG_RPC_HELLO_CMD "RPC.Hello"
 
+#define MG_RPC_TIMEOUT_ERROR_CODE 408
+#define MG_RPC_EVICTED_ERROR_CODE 503
+
 struct mg_rpc {
   struct mg_rpc_cfg *cfg;
   int64_t next_id;
   int queue_len;
+  size_t queue_bytes;
   SLIST_HEAD(handlers, mg_rpc_handler_info) handlers;
   SLIST_HEAD(channels, mg_rpc_channel_info) channels;
-  SLIST_HEAD(requests, mg_rpc_sent_request_info) requests;
   SLIST_HEAD(observers, mg_rpc_observer_info) observers;
-  STAILQ_HEAD(queue, mg_rpc_queue_entry) queue;
+  STAILQ_HEAD(dst_queues, mg_rpc_dst_queue) dst_queues;
+  STAILQ_HEAD(streams, mg_rpc_stream_info) streams;
+  /*
+   * Open addressing (linear probing) tables, sizes are powers of 2:
+   * handlers by method name hash, requests awaiting response by id.
+   */
+  struct mg_rpc_handler_info **handlers_map;
+  unsigned int handlers_map_size;
+  unsigned int num_handlers;
+  struct mg_rpc_sent_request_info **requests_map;
+  unsigned int requests_map_size;
+  unsigned int num_requests;
+  double next_deadline; /* Earliest request deadline, 0 if none */
 };
 
 struct mg_rpc_handler_info {
@@ -33,6 +52,7 @@ struct mg_rpc_handler_info {
   const char *args_fmt;
   mg_handler_cb_t cb;
   void *cb_arg;
+  uint32_t hash;
   SLIST_ENTRY(mg_rpc_handler_info) handlers;
 };
 
@@ -42,20 +62,54 @@ struct mg_rpc_channel_info {
   unsigned int is_trusted : 1;
   unsigned int is_open : 1;
   unsigned int is_busy : 1;
+  unsigned int peer_ubjson : 1;   /* Peer at the other end accepts UBJSON */
+  unsigned int enc_announced : 1; /* We told the peer we accept it */
   SLIST_ENTRY(mg_rpc_channel_info) channels;
 };
 
 struct mg_rpc_sent_request_info {
   int64_t id;
+  double deadline; /* mg_time() after which the request times out, 0: never */
+  double timeout;
   mg_result_cb_t cb;
   void *cb_arg;
-  SLIST_ENTRY(mg_rpc_sent_request_info) requests;
+  SLIST_ENTRY(mg_rpc_sent_request_info) requests; /* Timeout processing */
 };
 
 struct mg_rpc_queue_entry {
-  struct mg_str dst;
   struct mg_str frame;
-  STAILQ_ENTRY(mg_rpc_queue_entry) queue;
+  int64_t req_id; /* Id of the request in the frame, 0 for responses */
+  TAILQ_ENTRY(mg_rpc_queue_entry) queue;
+};
+
+/*
+ * Frames waiting to be sent to a destination, a FIFO per priority.
+ * Indexed by prio - MG_RPC_PRIO_LOW.
+ */
+struct mg_rpc_dst_queue {
+  struct mg_str dst;
+  TAILQ_HEAD(mg_rpc_frame_queue, mg_rpc_queue_entry) q[MG_RPC_NUM_PRIOS];
+  int len;
+  STAILQ_ENTRY(mg_rpc_dst_queue) dst_queues;
+};
+
+/* Outgoing frame: a request if method is set, a response otherwise. */
+struct mg_rpc_out_frame {
+  int64_t id;
+  struct mg_str dst, tag, method;
+  struct mg_str bin;
+  bool more;
+  enum mg_rpc_prio prio;
+  int error_code;
+  struct mg_str error_msg;
+};
+
+/* Streamed response in progress. */
+struct mg_rpc_stream_info {
+  struct mg_rpc_request_info *ri;
+  mg_rpc_stream_cb_t cb;
+  void *cb_arg;
+  STAILQ_ENTRY(mg_rpc_stream_info) streams;
 };
 
 struct mg_rpc_observer_info {
@@ -69,6 +123,174 @@ static int64_t mg_rpc_get_id(struct mg_rpc *c) {
   return c->next_id;
 }
 
+static uint32_t mg_rpc_hash_str(const struct mg_str s) {
+  uint32_t h = 2166136261U;
+  size_t i;
+  for (i = 0; i < s.len; i++) h = (h ^ (uint8_t) s.p[i]) * 16777619U;
+  return h;
+}
+
+static struct mg_rpc_handler_info *mg_rpc_find_handler(
+    struct mg_rpc *c, const struct mg_str method) {
+  if (c->handlers_map_size == 0) return NULL;
+  unsigned int mask = c->handlers_map_size - 1;
+  uint32_t h = mg_rpc_hash_str(method);
+  unsigned int i = h & mask;
+  struct mg_rpc_handler_info *hi;
+  while ((hi = c->handlers_map[i]) != NULL) {
+    if (hi->hash == h && mg_vcmp(&method, hi->method) == 0) return hi;
+    i = (i + 1) & mask;
+  }
+  return NULL;
+}
+
+/* Replaces the existing handler of the same method, if any. */
+static void mg_rpc_handlers_map_put(struct mg_rpc_handler_info **map,
+                                    unsigned int size,
+                                    struct mg_rpc_handler_info *hi) {
+  unsigned int i = hi->hash & (size - 1);
+  while (map[i] != NULL) {
+    if (map[i]->hash == hi->hash && strcmp(map[i]->method, hi->method) == 0) {
+      break;
+    }
+    i = (i + 1) & (size - 1);
+  }
+  map[i] = hi;
+}
+
+static bool mg_rpc_add_handler_to_map(struct mg_rpc *c,
+                                      struct mg_rpc_handler_info *hi) {
+  /* Keep load factor under 3/4. */
+  if ((c->num_handlers + 1) * 4 > c->handlers_map_size * 3) {
+    unsigned int i, new_size = (c->handlers_map_size ? c->handlers_map_size * 2
+                                                     : 16);
+    struct mg_rpc_handler_info **new_map =
+        (struct mg_rpc_handler_info **) calloc(new_size, sizeof(*new_map));
+    if (new_map == NULL) return false;
+    for (i = 0; i < c->handlers_map_size; i++) {
+      if (c->handlers_map[i] == NULL) continue;
+      mg_rpc_handlers_map_put(new_map, new_size, c->handlers_map[i]);
+    }
+    free(c->handlers_map);
+    c->handlers_map = new_map;
+    c->handlers_map_size = new_size;
+  }
+  if (mg_rpc_find_handler(c, mg_mk_str(hi->method)) == NULL) {
+    c->num_handlers++;
+  }
+  mg_rpc_handlers_map_put(c->handlers_map, c->handlers_map_size, hi);
+  return true;
+}
+
+static unsigned int mg_rpc_id_slot(unsigned int size, int64_t id) {
+  uint64_t h = ((uint64_t) id) * 0x9e3779b97f4a7c15ULL;
+  return ((unsigned int) (h >> 32)) & (size - 1);
+}
+
+static void mg_rpc_requests_map_put(struct mg_rpc_sent_request_info **map,
+                                    unsigned int size,
+                                    struct mg_rpc_sent_request_info *ri) {
+  unsigned int i = mg_rpc_id_slot(size, ri->id);
+  while (map[i] != NULL) i = (i + 1) & (size - 1);
+  map[i] = ri;
+}
+
+static bool mg_rpc_add_request(struct mg_rpc *c,
+                               struct mg_rpc_sent_request_info *ri) {
+  if ((c->num_requests + 1) * 4 > c->requests_map_size * 3) {
+    unsigned int i, new_size = (c->requests_map_size ? c->requests_map_size * 2
+                                                     : 16);
+    struct mg_rpc_sent_request_info **new_map =
+        (struct mg_rpc_sent_request_info **) calloc(new_size,
+                                                    sizeof(*new_map));
+    if (new_map == NULL) return false;
+    for (i = 0; i < c->requests_map_size; i++) {
+      if (c->requests_map[i] == NULL) continue;
+      mg_rpc_requests_map_put(new_map, new_size, c->requests_map[i]);
+    }
+    free(c->requests_map);
+    c->requests_map = new_map;
+    c->requests_map_size = new_size;
+  }
+  mg_rpc_requests_map_put(c->requests_map, c->requests_map_size, ri);
+  c->num_requests++;
+  if (ri->deadline > 0 &&
+      (c->next_deadline == 0 || ri->deadline < c->next_deadline)) {
+    c->next_deadline = ri->deadline;
+  }
+  return true;
+}
+
+/* Removes request with the given id from the table and returns it. */
+static struct mg_rpc_sent_request_info *mg_rpc_remove_request(struct mg_rpc *c,
+                                                              int64_t id) {
+  if (c->num_requests == 0) return NULL;
+  unsigned int mask = c->requests_map_size - 1;
+  unsigned int i = mg_rpc_id_slot(c->requests_map_size, id), j;
+  struct mg_rpc_sent_request_info *ri;
+  while ((ri = c->requests_map[i]) != NULL && ri->id != id) {
+    i = (i + 1) & mask;
+  }
+  if (ri == NULL) return NULL;
+  c->requests_map[i] = NULL;
+  c->num_requests--;
+  /* Shift back the following entries that can no longer be reached. */
+  for (j = (i + 1) & mask; c->requests_map[j] != NULL; j = (j + 1) & mask) {
+    unsigned int k = mg_rpc_id_slot(c->requests_map_size,
+                                    c->requests_map[j]->id);
+    if (((j - k) & mask) >= ((j - i) & mask)) {
+      c->requests_map[i] = c->requests_map[j];
+      c->requests_map[j] = NULL;
+      i = j;
+    }
+  }
+  return ri;
+}
+
+static struct mg_rpc_sent_request_info *mg_rpc_find_request(struct mg_rpc *c,
+                                                            int64_t id) {
+  if (c->num_requests == 0) return NULL;
+  unsigned int mask = c->requests_map_size - 1;
+  unsigned int i = mg_rpc_id_slot(c->requests_map_size, id);
+  struct mg_rpc_sent_request_info *ri;
+  while ((ri = c->requests_map[i]) != NULL && ri->id != id) {
+    i = (i + 1) & mask;
+  }
+  return ri;
+}
+
+void mg_rpc_check_timeouts(struct mg_rpc *c) {
+  double now = mg_time();
+  unsigned int i;
+  SLIST_HEAD(expired, mg_rpc_sent_request_info) expired;
+  struct mg_rpc_sent_request_info *ri, *rit;
+  if (c == NULL || c->next_deadline == 0 || now < c->next_deadline) return;
+  /* Collect first, callbacks may send new requests and modify the table. */
+  SLIST_INIT(&expired);
+  c->next_deadline = 0;
+  for (i = 0; i < c->requests_map_size; i++) {
+    ri = c->requests_map[i];
+    if (ri == NULL || ri->deadline == 0) continue;
+    if (ri->deadline <= now) {
+      SLIST_INSERT_HEAD(&expired, ri, requests);
+    } else if (c->next_deadline == 0 || ri->deadline < c->next_deadline) {
+      c->next_deadline = ri->deadline;
+    }
+  }
+  SLIST_FOREACH(ri, &expired, requests) {
+    mg_rpc_remove_request(c, ri->id);
+  }
+  SLIST_FOREACH_SAFE(ri, &expired, requests, rit) {
+    struct mg_rpc_frame_info fi;
+    memset(&fi, 0, sizeof(fi));
+    fi.channel_type = "";
+    LOG(LL_DEBUG, ("Request %lld timed out", ri->id));
+    ri->cb(c, ri->cb_arg, &fi, mg_mk_str_n(NULL, 0), MG_RPC_TIMEOUT_ERROR_CODE,
+           mg_mk_str("timed out"));
+    free(ri);
+  }
+}
+
 static void mg_rpc_call_observers(struct mg_rpc *c, enum mg_rpc_event ev,
                                   void *ev_arg) {
   struct mg_rpc_observer_info *oi, *oit;
@@ -100,6 +322,49 @@ static struct mg_rpc_channel_info *mg_rpc_get_channel_info_by_dst(
   return default_ch;
 }
 
+static bool mg_rpc_channel_is_stream_ok(struct mg_rpc_channel_info *ci) {
+  return (ci->ch->is_stream_ok != NULL && ci->ch->is_stream_ok(ci->ch));
+}
+
+#if CS_ENABLE_UBJSON
+static bool mg_rpc_channel_is_binary_ok(struct mg_rpc_channel_info *ci) {
+  return (ci->ch->is_binary_ok != NULL && ci->ch->is_binary_ok(ci->ch));
+}
+
+/*
+ * Encoding is negotiated per hop, so it only applies to frames exchanged
+ * with the peer at the other end of the channel, never to frames relayed
+ * through it (e.g. by a cloud dispatcher on the default channel).
+ * Empty address is implied to be the peer.
+ */
+static bool mg_rpc_is_channel_peer(const struct mg_rpc_channel_info *ci,
+                                   const struct mg_str addr) {
+  if (addr.len == 0) return true;
+  return (ci->dst.len > 0 && mg_vcmp(&ci->dst, MG_RPC_DST_DEFAULT) != 0 &&
+          mg_strcmp(ci->dst, addr) == 0);
+}
+#endif
+
+bool mg_rpc_frame_is_ubjson(const struct mg_str f) {
+  return (f.len > 0 && f.p[0] == MG_RPC_UBJSON_MARKER);
+}
+
+/*
+ * Returns binary payload of the frame. If it came base64-encoded, it is
+ * decoded into a buffer returned in *buf, which the caller must free.
+ */
+static struct mg_str mg_rpc_frame_bin(const struct mg_rpc_frame *frame,
+                                      char **buf) {
+  int len = 0;
+  *buf = NULL;
+  if (!frame->bin_is_base64 || frame->bin.len == 0) return frame->bin;
+  *buf = (char *) malloc(frame->bin.len * 3 / 4 + 1);
+  if (*buf == NULL) return mg_mk_str_n(NULL, 0);
+  cs_base64_decode((const unsigned char *) frame->bin.p, frame->bin.len, *buf,
+                   &len);
+  return mg_mk_str_n(*buf, len);
+}
+
 static bool mg_rpc_handle_request(struct mg_rpc *c,
                                   struct mg_rpc_channel_info *ci,
                                   const struct mg_rpc_frame *frame) {
@@ -111,11 +376,8 @@ static bool mg_rpc_handle_request(struct mg_rpc *c,
   ri->tag = mg_strdup(frame->tag);
   ri->ch = ci->ch;
 
-  struct mg_rpc_handler_info *hi;
-  SLIST_FOREACH(hi, &c->handlers, handlers) {
-    struct mg_str method = mg_mk_str_n(frame->method.p, frame->method.len);
-    if (mg_vcmp(&method, hi->method) == 0) break;
-  }
+  struct mg_rpc_handler_info *hi = mg_rpc_find_handler(
+      c, mg_mk_str_n(frame->method.p, frame->method.len));
   if (hi == NULL) {
     LOG(LL_ERROR,
         ("No handler for %.*s", (int) frame->method.len, frame->method.p));
@@ -124,52 +386,293 @@ static bool mg_rpc_handle_request(struct mg_rpc *c,
     ri = NULL;
     return true;
   }
+  char *bin_buf;
   struct mg_rpc_frame_info fi;
   memset(&fi, 0, sizeof(fi));
   fi.channel_type = ci->ch->get_type(ci->ch);
   fi.channel_is_trusted = ci->is_trusted;
+  fi.bin = mg_rpc_frame_bin(frame, &bin_buf);
   ri->args_fmt = hi->args_fmt;
   hi->cb(ri, hi->cb_arg, &fi, mg_mk_str_n(frame->args.p, frame->args.len));
+  free(bin_buf);
   return true;
 }
 
 static bool mg_rpc_handle_response(struct mg_rpc *c,
-                                   struct mg_rpc_channel_info *ci, int64_t id,
-                                   struct mg_str result, int error_code,
-                                   struct mg_str error_msg) {
+                                   struct mg_rpc_channel_info *ci,
+                                   const struct mg_rpc_frame *frame) {
+  int64_t id = frame->id;
   if (id == 0) {
     LOG(LL_ERROR, ("Response without an ID"));
     return false;
   }
 
-  struct mg_rpc_sent_request_info *ri;
-  SLIST_FOREACH(ri, &c->requests, requests) {
-    if (ri->id == id) break;
-  }
+  struct mg_rpc_sent_request_info *ri =
+      (frame->more ? mg_rpc_find_request(c, id) : mg_rpc_remove_request(c, id));
   if (ri == NULL) {
     /*
      * Response to a request we did not send.
      * Or (more likely) we did not request a response at all, so be quiet.
+     * Or it has already timed out.
      */
     return true;
   }
-  SLIST_REMOVE(&c->requests, ri, mg_rpc_sent_request_info, requests);
+  char *bin_buf;
   struct mg_rpc_frame_info fi;
   memset(&fi, 0, sizeof(fi));
   fi.channel_type = ci->ch->get_type(ci->ch);
   fi.channel_is_trusted = ci->is_trusted;
-  ri->cb(c, ri->cb_arg, &fi, mg_mk_str_n(result.p, result.len), error_code,
-         mg_mk_str_n(error_msg.p, error_msg.len));
-  free(ri);
+  fi.bin = mg_rpc_frame_bin(frame, &bin_buf);
+  fi.more = frame->more;
+  if (frame->more && ri->deadline > 0) {
+    /* next_deadline may now be early, that is fine. */
+    ri->deadline = mg_time() + ri->timeout;
+  }
+  ri->cb(c, ri->cb_arg, &fi, mg_mk_str_n(frame->result.p, frame->result.len),
+         frame->error_code,
+         mg_mk_str_n(frame->error_msg.p, frame->error_msg.len));
+  free(bin_buf);
+  if (!frame->more) free(ri);
+  return true;
+}
+
+#if CS_ENABLE_UBJSON
+/*
+ * Minimal UBJSON reader for binary frames. Strings and binary payloads are
+ * returned as pointers into the frame, values of unknown keys are skipped.
+ */
+#define MG_RPC_UBJ_MAX_DEPTH 8
+
+struct mg_rpc_ubj {
+  const uint8_t *p, *end;
+};
+
+static bool mg_rpc_ubj_int(struct mg_rpc_ubj *u, uint8_t type, int64_t *v) {
+  int i, n;
+  uint64_t x = 0;
+  switch (type) {
+    case 'i':
+    case 'U':
+      n = 1;
+      break;
+    case 'I':
+      n = 2;
+      break;
+    case 'l':
+      n = 4;
+      break;
+    case 'L':
+      n = 8;
+      break;
+    default:
+      return false;
+  }
+  if (u->end - u->p < n) return false;
+  for (i = 0; i < n; i++) x = (x << 8) | u->p[i];
+  u->p += n;
+  switch (type) {
+    case 'i':
+      *v = (int8_t) x;
+      break;
+    case 'I':
+      *v = (int16_t) x;
+      break;
+    case 'l':
+      *v = (int32_t) x;
+      break;
+    default:
+      *v = (int64_t) x;
+  }
+  return true;
+}
+
+/* Reads a length (or count), which cannot exceed the remaining data. */
+static bool mg_rpc_ubj_len(struct mg_rpc_ubj *u, size_t *len) {
+  int64_t v;
+  if (u->p >= u->end || !mg_rpc_ubj_int(u, *u->p++, &v)) return false;
+  if (v < 0 || v > u->end - u->p) return false;
+  *len = (size_t) v;
+  return true;
+}
+
+/* Reads string data (object key, or 'S' value after the marker). */
+static bool mg_rpc_ubj_str(struct mg_rpc_ubj *u, struct mg_str *s) {
+  size_t len;
+  if (!mg_rpc_ubj_len(u, &len)) return false;
+  *s = mg_mk_str_n((const char *) u->p, len);
+  u->p += len;
+  return true;
+}
+
+static bool mg_rpc_ubj_skip(struct mg_rpc_ubj *u, uint8_t type, int depth) {
+  int64_t v;
+  size_t n;
+  struct mg_str key;
+  switch (type) {
+    case 'Z':
+    case 'N':
+    case 'T':
+    case 'F':
+      return true;
+    case 'C':
+      n = 1;
+      break;
+    case 'd':
+      n = 4;
+      break;
+    case 'D':
+      n = 8;
+      break;
+    case 'S':
+    case 'H':
+      return mg_rpc_ubj_str(u, &key);
+    case '[':
+    case '{': {
+      uint8_t et = 0, end = (type == '[' ? ']' : '}');
+      int64_t count = -1;
+      if (depth >= MG_RPC_UBJ_MAX_DEPTH) return false;
+      if (u->p < u->end && *u->p == '$') {
+        if (u->end - u->p < 3 || u->p[2] != '#') return false;
+        et = u->p[1];
+        u->p += 2;
+      }
+      if (u->p < u->end && *u->p == '#') {
+        u->p++;
+        if (!mg_rpc_ubj_len(u, &n)) return false;
+        count = n;
+      }
+      for (;;) {
+        if (count < 0) {
+          if (u->p >= u->end) return false;
+          if (*u->p == end) break;
+          if (*u->p == 'N') {
+            u->p++;
+            continue;
+          }
+        } else if (count-- == 0) {
+          return true;
+        }
+        if (type == '{' && !mg_rpc_ubj_str(u, &key)) return false;
+        uint8_t t = et;
+        if (t == 0) {
+          if (u->p >= u->end) return false;
+          t = *u->p++;
+        }
+        if (!mg_rpc_ubj_skip(u, t, depth + 1)) return false;
+      }
+      u->p++;
+      return true;
+    }
+    default:
+      return mg_rpc_ubj_int(u, type, &v);
+  }
+  if ((size_t)(u->end - u->p) < n) return false;
+  u->p += n;
+  return true;
+}
+
+/* Parses frame object (depth 0) or its "error" member (depth 1). */
+static bool mg_rpc_ubj_parse_obj(struct mg_rpc_ubj *u,
+                                 struct mg_rpc_frame *frame, int depth) {
+  if (u->p >= u->end || *u->p++ != '{') return false;
+  for (;;) {
+    struct mg_str key, *sv = NULL;
+    int64_t v, *iv = NULL;
+    int *ip = NULL;
+    if (u->p >= u->end) return false;
+    if (*u->p == 'N') {
+      u->p++;
+      continue;
+    }
+    if (*u->p == '}') break;
+    if (!mg_rpc_ubj_str(u, &key) || u->p >= u->end) return false;
+    uint8_t t = *u->p;
+    if (depth == 0) {
+      if (mg_vcmp(&key, "id") == 0) {
+        iv = &frame->id;
+      } else if (mg_vcmp(&key, "v") == 0) {
+        ip = &frame->version;
+      } else if (mg_vcmp(&key, "src") == 0) {
+        sv = &frame->src;
+      } else if (mg_vcmp(&key, "dst") == 0) {
+        sv = &frame->dst;
+      } else if (mg_vcmp(&key, "tag") == 0) {
+        sv = &frame->tag;
+      } else if (mg_vcmp(&key, "method") == 0) {
+        sv = &frame->method;
+      } else if (mg_vcmp(&key, "args") == 0) {
+        sv = &frame->args;
+      } else if (mg_vcmp(&key, "result") == 0) {
+        sv = &frame->result;
+      } else if (mg_vcmp(&key, "more") == 0 && (t == 'T' || t == 'F')) {
+        frame->more = (t == 'T');
+        u->p++;
+        continue;
+      } else if (mg_vcmp(&key, "error") == 0 && t == '{') {
+        if (!mg_rpc_ubj_parse_obj(u, frame, 1)) return false;
+        continue;
+      } else if (mg_vcmp(&key, "bin") == 0 && u->end - u->p >= 4 &&
+                 memcmp(u->p, "[$U#", 4) == 0) {
+        size_t n;
+        u->p += 4;
+        if (!mg_rpc_ubj_len(u, &n)) return false;
+        frame->bin = mg_mk_str_n((const char *) u->p, n);
+        u->p += n;
+        continue;
+      }
+    } else {
+      if (mg_vcmp(&key, "code") == 0) {
+        ip = &frame->error_code;
+      } else if (mg_vcmp(&key, "message") == 0) {
+        sv = &frame->error_msg;
+      }
+    }
+    u->p++;
+    if (sv != NULL && t == 'S') {
+      if (!mg_rpc_ubj_str(u, sv)) return false;
+    } else if ((iv != NULL || ip != NULL) && mg_rpc_ubj_int(u, t, &v)) {
+      if (iv != NULL) {
+        *iv = v;
+      } else {
+        *ip = (int) v;
+      }
+    } else if (!mg_rpc_ubj_skip(u, t, depth + 1)) {
+      return false;
+    }
+  }
+  u->p++;
   return true;
 }
 
+static bool mg_rpc_parse_frame_ubjson(const struct mg_str f,
+                                      struct mg_rpc_frame *frame) {
+  struct mg_rpc_ubj u;
+  u.p = (const uint8_t *) f.p + 1; /* MG_RPC_UBJSON_MARKER */
+  u.end = (const uint8_t *) f.p + f.len;
+  if (!mg_rpc_ubj_parse_obj(&u, frame, 0)) return false;
+  frame->enc = mg_mk_str(MG_RPC_ENC_UBJSON);
+  return true;
+}
+#endif /* CS_ENABLE_UBJSON */
+
 bool mg_rpc_parse_frame(const struct mg_str f, struct mg_rpc_frame *frame) {
   memset(frame, 0, sizeof(*frame));
 
+#if CS_ENABLE_UBJSON
+  if (mg_rpc_frame_is_ubjson(f)) {
+    if (!mg_rpc_parse_frame_ubjson(f, frame)) return false;
+    LOG(LL_DEBUG, ("%lld '%.*s' '%.*s' '%.*s' (ubjson)", frame->id,
+                   (int) frame->src.len, frame->src.p, (int) frame->dst.len,
+                   frame->dst.p, (int) frame->method.len, frame->method.p));
+    return true;
+  }
+#endif
+
   struct json_token src, dst, tag;
   struct json_token method, args;
   struct json_token result, error_msg;
+  struct json_token bin, enc;
+  int more = 0;
   memset(&src, 0, sizeof(src));
   memset(&dst, 0, sizeof(dst));
   memset(&tag, 0, sizeof(tag));
@@ -177,13 +680,16 @@ bool mg_rpc_parse_frame(const struct mg_str f, struct mg_rpc_frame *frame) {
   memset(&args, 0, sizeof(args));
   memset(&result, 0, sizeof(result));
   memset(&error_msg, 0, sizeof(error_msg));
+  memset(&bin, 0, sizeof(bin));
+  memset(&enc, 0, sizeof(enc));
 
   if (json_scanf(f.p, f.len,
                  "{v:%d id:%lld src:%T dst:%T tag:%T"
                  "method:%T args:%T "
-                 "result:%T error:{code:%d message:%T}}",
+                 "result:%T error:{code:%d message:%T} bin:%T enc:%T more:%B}",
                  &frame->version, &frame->id, &src, &dst, &tag, &method, &args,
-                 &result, &frame->error_code, &error_msg) < 1) {
+                 &result, &frame->error_code, &error_msg, &bin, &enc,
+                 &more) < 1) {
     return false;
   }
 
@@ -194,6 +700,10 @@ bool mg_rpc_parse_frame(const struct mg_str f, struct mg_rpc_frame *frame) {
   frame->args = mg_mk_str_n(args.ptr, args.len);
   frame->result = mg_mk_str_n(result.ptr, result.len);
   frame->error_msg = mg_mk_str_n(error_msg.ptr, error_msg.len);
+  frame->bin = mg_mk_str_n(bin.ptr, bin.len);
+  frame->bin_is_base64 = true;
+  frame->enc = mg_mk_str_n(enc.ptr, enc.len);
+  frame->more = (more != 0);
 
   LOG(LL_DEBUG, ("%lld '%.*s' '%.*s' '%.*s'", frame->id, (int) src.len,
                  (src.len > 0 ? src.ptr : ""), (int) dst.len,
@@ -225,13 +735,18 @@ static bool mg_rpc_handle_frame(struct mg_rpc *c,
   if (ci->dst.len == 0) {
     ci->dst = mg_strdup(frame->src);
   }
+#if CS_ENABLE_UBJSON
+  if (!ci->peer_ubjson && mg_vcmp(&frame->enc, MG_RPC_ENC_UBJSON) == 0 &&
+      mg_rpc_is_channel_peer(ci, frame->src)) {
+    ci->peer_ubjson = mg_rpc_channel_is_binary_ok(ci);
+  }
+#endif
   if (frame->method.len > 0) {
     if (!mg_rpc_handle_request(c, ci, frame)) {
       return false;
     }
   } else {
-    if (!mg_rpc_handle_response(c, ci, frame->id, frame->result,
-                                frame->error_code, frame->error_msg)) {
+    if (!mg_rpc_handle_response(c, ci, frame)) {
       return false;
     }
   }
@@ -240,22 +755,55 @@ static bool mg_rpc_handle_frame(struct mg_rpc *c,
 
 static bool mg_rpc_send_frame(struct mg_rpc_channel_info *ci,
                               struct mg_str frame);
-static bool mg_rpc_dispatch_frame(struct mg_rpc *c, const struct mg_str dst,
-                                  int64_t id, const struct mg_str tag,
-                                  struct mg_rpc_channel_info *ci, bool enqueue,
-                                  struct mg_str payload_prefix_json,
-                                  const char *payload_jsonf, va_list ap);
+static void mg_rpc_run_streams(struct mg_rpc *c,
+                               struct mg_rpc_channel_info *ci);
+static void mg_rpc_cancel_streams(struct mg_rpc *c,
+                                  struct mg_rpc_channel_info *ci);
+
+static void mg_rpc_remove_queue_entry(struct mg_rpc *c,
+                                      struct mg_rpc_dst_queue *dq, int pi,
+                                      struct mg_rpc_queue_entry *qe) {
+  TAILQ_REMOVE(&dq->q[pi], qe, queue);
+  dq->len--;
+  c->queue_len--;
+  c->queue_bytes -= qe->frame.len;
+  free((void *) qe->frame.p);
+  free(qe);
+}
 
+static void mg_rpc_free_dst_queue_if_empty(struct mg_rpc *c,
+                                           struct mg_rpc_dst_queue *dq) {
+  if (dq->len > 0) return;
+  STAILQ_REMOVE(&c->dst_queues, dq, mg_rpc_dst_queue, dst_queues);
+  free((void *) dq->dst.p);
+  free(dq);
+}
+
+/*
+ * Sends queued frames on channels that are ready, highest priority first.
+ * Only queue heads are looked at, cost does not depend on the queue length.
+ */
 static void mg_rpc_process_queue(struct mg_rpc *c) {
-  struct mg_rpc_queue_entry *qe, *tqe;
-  STAILQ_FOREACH_SAFE(qe, &c->queue, queue, tqe) {
-    struct mg_rpc_channel_info *ci = mg_rpc_get_channel_info_by_dst(c, qe->dst);
-    if (mg_rpc_send_frame(ci, qe->frame)) {
-      STAILQ_REMOVE(&c->queue, qe, mg_rpc_queue_entry, queue);
-      free((void *) qe->dst.p);
-      free((void *) qe->frame.p);
-      free(qe);
-      c->queue_len--;
+  int pi;
+  for (pi = MG_RPC_NUM_PRIOS - 1; pi >= 0; pi--) {
+    struct mg_rpc_dst_queue *dq, *dqt;
+    STAILQ_FOREACH_SAFE(dq, &c->dst_queues, dst_queues, dqt) {
+      struct mg_rpc_queue_entry *qe;
+      if (TAILQ_EMPTY(&dq->q[pi])) continue;
+      struct mg_rpc_channel_info *ci =
+          mg_rpc_get_channel_info_by_dst(c, dq->dst);
+      while (ci != NULL && ci->is_open && !ci->is_busy &&
+             (qe = TAILQ_FIRST(&dq->q[pi])) != NULL) {
+        /* Channel may have been reconnected to a peer that only speaks JSON. */
+        bool drop = (!ci->peer_ubjson && mg_rpc_frame_is_ubjson(qe->frame));
+        if (drop) {
+          LOG(LL_DEBUG, ("DROPPED UBJSON FRAME (%d)", (int) qe->frame.len));
+        } else if (!mg_rpc_send_frame(ci, qe->frame)) {
+          break;
+        }
+        mg_rpc_remove_queue_entry(c, dq, pi, qe);
+      }
+      mg_rpc_free_dst_queue_if_empty(c, dq);
     }
   }
 }
@@ -273,6 +821,7 @@ static void mg_rpc_ev_handler(struct mg_rpc_channel *ch,
     case MG_RPC_CHANNEL_OPEN: {
       ci->is_open = true;
       ci->is_busy = false;
+      ci->peer_ubjson = ci->enc_announced = false;
       LOG(LL_DEBUG, ("%p CHAN OPEN (%s)", ch, ch->get_type(ch)));
       mg_rpc_process_queue(c);
       if (ci->dst.len > 0) {
@@ -311,12 +860,15 @@ static void mg_rpc_ev_handler(struct mg_rpc_channel *ch,
       LOG(LL_DEBUG, ("%p FRAME SENT (%d)", ch, success));
       ci->is_busy = false;
       mg_rpc_process_queue(c);
+      mg_rpc_run_streams(c, ci);
       break;
     }
     case MG_RPC_CHANNEL_CLOSED: {
       bool remove = !ch->is_persistent(ch);
       LOG(LL_DEBUG, ("%p CHAN CLOSED, remove? %d", ch, remove));
       ci->is_open = ci->is_busy = false;
+      ci->peer_ubjson = ci->enc_announced = false;
+      mg_rpc_cancel_streams(c, ci);
       if (ci->dst.len > 0) {
         mg_rpc_call_observers(c, MG_RPC_EV_CHANNEL_CLOSED, &ci->dst);
       }
@@ -365,9 +917,9 @@ struct mg_rpc *mg_rpc_create(struct mg_rpc_cfg *cfg) {
   c->cfg = cfg;
   SLIST_INIT(&c->handlers);
   SLIST_INIT(&c->channels);
-  SLIST_INIT(&c->requests);
   SLIST_INIT(&c->observers);
-  STAILQ_INIT(&c->queue);
+  STAILQ_INIT(&c->dst_queues);
+  STAILQ_INIT(&c->streams);
 
   return c;
 }
@@ -382,47 +934,217 @@ static bool mg_rpc_send_frame(struct mg_rpc_channel_info *ci,
   return result;
 }
 
-static bool mg_rpc_enqueue_frame(struct mg_rpc *c, struct mg_str dst,
+/*
+ * The byte limit is not applied to an empty queue, so a frame of any size
+ * can always get through, nor to high priority frames (responses): dropping
+ * those would leave the peer waiting for a timeout.
+ */
+static bool mg_rpc_queue_is_full(struct mg_rpc *c, int pi, size_t len) {
+  if (c->queue_len >= c->cfg->max_queue_size) return true;
+  return (c->cfg->max_queue_bytes > 0 && c->queue_len > 0 &&
+          pi < MG_RPC_PRIO_HIGH - MG_RPC_PRIO_LOW &&
+          c->queue_bytes + len > (size_t) c->cfg->max_queue_bytes);
+}
+
+/*
+ * Drops the newest of the lowest priority frames below priority index pi.
+ * If the frame was a request, its result callback is invoked with an error
+ * right away rather than waiting for the timeout.
+ */
+static bool mg_rpc_evict_frame(struct mg_rpc *c, int pi) {
+  int i;
+  for (i = 0; i < pi; i++) {
+    struct mg_rpc_dst_queue *dq;
+    STAILQ_FOREACH(dq, &c->dst_queues, dst_queues) {
+      struct mg_rpc_queue_entry *qe =
+          TAILQ_LAST(&dq->q[i], mg_rpc_frame_queue);
+      if (qe == NULL) continue;
+      int64_t req_id = qe->req_id;
+      LOG(LL_DEBUG, ("EVICTED FRAME (%d): %.*s", (int) qe->frame.len,
+                     (int) qe->frame.len, qe->frame.p));
+      mg_rpc_remove_queue_entry(c, dq, i, qe);
+      mg_rpc_free_dst_queue_if_empty(c, dq);
+      struct mg_rpc_sent_request_info *ri =
+          (req_id != 0 ? mg_rpc_remove_request(c, req_id) : NULL);
+      if (ri != NULL) {
+        struct mg_rpc_frame_info fi;
+        memset(&fi, 0, sizeof(fi));
+        fi.channel_type = "";
+        ri->cb(c, ri->cb_arg, &fi, mg_mk_str_n(NULL, 0),
+               MG_RPC_EVICTED_ERROR_CODE, mg_mk_str("dropped from the queue"));
+        free(ri);
+      }
+      return true;
+    }
+  }
+  return false;
+}
+
+static bool mg_rpc_enqueue_frame(struct mg_rpc *c, enum mg_rpc_prio prio,
+                                 struct mg_str dst, int64_t req_id,
                                  struct mg_str f) {
-  if (c->queue_len >= c->cfg->max_queue_size) return false;
+  int i, pi = prio - MG_RPC_PRIO_LOW;
+  struct mg_rpc_dst_queue *dq;
+  if (pi < 0 || pi >= MG_RPC_NUM_PRIOS) return false;
+  while (mg_rpc_queue_is_full(c, pi, f.len)) {
+    if (!mg_rpc_evict_frame(c, pi)) return false;
+  }
+  STAILQ_FOREACH(dq, &c->dst_queues, dst_queues) {
+    if (mg_strcmp(dq->dst, dst) == 0) break;
+  }
+  if (dq == NULL) {
+    dq = (struct mg_rpc_dst_queue *) calloc(1, sizeof(*dq));
+    if (dq == NULL) return false;
+    dq->dst = mg_strdup(dst);
+    for (i = 0; i < MG_RPC_NUM_PRIOS; i++) TAILQ_INIT(&dq->q[i]);
+    STAILQ_INSERT_TAIL(&c->dst_queues, dq, dst_queues);
+  }
   struct mg_rpc_queue_entry *qe =
       (struct mg_rpc_queue_entry *) calloc(1, sizeof(*qe));
-  qe->dst = mg_strdup(dst);
+  if (qe == NULL) {
+    mg_rpc_free_dst_queue_if_empty(c, dq);
+    return false;
+  }
   qe->frame = f;
-  STAILQ_INSERT_TAIL(&c->queue, qe, queue);
-  LOG(LL_DEBUG, ("QUEUED FRAME (%d): %.*s", (int) f.len, (int) f.len, f.p));
+  qe->req_id = req_id;
+  TAILQ_INSERT_TAIL(&dq->q[pi], qe, queue);
+  dq->len++;
   c->queue_len++;
+  c->queue_bytes += f.len;
+  LOG(LL_DEBUG, ("QUEUED FRAME (%d, prio %d): %.*s", (int) f.len, prio,
+                 (int) f.len, f.p));
   return true;
 }
 
-static bool mg_rpc_dispatch_frame(struct mg_rpc *c, const struct mg_str dst,
-                                  int64_t id, const struct mg_str tag,
-                                  struct mg_rpc_channel_info *ci, bool enqueue,
-                                  struct mg_str payload_prefix_json,
-                                  const char *payload_jsonf, va_list ap) {
-  struct mbuf fb;
-  struct json_out fout = JSON_OUT_MBUF(&fb);
-  if (ci == NULL) ci = mg_rpc_get_channel_info_by_dst(c, dst);
-  bool result = false;
-  mbuf_init(&fb, 100);
+static void mg_rpc_emit_frame_json(struct mg_rpc *c, struct mbuf *fb,
+                                   const struct mg_rpc_out_frame *of,
+                                   bool announce, const char *payload_jsonf,
+                                   va_list ap) {
+  struct json_out fout = JSON_OUT_MBUF(fb);
   json_printf(&fout, "{");
-  if (id != 0) {
-    json_printf(&fout, "id:%lld,", id);
+  if (of->id != 0) {
+    json_printf(&fout, "id:%lld,", of->id);
   }
   json_printf(&fout, "src:%Q", c->cfg->id);
-  if (dst.len > 0) {
-    json_printf(&fout, ",dst:%.*Q", (int) dst.len, dst.p);
+  if (of->dst.len > 0) {
+    json_printf(&fout, ",dst:%.*Q", (int) of->dst.len, of->dst.p);
+  }
+  if (of->tag.len > 0) {
+    json_printf(&fout, ",tag:%.*Q", (int) of->tag.len, of->tag.p);
+  }
+  if (announce) {
+    json_printf(&fout, ",enc:%Q", MG_RPC_ENC_UBJSON);
   }
-  if (tag.len > 0) {
-    json_printf(&fout, ",tag:%.*Q", (int) tag.len, tag.p);
+  if (of->method.len > 0) {
+    json_printf(&fout, ",method:%.*Q", (int) of->method.len, of->method.p);
   }
-  if (payload_prefix_json.len > 0) {
-    mbuf_append(&fb, ",", 1);
-    mbuf_append(&fb, payload_prefix_json.p, payload_prefix_json.len);
-    free((void *) payload_prefix_json.p);
+  if (payload_jsonf != NULL) {
+    json_printf(&fout, (of->method.len > 0 ? ",args:" : ",result:"));
+    json_vprintf(&fout, payload_jsonf, ap);
+  }
+  if (of->bin.len > 0) {
+    json_printf(&fout, ",bin:%V", of->bin.p, (int) of->bin.len);
+  }
+  if (of->more) {
+    json_printf(&fout, ",more:%B", 1);
+  }
+  if (of->error_code != 0) {
+    json_printf(&fout, ",error:{code:%d", of->error_code);
+    if (of->error_msg.len > 0) {
+      json_printf(&fout, ",message:%.*Q", (int) of->error_msg.len,
+                  of->error_msg.p);
+    }
+    json_printf(&fout, "}");
   }
-  if (payload_jsonf != NULL) json_vprintf(&fout, payload_jsonf, ap);
   json_printf(&fout, "}");
+}
+
+#if CS_ENABLE_UBJSON
+static void mg_rpc_emit_key(struct mbuf *fb, const char *key) {
+  cs_ubjson_emit_object_key(fb, key, strlen(key));
+}
+
+static void mg_rpc_emit_str_kv(struct mbuf *fb, const char *key,
+                               const struct mg_str v) {
+  mg_rpc_emit_key(fb, key);
+  cs_ubjson_emit_string(fb, v.p, v.len);
+}
+
+static void mg_rpc_emit_frame_ubjson(struct mg_rpc *c, struct mbuf *fb,
+                                     const struct mg_rpc_out_frame *of,
+                                     const char *payload_jsonf, va_list ap) {
+  char marker = MG_RPC_UBJSON_MARKER;
+  mbuf_append(fb, &marker, 1);
+  cs_ubjson_open_object(fb);
+  if (of->id != 0) {
+    mg_rpc_emit_key(fb, "id");
+    cs_ubjson_emit_autoint(fb, of->id);
+  }
+  mg_rpc_emit_str_kv(fb, "src", mg_mk_str(c->cfg->id));
+  if (of->dst.len > 0) mg_rpc_emit_str_kv(fb, "dst", of->dst);
+  if (of->tag.len > 0) mg_rpc_emit_str_kv(fb, "tag", of->tag);
+  if (of->method.len > 0) mg_rpc_emit_str_kv(fb, "method", of->method);
+  if (payload_jsonf != NULL) {
+    /* JSON is printed in place, string length is filled in afterwards. */
+    struct json_out fout = JSON_OUT_MBUF(fb);
+    size_t start, len;
+    mg_rpc_emit_key(fb, (of->method.len > 0 ? "args" : "result"));
+    mbuf_append(fb, "Sl\0\0\0\0", 6);
+    start = fb->len;
+    json_vprintf(&fout, payload_jsonf, ap);
+    len = fb->len - start;
+    fb->buf[start - 4] = (len >> 24) & 0xff;
+    fb->buf[start - 3] = (len >> 16) & 0xff;
+    fb->buf[start - 2] = (len >> 8) & 0xff;
+    fb->buf[start - 1] = len & 0xff;
+  }
+  if (of->bin.len > 0) {
+    mg_rpc_emit_key(fb, "bin");
+    cs_ubjson_emit_bin(fb, of->bin.p, of->bin.len);
+  }
+  if (of->more) {
+    mg_rpc_emit_key(fb, "more");
+    cs_ubjson_emit_boolean(fb, 1);
+  }
+  if (of->error_code != 0) {
+    mg_rpc_emit_key(fb, "error");
+    cs_ubjson_open_object(fb);
+    mg_rpc_emit_key(fb, "code");
+    cs_ubjson_emit_autoint(fb, of->error_code);
+    if (of->error_msg.len > 0) {
+      mg_rpc_emit_str_kv(fb, "message", of->error_msg);
+    }
+    cs_ubjson_close_object(fb);
+  }
+  cs_ubjson_close_object(fb);
+}
+#endif /* CS_ENABLE_UBJSON */
+
+static bool mg_rpc_dispatch_frame(struct mg_rpc *c,
+                                  struct mg_rpc_channel_info *ci,
+                                  const struct mg_rpc_out_frame *of,
+                                  bool enqueue, const char *payload_jsonf,
+                                  va_list ap) {
+  struct mbuf fb;
+  bool result = false, announce = false;
+  if (ci == NULL) ci = mg_rpc_get_channel_info_by_dst(c, of->dst);
+  mbuf_init(&fb, 100);
+#if CS_ENABLE_UBJSON
+  /*
+   * Binary frames are only used for immediate sending, frames that are going
+   * to be queued stay JSON since peer on the other end may change.
+   */
+  bool to_peer = (ci != NULL && mg_rpc_is_channel_peer(ci, of->dst));
+  if (to_peer && ci->peer_ubjson && ci->is_open && !ci->is_busy) {
+    mg_rpc_emit_frame_ubjson(c, &fb, of, payload_jsonf, ap);
+  } else {
+    announce = (to_peer && !ci->enc_announced &&
+                mg_rpc_channel_is_binary_ok(ci));
+    mg_rpc_emit_frame_json(c, &fb, of, announce, payload_jsonf, ap);
+  }
+#else
+  mg_rpc_emit_frame_json(c, &fb, of, announce, payload_jsonf, ap);
+#endif
   mbuf_trim(&fb);
 
   /* Try sending directly first or put on the queue. */
@@ -430,7 +1152,9 @@ static bool mg_rpc_dispatch_frame(struct mg_rpc *c, const struct mg_str dst,
   if (mg_rpc_send_frame(ci, f)) {
     mbuf_free(&fb);
     result = true;
-  } else if (enqueue && mg_rpc_enqueue_frame(c, dst, f)) {
+  } else if (enqueue &&
+             mg_rpc_enqueue_frame(c, of->prio, of->dst,
+                                  (of->method.len > 0 ? of->id : 0), f)) {
     /* Frame is on the queue, do not free. */
     result = true;
   } else {
@@ -438,6 +1162,7 @@ static bool mg_rpc_dispatch_frame(struct mg_rpc *c, const struct mg_str dst,
         ("DROPPED FRAME (%d): %.*s", (int) fb.len, (int) fb.len, fb.buf));
     mbuf_free(&fb);
   }
+  if (result && announce) ci->enc_announced = true;
   return result;
 }
 
@@ -445,81 +1170,174 @@ bool mg_rpc_callf(struct mg_rpc *c, const struct mg_str method,
                   mg_result_cb_t cb, void *cb_arg,
                   const struct mg_rpc_call_opts *opts, const char *args_jsonf,
                   ...) {
-  struct mbuf prefb;
-  struct json_out prefbout = JSON_OUT_MBUF(&prefb);
-  int64_t id = mg_rpc_get_id(c);
-  struct mg_str dst = MG_MK_STR("");
-  if (opts != NULL) dst = opts->dst;
+  struct mg_rpc_out_frame of;
+  memset(&of, 0, sizeof(of));
+  of.id = mg_rpc_get_id(c);
+  of.method = method;
+  if (opts != NULL) {
+    of.dst = opts->dst;
+    of.bin = opts->bin;
+    of.prio = opts->prio;
+  }
+  double timeout = c->cfg->default_out_timeout;
+  if (opts != NULL && opts->timeout != 0) timeout = opts->timeout;
   struct mg_rpc_sent_request_info *ri = NULL;
   if (cb != NULL) {
     ri = (struct mg_rpc_sent_request_info *) calloc(1, sizeof(*ri));
-    ri->id = id;
+    ri->id = of.id;
+    ri->deadline = (timeout > 0 ? mg_time() + timeout : 0);
+    ri->timeout = timeout;
     ri->cb = cb;
     ri->cb_arg = cb_arg;
   }
-  mbuf_init(&prefb, 100);
-  json_printf(&prefbout, "method:%.*Q", (int) method.len, method.p);
-  if (args_jsonf != NULL) json_printf(&prefbout, ",args:");
   va_list ap;
   va_start(ap, args_jsonf);
-  bool result = mg_rpc_dispatch_frame(
-      c, dst, id, mg_mk_str(""), NULL /* ci */, true /* enqueue */,
-      mg_mk_str_n(prefb.buf, prefb.len), args_jsonf, ap);
+  bool result = mg_rpc_dispatch_frame(c, NULL /* ci */, &of, true /* enqueue */,
+                                      args_jsonf, ap);
   va_end(ap);
-  if (result && ri != NULL) {
-    SLIST_INSERT_HEAD(&c->requests, ri, requests);
-    return true;
-  } else {
+  if (!result) {
     /* Could not send or queue, drop on the floor. */
     free(ri);
     return false;
   }
+  if (ri != NULL && !mg_rpc_add_request(c, ri)) {
+    /* Out of memory, the response will be ignored. */
+    free(ri);
+  }
+  return true;
+}
+
+/* Sends a result, `ri` is freed unless more results are to follow. */
+static bool mg_rpc_send_responsevf(struct mg_rpc_request_info *ri,
+                                   const struct mg_str bin, bool more,
+                                   const char *result_json_fmt, va_list ap) {
+  struct mg_rpc_out_frame of;
+  memset(&of, 0, sizeof(of));
+  of.id = ri->id;
+  of.dst = ri->src;
+  of.tag = ri->tag;
+  of.bin = bin;
+  of.more = more;
+  of.prio = MG_RPC_PRIO_HIGH;
+  if (result_json_fmt != NULL && result_json_fmt[0] == '\0') {
+    result_json_fmt = NULL;
+  }
+  struct mg_rpc_channel_info *ci = mg_rpc_get_channel_info(ri->rpc, ri->ch);
+  bool result = mg_rpc_dispatch_frame(ri->rpc, ci, &of, true /* enqueue */,
+                                      result_json_fmt, ap);
+  if (!more) mg_rpc_free_request_info(ri);
+  return result;
 }
 
 bool mg_rpc_send_responsef(struct mg_rpc_request_info *ri,
                            const char *result_json_fmt, ...) {
-  struct mbuf prefb;
-  mbuf_init(&prefb, 0);
-  if (result_json_fmt != NULL && result_json_fmt[0] != '\0') {
-    mbuf_init(&prefb, 7);
-    mbuf_append(&prefb, "\"result\":", 9);
-  }
   va_list ap;
   va_start(ap, result_json_fmt);
-  struct mg_rpc_channel_info *ci = mg_rpc_get_channel_info(ri->rpc, ri->ch);
-  bool result = mg_rpc_dispatch_frame(
-      ri->rpc, ri->src, ri->id, ri->tag, ci, true /* enqueue */,
-      mg_mk_str_n(prefb.buf, prefb.len), result_json_fmt, ap);
+  bool result = mg_rpc_send_responsevf(ri, mg_mk_str_n(NULL, 0), false,
+                                       result_json_fmt, ap);
+  va_end(ap);
+  return result;
+}
+
+bool mg_rpc_send_response_binf(struct mg_rpc_request_info *ri,
+                               const struct mg_str bin,
+                               const char *result_json_fmt, ...) {
+  va_list ap;
+  va_start(ap, result_json_fmt);
+  bool result = mg_rpc_send_responsevf(ri, bin, false, result_json_fmt, ap);
   va_end(ap);
-  mg_rpc_free_request_info(ri);
   return result;
 }
 
+bool mg_rpc_send_response_chunkf(struct mg_rpc_request_info *ri,
+                                 const struct mg_str bin,
+                                 const char *result_json_fmt, ...) {
+  va_list ap;
+  va_start(ap, result_json_fmt);
+  bool result = mg_rpc_send_responsevf(ri, bin, true, result_json_fmt, ap);
+  va_end(ap);
+  return result;
+}
+
+static struct mg_rpc_stream_info *mg_rpc_find_stream(
+    struct mg_rpc *c, const struct mg_rpc_channel *ch,
+    const struct mg_rpc_request_info *ri) {
+  struct mg_rpc_stream_info *si;
+  STAILQ_FOREACH(si, &c->streams, streams) {
+    if (si->ri == ri || (ri == NULL && si->ri->ch == ch)) return si;
+  }
+  return NULL;
+}
+
+/* Lets the next stream waiting on the channel send a chunk, if it's free. */
+static void mg_rpc_run_streams(struct mg_rpc *c,
+                               struct mg_rpc_channel_info *ci) {
+  if (!ci->is_open || ci->is_busy) return;
+  struct mg_rpc_stream_info *si = mg_rpc_find_stream(c, ci->ch, NULL);
+  if (si == NULL) return;
+  /* Round-robin between streams on the same channel. */
+  STAILQ_REMOVE(&c->streams, si, mg_rpc_stream_info, streams);
+  STAILQ_INSERT_TAIL(&c->streams, si, streams);
+  /* Note: si may be freed by the callback. */
+  si->cb(si->ri, si->cb_arg, true);
+}
+
+static void mg_rpc_cancel_streams(struct mg_rpc *c,
+                                  struct mg_rpc_channel_info *ci) {
+  struct mg_rpc_stream_info *si;
+  /* Callbacks may end other streams too, so start over every time. */
+  while ((si = mg_rpc_find_stream(c, ci->ch, NULL)) != NULL) {
+    struct mg_rpc_request_info *ri = si->ri;
+    mg_rpc_stream_cb_t cb = si->cb;
+    void *cb_arg = si->cb_arg;
+    STAILQ_REMOVE(&c->streams, si, mg_rpc_stream_info, streams);
+    free(si);
+    LOG(LL_DEBUG, ("Stream %lld cancelled", ri->id));
+    cb(ri, cb_arg, false);
+  }
+}
+
+bool mg_rpc_stream_response(struct mg_rpc_request_info *ri,
+                            mg_rpc_stream_cb_t cb, void *cb_arg) {
+  struct mg_rpc *c = ri->rpc;
+  struct mg_rpc_channel_info *ci = mg_rpc_get_channel_info(c, ri->ch);
+  if (ci == NULL || !ci->is_open || !mg_rpc_channel_is_stream_ok(ci)) {
+    return false;
+  }
+  struct mg_rpc_stream_info *si =
+      (struct mg_rpc_stream_info *) calloc(1, sizeof(*si));
+  if (si == NULL) return false;
+  si->ri = ri;
+  si->cb = cb;
+  si->cb_arg = cb_arg;
+  STAILQ_INSERT_TAIL(&c->streams, si, streams);
+  mg_rpc_run_streams(c, ci);
+  return true;
+}
+
 bool mg_rpc_send_errorf(struct mg_rpc_request_info *ri, int error_code,
                         const char *error_msg_fmt, ...) {
-  struct mbuf prefb;
-  struct json_out prefbout = JSON_OUT_MBUF(&prefb);
-  mbuf_init(&prefb, 0);
-  if (error_code != 0) {
-    json_printf(&prefbout, "error:{code:%d", error_code);
-    if (error_msg_fmt != NULL) {
-      va_list ap;
-      va_start(ap, error_msg_fmt);
-      char buf[100], *msg = buf;
-      if (mg_avprintf(&msg, sizeof(buf), error_msg_fmt, ap) > 0) {
-        json_printf(&prefbout, ",message:%Q", msg);
-      }
-      if (msg != buf) free(msg);
-      va_end(ap);
-    }
-    json_printf(&prefbout, "}");
+  char buf[100], *msg = buf;
+  struct mg_rpc_out_frame of;
+  memset(&of, 0, sizeof(of));
+  of.id = ri->id;
+  of.dst = ri->src;
+  of.tag = ri->tag;
+  of.prio = MG_RPC_PRIO_HIGH;
+  of.error_code = error_code;
+  if (error_code != 0 && error_msg_fmt != NULL) {
+    va_list ap;
+    va_start(ap, error_msg_fmt);
+    int len = mg_avprintf(&msg, sizeof(buf), error_msg_fmt, ap);
+    if (len > 0) of.error_msg = mg_mk_str_n(msg, len);
+    va_end(ap);
   }
   va_list dummy;
   memset(&dummy, 0, sizeof(dummy));
   struct mg_rpc_channel_info *ci = mg_rpc_get_channel_info(ri->rpc, ri->ch);
-  bool result = mg_rpc_dispatch_frame(
-      ri->rpc, ri->src, ri->id, ri->tag, ci, true /* enqueue */,
-      mg_mk_str_n(prefb.buf, prefb.len), NULL, dummy);
+  bool result = mg_rpc_dispatch_frame(ri->rpc, ci, &of, true /* enqueue */,
+                                      NULL, dummy);
+  if (msg != buf) free(msg);
   mg_rpc_free_request_info(ri);
   return result;
 }
@@ -534,6 +1352,11 @@ void mg_rpc_add_handler(struct mg_rpc *c, const char *method,
   hi->cb = cb;
   hi->cb_arg = cb_arg;
   hi->args_fmt = args_fmt;
+  hi->hash = mg_rpc_hash_str(mg_mk_str(method));
+  if (!mg_rpc_add_handler_to_map(c, hi)) {
+    free(hi);
+    return;
+  }
   SLIST_INSERT_HEAD(&c->handlers, hi, handlers);
 }
 
@@ -550,6 +1373,11 @@ bool mg_rpc_can_send(struct mg_rpc *c) {
 }
 
 void mg_rpc_free_request_info(struct mg_rpc_request_info *ri) {
+  struct mg_rpc_stream_info *si = mg_rpc_find_stream(ri->rpc, NULL, ri);
+  if (si != NULL) {
+    STAILQ_REMOVE(&ri->rpc->streams, si, mg_rpc_stream_info, streams);
+    free(si);
+  }
   free((void *) ri->src.p);
   memset(ri, 0, sizeof(*ri));
   free(ri);
@@ -579,6 +1407,8 @@ void mg_rpc_remove_observer(struct mg_rpc *c, mg_observer_cb_t cb,
 
 void mg_rpc_free(struct mg_rpc *c) {
   /* FIXME(rojer): free other stuff */
+  free(c->handlers_map);
+  free(c->requests_map);
   free(c);
 }
 
@@ -625,18 +1455,16 @@ static void mg_rpc_describe_handler(struct mg_rpc_request_info *ri,
     mg_rpc_send_errorf(ri, 400, "name is required");
     return;
   }
-  struct mg_str name = mg_mk_str_n(t.ptr, t.len);
-  SLIST_FOREACH(hi, &ri->rpc->handlers, handlers) {
-    if (mg_vcmp(&name, hi->method) == 0) {
-      struct mbuf mbuf;
-      struct json_out out = JSON_OUT_MBUF(&mbuf);
-      mbuf_init(&mbuf, 100);
-      json_printf(&out, "{name: %.*Q, args_fmt: %Q}", t.len, t.ptr,
-                  hi->args_fmt);
-      mg_rpc_send_responsef(ri, "%.*s", mbuf.len, mbuf.buf);
-      mbuf_free(&mbuf);
-      return;
-    }
+  hi = mg_rpc_find_handler(ri->rpc, mg_mk_str_n(t.ptr, t.len));
+  if (hi != NULL) {
+    struct mbuf mbuf;
+    struct json_out out = JSON_OUT_MBUF(&mbuf);
+    mbuf_init(&mbuf, 100);
+    json_printf(&out, "{name: %.*Q, args_fmt: %Q}", t.len, t.ptr,
+                hi->args_fmt);
+    mg_rpc_send_responsef(ri, "%.*s", mbuf.len, mbuf.buf);
+    mbuf_free(&mbuf);
+    return;
   }
   mg_rpc_send_errorf(ri, 404, "name not found");
   (void) cb_arg;
@@ -20,7 +20,9 @@ struct mg_rpc;
 struct mg_rpc_cfg {
   char *id;
   char *psk;
-  int max_queue_size;
+  int max_queue_size;  /* Frames */
+  int max_queue_bytes; /* Total size of queued frames, 0 - no limit */
+  double default_out_timeout; /* Seconds, <= 0: requests never time out */
 };
 
 struct mg_rpc_frame {
@@ -30,8 +32,31 @@ struct mg_rpc_frame {
   struct mg_str src, dst, tag;
   struct mg_str method, args;
   struct mg_str result, error_msg;
+  /* Binary payload: raw in a UBJSON frame, base64 text in a JSON one. */
+  struct mg_str bin;
+  bool bin_is_base64;
+  struct mg_str enc; /* Frame encoding the sender accepts, if advertised. */
+  bool more;         /* Partial result, more frames for this id follow. */
 };
 
+/*
+ * Frames are JSON by default. A compact alternative is a UBJSON object
+ * prefixed with the no-op marker 'N', which JSON frames never start with.
+ * Its method/args/result are the same JSON text wrapped in UBJSON strings,
+ * so handlers see no difference, and binary payloads ("bin") travel as raw
+ * bytes instead of base64. Senders advertise support by including
+ * "enc": "ubjson" into a JSON frame; once the peer has done so (or sent a
+ * UBJSON frame), the channel switches to UBJSON for frames going out on it.
+ * This is per hop: only frames to and from the peer at the other end of
+ * the channel count, frames relayed through it stay JSON.
+ * Requires CS_ENABLE_UBJSON and a channel that can carry binary frames.
+ */
+#define MG_RPC_ENC_UBJSON "ubjson"
+#define MG_RPC_UBJSON_MARKER 'N'
+
+/* Returns true if frame `f` is UBJSON-encoded. */
+bool mg_rpc_frame_is_ubjson(const struct mg_str f);
+
 /* Create mg_rpc instance. Takes over cfg, which must be heap-allocated. */
 struct mg_rpc *mg_rpc_create(struct mg_rpc_cfg *cfg);
 
@@ -56,6 +81,8 @@ void mg_rpc_disconnect(struct mg_rpc *c);
 struct mg_rpc_frame_info {
   const char *channel_type; /* Type of the channel this message arrived on. */
   bool channel_is_trusted;  /* Whether the channel is marked as trusted. */
+  struct mg_str bin; /* Binary payload, if any. Valid until return. */
+  bool more;         /* Partial result, result callback will be invoked again */
 };
 
 /* Signature of the function that receives response to a request. */
@@ -64,6 +91,22 @@ typedef void (*mg_result_cb_t)(struct mg_rpc *c, void *cb_arg,
                                struct mg_str result, int error_code,
                                struct mg_str error_msg);
 
+/*
+ * Priority of outgoing frames. Frames that cannot be sent immediately are
+ * queued per destination and sent highest priority first. When the queue is
+ * full, a frame can evict the newest queued frame of a lower priority.
+ * An evicted request fails at once: its result callback gets error 503.
+ * The byte limit (max_queue_bytes) is not applied to high priority frames
+ * or to a frame arriving at an empty queue.
+ * Responses are always sent with MG_RPC_PRIO_HIGH.
+ */
+enum mg_rpc_prio {
+  MG_RPC_PRIO_LOW = -1,   /* Background traffic, e.g. logs */
+  MG_RPC_PRIO_NORMAL = 0, /* Requests */
+  MG_RPC_PRIO_HIGH = 1,   /* Responses */
+};
+#define MG_RPC_NUM_PRIOS 3
+
 /*
  * Send a request.
  * cb is optional, in which case request is sent but response is not required.
@@ -71,6 +114,15 @@ typedef void (*mg_result_cb_t)(struct mg_rpc *c, void *cb_arg,
  */
 struct mg_rpc_call_opts {
   struct mg_str dst; /* Destination ID. If not provided, cloud is implied. */
+  /*
+   * Seconds to wait for the response, 0 means cfg->default_out_timeout,
+   * negative - forever. On timeout, cb is invoked with error code 408.
+   */
+  double timeout;
+  /* Binary payload to attach to the request, raw or base64 depending on the
+   * encoding negotiated with the peer. Optional. */
+  struct mg_str bin;
+  enum mg_rpc_prio prio; /* MG_RPC_PRIO_NORMAL by default */
 };
 bool mg_rpc_callf(struct mg_rpc *c, const struct mg_str method,
                   mg_result_cb_t cb, void *cb_arg,
@@ -118,6 +170,47 @@ void mg_rpc_add_handler(struct mg_rpc *c, const char *method,
 bool mg_rpc_send_responsef(struct mg_rpc_request_info *ri,
                            const char *result_json_fmt, ...);
 
+/* Same as mg_rpc_send_responsef, with a binary payload attached. */
+bool mg_rpc_send_response_binf(struct mg_rpc_request_info *ri,
+                               const struct mg_str bin,
+                               const char *result_json_fmt, ...);
+
+/*
+ * Streaming responses.
+ *
+ * A handler that produces a large result can send it as a series of partial
+ * results followed by the final response, all with the request's id.
+ * Partial result frames carry "more": true, on the requesting side they are
+ * delivered to the result callback with fi->more set and keep the request
+ * alive (each one restarts its timeout).
+ *
+ * Chunks are produced on demand: after mg_rpc_stream_response(), cb is
+ * invoked every time the channel the request came on can take another frame,
+ * the first time possibly before mg_rpc_stream_response() returns. Each
+ * invocation should send one chunk with mg_rpc_send_response_chunkf() or
+ * finish the stream with mg_rpc_send_responsef() / mg_rpc_send_errorf().
+ * This keeps memory use bounded by a single chunk regardless of the total
+ * size. If the channel is closed before the stream is finished, cb is invoked
+ * with ok = false and must release `ri` with mg_rpc_free_request_info().
+ *
+ * Returns false if the channel is not available or cannot carry a stream
+ * (see is_stream_ok in mg_rpc_channel.h: e.g. HTTP closes after the first
+ * response, MQTT cannot tell when a frame has been delivered), then the
+ * handler must respond in some other way.
+ */
+typedef void (*mg_rpc_stream_cb_t)(struct mg_rpc_request_info *ri,
+                                   void *cb_arg, bool ok);
+bool mg_rpc_stream_response(struct mg_rpc_request_info *ri,
+                            mg_rpc_stream_cb_t cb, void *cb_arg);
+
+/*
+ * Sends a partial result. Unlike mg_rpc_send_responsef, `ri` remains valid.
+ * bin is optional.
+ */
+bool mg_rpc_send_response_chunkf(struct mg_rpc_request_info *ri,
+                                 const struct mg_str bin,
+                                 const char *result_json_fmt, ...);
+
 /*
  * Send and error response to an incoming request.
  * error_msg_fmt is optional and can be NULL, in which case only code is sent.
@@ -126,6 +219,12 @@ bool mg_rpc_send_responsef(struct mg_rpc_request_info *ri,
 bool mg_rpc_send_errorf(struct mg_rpc_request_info *ri, int error_code,
                         const char *error_msg_fmt, ...);
 
+/*
+ * Fails requests that have not been responded to in time.
+ * Should be called periodically.
+ */
+void mg_rpc_check_timeouts(struct mg_rpc *c);
+
 /* Returns true if the instance has an open default channel. */
 bool mg_rpc_is_connected(struct mg_rpc *c);
 
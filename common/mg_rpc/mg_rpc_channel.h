@@ -29,6 +29,14 @@ struct mg_rpc_channel {
   void (*ch_close)(struct mg_rpc_channel *ch);
   const char *(*get_type)(struct mg_rpc_channel *ch);
   bool (*is_persistent)(struct mg_rpc_channel *ch);
+  /* Optional: true if binary (UBJSON) frames can be sent over the channel. */
+  bool (*is_binary_ok)(struct mg_rpc_channel *ch);
+  /*
+   * Optional: true if several response frames can be sent for one request
+   * and FRAME_SENT is only reported once the frame is actually out, so it
+   * can be used to pace a streamed response.
+   */
+  bool (*is_stream_ok)(struct mg_rpc_channel *ch);
 
   void *channel_data;
   void *mg_rpc_data;
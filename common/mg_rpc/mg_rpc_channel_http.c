@@ -122,6 +122,7 @@ struct mg_rpc_channel *mg_rpc_channel_http(struct mg_connection *nc) {
   ch->ch_close = mg_rpc_channel_http_ch_close;
   ch->get_type = mg_rpc_channel_http_get_type;
   ch->is_persistent = mg_rpc_channel_http_is_persistent;
+  /* No is_stream_ok: the connection is closed after the first frame. */
 
   struct mg_rpc_channel_http_data *chd =
       (struct mg_rpc_channel_http_data *) calloc(1, sizeof(*chd));
@@ -35,6 +35,11 @@ static bool mg_rpc_channel_loopback_is_persistent(struct mg_rpc_channel *ch) {
   return true;
 }
 
+static bool mg_rpc_channel_loopback_is_stream_ok(struct mg_rpc_channel *ch) {
+  (void) ch;
+  return true;
+}
+
 static const char *mg_rpc_channel_loopback_get_type(struct mg_rpc_channel *ch) {
   (void) ch;
   return "loopback";
@@ -95,6 +100,7 @@ struct mg_rpc_channel *mg_rpc_channel_loopback(void) {
   ch->ch_close = mg_rpc_channel_loopback_ch_close;
   ch->get_type = mg_rpc_channel_loopback_get_type;
   ch->is_persistent = mg_rpc_channel_loopback_is_persistent;
+  ch->is_stream_ok = mg_rpc_channel_loopback_is_stream_ok;
 
   return ch;
 }
@@ -5,6 +5,7 @@
 
 #include "common/mg_rpc/mg_rpc_channel_ws.h"
 #include "common/cs_dbg.h"
+#include "common/mg_rpc/mg_rpc.h"
 #include "common/mg_rpc/mg_rpc_channel.h"
 
 #if MGOS_ENABLE_RPC
@@ -79,7 +80,10 @@ static bool mg_rpc_channel_ws_send_frame(struct mg_rpc_channel *ch,
       (struct mg_rpc_channel_ws_data *) ch->channel_data;
   if (chd->nc == NULL || chd->sending) return false;
   chd->sending = true;
-  mg_send_websocket_frame(chd->nc, WEBSOCKET_OP_TEXT, f.p, f.len);
+  mg_send_websocket_frame(
+      chd->nc,
+      (mg_rpc_frame_is_ubjson(f) ? WEBSOCKET_OP_BINARY : WEBSOCKET_OP_TEXT),
+      f.p, f.len);
   return true;
 }
 
@@ -89,6 +93,16 @@ static void mg_rpc_channel_ws_ch_close(struct mg_rpc_channel *ch) {
   if (chd->nc != NULL) chd->nc->flags |= MG_F_CLOSE_IMMEDIATELY;
 }
 
+static bool mg_rpc_channel_ws_is_binary_ok(struct mg_rpc_channel *ch) {
+  (void) ch;
+  return true;
+}
+
+static bool mg_rpc_channel_ws_is_stream_ok(struct mg_rpc_channel *ch) {
+  (void) ch;
+  return true;
+}
+
 static const char *mg_rpc_channel_ws_in_get_type(struct mg_rpc_channel *ch) {
   (void) ch;
   return "WS_in";
@@ -103,6 +117,8 @@ struct mg_rpc_channel *mg_rpc_channel_ws_in(struct mg_connection *nc) {
   struct mg_rpc_channel *ch = (struct mg_rpc_channel *) calloc(1, sizeof(*ch));
   ch->ch_connect = mg_rpc_channel_ws_in_ch_connect;
   ch->send_frame = mg_rpc_channel_ws_send_frame;
+  ch->is_binary_ok = mg_rpc_channel_ws_is_binary_ok;
+  ch->is_stream_ok = mg_rpc_channel_ws_is_stream_ok;
   ch->ch_close = mg_rpc_channel_ws_ch_close;
   ch->get_type = mg_rpc_channel_ws_in_get_type;
   ch->is_persistent = mg_rpc_channel_ws_in_is_persistent;
@@ -259,6 +275,8 @@ struct mg_rpc_channel *mg_rpc_channel_ws_out(
   struct mg_rpc_channel *ch = (struct mg_rpc_channel *) calloc(1, sizeof(*ch));
   ch->ch_connect = mg_rpc_channel_ws_out_ch_connect;
   ch->send_frame = mg_rpc_channel_ws_send_frame;
+  ch->is_binary_ok = mg_rpc_channel_ws_is_binary_ok;
+  ch->is_stream_ok = mg_rpc_channel_ws_is_stream_ok;
   ch->ch_close = mg_rpc_channel_ws_ch_close;
   ch->get_type = mg_rpc_channel_ws_out_get_type;
   ch->is_persistent = mg_rpc_channel_ws_out_is_persistent;
@@ -72,10 +72,6 @@ typedef unsigned _int64 uint64_t;
 #define va_copy(x, y) x = y
 #endif
 
-#ifndef JSON_MAX_PATH_LEN
-#define JSON_MAX_PATH_LEN 60
-#endif
-
 struct frozen {
   const char *end;
   const char *cur;
@@ -117,11 +113,11 @@ struct fstate {
 
 static int append_to_path(struct frozen *f, const char *str, int size) {
   int n = f->path_len;
-  f->path_len +=
-      snprintf(f->path + f->path_len, sizeof(f->path) - (f->path_len), "%.*s", size, str);
-  if (f->path_len > sizeof(f->path) - 1) {
-    f->path_len = sizeof(f->path) - 1;
-  }
+  int left = sizeof(f->path) - 1 - n;
+  if (size > left) size = left;
+  memcpy(f->path + n, str, size);
+  f->path_len += size;
+  f->path[f->path_len] = '\0';
 
   return n;
 }
@@ -155,7 +151,77 @@ static int is_space(int ch) {
   return ch == ' ' || ch == '\t' || ch == '\r' || ch == '\n';
 }
 
+/*
+ * Block scanners: find the first byte of interest 16 bytes at a time.
+ * SSE2 is part of the x86_64 baseline, NEON of aarch64, so no runtime
+ * detection is needed.
+ */
+#if !defined(JSON_DISABLE_SIMD) && (defined(__GNUC__) || defined(__clang__))
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define JSON_SIMD_SSE2 1
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define JSON_SIMD_NEON 1
+#endif
+#endif
+
+/*
+ * Skip characters that need no attention inside a string: everything except
+ * '"', '\\', control characters and non-ASCII (UTF-8) bytes.
+ */
+static const char *skip_plain_chars(const char *p, const char *end) {
+#if defined(JSON_SIMD_SSE2)
+  const __m128i quote = _mm_set1_epi8('"'), bslash = _mm_set1_epi8('\\');
+  const __m128i space = _mm_set1_epi8(0x20);
+  while (end - p >= 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *) p);
+    /* Signed compare catches both < 0x20 and >= 0x80 */
+    __m128i m = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, bslash)),
+        _mm_cmplt_epi8(v, space));
+    int mask = _mm_movemask_epi8(m);
+    if (mask != 0) return p + __builtin_ctz(mask);
+    p += 16;
+  }
+#elif defined(JSON_SIMD_NEON)
+  const uint8x16_t quote = vdupq_n_u8('"'), bslash = vdupq_n_u8('\\');
+  const uint8x16_t space = vdupq_n_u8(0x20), high = vdupq_n_u8(0x80);
+  while (end - p >= 16) {
+    uint8x16_t v = vld1q_u8((const uint8_t *) p);
+    uint8x16_t m = vorrq_u8(vorrq_u8(vceqq_u8(v, quote), vceqq_u8(v, bslash)),
+                            vorrq_u8(vcltq_u8(v, space), vcgeq_u8(v, high)));
+    if (vmaxvq_u8(m) != 0) break; /* Scalar loop below finds it */
+    p += 16;
+  }
+#endif
+  while (p < end) {
+    unsigned char ch = *(const unsigned char *) p;
+    if (ch < 0x20 || ch >= 0x80 || ch == '"' || ch == '\\') break;
+    p++;
+  }
+  return p;
+}
+
 static void skip_whitespaces(struct frozen *f) {
+  /* Usually there is none or very little */
+  if (f->cur < f->end && !is_space(*f->cur)) return;
+#if defined(JSON_SIMD_SSE2)
+  while (f->end - f->cur >= 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *) f->cur);
+    __m128i m = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')),
+                     _mm_cmpeq_epi8(v, _mm_set1_epi8('\n'))),
+        _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\r')),
+                     _mm_cmpeq_epi8(v, _mm_set1_epi8('\t'))));
+    int mask = _mm_movemask_epi8(m) ^ 0xffff;
+    if (mask != 0) {
+      f->cur += __builtin_ctz(mask);
+      return;
+    }
+    f->cur += 16;
+  }
+#endif
   while (f->cur < f->end && is_space(*f->cur)) f->cur++;
 }
 
@@ -241,6 +307,8 @@ static int parse_string(struct frozen *f) {
   {
     SET_STATE(f, f->cur, "", 0);
     for (; f->cur < f->end; f->cur += len) {
+      f->cur = skip_plain_chars(f->cur, f->end);
+      if (f->cur >= f->end) break;
       ch = *(unsigned char *) f->cur;
       len = get_utf8_char_len((unsigned char) ch);
       EXPECT(ch >= 32 && len > 0, JSON_STRING_INVALID); /* No control chars */
@@ -286,9 +354,23 @@ static int parse_number(struct frozen *f) {
   return 0;
 }
 
+/* Formats "[index]" into buf, returns length */
+static int format_index(char *buf, int index) {
+  char digits[12];
+  int n = 0, len = 0;
+  do {
+    digits[n++] = '0' + index % 10;
+    index /= 10;
+  } while (index > 0);
+  buf[len++] = '[';
+  while (n > 0) buf[len++] = digits[--n];
+  buf[len++] = ']';
+  return len;
+}
+
 /* array = '[' [ value { ',' value } ] ']' */
 static int parse_array(struct frozen *f) {
-  int i = 0, current_path_len;
+  int i = 0, current_path_len, buf_len;
   char buf[20];
   TRY(test_and_skip(f, '['));
   {
@@ -296,12 +378,11 @@ static int parse_array(struct frozen *f) {
     {
       SET_STATE(f, f->cur - 1, "", 0);
       while (cur(f) != ']') {
-        snprintf(buf, sizeof(buf), "[%d]", i);
+        buf_len = format_index(buf, i);
         i++;
-        current_path_len = append_to_path(f, buf, strlen(buf));
-        f->cur_name =
-            f->path + strlen(f->path) - strlen(buf) + 1 /*opening brace*/;
-        f->cur_name_len = strlen(buf) - 2 /*braces*/;
+        current_path_len = append_to_path(f, buf, buf_len);
+        f->cur_name = f->path + f->path_len - buf_len + 1 /*opening brace*/;
+        f->cur_name_len = buf_len - 2 /*braces*/;
         TRY(parse_value(f));
         truncate_path(f, current_path_len);
         if (cur(f) == ',') f->cur++;
@@ -432,33 +513,96 @@ static int doit(struct frozen *f) {
   return parse_value(f);
 }
 
-int json_escape(struct json_out *out, const char *p, size_t len) WEAK;
-int json_escape(struct json_out *out, const char *p, size_t len) {
-  size_t i, cl, n = 0;
+#ifndef JSON_PRINTF_BUF_SIZE
+#define JSON_PRINTF_BUF_SIZE 128
+#endif
+
+/*
+ * Output of json_vprintf() and json_escape() is staged here, so the printer
+ * is called once per JSON_PRINTF_BUF_SIZE bytes rather than once per token
+ * (or, when escaping, per character).
+ */
+struct json_printf_ctx {
+  struct json_out *out;
+  int len;  /* Sum of the printer return values */
+  size_t n; /* Bytes staged in buf */
+  char buf[JSON_PRINTF_BUF_SIZE];
+};
+
+static void json_pf_init(struct json_printf_ctx *ctx, struct json_out *out) {
+  ctx->out = out;
+  ctx->len = 0;
+  ctx->n = 0;
+}
+
+static void json_pf_flush(struct json_printf_ctx *ctx) {
+  if (ctx->n > 0) {
+    ctx->len += ctx->out->printer(ctx->out, ctx->buf, ctx->n);
+    ctx->n = 0;
+  }
+}
+
+static void json_pf_put(struct json_printf_ctx *ctx, const char *s,
+                        size_t len) {
+  if (ctx->n + len > sizeof(ctx->buf)) {
+    json_pf_flush(ctx);
+    if (len >= sizeof(ctx->buf)) {
+      /* Large chunks go straight to the printer */
+      ctx->len += ctx->out->printer(ctx->out, s, len);
+      return;
+    }
+  }
+  memcpy(ctx->buf + ctx->n, s, len);
+  ctx->n += len;
+}
+
+static int json_pf_is_plain(unsigned char ch) {
+  return ch != '"' && ch != '\\' && (ch < '\b' || ch > '\r') && isprint(ch);
+}
+
+static void json_pf_escape(struct json_printf_ctx *ctx, const char *p,
+                           size_t len) {
+  size_t i = 0, j, cl;
   const char *hex_digits = "0123456789abcdef";
   const char *specials = "btnvfr";
 
-  for (i = 0; i < len; i++) {
-    unsigned char ch = ((unsigned char *) p)[i];
+  while (i < len) {
+    unsigned char ch;
+    /* Runs of characters that need no escaping are copied in one go */
+    for (j = i; j < len && json_pf_is_plain(((unsigned char *) p)[j]); j++) {
+    }
+    if (j > i) {
+      json_pf_put(ctx, p + i, j - i);
+      if (j == len) break;
+      i = j;
+    }
+    ch = ((unsigned char *) p)[i];
     if (ch == '"' || ch == '\\') {
-      n += out->printer(out, "\\", 1);
-      n += out->printer(out, p + i, 1);
+      json_pf_put(ctx, "\\", 1);
+      json_pf_put(ctx, p + i, 1);
     } else if (ch >= '\b' && ch <= '\r') {
-      n += out->printer(out, "\\", 1);
-      n += out->printer(out, &specials[ch - '\b'], 1);
-    } else if (isprint(ch)) {
-      n += out->printer(out, p + i, 1);
+      json_pf_put(ctx, "\\", 1);
+      json_pf_put(ctx, &specials[ch - '\b'], 1);
     } else if ((cl = get_utf8_char_len(ch)) == 1) {
-      n += out->printer(out, "\\u00", 4);
-      n += out->printer(out, &hex_digits[(ch >> 4) % 0xf], 1);
-      n += out->printer(out, &hex_digits[ch % 0xf], 1);
+      json_pf_put(ctx, "\\u00", 4);
+      json_pf_put(ctx, &hex_digits[(ch >> 4) % 0xf], 1);
+      json_pf_put(ctx, &hex_digits[ch % 0xf], 1);
     } else {
-      n += out->printer(out, p + i, cl);
+      if (cl > len - i) cl = len - i;
+      json_pf_put(ctx, p + i, cl);
       i += cl - 1;
     }
+    i++;
   }
+}
 
-  return n;
+int json_escape(struct json_out *out, const char *p, size_t len) WEAK;
+int json_escape(struct json_out *out, const char *p, size_t len) {
+  struct json_printf_ctx ctx;
+  json_pf_init(&ctx, out);
+  json_pf_escape(&ctx, p, len);
+  json_pf_flush(&ctx);
+  return ctx.len;
 }
 
 int json_printer_buf(struct json_out *out, const char *buf, size_t len) WEAK;
@@ -480,18 +624,6 @@ int json_printer_file(struct json_out *out, const char *buf, size_t len) {
   return fwrite(buf, 1, len, out->u.fp);
 }
 
-static int b64idx(int c) {
-  if (c < 26) {
-    return c + 'A';
-  } else if (c < 52) {
-    return c - 26 + 'a';
-  } else if (c < 62) {
-    return c - 52 + '0';
-  } else {
-    return c == 62 ? '+' : '/';
-  }
-}
-
 static int b64rev(int c) {
   if (c >= 'A' && c <= 'Z') {
     return c - 'A';
@@ -515,23 +647,24 @@ static uint8_t hexdec(const char *s) {
   return (HEXTOI(a) << 4) | HEXTOI(b);
 }
 
-static int b64enc(struct json_out *out, const unsigned char *p, int n) {
+static void b64enc(struct json_printf_ctx *ctx, const unsigned char *p,
+                   int n) {
+  static const char *b64 =
+      "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
   char buf[4];
-  int i, len = 0;
+  int i;
   for (i = 0; i < n; i += 3) {
     int a = p[i], b = i + 1 < n ? p[i + 1] : 0, c = i + 2 < n ? p[i + 2] : 0;
-    buf[0] = b64idx(a >> 2);
-    buf[1] = b64idx((a & 3) << 4 | (b >> 4));
-    buf[2] = b64idx((b & 15) << 2 | (c >> 6));
-    buf[3] = b64idx(c & 63);
-    if (i + 1 >= n) buf[2] = '=';
-    if (i + 2 >= n) buf[3] = '=';
-    len += out->printer(out, buf, sizeof(buf));
+    buf[0] = b64[a >> 2];
+    buf[1] = b64[(a & 3) << 4 | (b >> 4)];
+    buf[2] = i + 1 < n ? b64[(b & 15) << 2 | (c >> 6)] : '=';
+    buf[3] = i + 2 < n ? b64[c & 63] : '=';
+    json_pf_put(ctx, buf, 4);
   }
-  return len;
 }
 
-static int b64dec(const char *src, int n, char *dst) {
+int json_base64_decode(const char *src, int n, char *dst) WEAK;
+int json_base64_decode(const char *src, int n, char *dst) {
   const char *end = src + n;
   int len = 0;
   while (src + 3 < end) {
@@ -549,170 +682,467 @@ static int b64dec(const char *src, int n, char *dst) {
   return len;
 }
 
-int json_vprintf(struct json_out *out, const char *fmt, va_list xap) WEAK;
-int json_vprintf(struct json_out *out, const char *fmt, va_list xap) {
-  int len = 0;
-  const char *quote = "\"", *null = "null";
-  va_list ap;
-  va_copy(ap, xap);
+enum json_printf_seg_type {
+  JSON_PF_LITERAL, /* JSON punctuation and whitespace, printed as is */
+  JSON_PF_KEY,     /* Bare identifier, printed quoted */
+  JSON_PF_INT,
+  JSON_PF_UINT,
+  JSON_PF_INT64,
+  JSON_PF_UINT64,
+  JSON_PF_SIZE_T,
+  JSON_PF_DOUBLE,
+  JSON_PF_BOOL,
+  JSON_PF_QUOTED,
+  JSON_PF_QUOTED_LEN,
+  JSON_PF_HEX,
+  JSON_PF_BASE64,
+  JSON_PF_CALLBACK,
+  JSON_PF_SYSTEM /* Delegated to vsnprintf() */
+};
 
-  while (*fmt != '\0') {
-    if (strchr(":, \r\n\t[]{}\"", *fmt) != NULL) {
-      len += out->printer(out, fmt, 1);
-      fmt++;
-    } else if (fmt[0] == '%') {
-      char buf[21];
-      size_t skip = 2;
-
-      if (fmt[1] == 'l' && fmt[2] == 'l' && (fmt[3] == 'd' || fmt[3] == 'u')) {
-        int64_t val = va_arg(ap, int64_t);
-        const char *fmt2 = fmt[3] == 'u' ? "%" UINT64_FMT : "%" INT64_FMT;
-        snprintf(buf, sizeof(buf), fmt2, val);
-        len += out->printer(out, buf, strlen(buf));
-        skip += 2;
-      } else if (fmt[1] == 'z' && fmt[2] == 'u') {
-        size_t val = va_arg(ap, size_t);
-        snprintf(buf, sizeof(buf), "%" SIZE_T_FMT, val);
-        len += out->printer(out, buf, strlen(buf));
-        skip += 1;
-      } else if (fmt[1] == 'M') {
-        json_printf_callback_t f = va_arg(ap, json_printf_callback_t);
-        len += f(out, &ap);
-      } else if (fmt[1] == 'B') {
-        int val = va_arg(ap, int);
-        const char *str = val ? "true" : "false";
-        len += out->printer(out, str, strlen(str));
-      } else if (fmt[1] == 'H') {
-        const char *hex = "0123456789abcdef";
-        int i, n = va_arg(ap, int);
-        const unsigned char *p = va_arg(ap, const unsigned char *);
-        len += out->printer(out, quote, 1);
-        for (i = 0; i < n; i++) {
-          len += out->printer(out, &hex[(p[i] >> 4) & 0xf], 1);
-          len += out->printer(out, &hex[p[i] & 0xf], 1);
-        }
-        len += out->printer(out, quote, 1);
-      } else if (fmt[1] == 'V') {
-        const unsigned char *p = va_arg(ap, const unsigned char *);
-        int n = va_arg(ap, int);
-        len += out->printer(out, quote, 1);
-        len += b64enc(out, p, n);
-        len += out->printer(out, quote, 1);
-      } else if (fmt[1] == 'Q' ||
-                 (fmt[1] == '.' && fmt[2] == '*' && fmt[3] == 'Q')) {
-        size_t l = 0;
-        const char *p;
-
-        if (fmt[1] == '.') {
-          l = (size_t) va_arg(ap, int);
-          skip += 2;
-        }
-        p = va_arg(ap, char *);
+/* Type of the argument consumed by a JSON_PF_SYSTEM conversion */
+enum json_printf_arg_type {
+  JSON_PF_ARG_INT,
+  JSON_PF_ARG_INT64,
+  JSON_PF_ARG_DOUBLE,
+  JSON_PF_ARG_STR,
+  JSON_PF_ARG_PREC_STR
+};
 
-        if (p == NULL) {
-          len += out->printer(out, null, 4);
-        } else {
-          if (fmt[1] == 'Q') {
-            l = strlen(p);
-          }
-          len += out->printer(out, quote, 1);
-          len += json_escape(out, p, l);
-          len += out->printer(out, quote, 1);
-        }
-      } else {
-        /*
-         * we delegate printing to the system printf.
-         * The goal here is to delegate all modifiers parsing to the system
-         * printf, as you can see below we still have to parse the format
-         * types.
-         *
-         * Currently, %s with strings longer than 20 chars will require
-         * double-buffering (an auxiliary buffer will be allocated from heap).
-         * TODO(dfrank): reimplement %s and %.*s in order to avoid that.
-         */
-
-        const char *end_of_format_specifier = "sdfFgGlhuI.*-0123456789";
-        size_t n = strspn(fmt + 1, end_of_format_specifier);
-        char *pbuf = buf;
-        size_t need_len;
-        char fmt2[20];
-        va_list sub_ap;
-        strncpy(fmt2, fmt, n + 1 > sizeof(fmt2) ? sizeof(fmt2) : n + 1);
-        fmt2[n + 1] = '\0';
-
-        va_copy(sub_ap, ap);
-        need_len =
-            vsnprintf(buf, sizeof(buf), fmt2, sub_ap) + 1 /* null-term */;
-        /*
-         * TODO(lsm): Fix windows & eCos code path here. Their vsnprintf
-         * implementation returns -1 on overflow rather needed size.
-         */
-        if (need_len > sizeof(buf)) {
-          /*
-           * resulting string doesn't fit into a stack-allocated buffer `buf`,
-           * so we need to allocate a new buffer from heap and use it
-           */
-          pbuf = (char *) malloc(need_len);
-          va_copy(sub_ap, ap);
-          vsnprintf(pbuf, need_len, fmt2, sub_ap);
-        }
+struct json_printf_seg {
+  unsigned int off; /* Text of the literal, key or conversion in the format */
+  unsigned int len;
+  unsigned char type;
+  unsigned char arg;
+};
 
-        /*
-         * however we need to parse the type ourselves in order to advance
-         * the va_list by the correct amount; there is no portable way to
-         * inherit the advancement made by vprintf.
-         * 32-bit (linux or windows) passes va_list by value.
-         */
-        if ((n + 1 == strlen("%" PRId64) && strcmp(fmt2, "%" PRId64) == 0) ||
-            (n + 1 == strlen("%" PRIu64) && strcmp(fmt2, "%" PRIu64) == 0)) {
-          (void) va_arg(ap, int64_t);
-          skip += strlen(PRIu64) - 1;
-        } else if (strcmp(fmt2, "%.*s") == 0) {
-          (void) va_arg(ap, int);
-          (void) va_arg(ap, char *);
-        } else {
-          switch (fmt2[n]) {
-            case 'u':
-            case 'd':
-              (void) va_arg(ap, int);
-              break;
-            case 'g':
-            case 'f':
-              (void) va_arg(ap, double);
-              break;
-            case 'p':
-              (void) va_arg(ap, void *);
-              break;
-            default:
-              /* many types are promoted to int */
-              (void) va_arg(ap, int);
-          }
-        }
+struct json_printf_plan {
+  const char *fmt_ptr; /* Format the plan was compiled from, for the cache */
+  const char *fmt;     /* Copy of the format, segments point into it */
+  int num_segs;
+  struct json_printf_seg *segs;
+};
 
-        len += out->printer(out, pbuf, strlen(pbuf));
-        skip = n + 1;
+#ifndef JSON_PRINTF_PLAN_CACHE_SIZE
+#define JSON_PRINTF_PLAN_CACHE_SIZE 8
+#endif
 
-        /* If buffer was allocated from heap, free it */
-        if (pbuf != buf) {
-          free(pbuf);
-          pbuf = NULL;
-        }
+/* Shorter formats are parsed on every call, that is as cheap as a lookup. */
+#ifndef JSON_PRINTF_PLAN_MIN_LEN
+#define JSON_PRINTF_PLAN_MIN_LEN 16
+#endif
+
+#if JSON_PRINTF_PLAN_CACHE_SIZE > 0
+static struct json_printf_plan
+    *s_json_printf_cache[JSON_PRINTF_PLAN_CACHE_SIZE];
+static int s_json_printf_cache_next;
+/* Nesting level of json_vprintf(), %M callbacks may print too */
+static int s_json_printf_depth;
+#endif
+
+static int json_pf_is_punct(int ch) {
+  switch (ch) {
+    case ':':
+    case ',':
+    case ' ':
+    case '\r':
+    case '\n':
+    case '\t':
+    case '[':
+    case ']':
+    case '{':
+    case '}':
+    case '"':
+      return 1;
+    default:
+      return 0;
+  }
+}
+
+/*
+ * Classifies the conversion at `fmt` the same way json_vprintf() always has,
+ * return its length.
+ */
+static size_t json_printf_parse_conv(const char *fmt,
+                                     struct json_printf_seg *seg) {
+  size_t n;
+  seg->arg = JSON_PF_ARG_INT;
+  if (fmt[1] == 'l' && fmt[2] == 'l' && (fmt[3] == 'd' || fmt[3] == 'u')) {
+    seg->type = fmt[3] == 'u' ? JSON_PF_UINT64 : JSON_PF_INT64;
+    return 4;
+  } else if (fmt[1] == 'z' && fmt[2] == 'u') {
+    seg->type = JSON_PF_SIZE_T;
+    return 3;
+  } else if (fmt[1] == '.' && fmt[2] == '*' && fmt[3] == 'Q') {
+    seg->type = JSON_PF_QUOTED_LEN;
+    return 4;
+  }
+  switch (fmt[1]) {
+    case 'M':
+      seg->type = JSON_PF_CALLBACK;
+      return 2;
+    case 'B':
+      seg->type = JSON_PF_BOOL;
+      return 2;
+    case 'D':
+      seg->type = JSON_PF_DOUBLE;
+      return 2;
+    case 'H':
+      seg->type = JSON_PF_HEX;
+      return 2;
+    case 'V':
+      seg->type = JSON_PF_BASE64;
+      return 2;
+    case 'Q':
+      seg->type = JSON_PF_QUOTED;
+      return 2;
+  }
+
+  /*
+   * Everything else is delegated to the system printf, but we still have to
+   * know the argument type in order to advance the va_list: there is no
+   * portable way to inherit the advancement made by vsnprintf().
+   */
+  n = strspn(fmt + 1, "sdfFgGlhuI.*-0123456789");
+  seg->type = JSON_PF_SYSTEM;
+  if (n + 1 == strlen("%" PRId64) && strncmp(fmt, "%" PRId64, n + 1) == 0) {
+    seg->type = JSON_PF_INT64;
+  } else if (n + 1 == strlen("%" PRIu64) &&
+             strncmp(fmt, "%" PRIu64, n + 1) == 0) {
+    seg->type = JSON_PF_UINT64;
+  } else if (n == 1 && fmt[1] == 'd') {
+    seg->type = JSON_PF_INT;
+  } else if (n == 1 && fmt[1] == 'u') {
+    seg->type = JSON_PF_UINT;
+  } else if (n == 3 && strncmp(fmt, "%.*s", 4) == 0) {
+    seg->arg = JSON_PF_ARG_PREC_STR;
+  } else {
+    switch (fmt[n]) {
+      case 'f':
+      case 'F':
+      case 'g':
+      case 'G':
+        seg->arg = JSON_PF_ARG_DOUBLE;
+        break;
+      case 's':
+        seg->arg = JSON_PF_ARG_STR;
+        break;
+      default:
+        /* many types are promoted to int */
+        break;
+    }
+  }
+  return n + 1;
+}
+
+/*
+ * Parses the next segment of the format starting at `*pos`.
+ * Return 0 at the end of the format.
+ */
+static int json_printf_next_seg(const char *fmt, size_t *pos,
+                                struct json_printf_seg *seg) {
+  const char *p = fmt + *pos, *start;
+  /* Anything that is not punctuation, a key or a conversion is dropped */
+  while (*p != '\0' && *p != '%' && *p != '_' && !is_alpha(*p) &&
+         !json_pf_is_punct(*p)) {
+    p++;
+  }
+  if (*p == '\0') {
+    *pos = p - fmt;
+    return 0;
+  }
+  start = p;
+  if (*p == '%') {
+    p += json_printf_parse_conv(p, seg);
+  } else if (*p == '_' || is_alpha(*p)) {
+    seg->type = JSON_PF_KEY;
+    while (*p == '_' || is_alpha(*p) || is_digit(*p)) p++;
+  } else {
+    seg->type = JSON_PF_LITERAL;
+    while (*p != '\0' && json_pf_is_punct(*p)) p++;
+  }
+  seg->off = start - fmt;
+  seg->len = p - start;
+  *pos = p - fmt;
+  return 1;
+}
+
+static void json_pf_uint64(struct json_printf_ctx *ctx, uint64_t v, int neg) {
+  char buf[21], *p = buf + sizeof(buf);
+  if (v <= 0xffffffffUL) {
+    /* Avoid 64-bit division where it is expensive */
+    unsigned long v32 = (unsigned long) v;
+    do {
+      *--p = '0' + (v32 % 10);
+      v32 /= 10;
+    } while (v32 != 0);
+  } else {
+    do {
+      *--p = '0' + (int) (v % 10);
+      v /= 10;
+    } while (v != 0);
+  }
+  if (neg) *--p = '-';
+  json_pf_put(ctx, p, buf + sizeof(buf) - p);
+}
+
+static void json_pf_int64(struct json_printf_ctx *ctx, int64_t v) {
+  if (v < 0) {
+    json_pf_uint64(ctx, 0 - (uint64_t) v, 1);
+  } else {
+    json_pf_uint64(ctx, (uint64_t) v, 0);
+  }
+}
+
+/*
+ * Shortest representation that reads back as the same double: integral
+ * values are printed as integers, others with the smallest of 15, 16 and 17
+ * significant digits that round-trips. JSON has no NaN or infinity, these
+ * are printed as null.
+ */
+static void json_pf_double(struct json_printf_ctx *ctx, double d) {
+  static const double zero = 0;
+  char buf[32];
+  int prec;
+  if (!(d - d == 0)) {
+    json_pf_put(ctx, "null", 4);
+    return;
+  }
+  if (d > -1e15 && d < 1e15 && d == (double) (int64_t) d &&
+      (d != 0 || memcmp(&d, &zero, sizeof(d)) == 0)) {
+    json_pf_int64(ctx, (int64_t) d);
+    return;
+  }
+  for (prec = 15;; prec++) {
+    snprintf(buf, sizeof(buf), "%.*g", prec, d);
+    if (prec == 17 || strtod(buf, NULL) == d) break;
+  }
+  json_pf_put(ctx, buf, strlen(buf));
+}
+
+static void json_pf_system(struct json_printf_ctx *ctx, const char *fmt,
+                           const struct json_printf_seg *seg, va_list *ap) {
+  char buf[21], fmt2[20], *pbuf = buf;
+  size_t n = seg->len < sizeof(fmt2) ? seg->len : sizeof(fmt2) - 1;
+  size_t need_len;
+  va_list sub_ap;
+  memcpy(fmt2, fmt + seg->off, n);
+  fmt2[n] = '\0';
+
+  va_copy(sub_ap, *ap);
+  need_len = vsnprintf(buf, sizeof(buf), fmt2, sub_ap) + 1 /* null-term */;
+  va_end(sub_ap);
+  /*
+   * TODO(lsm): Fix windows & eCos code path here. Their vsnprintf
+   * implementation returns -1 on overflow rather needed size.
+   */
+  if (need_len > sizeof(buf)) {
+    /*
+     * resulting string doesn't fit into a stack-allocated buffer `buf`,
+     * so we need to allocate a new buffer from heap and use it
+     */
+    char *hbuf = (char *) malloc(need_len);
+    if (hbuf != NULL) {
+      pbuf = hbuf;
+      va_copy(sub_ap, *ap);
+      vsnprintf(pbuf, need_len, fmt2, sub_ap);
+      va_end(sub_ap);
+    }
+  }
+
+  switch (seg->arg) {
+    case JSON_PF_ARG_INT64:
+      (void) va_arg(*ap, int64_t);
+      break;
+    case JSON_PF_ARG_DOUBLE:
+      (void) va_arg(*ap, double);
+      break;
+    case JSON_PF_ARG_STR:
+      (void) va_arg(*ap, char *);
+      break;
+    case JSON_PF_ARG_PREC_STR:
+      (void) va_arg(*ap, int);
+      (void) va_arg(*ap, char *);
+      break;
+    default:
+      (void) va_arg(*ap, int);
+      break;
+  }
+
+  json_pf_put(ctx, pbuf, strlen(pbuf));
+  if (pbuf != buf) free(pbuf);
+}
+
+static void json_printf_run_seg(struct json_printf_ctx *ctx, const char *fmt,
+                                const struct json_printf_seg *seg,
+                                va_list *ap) {
+  switch (seg->type) {
+    case JSON_PF_LITERAL:
+      json_pf_put(ctx, fmt + seg->off, seg->len);
+      break;
+    case JSON_PF_KEY:
+      json_pf_put(ctx, "\"", 1);
+      json_pf_put(ctx, fmt + seg->off, seg->len);
+      json_pf_put(ctx, "\"", 1);
+      break;
+    case JSON_PF_INT:
+      json_pf_int64(ctx, va_arg(*ap, int));
+      break;
+    case JSON_PF_UINT:
+      json_pf_uint64(ctx, va_arg(*ap, unsigned int), 0);
+      break;
+    case JSON_PF_INT64:
+      json_pf_int64(ctx, va_arg(*ap, int64_t));
+      break;
+    case JSON_PF_UINT64:
+      json_pf_uint64(ctx, va_arg(*ap, uint64_t), 0);
+      break;
+    case JSON_PF_SIZE_T:
+      json_pf_uint64(ctx, va_arg(*ap, size_t), 0);
+      break;
+    case JSON_PF_DOUBLE:
+      json_pf_double(ctx, va_arg(*ap, double));
+      break;
+    case JSON_PF_BOOL:
+      if (va_arg(*ap, int)) {
+        json_pf_put(ctx, "true", 4);
+      } else {
+        json_pf_put(ctx, "false", 5);
       }
-      fmt += skip;
-    } else if (*fmt == '_' || is_alpha(*fmt)) {
-      len += out->printer(out, quote, 1);
-      while (*fmt == '_' || is_alpha(*fmt) || is_digit(*fmt)) {
-        len += out->printer(out, fmt, 1);
-        fmt++;
+      break;
+    case JSON_PF_QUOTED:
+    case JSON_PF_QUOTED_LEN: {
+      size_t l = 0;
+      const char *p;
+      if (seg->type == JSON_PF_QUOTED_LEN) l = (size_t) va_arg(*ap, int);
+      p = va_arg(*ap, char *);
+      if (p == NULL) {
+        json_pf_put(ctx, "null", 4);
+      } else {
+        if (seg->type == JSON_PF_QUOTED) l = strlen(p);
+        json_pf_put(ctx, "\"", 1);
+        json_pf_escape(ctx, p, l);
+        json_pf_put(ctx, "\"", 1);
       }
-      len += out->printer(out, quote, 1);
-    } else {
-      fmt++;
+      break;
+    }
+    case JSON_PF_HEX: {
+      const char *hex = "0123456789abcdef";
+      int i, n = va_arg(*ap, int);
+      const unsigned char *p = va_arg(*ap, const unsigned char *);
+      char buf[2];
+      json_pf_put(ctx, "\"", 1);
+      for (i = 0; i < n; i++) {
+        buf[0] = hex[(p[i] >> 4) & 0xf];
+        buf[1] = hex[p[i] & 0xf];
+        json_pf_put(ctx, buf, 2);
+      }
+      json_pf_put(ctx, "\"", 1);
+      break;
+    }
+    case JSON_PF_BASE64: {
+      const unsigned char *p = va_arg(*ap, const unsigned char *);
+      int n = va_arg(*ap, int);
+      json_pf_put(ctx, "\"", 1);
+      b64enc(ctx, p, n);
+      json_pf_put(ctx, "\"", 1);
+      break;
+    }
+    case JSON_PF_CALLBACK: {
+      json_printf_callback_t f = va_arg(*ap, json_printf_callback_t);
+      /* The callback prints directly, keep the output in order */
+      json_pf_flush(ctx);
+      ctx->len += f(ctx->out, ap);
+      break;
+    }
+    default:
+      json_pf_system(ctx, fmt, seg, ap);
+      break;
+  }
+}
+
+#if JSON_PRINTF_PLAN_CACHE_SIZE > 0
+static struct json_printf_plan *json_printf_compile(const char *fmt,
+                                                    size_t fmt_len) {
+  struct json_printf_plan *plan;
+  struct json_printf_seg seg;
+  size_t pos = 0, segs_size;
+  int n = 0;
+  while (json_printf_next_seg(fmt, &pos, &seg)) n++;
+  segs_size = n * sizeof(seg);
+  /* Plan, segments and a copy of the format in one block */
+  plan = (struct json_printf_plan *) malloc(sizeof(*plan) + segs_size +
+                                            fmt_len + 1);
+  if (plan == NULL) return NULL;
+  plan->fmt_ptr = fmt;
+  plan->num_segs = n;
+  plan->segs = (struct json_printf_seg *) (plan + 1);
+  memcpy((char *) plan->segs + segs_size, fmt, fmt_len + 1);
+  plan->fmt = (char *) plan->segs + segs_size;
+  for (n = 0, pos = 0; json_printf_next_seg(fmt, &pos, &plan->segs[n]); n++) {
+  }
+  return plan;
+}
+
+/*
+ * Same caching policy as json_scanf_get_plan(). Plans are only added by the
+ * outermost json_vprintf(): a nested call from a %M callback must not evict
+ * the plan that is being executed.
+ */
+static struct json_printf_plan *json_printf_get_plan(const char *fmt) {
+  struct json_printf_plan *plan, **slot;
+  size_t fmt_len;
+  int i;
+  for (i = 0; i < JSON_PRINTF_PLAN_CACHE_SIZE; i++) {
+    plan = s_json_printf_cache[i];
+    if (plan != NULL && plan->fmt_ptr == fmt && strcmp(plan->fmt, fmt) == 0) {
+      return plan;
+    }
+  }
+  if (s_json_printf_depth > 1) return NULL;
+  fmt_len = strlen(fmt);
+  if (fmt_len < JSON_PRINTF_PLAN_MIN_LEN) return NULL;
+  if ((plan = json_printf_compile(fmt, fmt_len)) == NULL) return NULL;
+  slot = &s_json_printf_cache[s_json_printf_cache_next];
+  s_json_printf_cache_next =
+      (s_json_printf_cache_next + 1) % JSON_PRINTF_PLAN_CACHE_SIZE;
+  free(*slot);
+  *slot = plan;
+  return plan;
+}
+#endif
+
+int json_vprintf(struct json_out *out, const char *fmt, va_list xap) WEAK;
+int json_vprintf(struct json_out *out, const char *fmt, va_list xap) {
+  struct json_printf_ctx ctx;
+  const struct json_printf_plan *plan = NULL;
+  va_list ap;
+  va_copy(ap, xap);
+  json_pf_init(&ctx, out);
+
+#if JSON_PRINTF_PLAN_CACHE_SIZE > 0
+  s_json_printf_depth++;
+  plan = json_printf_get_plan(fmt);
+#endif
+  if (plan != NULL) {
+    int i;
+    for (i = 0; i < plan->num_segs; i++) {
+      json_printf_run_seg(&ctx, plan->fmt, &plan->segs[i], &ap);
+    }
+  } else {
+    struct json_printf_seg seg;
+    size_t pos = 0;
+    while (json_printf_next_seg(fmt, &pos, &seg)) {
+      json_printf_run_seg(&ctx, fmt, &seg, &ap);
     }
   }
+  json_pf_flush(&ctx);
+#if JSON_PRINTF_PLAN_CACHE_SIZE > 0
+  s_json_printf_depth--;
+#endif
   va_end(ap);
 
-  return len;
+  return ctx.len;
 }
 
 int json_printf(struct json_out *out, const char *fmt, ...) WEAK;
@@ -741,7 +1171,7 @@ int json_printf_array(struct json_out *out, va_list *ap) {
     memcpy(&val, arr + i * elem_size,
            elem_size > sizeof(val) ? sizeof(val) : elem_size);
     if (i > 0) len += json_printf(out, ", ");
-    if (strchr(fmt, 'f') != NULL) {
+    if (strchr(fmt, 'f') != NULL || strchr(fmt, 'D') != NULL) {
       len += json_printf(out, fmt, val.d);
     } else {
       len += json_printf(out, fmt, val.i);
@@ -790,6 +1220,401 @@ int json_walk(const char *json_string, int json_string_length,
   return frozen.cur - json_string;
 }
 
+enum json_push_state {
+  JSON_PUSH_VALUE,    /* Expecting a value */
+  JSON_PUSH_OBJ_NEXT, /* Expecting a key or '}' */
+  JSON_PUSH_ARR_NEXT, /* Expecting a value or ']' */
+  JSON_PUSH_COLON,
+  JSON_PUSH_STRING,
+  JSON_PUSH_IDENT,
+  JSON_PUSH_NUMBER,
+  JSON_PUSH_LITERAL,
+  JSON_PUSH_DONE
+};
+
+/* String sub-states, 1..4 is the number of \u hex digits left */
+#define JSON_PUSH_STR_ESC 8
+
+enum json_push_num_state {
+  JSON_PUSH_NUM_SIGN, /* After '-', a digit is required */
+  JSON_PUSH_NUM_INT,
+  JSON_PUSH_NUM_DOT, /* After '.', a digit is required */
+  JSON_PUSH_NUM_FRAC,
+  JSON_PUSH_NUM_E, /* After 'e', a sign or a digit is required */
+  JSON_PUSH_NUM_ESIGN,
+  JSON_PUSH_NUM_EXP
+};
+
+void json_push_init(struct json_push_parser *p, char *buf, size_t buf_size,
+                    json_walk_callback_t callback, void *callback_data) WEAK;
+void json_push_init(struct json_push_parser *p, char *buf, size_t buf_size,
+                    json_walk_callback_t callback, void *callback_data) {
+  memset(p, 0, sizeof(*p));
+  p->buf = buf;
+  p->buf_size = buf_size;
+  p->callback = callback;
+  p->callback_data = callback_data;
+  p->state = JSON_PUSH_VALUE;
+}
+
+static int json_push_in_token(const struct json_push_parser *p) {
+  return p->state >= JSON_PUSH_STRING && p->state <= JSON_PUSH_LITERAL;
+}
+
+/* Same path rules as append_to_path() and truncate_path() */
+static void json_push_path_append(struct json_push_parser *p, const char *s,
+                                  size_t len) {
+  size_t left = sizeof(p->path) - 1 - p->path_len;
+  if (len > left) len = left;
+  memcpy(p->path + p->path_len, s, len);
+  p->path_len += len;
+  p->path[p->path_len] = '\0';
+}
+
+static void json_push_path_truncate(struct json_push_parser *p, size_t len) {
+  p->path_len = len;
+  p->path[len] = '\0';
+}
+
+/* Same as CALL_BACK() */
+static void json_push_emit(struct json_push_parser *p,
+                           enum json_token_type type, const char *ptr,
+                           size_t len) {
+  if (p->callback != NULL &&
+      (p->path_len == 0 || p->path[p->path_len - 1] != '.')) {
+    struct json_token t;
+    t.ptr = ptr;
+    t.len = len;
+    t.type = type;
+    p->callback(p->callback_data, p->name, p->name_len, p->path, &t);
+    p->name = NULL;
+    p->name_len = 0;
+    p->key_len = 0;
+  }
+}
+
+/* Keep the part of the current token that is in the chunk */
+static int json_push_save(struct json_push_parser *p, const char *s,
+                          size_t len) {
+  if (p->key_len + p->tok_len + len > p->buf_size) return JSON_PUSH_OVERFLOW;
+  memcpy(p->buf + p->key_len + p->tok_len, s, len);
+  p->tok_len += len;
+  return 0;
+}
+
+/* Current token, ending at `s`: in place, or collected in the buffer */
+static int json_push_take(struct json_push_parser *p, const char *s,
+                          const char **ptr, size_t *len) {
+  if (p->tok_len == 0) {
+    *ptr = p->tok;
+    *len = s - p->tok;
+  } else {
+    TRY(json_push_save(p, p->tok, s - p->tok));
+    *ptr = p->buf + p->key_len;
+    *len = p->tok_len;
+    p->tok_len = 0;
+  }
+  return 0;
+}
+
+static void json_push_value_done(struct json_push_parser *p) {
+  struct json_push_level *l;
+  if (p->depth == 0) {
+    p->state = JSON_PUSH_DONE;
+    p->result = 1;
+    return;
+  }
+  l = &p->stack[p->depth - 1];
+  json_push_path_truncate(p, l->elem_path_len);
+  l->comma_ok = 1;
+  p->state = l->is_array ? JSON_PUSH_ARR_NEXT : JSON_PUSH_OBJ_NEXT;
+}
+
+static int json_push_scalar(struct json_push_parser *p, const char *s,
+                            enum json_token_type type) {
+  const char *ptr;
+  size_t len;
+  TRY(json_push_take(p, s, &ptr, &len));
+  json_push_emit(p, type, ptr, len);
+  json_push_value_done(p);
+  return 0;
+}
+
+static int json_push_key(struct json_push_parser *p, const char *s) {
+  const char *ptr;
+  size_t len;
+  TRY(json_push_take(p, s, &ptr, &len));
+  json_push_emit(p, JSON_TYPE_STRING, ptr, len);
+  p->name = ptr;
+  p->name_len = len;
+  p->key_len = ptr == p->buf ? len : 0;
+  json_push_path_append(p, ptr, len);
+  p->state = JSON_PUSH_COLON;
+  return 0;
+}
+
+static int json_push_open(struct json_push_parser *p, int is_array) {
+  struct json_push_level *l;
+  if (p->depth >= JSON_PUSH_MAX_DEPTH) return JSON_PUSH_TOO_DEEP;
+  json_push_emit(p, is_array ? JSON_TYPE_ARRAY_START : JSON_TYPE_OBJECT_START,
+                 NULL, 0);
+  l = &p->stack[p->depth++];
+  l->path_len = p->path_len;
+  l->is_array = is_array;
+  l->comma_ok = 0;
+  l->index = 0;
+  if (!is_array) json_push_path_append(p, ".", 1);
+  p->state = is_array ? JSON_PUSH_ARR_NEXT : JSON_PUSH_OBJ_NEXT;
+  return 0;
+}
+
+static void json_push_close(struct json_push_parser *p) {
+  struct json_push_level *l = &p->stack[--p->depth];
+  json_push_path_truncate(p, l->path_len);
+  json_push_emit(p, l->is_array ? JSON_TYPE_ARRAY_END : JSON_TYPE_OBJECT_END,
+                 NULL, 0);
+  json_push_value_done(p);
+}
+
+static void json_push_start_token(struct json_push_parser *p, const char *s,
+                                  int state) {
+  p->state = state;
+  p->tok = s;
+  p->tok_len = 0;
+  p->sub_state = 0;
+  p->utf8_left = 0;
+}
+
+/* value = 'null' | 'true' | 'false' | number | string | array | object */
+static int json_push_value(struct json_push_parser *p, const char *s) {
+  switch (*s) {
+    case '"':
+      json_push_start_token(p, s + 1, JSON_PUSH_STRING);
+      p->in_key = 0;
+      break;
+    case '{':
+    case '[':
+      TRY(json_push_open(p, *s == '['));
+      break;
+    case 'n':
+    case 't':
+    case 'f':
+      json_push_start_token(p, s, JSON_PUSH_LITERAL);
+      p->literal = *s == 'n' ? "null" : *s == 't' ? "true" : "false";
+      p->sub_state = 1;
+      break;
+    case '-':
+      json_push_start_token(p, s, JSON_PUSH_NUMBER);
+      p->sub_state = JSON_PUSH_NUM_SIGN;
+      break;
+    default:
+      if (!is_digit(*s)) return JSON_STRING_INVALID;
+      json_push_start_token(p, s, JSON_PUSH_NUMBER);
+      p->sub_state = JSON_PUSH_NUM_INT;
+      break;
+  }
+  return 0;
+}
+
+/* Process input at `s`, return the number of bytes consumed */
+static int json_push_step(struct json_push_parser *p, const char *s,
+                          const char *end) {
+  int ch = *(const unsigned char *) s;
+  struct json_push_level *l = p->depth > 0 ? &p->stack[p->depth - 1] : NULL;
+
+  switch (p->state) {
+    case JSON_PUSH_VALUE:
+      if (is_space(ch)) return 1;
+      TRY(json_push_value(p, s));
+      return 1;
+
+    case JSON_PUSH_OBJ_NEXT:
+      if (is_space(ch)) return 1;
+      if (ch == '}') {
+        json_push_close(p);
+      } else if (ch == ',' && l->comma_ok) {
+        l->comma_ok = 0;
+      } else if (ch == '"' || is_alpha(ch)) {
+        l->elem_path_len = p->path_len;
+        p->name = NULL;
+        p->name_len = 0;
+        p->key_len = 0;
+        if (ch == '"') {
+          json_push_start_token(p, s + 1, JSON_PUSH_STRING);
+          p->in_key = 1;
+        } else {
+          json_push_start_token(p, s, JSON_PUSH_IDENT);
+        }
+      } else {
+        return JSON_STRING_INVALID;
+      }
+      return 1;
+
+    case JSON_PUSH_ARR_NEXT:
+      if (is_space(ch)) return 1;
+      if (ch == ']') {
+        json_push_close(p);
+      } else if (ch == ',' && l->comma_ok) {
+        l->comma_ok = 0;
+      } else {
+        int n = format_index(p->index, l->index++);
+        l->elem_path_len = p->path_len;
+        json_push_path_append(p, p->index, n);
+        p->name = p->index + 1;
+        p->name_len = n - 2;
+        p->key_len = 0;
+        TRY(json_push_value(p, s));
+      }
+      return 1;
+
+    case JSON_PUSH_COLON:
+      if (is_space(ch)) return 1;
+      if (ch != ':') return JSON_STRING_INVALID;
+      p->state = JSON_PUSH_VALUE;
+      return 1;
+
+    case JSON_PUSH_STRING: {
+      const char *q;
+      if (p->utf8_left > 0) {
+        int n = end - s < p->utf8_left ? end - s : p->utf8_left;
+        p->utf8_left -= n;
+        return n;
+      } else if (p->sub_state == JSON_PUSH_STR_ESC) {
+        if (ch == 'u') {
+          p->sub_state = 4;
+        } else if (ch != '\0' && strchr("\"\\/bfnrt", ch) != NULL) {
+          p->sub_state = 0;
+        } else {
+          return JSON_STRING_INVALID;
+        }
+        return 1;
+      } else if (p->sub_state > 0) {
+        if (!is_hex_digit(ch)) return JSON_STRING_INVALID;
+        p->sub_state--;
+        return 1;
+      }
+      q = skip_plain_chars(s, end);
+      if (q > s) return q - s;
+      if (ch == '"') {
+        if (p->in_key) {
+          TRY(json_push_key(p, s));
+        } else {
+          TRY(json_push_scalar(p, s, JSON_TYPE_STRING));
+        }
+      } else if (ch == '\\') {
+        p->sub_state = JSON_PUSH_STR_ESC;
+      } else if (ch < 32) {
+        return JSON_STRING_INVALID; /* No control chars */
+      } else {
+        p->utf8_left = get_utf8_char_len((unsigned char) ch) - 1;
+      }
+      return 1;
+    }
+
+    case JSON_PUSH_IDENT:
+      /* identifier = letter { letter | digit | '_' } */
+      if (ch == '_' || is_alpha(ch) || is_digit(ch)) return 1;
+      TRY(json_push_key(p, s));
+      return 0;
+
+    case JSON_PUSH_NUMBER:
+      /* Same grammar as parse_number() */
+      if (is_digit(ch)) {
+        const char *q = s + 1;
+        while (q < end && is_digit(*q)) q++;
+        switch (p->sub_state) {
+          case JSON_PUSH_NUM_SIGN:
+            p->sub_state = JSON_PUSH_NUM_INT;
+            break;
+          case JSON_PUSH_NUM_DOT:
+            p->sub_state = JSON_PUSH_NUM_FRAC;
+            break;
+          case JSON_PUSH_NUM_E:
+          case JSON_PUSH_NUM_ESIGN:
+            p->sub_state = JSON_PUSH_NUM_EXP;
+            break;
+        }
+        return q - s;
+      }
+      switch (p->sub_state) {
+        case JSON_PUSH_NUM_INT:
+          if (ch == '.') {
+            p->sub_state = JSON_PUSH_NUM_DOT;
+            return 1;
+          }
+        /* FALLTHROUGH */
+        case JSON_PUSH_NUM_FRAC:
+          if (ch == 'e' || ch == 'E') {
+            p->sub_state = JSON_PUSH_NUM_E;
+            return 1;
+          }
+        /* FALLTHROUGH */
+        case JSON_PUSH_NUM_EXP:
+          TRY(json_push_scalar(p, s, JSON_TYPE_NUMBER));
+          return 0;
+        case JSON_PUSH_NUM_E:
+          if (ch == '+' || ch == '-') {
+            p->sub_state = JSON_PUSH_NUM_ESIGN;
+            return 1;
+          }
+          return JSON_STRING_INVALID;
+        default:
+          return JSON_STRING_INVALID;
+      }
+
+    case JSON_PUSH_LITERAL:
+      if (ch != p->literal[p->sub_state]) return JSON_STRING_INVALID;
+      if (p->literal[++p->sub_state] == '\0') {
+        enum json_token_type type =
+            p->literal[0] == 'n' ? JSON_TYPE_NULL : p->literal[0] == 't'
+                                                        ? JSON_TYPE_TRUE
+                                                        : JSON_TYPE_FALSE;
+        TRY(json_push_scalar(p, s + 1, type));
+      }
+      return 1;
+  }
+  return JSON_STRING_INVALID;
+}
+
+int json_push_feed(struct json_push_parser *p, const char *data,
+                   size_t len) WEAK;
+int json_push_feed(struct json_push_parser *p, const char *data, size_t len) {
+  const char *s = data, *end = data + len;
+  int n;
+  if (p->result < 0) return p->result;
+  if (json_push_in_token(p)) p->tok = data;
+  while (s < end && p->state != JSON_PUSH_DONE) {
+    if ((n = json_push_step(p, s, end)) < 0) return p->result = n;
+    s += n;
+  }
+  /* The chunk goes away: keep the pending key and the current token */
+  if (p->name != NULL && p->name != p->buf && p->name != p->index + 1) {
+    if (p->name_len > p->buf_size) return p->result = JSON_PUSH_OVERFLOW;
+    memmove(p->buf, p->name, p->name_len);
+    p->name = p->buf;
+    p->key_len = p->name_len;
+  }
+  if (json_push_in_token(p) &&
+      (n = json_push_save(p, p->tok, end - p->tok)) < 0) {
+    return p->result = n;
+  }
+  return s - data;
+}
+
+int json_push_end(struct json_push_parser *p) WEAK;
+int json_push_end(struct json_push_parser *p) {
+  if (p->result == 0 && p->state == JSON_PUSH_NUMBER && p->depth == 0 &&
+      (p->sub_state == JSON_PUSH_NUM_INT ||
+       p->sub_state == JSON_PUSH_NUM_FRAC ||
+       p->sub_state == JSON_PUSH_NUM_EXP)) {
+    /* All of the number is in the buffer by now */
+    p->tok = p->buf + p->key_len + p->tok_len;
+    TRY(json_push_scalar(p, p->tok, JSON_TYPE_NUMBER));
+  }
+  if (p->result < 0) return p->result;
+  return p->result == 1 ? 0 : JSON_STRING_INCOMPLETE;
+}
+
 struct scan_array_info {
   char path[JSON_MAX_PATH_LEN];
   struct json_token *token;
@@ -855,27 +1680,9 @@ int json_unescape(const char *src, int slen, char *dst, int dlen) {
   return dst - orig_dst;
 }
 
-static void json_scanf_cb(void *callback_data, const char *name,
-                          size_t name_len, const char *path,
-                          const struct json_token *token) {
-  struct json_scanf_info *info = (struct json_scanf_info *) callback_data;
-
-  (void) name;
-  (void) name_len;
-
-  if (strcmp(path, info->path) != 0) {
-    /* It's not the path we're looking for, so, just ignore this callback */
-    return;
-  }
-
-  if (token->ptr == NULL) {
-    /*
-     * We're not interested here in the events for which we have no value;
-     * namely, JSON_TYPE_OBJECT_START and JSON_TYPE_ARRAY_START
-     */
-    return;
-  }
-
+/* Performs the conversion described by `info` on a matched token. */
+static void json_scanf_convert(struct json_scanf_info *info,
+                               const struct json_token *token) {
   switch (info->type) {
     case 'B':
       info->num_conversions++;
@@ -932,7 +1739,7 @@ static void json_scanf_cb(void *callback_data, const char *name,
       char **dst = (char **) info->target;
       int len = token->len * 4 / 3 + 2;
       if ((*dst = (char *) malloc(len + 1)) != NULL) {
-        int n = b64dec(token->ptr, token->len, *dst);
+        int n = json_base64_decode(token->ptr, token->len, *dst);
         (*dst)[n] = '\0';
         *(int *) info->user_data = n;
         info->num_conversions++;
@@ -949,28 +1756,107 @@ static void json_scanf_cb(void *callback_data, const char *name,
   }
 }
 
-int json_vscanf(const char *s, int len, const char *fmt, va_list ap) WEAK;
-int json_vscanf(const char *s, int len, const char *fmt, va_list ap) {
-  char path[JSON_MAX_PATH_LEN] = "", fmtbuf[20];
-  int i = 0;
+/*
+ * Compiled format: the list of conversions with the full path each one
+ * applies to, so that all of them can be done in a single json_walk().
+ */
+struct json_scanf_entry {
+  unsigned int path_hash;
+  unsigned short path_off; /* Offset of the NUL-terminated path in the pool */
+  unsigned short path_len;
+  unsigned short conv_off; /* Offset of the sscanf() conversion, if any */
+  char type;               /* Conversion character */
+  char num_args;           /* Number of va_args consumed */
+};
+
+struct json_scanf_plan {
+  const char *fmt_ptr; /* Format the plan was compiled from, for the cache */
+  const char *fmt;     /* Copy of the format, in the pool */
+  int num_entries;
+  struct json_scanf_entry *entries;
+  char *pool;
+};
+
+struct json_scanf_target {
+  void *target;
+  void *user_data;
+};
+
+struct json_scanf_walk_info {
+  const struct json_scanf_plan *plan;
+  const struct json_scanf_target *targets;
+  int num_conversions;
+};
+
+#ifndef JSON_SCANF_PLAN_CACHE_SIZE
+#define JSON_SCANF_PLAN_CACHE_SIZE 8
+#endif
+
+/* Targets for up to this many conversions are kept on stack. */
+#ifndef JSON_SCANF_STACK_TARGETS
+#define JSON_SCANF_STACK_TARGETS 16
+#endif
+
+#if JSON_SCANF_PLAN_CACHE_SIZE > 0
+static struct json_scanf_plan *s_json_scanf_cache[JSON_SCANF_PLAN_CACHE_SIZE];
+static int s_json_scanf_cache_next;
+static int s_json_scanf_depth;
+#endif
+
+static unsigned int json_path_hash(const char *path, size_t *len) {
+  unsigned int h = 2166136261U;
+  const char *p = path;
+  while (*p != '\0') {
+    h = (h ^ (unsigned char) *p++) * 16777619U;
+  }
+  *len = p - path;
+  return h;
+}
+
+static size_t json_scanf_pool_add(char *pool, size_t *pool_len, const char *s,
+                                  size_t len) {
+  size_t off = *pool_len;
+  if (pool != NULL) {
+    memcpy(pool + off, s, len);
+    pool[off + len] = '\0';
+  }
+  *pool_len += len + 1;
+  return off;
+}
+
+/*
+ * Parses the format the same way json_vscanf() always has. If `entries` is
+ * NULL, only counts entries and pool size.
+ */
+static int json_scanf_parse_fmt(const char *fmt,
+                                struct json_scanf_entry *entries, char *pool,
+                                size_t *pool_len) {
+  char path[JSON_MAX_PATH_LEN] = "";
+  size_t plen = 0;
+  int i = 0, n = 0;
   char *p = NULL;
-  struct json_scanf_info info = {0, path, fmtbuf, NULL, NULL, 0};
 
   while (fmt[i] != '\0') {
     if (fmt[i] == '{') {
-      strcat(path, ".");
+      if (plen < sizeof(path) - 1) path[plen++] = '.';
+      path[plen] = '\0';
       i++;
     } else if (fmt[i] == '}') {
       if ((p = strrchr(path, '.')) != NULL) *p = '\0';
+      plen = strlen(path);
       i++;
     } else if (fmt[i] == '%') {
-      info.target = va_arg(ap, void *);
-      info.type = fmt[i + 1];
+      struct json_scanf_entry e;
+      const char *conv = fmt + i;
+      int conv_len = 2;
+      memset(&e, 0, sizeof(e));
+      e.type = fmt[i + 1];
+      e.num_args = 1;
       switch (fmt[i + 1]) {
         case 'M':
         case 'V':
         case 'H':
-          info.user_data = va_arg(ap, void *);
+          e.num_args = 2;
         /* FALLTHROUGH */
         case 'B':
         case 'Q':
@@ -979,27 +1865,458 @@ int json_vscanf(const char *s, int len, const char *fmt, va_list ap) {
           break;
         default: {
           const char *delims = ", \t\r\n]}";
-          int conv_len = strcspn(fmt + i + 1, delims) + 1;
-          snprintf(fmtbuf, sizeof(fmtbuf), "%.*s", conv_len, fmt + i);
+          conv_len = strcspn(fmt + i + 1, delims) + 1;
           i += conv_len;
           i += strspn(fmt + i, delims);
+          /* Same limit as the old fixed-size conversion buffer */
+          if (conv_len > 19) conv_len = 19;
+          e.type = 0;
           break;
         }
       }
-      json_walk(s, len, json_scanf_cb, &info);
+      e.path_hash = json_path_hash(path, &plen);
+      e.path_len = plen;
+      e.path_off = json_scanf_pool_add(pool, pool_len, path, plen);
+      e.conv_off = json_scanf_pool_add(pool, pool_len, conv, conv_len);
+      if (entries != NULL) entries[n] = e;
+      n++;
     } else if (is_alpha(fmt[i]) || get_utf8_char_len(fmt[i]) > 1) {
       const char *delims = ": \r\n\t";
       int key_len = strcspn(&fmt[i], delims);
       if ((p = strrchr(path, '.')) != NULL) p[1] = '\0';
-      sprintf(path + strlen(path), "%.*s", key_len, &fmt[i]);
+      plen = strlen(path);
+      plen += snprintf(path + plen, sizeof(path) - plen, "%.*s", key_len,
+                       &fmt[i]);
+      if (plen > sizeof(path) - 1) plen = sizeof(path) - 1;
       i += key_len + strspn(fmt + i + key_len, delims);
     } else {
       i++;
     }
   }
+  return n;
+}
+
+struct json_scanf_plan *json_scanf_compile(const char *fmt) WEAK;
+struct json_scanf_plan *json_scanf_compile(const char *fmt) {
+  struct json_scanf_plan *plan;
+  size_t pool_len = 0, fmt_len = strlen(fmt);
+  int n = json_scanf_parse_fmt(fmt, NULL, NULL, &pool_len);
+  size_t entries_size = n * sizeof(struct json_scanf_entry);
+  /* Plan, entries and pool (with a copy of the format) in one block */
+  plan = (struct json_scanf_plan *) malloc(sizeof(*plan) + entries_size +
+                                           pool_len + fmt_len + 1);
+  if (plan == NULL) return NULL;
+  plan->fmt_ptr = fmt;
+  plan->num_entries = n;
+  plan->entries = (struct json_scanf_entry *) (plan + 1);
+  plan->pool = (char *) plan->entries + entries_size;
+  pool_len = 0;
+  json_scanf_parse_fmt(fmt, plan->entries, plan->pool, &pool_len);
+  plan->fmt = plan->pool + json_scanf_pool_add(plan->pool, &pool_len, fmt,
+                                               fmt_len);
+  return plan;
+}
+
+void json_scanf_plan_free(struct json_scanf_plan *plan) WEAK;
+void json_scanf_plan_free(struct json_scanf_plan *plan) {
+  free(plan);
+}
+
+static int json_scanf_entry_convert(const struct json_scanf_plan *plan,
+                                    const struct json_scanf_entry *e,
+                                    const struct json_scanf_target *target,
+                                    const struct json_token *token) {
+  struct json_scanf_info info;
+  info.num_conversions = 0;
+  info.path = plan->pool + e->path_off;
+  info.fmt = plan->pool + e->conv_off;
+  info.target = target->target;
+  info.user_data = target->user_data;
+  info.type = e->type;
+  if (e->type == 0 && strcmp(info.fmt, "%d") == 0) {
+    /* Most common conversion, skip sscanf() */
+    char *end;
+    long v = strtol(token->ptr, &end, 10);
+    if (end != token->ptr) {
+      *(int *) info.target = (int) v;
+      info.num_conversions++;
+    }
+  } else {
+    json_scanf_convert(&info, token);
+  }
   return info.num_conversions;
 }
 
+static void json_scanf_plan_cb(void *callback_data, const char *name,
+                               size_t name_len, const char *path,
+                               const struct json_token *token) {
+  struct json_scanf_walk_info *wi =
+      (struct json_scanf_walk_info *) callback_data;
+  const struct json_scanf_plan *plan = wi->plan;
+  size_t path_len;
+  unsigned int hash;
+  int i;
+
+  (void) name;
+  (void) name_len;
+
+  if (token->ptr == NULL) {
+    /*
+     * We're not interested here in the events for which we have no value;
+     * namely, JSON_TYPE_OBJECT_START and JSON_TYPE_ARRAY_START
+     */
+    return;
+  }
+
+  hash = json_path_hash(path, &path_len);
+  for (i = 0; i < plan->num_entries; i++) {
+    const struct json_scanf_entry *e = &plan->entries[i];
+    if (e->path_hash != hash || e->path_len != path_len ||
+        memcmp(plan->pool + e->path_off, path, path_len) != 0) {
+      continue;
+    }
+    wi->num_conversions +=
+        json_scanf_entry_convert(plan, e, &wi->targets[i], token);
+  }
+}
+
+/*
+ * Collects targets for all of the plan's conversions from `ap`. Returns
+ * `stack_targets` if they fit, heap-allocated array otherwise.
+ */
+static struct json_scanf_target *json_scanf_get_targets(
+    const struct json_scanf_plan *plan,
+    struct json_scanf_target *stack_targets, va_list ap) {
+  struct json_scanf_target *targets = stack_targets;
+  int i;
+  if (plan->num_entries > JSON_SCANF_STACK_TARGETS) {
+    targets = (struct json_scanf_target *) malloc(plan->num_entries *
+                                                  sizeof(*targets));
+    if (targets == NULL) return NULL;
+  }
+  for (i = 0; i < plan->num_entries; i++) {
+    targets[i].target = va_arg(ap, void *);
+    targets[i].user_data =
+        (plan->entries[i].num_args > 1 ? va_arg(ap, void *) : NULL);
+  }
+  return targets;
+}
+
+int json_vscanf_with_plan(const char *s, int len,
+                          const struct json_scanf_plan *plan,
+                          va_list ap) WEAK;
+int json_vscanf_with_plan(const char *s, int len,
+                          const struct json_scanf_plan *plan, va_list ap) {
+  struct json_scanf_target stack_targets[JSON_SCANF_STACK_TARGETS];
+  struct json_scanf_target *targets;
+  struct json_scanf_walk_info wi;
+
+  if (plan->num_entries == 0) return 0;
+  targets = json_scanf_get_targets(plan, stack_targets, ap);
+  if (targets == NULL) return 0;
+
+  wi.plan = plan;
+  wi.targets = targets;
+  wi.num_conversions = 0;
+  json_walk(s, len, json_scanf_plan_cb, &wi);
+
+  if (targets != stack_targets) free(targets);
+  return wi.num_conversions;
+}
+
+int json_scanf_with_plan(const char *s, int len,
+                         const struct json_scanf_plan *plan, ...) WEAK;
+int json_scanf_with_plan(const char *s, int len,
+                         const struct json_scanf_plan *plan, ...) {
+  int result;
+  va_list ap;
+  va_start(ap, plan);
+  result = json_vscanf_with_plan(s, len, plan, ap);
+  va_end(ap);
+  return result;
+}
+
+/*
+ * Format strings are almost always literals (or handler descriptors, like
+ * mg_rpc's args_fmt), so plans are cached by pointer. The contents are
+ * compared too, in case the pointer is reused for a different format.
+ * Plans are only added by the outermost json_vscanf(): a nested call from
+ * a %M callback must not evict the plan that is being executed, it gets
+ * a plan of its own instead.
+ */
+static struct json_scanf_plan *json_scanf_get_plan(const char *fmt,
+                                                   int *cached) {
+#if JSON_SCANF_PLAN_CACHE_SIZE > 0
+  struct json_scanf_plan *plan, **slot;
+  int i;
+  for (i = 0; i < JSON_SCANF_PLAN_CACHE_SIZE; i++) {
+    plan = s_json_scanf_cache[i];
+    if (plan != NULL && plan->fmt_ptr == fmt && strcmp(plan->fmt, fmt) == 0) {
+      *cached = 1;
+      return plan;
+    }
+  }
+  if (s_json_scanf_depth > 1) {
+    *cached = 0;
+    return json_scanf_compile(fmt);
+  }
+  if ((plan = json_scanf_compile(fmt)) == NULL) return NULL;
+  slot = &s_json_scanf_cache[s_json_scanf_cache_next];
+  s_json_scanf_cache_next =
+      (s_json_scanf_cache_next + 1) % JSON_SCANF_PLAN_CACHE_SIZE;
+  json_scanf_plan_free(*slot);
+  *slot = plan;
+  *cached = 1;
+  return plan;
+#else
+  *cached = 0;
+  return json_scanf_compile(fmt);
+#endif
+}
+
+int json_vscanf(const char *s, int len, const char *fmt, va_list ap) WEAK;
+int json_vscanf(const char *s, int len, const char *fmt, va_list ap) {
+  int result = 0, cached = 0;
+  struct json_scanf_plan *plan;
+#if JSON_SCANF_PLAN_CACHE_SIZE > 0
+  s_json_scanf_depth++;
+#endif
+  plan = json_scanf_get_plan(fmt, &cached);
+  if (plan != NULL) {
+    result = json_vscanf_with_plan(s, len, plan, ap);
+    if (!cached) json_scanf_plan_free(plan);
+  }
+#if JSON_SCANF_PLAN_CACHE_SIZE > 0
+  s_json_scanf_depth--;
+#endif
+  return result;
+}
+
+struct json_tape_build_info {
+  struct json_tape *tape;
+  const char *json;
+  int num_toks;
+  int depth;
+  int err;
+  int grow; /* Move to heap and grow storage as needed */
+  int open[JSON_TAPE_MAX_DEPTH]; /* Indices of the open containers */
+};
+
+static void json_tape_build_cb(void *callback_data, const char *name,
+                               size_t name_len, const char *path,
+                               const struct json_token *token) {
+  struct json_tape_build_info *bi =
+      (struct json_tape_build_info *) callback_data;
+  struct json_tape *tape = bi->tape;
+  struct json_tape_tok *t = NULL;
+  int idx;
+
+  (void) path;
+
+  if (token->type == JSON_TYPE_OBJECT_END ||
+      token->type == JSON_TYPE_ARRAY_END) {
+    if (bi->depth <= 0) return; /* Past the depth limit */
+    idx = bi->open[--bi->depth];
+    if (tape->toks != NULL && idx < tape->max_toks) {
+      t = &tape->toks[idx];
+      t->start = token->ptr - bi->json;
+      t->len = token->len;
+      t->next = bi->num_toks;
+    }
+    return;
+  }
+
+  idx = bi->num_toks++;
+  if (bi->grow && idx >= tape->max_toks) {
+    int n = (tape->max_toks > 0 ? tape->max_toks * 2 : 32);
+    struct json_tape_tok *toks =
+        (struct json_tape_tok *) malloc(n * sizeof(*toks));
+    if (toks != NULL) {
+      if (tape->max_toks > 0) {
+        memcpy(toks, tape->toks, tape->max_toks * sizeof(*toks));
+      }
+      if (tape->allocated) free(tape->toks);
+      tape->toks = toks;
+      tape->max_toks = n;
+      tape->allocated = 1;
+    } else {
+      bi->grow = 0;
+      if (tape->toks == NULL) bi->err = JSON_TAPE_OVERFLOW;
+    }
+  }
+  if (tape->toks != NULL && idx < tape->max_toks) {
+    int parent = (bi->depth > 0 ? bi->open[bi->depth - 1] : -1);
+    t = &tape->toks[idx];
+    t->type = token->type;
+    t->depth = bi->depth;
+    t->key = -1;
+    t->key_len = 0;
+    /* For array elements name is the index, it's not in the document */
+    if (name != NULL && parent >= 0 &&
+        tape->toks[parent].type == JSON_TYPE_OBJECT_START) {
+      t->key = name - bi->json;
+      t->key_len = name_len;
+    }
+    t->start = (token->ptr != NULL ? token->ptr - bi->json : -1);
+    t->len = token->len;
+    t->next = idx + 1;
+  }
+
+  if (token->type == JSON_TYPE_OBJECT_START ||
+      token->type == JSON_TYPE_ARRAY_START) {
+    if (bi->depth >= JSON_TAPE_MAX_DEPTH) {
+      bi->err = JSON_TAPE_TOO_DEEP;
+    } else {
+      bi->open[bi->depth++] = idx;
+    }
+  }
+}
+
+static int json_tape_build(struct json_tape *tape, const char *json, int len,
+                           int grow) {
+  struct json_tape_build_info bi;
+  int res;
+  memset(&bi, 0, sizeof(bi));
+  bi.tape = tape;
+  bi.json = json;
+  bi.grow = grow;
+  tape->json = json;
+  tape->num_toks = 0;
+  res = json_walk(json, len, json_tape_build_cb, &bi);
+  if (res < 0) return res;
+  if (bi.err != 0) return bi.err;
+  if (tape->toks != NULL && bi.num_toks > tape->max_toks) {
+    return JSON_TAPE_OVERFLOW;
+  }
+  if (tape->toks != NULL) tape->num_toks = bi.num_toks;
+  return bi.num_toks;
+}
+
+int json_tape_parse(struct json_tape *tape, const char *json, int len) WEAK;
+int json_tape_parse(struct json_tape *tape, const char *json, int len) {
+  return json_tape_build(tape, json, len, 0);
+}
+
+int json_tape_parse_dyn(struct json_tape *tape, const char *json,
+                        int len) WEAK;
+int json_tape_parse_dyn(struct json_tape *tape, const char *json, int len) {
+  return json_tape_build(tape, json, len, 1);
+}
+
+void json_tape_free(struct json_tape *tape) WEAK;
+void json_tape_free(struct json_tape *tape) {
+  if (tape->allocated) {
+    free(tape->toks);
+    tape->toks = NULL;
+    tape->max_toks = 0;
+    tape->allocated = 0;
+  }
+  tape->num_toks = 0;
+}
+
+int json_tape_array_elem(const struct json_tape *tape, int array,
+                         int index) WEAK;
+int json_tape_array_elem(const struct json_tape *tape, int array, int index) {
+  const struct json_tape_tok *a;
+  int i;
+  if (array < 0 || array >= tape->num_toks || index < 0) return -1;
+  a = &tape->toks[array];
+  if (a->type != JSON_TYPE_ARRAY_START) return -1;
+  for (i = array + 1; i < a->next; i = tape->toks[i].next) {
+    if (index-- == 0) return i;
+  }
+  return -1;
+}
+
+int json_tape_find(const struct json_tape *tape, int from,
+                   const char *path) WEAK;
+int json_tape_find(const struct json_tape *tape, int from, const char *path) {
+  int cur = from;
+  const char *p = path;
+  if (cur < 0 || cur >= tape->num_toks) return -1;
+  while (*p != '\0') {
+    const struct json_tape_tok *t = &tape->toks[cur];
+    if (*p == '.') {
+      const char *key = p + 1;
+      int i, found = -1, key_len = strcspn(key, ".[");
+      if (t->type != JSON_TYPE_OBJECT_START) return -1;
+      /* Last one wins, same as with json_scanf() */
+      for (i = cur + 1; i < t->next; i = tape->toks[i].next) {
+        const struct json_tape_tok *m = &tape->toks[i];
+        if (m->key_len == key_len &&
+            memcmp(tape->json + m->key, key, key_len) == 0) {
+          found = i;
+        }
+      }
+      if (found < 0) return -1;
+      cur = found;
+      p = key + key_len;
+    } else if (*p == '[') {
+      char *end;
+      long index = strtol(p + 1, &end, 10);
+      if (end == p + 1 || *end != ']') return -1;
+      if ((cur = json_tape_array_elem(tape, cur, (int) index)) < 0) return -1;
+      p = end + 1;
+    } else {
+      return -1;
+    }
+  }
+  return cur;
+}
+
+int json_tape_token(const struct json_tape *tape, int idx,
+                    struct json_token *token) WEAK;
+int json_tape_token(const struct json_tape *tape, int idx,
+                    struct json_token *token) {
+  const struct json_tape_tok *t;
+  memset(token, 0, sizeof(*token));
+  if (idx < 0 || idx >= tape->num_toks) return 0;
+  t = &tape->toks[idx];
+  token->ptr = tape->json + t->start;
+  token->len = t->len;
+  token->type = (enum json_token_type) t->type;
+  /* Report containers the way json_walk() does on completion */
+  if (t->type == JSON_TYPE_OBJECT_START) token->type = JSON_TYPE_OBJECT_END;
+  if (t->type == JSON_TYPE_ARRAY_START) token->type = JSON_TYPE_ARRAY_END;
+  return 1;
+}
+
+int json_vscanf_tape(const struct json_tape *tape, const char *fmt,
+                     va_list ap) WEAK;
+int json_vscanf_tape(const struct json_tape *tape, const char *fmt,
+                     va_list ap) {
+  struct json_scanf_target stack_targets[JSON_SCANF_STACK_TARGETS];
+  struct json_scanf_target *targets;
+  struct json_scanf_plan *plan;
+  int i, cached = 0, result = 0;
+
+  if ((plan = json_scanf_get_plan(fmt, &cached)) == NULL) return 0;
+  targets = json_scanf_get_targets(plan, stack_targets, ap);
+  if (targets != NULL) {
+    for (i = 0; i < plan->num_entries; i++) {
+      const struct json_scanf_entry *e = &plan->entries[i];
+      struct json_token token;
+      int idx = json_tape_find(tape, 0, plan->pool + e->path_off);
+      if (json_tape_token(tape, idx, &token)) {
+        result += json_scanf_entry_convert(plan, e, &targets[i], &token);
+      }
+    }
+    if (targets != stack_targets) free(targets);
+  }
+  if (!cached) json_scanf_plan_free(plan);
+  return result;
+}
+
+int json_tape_scanf(const struct json_tape *tape, const char *fmt, ...) WEAK;
+int json_tape_scanf(const struct json_tape *tape, const char *fmt, ...) {
+  int result;
+  va_list ap;
+  va_start(ap, fmt);
+  result = json_vscanf_tape(tape, fmt, ap);
+  va_end(ap);
+  return result;
+}
+
 int json_scanf(const char *str, int len, const char *fmt, ...) WEAK;
 int json_scanf(const char *str, int len, const char *fmt, ...) {
   int result;
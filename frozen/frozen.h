@@ -67,6 +67,10 @@ struct json_token {
 #define JSON_STRING_INVALID -1
 #define JSON_STRING_INCOMPLETE -2
 
+#ifndef JSON_MAX_PATH_LEN
+#define JSON_MAX_PATH_LEN 60
+#endif
+
 /*
  * Callback-based SAX-like API.
  *
@@ -143,6 +147,8 @@ typedef int (*json_printf_callback_t)(struct json_out *, va_list *ap);
  * Generate formatted output into a given sting buffer.
  * This is a superset of printf() function, with extra format specifiers:
  *  - `%B` print json boolean, `true` or `false`. Accepts an `int`.
+ *  - `%D` print the shortest decimal that reads back as the same double, or
+ *  `null` for NaN and infinity. Accepts a `double`.
  *  - `%Q` print quoted escaped string or `null`. Accepts a `const char *`.
  *  - `%.*Q` same as `%Q`, but with length. Accepts `int`, `const char *`
  *  - `%V` print quoted base64-encoded string. Accepts a `const char *`, `int`.
@@ -153,6 +159,11 @@ typedef int (*json_printf_callback_t)(struct json_out *, va_list *ap);
  * Return number of bytes printed. If the return value is bigger then the
  * supplied buffer, that is an indicator of overflow. In the overflow case,
  * overflown bytes are not printed.
+ *
+ * Output is passed to the printer in chunks of up to JSON_PRINTF_BUF_SIZE
+ * bytes. Long formats are compiled once and cached by pointer, like
+ * json_scanf() formats (see JSON_PRINTF_PLAN_CACHE_SIZE; the cache is not
+ * thread-safe either).
  */
 int json_printf(struct json_out *, const char *fmt, ...);
 int json_vprintf(struct json_out *, const char *fmt, va_list ap);
@@ -194,6 +205,36 @@ int json_printf_array(struct json_out *, va_list *ap);
 int json_scanf(const char *str, int str_len, const char *fmt, ...);
 int json_vscanf(const char *str, int str_len, const char *fmt, va_list ap);
 
+/*
+ * Decodes `len` base64 chars into `dst`, which must have room for
+ * `len / 4 * 3` bytes. Returns the number of bytes written.
+ * This is what `%V` uses. It is a weak symbol, so a faster codec can
+ * replace it.
+ */
+int json_base64_decode(const char *src, int len, char *dst);
+
+/*
+ * Compiled json_scanf() format.
+ *
+ * json_scanf() compiles the format into a list of (path, conversion) pairs
+ * and then fills all targets in a single json_walk(). Plans for recently
+ * used formats are cached by format pointer (see JSON_SCANF_PLAN_CACHE_SIZE;
+ * the cache is not thread-safe, set it to 0 if frozen is used from several
+ * threads). A plan can also be compiled and owned explicitly.
+ */
+struct json_scanf_plan;
+
+/* Compile `fmt`. Return NULL on allocation failure. */
+struct json_scanf_plan *json_scanf_compile(const char *fmt);
+
+/* Same as json_scanf(), with a plan instead of the format string. */
+int json_scanf_with_plan(const char *str, int str_len,
+                         const struct json_scanf_plan *plan, ...);
+int json_vscanf_with_plan(const char *str, int str_len,
+                          const struct json_scanf_plan *plan, va_list ap);
+
+void json_scanf_plan_free(struct json_scanf_plan *plan);
+
 /* json_scanf's %M handler  */
 typedef void (*json_scanner_t)(const char *str, int len, void *user_data);
 
@@ -205,6 +246,155 @@ typedef void (*json_scanner_t)(const char *str, int len, void *user_data);
 int json_scanf_array_elem(const char *s, int len, const char *path, int index,
                           struct json_token *token);
 
+/*
+ * Token index ("tape") of a JSON document, for running several queries
+ * over the same document without re-parsing it.
+ *
+ * Tokens are stored in document order. Containers know where their subtree
+ * ends, so siblings can be skipped over without looking at their contents.
+ */
+struct json_tape_tok {
+  int start;         /* Offset of the value in the document */
+  int len;           /* Length of the value */
+  int key;           /* Offset of the key, for object members; -1 otherwise */
+  int next;          /* Index of the next sibling (first token after subtree) */
+  short key_len;     /* Length of the key */
+  unsigned char type;  /* enum json_token_type, *_START for containers */
+  unsigned char depth; /* Nesting level, 0 for the top-level value */
+};
+
+struct json_tape {
+  const char *json;
+  struct json_tape_tok *toks; /* Caller-provided storage (or NULL) */
+  int max_toks;
+  int num_toks;
+  int allocated; /* toks were allocated by json_tape_parse_dyn() */
+};
+
+#ifndef JSON_TAPE_MAX_DEPTH
+#define JSON_TAPE_MAX_DEPTH 32
+#endif
+
+#define JSON_TAPE_OVERFLOW -3
+#define JSON_TAPE_TOO_DEEP -4
+
+/* Initializer for a tape backed by a static array of `struct json_tape_tok` */
+#define JSON_TAPE(toks) \
+  { NULL, (toks), (int) (sizeof(toks) / sizeof((toks)[0])), 0, 0 }
+
+/*
+ * Tokenize `json` into `tape->toks`. Return the number of tokens or a
+ * negative error: JSON_STRING_INVALID, JSON_STRING_INCOMPLETE,
+ * JSON_TAPE_OVERFLOW if `tape->max_toks` is too small,
+ * JSON_TAPE_TOO_DEEP if nesting exceeds JSON_TAPE_MAX_DEPTH.
+ * If `tape->toks` is NULL, only counts the tokens.
+ * The document must outlive the tape.
+ */
+int json_tape_parse(struct json_tape *tape, const char *json, int len);
+
+/*
+ * Same as json_tape_parse(), but if caller-provided storage (which may be
+ * NULL) is too small, tokens are moved to a heap-allocated array that grows
+ * as needed, still in a single pass. Call json_tape_free() when done, also
+ * on error.
+ */
+int json_tape_parse_dyn(struct json_tape *tape, const char *json, int len);
+void json_tape_free(struct json_tape *tape);
+
+/*
+ * Find the token at `path` (same syntax as json_walk() paths, e.g.
+ * ".foo.bar[2]") relative to the token `from` (0 is the top-level value).
+ * Return token index or -1 if not found.
+ */
+int json_tape_find(const struct json_tape *tape, int from, const char *path);
+
+/* Return index of the `index`-th element of the array `array`, or -1. */
+int json_tape_array_elem(const struct json_tape *tape, int array, int index);
+
+/*
+ * Fill `token` for the token at `idx`, the same way json_scanf() %T does.
+ * Return 0 if `idx` is not valid.
+ */
+int json_tape_token(const struct json_tape *tape, int idx,
+                    struct json_token *token);
+
+/*
+ * json_scanf() over a tokenized document. Unlike json_scanf(), if a key is
+ * repeated, only its last value is converted.
+ */
+int json_tape_scanf(const struct json_tape *tape, const char *fmt, ...);
+int json_vscanf_tape(const struct json_tape *tape, const char *fmt,
+                     va_list ap);
+
+/*
+ * Push parser: json_walk() over a document that arrives in chunks of any
+ * size, with bounded memory.
+ *
+ * Callbacks are the same as json_walk() ones, with one difference: for
+ * JSON_TYPE_OBJECT_END and JSON_TYPE_ARRAY_END events the value is NULL, the
+ * container text is not kept. Tokens are passed in place when they lie
+ * within one chunk; a token (or object key) that spans chunks is collected
+ * in the caller-provided buffer, which therefore limits the length of a
+ * key plus a value. The name and token pointers are only valid during the
+ * callback.
+ */
+#ifndef JSON_PUSH_MAX_DEPTH
+#define JSON_PUSH_MAX_DEPTH 32
+#endif
+
+#define JSON_PUSH_OVERFLOW -3
+#define JSON_PUSH_TOO_DEEP -4
+
+struct json_push_level {
+  unsigned short path_len;      /* Path length before the container */
+  unsigned short elem_path_len; /* Before the current key or index */
+  unsigned char is_array;
+  unsigned char comma_ok;
+  int index;
+};
+
+struct json_push_parser {
+  json_walk_callback_t callback;
+  void *callback_data;
+  char *buf; /* Key and token storage */
+  size_t buf_size;
+  size_t key_len; /* Key of the pending value, at the start of buf */
+  size_t tok_len; /* Part of the current token collected in buf */
+  const char *tok;     /* Start of the current token in the current chunk */
+  const char *literal; /* "null", "true" or "false" being matched */
+  const char *name;
+  size_t name_len;
+  int state;
+  int sub_state; /* Progress within the current token */
+  int utf8_left; /* Bytes left of a multibyte character */
+  int in_key;
+  int result; /* 0, 1 when the value is complete or an error */
+  int depth;
+  struct json_push_level stack[JSON_PUSH_MAX_DEPTH];
+  char index[12];
+  char path[JSON_MAX_PATH_LEN];
+  size_t path_len;
+};
+
+void json_push_init(struct json_push_parser *p, char *buf, size_t buf_size,
+                    json_walk_callback_t callback, void *callback_data);
+
+/*
+ * Feed the next chunk. Return the number of bytes consumed, which is less
+ * than `len` only if the top-level value ended within the chunk, or a
+ * negative error: JSON_STRING_INVALID, JSON_PUSH_OVERFLOW if a token does
+ * not fit the buffer, JSON_PUSH_TOO_DEEP if nesting exceeds
+ * JSON_PUSH_MAX_DEPTH. Errors are sticky.
+ */
+int json_push_feed(struct json_push_parser *p, const char *data, size_t len);
+
+/*
+ * Signal the end of input. Return 0 if a complete value has been parsed
+ * (a top-level number is only known to be complete at this point),
+ * JSON_STRING_INCOMPLETE or the error returned by json_push_feed().
+ */
+int json_push_end(struct json_push_parser *p);
+
 /*
  * Unescape JSON-encoded string src,slen into dst, dlen.
  * src and dst may overlap.
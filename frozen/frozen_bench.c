@@ -0,0 +1,102 @@
+/*
+ * Copyright (c) 2017 Cesanta Software Limited
+ * All rights reserved
+ *
+ * json_walk() throughput on typical documents, in MB/s.
+ * Build and run with:
+ *   cc -O2 frozen_bench.c frozen.c -o frozen_bench && ./frozen_bench
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "frozen.h"
+
+#define MIN_TIME 0.5
+
+static volatile size_t s_sink;
+
+static double now(void) {
+  return (double) clock() / CLOCKS_PER_SEC;
+}
+
+static void cb(void *data, const char *name, size_t name_len,
+               const char *path, const struct json_token *token) {
+  s_sink += name_len + token->len + (path[0] != '\0');
+  (void) data;
+  (void) name;
+}
+
+static void bench(const char *name, const char *doc) {
+  int len = (int) strlen(doc);
+  double start = now(), elapsed;
+  size_t total = 0;
+  if (json_walk(doc, len, cb, NULL) < 0) {
+    printf("%-12s: parse error\n", name);
+    return;
+  }
+  do {
+    json_walk(doc, len, cb, NULL);
+    total += len;
+  } while ((elapsed = now() - start) < MIN_TIME);
+  printf("%-12s %6d bytes: %8.1f MB/s\n", name, len, total / elapsed / 1e6);
+}
+
+/* RPC request frame, as received over WebSocket or MQTT. */
+static const char *s_rpc_frame =
+    "{\"id\":1949385512,\"src\":\"mos\",\"method\":\"Config.Set\","
+    "\"args\":{\"config\":{\"wifi\":{\"sta\":{\"enable\":true,"
+    "\"ssid\":\"my network\",\"pass\":\"my password\"}}}}}";
+
+/* Pretty-printed config, the way it is stored on the filesystem. */
+static char *make_config(void) {
+  const char *sections[] = {"wifi", "http", "mqtt", "rpc", "debug", "sntp",
+                            "device", "update", "dns_sd", "i2c"};
+  size_t i, j, n = 0, size = 16384;
+  char *buf = (char *) malloc(size);
+  n += snprintf(buf + n, size - n, "{\n");
+  for (i = 0; i < sizeof(sections) / sizeof(sections[0]); i++) {
+    n += snprintf(buf + n, size - n, "  \"%s\": {\n", sections[i]);
+    for (j = 0; j < 8; j++) {
+      n += snprintf(buf + n, size - n,
+                    "    \"option_%d\": \"some value %d\",\n"
+                    "    \"number_%d\": %d,\n"
+                    "    \"flag_%d\": %s,\n",
+                    (int) j, (int) j, (int) j, (int) (j * 1000),
+                    (int) j, j % 2 ? "true" : "false");
+    }
+    n += snprintf(buf + n, size - n, "    \"enable\": true\n  }%s\n",
+                  i + 1 < sizeof(sections) / sizeof(sections[0]) ? "," : "");
+  }
+  snprintf(buf + n, size - n, "}\n");
+  return buf;
+}
+
+/* AWS IoT shadow document with nested reported state. */
+static char *make_shadow(void) {
+  size_t i, n = 0, size = 65536;
+  char *buf = (char *) malloc(size);
+  n += snprintf(buf + n, size - n, "{\"state\":{\"reported\":{");
+  for (i = 0; i < 200; i++) {
+    n += snprintf(buf + n, size - n,
+                  "\"sensor%d\":{\"value\":%d.%d,\"unit\":\"celsius\","
+                  "\"history\":[1,2,3,4,5,6,7,8],\"ok\":true},",
+                  (int) i, (int) i, (int) (i % 10));
+  }
+  snprintf(buf + n, size - n,
+           "\"uptime\":12345}},\"metadata\":{},\"version\":42,"
+           "\"timestamp\":1500000000,\"clientToken\":\"0123abcd\"}");
+  return buf;
+}
+
+int main(void) {
+  char *config = make_config(), *shadow = make_shadow();
+  bench("rpc frame", s_rpc_frame);
+  bench("config", config);
+  bench("shadow", shadow);
+  free(config);
+  free(shadow);
+  return 0;
+}
@@ -26,6 +26,8 @@
 #define AWS_SHADOW_TOPIC_SHADOW_LEN (sizeof(AWS_SHADOW_TOPIC_SHADOW) - 1)
 #define TOKEN_LEN 8
 #define TOKEN_BUF_SIZE (TOKEN_LEN + 1)
+/* Payloads with more tokens than this are tokenized into heap */
+#define AWS_SHADOW_TAPE_SIZE 32
 
 enum mgos_aws_shadow_topic_id {
   MGOS_AWS_SHADOW_TOPIC_UNKNOWN = 0,
@@ -44,6 +46,7 @@ struct aws_shadow_state {
   unsigned int online : 1;
   unsigned int want_get : 1;
   unsigned int sent_get : 1;
+  unsigned int subscribed : 1;
   struct mbuf update;
   mgos_aws_shadow_state_handler state_cb;
   mgos_aws_shadow_error_handler error_cb;
@@ -185,6 +188,118 @@ static bool is_our_token(const struct aws_shadow_state *ss,
                      mg_mk_str_n(exp_token, TOKEN_LEN), TOKEN_LEN) == 0);
 }
 
+static void aws_shadow_set_online(struct aws_shadow_state *ss) {
+  ss->online = true;
+  ss->sent_get = false;
+  if (ss->state_cb != NULL) {
+    ss->state_cb(ss->state_cb_arg, MGOS_AWS_SHADOW_CONNECTED, 0,
+                 mg_mk_str_n("", 0), mg_mk_str_n("", 0));
+  }
+}
+
+/*
+ * Payload is tokenized once by the caller, then queried several times.
+ */
+static void aws_shadow_handle_msg(struct aws_shadow_state *ss,
+                                  struct mg_connection *nc,
+                                  struct mg_mqtt_message *msg,
+                                  const struct json_tape *tape) {
+  enum mgos_aws_shadow_topic_id topic_id =
+      get_aws_shadow_topic_id(msg->topic, ss->thing_name);
+  bool token_matches = false;
+  struct json_token client_token = JSON_INVALID_TOKEN;
+  switch (topic_id) {
+    case MGOS_AWS_SHADOW_TOPIC_UPDATE_DELTA:
+    case MGOS_AWS_SHADOW_TOPIC_GET_REJECTED:
+    case MGOS_AWS_SHADOW_TOPIC_UPDATE_REJECTED: {
+      /* Deltas and errors come without a token, assume they are for us. */
+      token_matches = true;
+      break;
+    }
+    default: {
+      json_tape_scanf(tape, "{clientToken:%T}", &client_token);
+      token_matches = is_our_token(ss, client_token);
+      break;
+    }
+  }
+  LOG(LL_DEBUG, ("Topic %.*s (%d), id 0x%04x, token %.*s, payload:\r\n%.*s",
+                 (int) msg->topic.len, msg->topic.p, topic_id, msg->message_id,
+                 (int) client_token.len,
+                 client_token.ptr ? client_token.ptr : "",
+                 (int) msg->payload.len, msg->payload.p));
+  if (!token_matches) {
+    /*
+     * This is not a response to one of our requests.
+     * Still needs to be acked so that the broker doesn't lose patience with
+     * us, but we otherwise ignore it.
+     */
+    mg_mqtt_puback(nc, msg->message_id);
+    return;
+  }
+  if (topic_id == MGOS_AWS_SHADOW_TOPIC_GET_ACCEPTED ||
+      topic_id == MGOS_AWS_SHADOW_TOPIC_GET_REJECTED) {
+    ss->want_get = false;
+  }
+  switch (topic_id) {
+    case MGOS_AWS_SHADOW_TOPIC_GET_ACCEPTED:
+    case MGOS_AWS_SHADOW_TOPIC_UPDATE_ACCEPTED:
+    case MGOS_AWS_SHADOW_TOPIC_UPDATE_DELTA: {
+      uint64_t version = 0;
+      json_tape_scanf(tape, "{version:%llu}", &version);
+      LOG(LL_INFO, ("Version: %llu -> %llu (%d)", ss->current_version,
+                    version, topic_id));
+      if (version < ss->current_version) {
+        /* Thanks, not interested. */
+        mg_mqtt_puback(nc, msg->message_id);
+        break;
+      }
+      if (ss->state_cb == NULL) {
+        LOG(LL_WARN, ("No state handler, message ignored."));
+        mg_mqtt_puback(nc, msg->message_id);
+        break;
+      }
+      struct json_token reported = JSON_INVALID_TOKEN;
+      struct json_token desired = JSON_INVALID_TOKEN;
+      reported.ptr = desired.ptr = ""; /* Avoid NULL strings. */
+      if (topic_id == MGOS_AWS_SHADOW_TOPIC_UPDATE_DELTA) {
+        json_tape_scanf(tape, "{state:%T}", &desired);
+      } else {
+        json_tape_scanf(tape, "{state:{reported:%T, desired:%T}}", &reported,
+                        &desired);
+      }
+      mgos_unlock();
+      ss->state_cb(ss->state_cb_arg, topic_id_to_aws_ev(topic_id), version,
+                   mg_mk_str_n(reported.ptr, reported.len),
+                   mg_mk_str_n(desired.ptr, desired.len));
+      mg_mqtt_puback(nc, msg->message_id);
+      mgos_lock();
+      ss->current_version = version;
+      break;
+    }
+    case MGOS_AWS_SHADOW_TOPIC_GET_REJECTED:
+    case MGOS_AWS_SHADOW_TOPIC_UPDATE_REJECTED: {
+      mg_mqtt_puback(nc, msg->message_id);
+      int code = -1;
+      char *message = NULL;
+      json_tape_scanf(tape, "{code: %d, message: %Q}", &code, &message);
+      LOG(LL_ERROR, ("Error: %d %s", code, (message ? message : "")));
+      if (ss->error_cb != NULL) {
+        mgos_unlock();
+        ss->error_cb(ss->error_cb_arg, topic_id_to_aws_ev(topic_id), code,
+                     message ? message : "");
+        mgos_lock();
+      }
+      free(message);
+      break;
+    }
+    /* We do not subscribe to GET and UPDATE */
+    case MGOS_AWS_SHADOW_TOPIC_GET:
+    case MGOS_AWS_SHADOW_TOPIC_UPDATE:
+    case MGOS_AWS_SHADOW_TOPIC_UNKNOWN:
+      break;
+  }
+}
+
 static void mgos_aws_shadow_ev(struct mg_connection *nc, int ev, void *ev_data,
                                void *user_data) {
   struct aws_shadow_state *ss = (struct aws_shadow_state *) user_data;
@@ -227,6 +342,14 @@ static void mgos_aws_shadow_ev(struct mg_connection *nc, int ev, void *ev_data,
       break;
     }
     case MG_EV_MQTT_CONNACK: {
+      struct mg_mqtt_message *msg = (struct mg_mqtt_message *) ev_data;
+      if (msg->session_present && ss->subscribed) {
+        /* Resumed session still has our subscriptions. */
+        LOG(LL_INFO, ("Session resumed"));
+        aws_shadow_set_online(ss);
+        break;
+      }
+      ss->subscribed = false;
       struct mg_mqtt_topic_expression topic_exprs[5] = {
           /* Hack: use QoS field to hold topic ID for now. */
           {.qos = MGOS_AWS_SHADOW_TOPIC_GET_ACCEPTED},
@@ -252,118 +375,28 @@ static void mgos_aws_shadow_ev(struct mg_connection *nc, int ev, void *ev_data,
     case MG_EV_MQTT_SUBACK: {
       struct mg_mqtt_message *msg = (struct mg_mqtt_message *) ev_data;
       if (msg->message_id == AWS_SHADOW_SUB_ID) {
-        LOG(LL_INFO, ("Subscribed"));
-        ss->online = true;
-        ss->sent_get = false;
-        if (ss->state_cb != NULL) {
-          ss->state_cb(ss->state_cb_arg, MGOS_AWS_SHADOW_CONNECTED, 0,
-                       mg_mk_str_n("", 0), mg_mk_str_n("", 0));
+        size_t i;
+        for (i = 0; i < msg->payload.len; i++) {
+          if (msg->payload.p[i] & MG_MQTT_SUBACK_FAILURE) break;
         }
+        if (msg->payload.len == 0 || i < msg->payload.len) {
+          /* Stay offline, we'll subscribe again on the next CONNACK. */
+          LOG(LL_ERROR, ("Subscription rejected"));
+          break;
+        }
+        LOG(LL_INFO, ("Subscribed"));
+        ss->subscribed = true;
+        aws_shadow_set_online(ss);
       }
       break;
     }
     case MG_EV_MQTT_PUBLISH: {
       struct mg_mqtt_message *msg = (struct mg_mqtt_message *) ev_data;
-      enum mgos_aws_shadow_topic_id topic_id =
-          get_aws_shadow_topic_id(msg->topic, ss->thing_name);
-      bool token_matches = false;
-      struct json_token client_token = JSON_INVALID_TOKEN;
-      switch (topic_id) {
-        case MGOS_AWS_SHADOW_TOPIC_UPDATE_DELTA:
-        case MGOS_AWS_SHADOW_TOPIC_GET_REJECTED:
-        case MGOS_AWS_SHADOW_TOPIC_UPDATE_REJECTED: {
-          /* Deltas and errors come without a token, assume they are for us. */
-          token_matches = true;
-          break;
-        }
-        default: {
-          json_scanf(msg->payload.p, msg->payload.len, "{clientToken:%T}",
-                     &client_token);
-          token_matches = is_our_token(ss, client_token);
-          break;
-        }
-      }
-      LOG(LL_DEBUG,
-          ("Topic %.*s (%d), id 0x%04x, token %.*s, payload:\r\n%.*s",
-           (int) msg->topic.len, msg->topic.p, topic_id, msg->message_id,
-           (int) client_token.len, client_token.ptr ? client_token.ptr : "",
-           (int) msg->payload.len, msg->payload.p));
-      if (!token_matches) {
-        /*
-         * This is not a response to one of our requests.
-         * Still needs to be acked so that the broker doesn't lose patience with
-         * us,
-         * but we otherwise ignore it.
-         */
-        mg_mqtt_puback(nc, msg->message_id);
-        break;
-      }
-      if (topic_id == MGOS_AWS_SHADOW_TOPIC_GET_ACCEPTED ||
-          topic_id == MGOS_AWS_SHADOW_TOPIC_GET_REJECTED) {
-        ss->want_get = false;
-      }
-      switch (topic_id) {
-        case MGOS_AWS_SHADOW_TOPIC_GET_ACCEPTED:
-        case MGOS_AWS_SHADOW_TOPIC_UPDATE_ACCEPTED:
-        case MGOS_AWS_SHADOW_TOPIC_UPDATE_DELTA: {
-          uint64_t version = 0;
-          json_scanf(msg->payload.p, msg->payload.len, "{version:%llu}",
-                     &version);
-          LOG(LL_INFO, ("Version: %llu -> %llu (%d)", ss->current_version,
-                        version, topic_id));
-          if (version < ss->current_version) {
-            /* Thanks, not interested. */
-            mg_mqtt_puback(nc, msg->message_id);
-            break;
-          }
-          if (ss->state_cb == NULL) {
-            LOG(LL_WARN, ("No state handler, message ignored."));
-            mg_mqtt_puback(nc, msg->message_id);
-            break;
-          }
-          struct json_token reported = JSON_INVALID_TOKEN;
-          struct json_token desired = JSON_INVALID_TOKEN;
-          reported.ptr = desired.ptr = ""; /* Avoid NULL strings. */
-          if (topic_id == MGOS_AWS_SHADOW_TOPIC_UPDATE_DELTA) {
-            json_scanf(msg->payload.p, msg->payload.len, "{state:%T}",
-                       &desired);
-          } else {
-            json_scanf(msg->payload.p, msg->payload.len,
-                       "{state:{reported:%T, desired:%T}}", &reported,
-                       &desired);
-          }
-          mgos_unlock();
-          ss->state_cb(ss->state_cb_arg, topic_id_to_aws_ev(topic_id), version,
-                       mg_mk_str_n(reported.ptr, reported.len),
-                       mg_mk_str_n(desired.ptr, desired.len));
-          mg_mqtt_puback(nc, msg->message_id);
-          mgos_lock();
-          ss->current_version = version;
-          break;
-        }
-        case MGOS_AWS_SHADOW_TOPIC_GET_REJECTED:
-        case MGOS_AWS_SHADOW_TOPIC_UPDATE_REJECTED: {
-          mg_mqtt_puback(nc, msg->message_id);
-          int code = -1;
-          char *message = NULL;
-          json_scanf(msg->payload.p, msg->payload.len,
-                     "{code: %d, message: %Q}", &code, &message);
-          LOG(LL_ERROR, ("Error: %d %s", code, (message ? message : "")));
-          if (ss->error_cb != NULL) {
-            mgos_unlock();
-            ss->error_cb(ss->error_cb_arg, topic_id_to_aws_ev(topic_id), code,
-                         message ? message : "");
-            mgos_lock();
-          }
-          free(message);
-          break;
-        }
-        /* We do not subscribe to GET and UPDATE */
-        case MGOS_AWS_SHADOW_TOPIC_GET:
-        case MGOS_AWS_SHADOW_TOPIC_UPDATE:
-        case MGOS_AWS_SHADOW_TOPIC_UNKNOWN:
-          break;
-      }
+      struct json_tape_tok toks[AWS_SHADOW_TAPE_SIZE];
+      struct json_tape tape = JSON_TAPE(toks);
+      json_tape_parse_dyn(&tape, msg->payload.p, msg->payload.len);
+      aws_shadow_handle_msg(ss, nc, msg, &tape);
+      json_tape_free(&tape);
       break;
     }
   }
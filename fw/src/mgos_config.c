@@ -4,10 +4,12 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include "common/json_utils.h"
 #include "common/mbuf.h"
 #include "common/cs_dbg.h"
+#include "common/cs_file.h"
 #include "fw/src/mgos_config.h"
 
 bool mgos_conf_check_access(const struct mg_str key, const char *acl) {
@@ -27,10 +29,126 @@ bool mgos_conf_check_access(const struct mg_str key, const char *acl) {
   return false;
 }
 
+enum mgos_conf_acl_kind {
+  MGOS_CONF_ACL_EXACT,
+  MGOS_CONF_ACL_PREFIX,     /* "prefix*": the rest has no '/' */
+  MGOS_CONF_ACL_PREFIX_ANY, /* "prefix**" */
+  MGOS_CONF_ACL_GLOB,       /* Anything else, mg_match_prefix_n() */
+};
+
+void mgos_conf_acl_compile(const char *acl, struct mgos_conf_acl *cacl) {
+  struct mg_str entry;
+  cacl->acl = acl;
+  cacl->num_rules = 0;
+  if (acl == NULL) return;
+  while ((acl = mg_next_comma_list_entry(acl, &entry, NULL)) != NULL) {
+    if (entry.len == 0) continue;
+    if (cacl->num_rules == MGOS_CONF_ACL_MAX_RULES) {
+      cacl->num_rules = -1; /* Use the string */
+      return;
+    }
+    struct mgos_conf_acl_rule *r = &cacl->rules[cacl->num_rules++];
+    r->allow = (entry.p[0] != '-');
+    if (entry.p[0] == '-' || entry.p[0] == '+') {
+      entry.p++;
+      entry.len--;
+    }
+    size_t n = 0;
+    while (n < entry.len && strchr("?*$|", entry.p[n]) == NULL) n++;
+    r->pattern = entry;
+    if (n == entry.len) {
+      r->kind = MGOS_CONF_ACL_EXACT;
+    } else if (n == entry.len - 1 && entry.p[n] == '*') {
+      r->kind = MGOS_CONF_ACL_PREFIX;
+      r->pattern.len = n;
+    } else if (n == entry.len - 2 && entry.p[n] == '*' &&
+               entry.p[n + 1] == '*') {
+      r->kind = MGOS_CONF_ACL_PREFIX_ANY;
+      r->pattern.len = n;
+    } else {
+      r->kind = MGOS_CONF_ACL_GLOB;
+    }
+  }
+}
+
+static bool mgos_conf_acl_match(const struct mgos_conf_acl_rule *r,
+                                const struct mg_str key) {
+  const struct mg_str p = r->pattern;
+  switch (r->kind) {
+    case MGOS_CONF_ACL_EXACT:
+      return key.len == p.len && mg_ncasecmp(key.p, p.p, p.len) == 0;
+    case MGOS_CONF_ACL_PREFIX:
+      return key.len >= p.len && mg_ncasecmp(key.p, p.p, p.len) == 0 &&
+             memchr(key.p + p.len, '/', key.len - p.len) == NULL;
+    case MGOS_CONF_ACL_PREFIX_ANY:
+      return key.len >= p.len && mg_ncasecmp(key.p, p.p, p.len) == 0;
+    default:
+      return mg_match_prefix_n(p, key) == (int) key.len;
+  }
+}
+
+bool mgos_conf_acl_check(const struct mgos_conf_acl *cacl,
+                         const struct mg_str key) {
+  int i;
+  if (cacl->num_rules < 0) return mgos_conf_check_access(key, cacl->acl);
+  for (i = 0; i < cacl->num_rules; i++) {
+    if (mgos_conf_acl_match(&cacl->rules[i], key)) return cacl->rules[i].allow;
+  }
+  return false;
+}
+
+/* Shared string storage, see mgos_conf_str_is_shared() */
+struct mgos_conf_str_region {
+  const char *start;
+  size_t size;
+  const void *cfg; /* Owner of an arena, NULL for read-only defaults */
+  struct mgos_conf_str_region *next;
+};
+
+static struct mgos_conf_str_region *s_str_regions = NULL;
+
+bool mgos_conf_str_is_shared(const char *s) {
+  const struct mgos_conf_str_region *r;
+  if (s == NULL) return false;
+  for (r = s_str_regions; r != NULL; r = r->next) {
+    if (s >= r->start && s < r->start + r->size) return true;
+  }
+  return false;
+}
+
+static bool mgos_conf_add_str_region(const char *start, size_t size,
+                                     const void *cfg) {
+  struct mgos_conf_str_region *r =
+      (struct mgos_conf_str_region *) calloc(1, sizeof(*r));
+  if (r == NULL) return false;
+  r->start = start;
+  r->size = size;
+  r->cfg = cfg;
+  r->next = s_str_regions;
+  s_str_regions = r;
+  return true;
+}
+
+static void mgos_conf_free_arenas(const void *cfg) {
+  struct mgos_conf_str_region **rp = &s_str_regions;
+  while (*rp != NULL) {
+    struct mgos_conf_str_region *r = *rp;
+    if (r->cfg == cfg) {
+      *rp = r->next;
+      free((void *) r->start);
+      free(r);
+    } else {
+      rp = &r->next;
+    }
+  }
+}
+
 struct parse_ctx {
   const struct mgos_conf_entry *schema;
-  const char *acl;
+  const struct mgos_conf_index *idx;
+  struct mgos_conf_acl acl;
   void *cfg;
+  bool str_defaults;
   bool result;
 };
 
@@ -51,6 +169,50 @@ const struct mgos_conf_entry *mgos_conf_find_schema_entry(
   return NULL;
 }
 
+/* Must match _Hash() and _Slot() in gen_sys_config.py */
+static uint32_t mgos_conf_index_slot(const struct mgos_conf_index *idx,
+                                     uint32_t h) {
+  uint32_t x = h ^ (idx->disp[h & (idx->num_buckets - 1)] * 0x9e3779b9U);
+  x ^= x >> 16;
+  x *= 0x85ebca6bU;
+  x ^= x >> 13;
+  x *= 0xc2b2ae35U;
+  x ^= x >> 16;
+  return x & (idx->num_slots - 1);
+}
+
+const struct mgos_conf_entry *mgos_conf_index_find(
+    const struct mgos_conf_index *idx, const struct mg_str path) {
+  uint32_t h = 2166136261U;
+  size_t i;
+  for (i = 0; i < path.len; i++) {
+    h = (h ^ (uint8_t) path.p[i]) * 16777619U;
+  }
+  int ei = idx->slots[mgos_conf_index_slot(idx, h)];
+  if (ei == 0) return NULL;
+  const char *ep = idx->paths[ei];
+  if (strncmp(ep, path.p, path.len) != 0 || ep[path.len] != '\0') return NULL;
+  return idx->schema + ei;
+}
+
+int mgos_conf_key_id(const struct mgos_conf_index *idx, const char *path) {
+  const struct mgos_conf_entry *e = mgos_conf_index_find(idx, mg_mk_str(path));
+  return (e != NULL ? (int) (e - idx->schema) : -1);
+}
+
+const struct mgos_conf_entry *mgos_conf_key_entry(
+    const struct mgos_conf_index *idx, int id) {
+  if (id <= 0 || id > idx->schema->num_desc) return NULL;
+  return idx->schema + id;
+}
+
+static const char *mgos_conf_str_default(const struct parse_ctx *ctx,
+                                         const struct mgos_conf_entry *e) {
+  if (!ctx->str_defaults) return NULL;
+  uint16_t off = ctx->idx->str_defaults[e - ctx->idx->schema];
+  return (off > 0 ? ctx->idx->str_pool + off - 1 : NULL);
+}
+
 void mgos_conf_parse_cb(void *data, const char *name, size_t name_len,
                         const char *path, const struct json_token *tok) {
   struct parse_ctx *ctx = (struct parse_ctx *) data;
@@ -67,13 +229,14 @@ void mgos_conf_parse_cb(void *data, const char *name, size_t name_len,
   }
   path++;
   const struct mgos_conf_entry *e =
-      mgos_conf_find_schema_entry(path, ctx->schema);
+      (ctx->idx != NULL ? mgos_conf_index_find(ctx->idx, mg_mk_str(path))
+                        : mgos_conf_find_schema_entry(path, ctx->schema));
   if (e == NULL) {
     LOG(LL_INFO, ("Extra key: [%s]", path));
     return;
   }
   if (e->type != CONF_TYPE_OBJECT &&
-      !mgos_conf_check_access(mg_mk_str(path), ctx->acl)) {
+      !mgos_conf_acl_check(&ctx->acl, mg_mk_str(path))) {
     LOG(LL_ERROR, ("Not allowed to set [%s]", path));
     return;
   }
@@ -123,8 +286,12 @@ void mgos_conf_parse_cb(void *data, const char *name, size_t name_len,
       }
       char **sp = (char **) vp;
       char *s = NULL;
-      if (*sp != NULL) free(*sp);
-      if (tok->len > 0) {
+      const char *def = mgos_conf_str_default(ctx, e);
+      if (!mgos_conf_str_is_shared(*sp)) free(*sp);
+      if (def != NULL && strncmp(def, tok->ptr, tok->len) == 0 &&
+          def[tok->len] == '\0' && memchr(tok->ptr, '\\', tok->len) == NULL) {
+        s = (char *) def; /* Unchanged default, no need to copy. */
+      } else if (tok->len > 0) {
         s = (char *) malloc(tok->len + 1);
         if (s == NULL) {
           ctx->result = false;
@@ -151,14 +318,31 @@ void mgos_conf_parse_cb(void *data, const char *name, size_t name_len,
   LOG(LL_DEBUG, ("Set [%s] = [%.*s]", path, (int) tok->len, tok->ptr));
 }
 
-bool mgos_conf_parse(const struct mg_str json, const char *acl,
-                     const struct mgos_conf_entry *schema, void *cfg) {
+static bool mgos_conf_parse_int(const struct mg_str json, const char *acl,
+                                const struct mgos_conf_entry *schema,
+                                const struct mgos_conf_index *idx, void *cfg) {
   struct parse_ctx ctx = {
-      .schema = schema, .acl = acl, .cfg = cfg, .result = true};
+      .schema = schema, .idx = idx, .cfg = cfg, .result = true};
+  mgos_conf_acl_compile(acl, &ctx.acl);
+  if (idx != NULL && idx->str_pool != NULL && idx->str_pool_size > 0) {
+    ctx.str_defaults = (mgos_conf_str_is_shared(idx->str_pool) ||
+                        mgos_conf_add_str_region(idx->str_pool,
+                                                 idx->str_pool_size, NULL));
+  }
   return (json_walk(json.p, json.len, mgos_conf_parse_cb, &ctx) >= 0 &&
           ctx.result == true);
 }
 
+bool mgos_conf_parse(const struct mg_str json, const char *acl,
+                     const struct mgos_conf_entry *schema, void *cfg) {
+  return mgos_conf_parse_int(json, acl, schema, NULL, cfg);
+}
+
+bool mgos_conf_parse_index(const struct mg_str json, const char *acl,
+                           const struct mgos_conf_index *idx, void *cfg) {
+  return mgos_conf_parse_int(json, acl, idx->schema, idx, cfg);
+}
+
 struct emit_ctx {
   const void *cfg;
   const void *base;
@@ -212,13 +396,10 @@ static void mgos_conf_emit_obj(struct emit_ctx *ctx,
 
 static void mgos_conf_emit_entry(struct emit_ctx *ctx,
                                  const struct mgos_conf_entry *e, int indent) {
-  char buf[40];
-  int len;
+  struct json_out out = JSON_OUT_MBUF(ctx->out);
   switch (e->type) {
     case CONF_TYPE_INT: {
-      len = snprintf(buf, sizeof(buf), "%d",
-                     *((int *) (((char *) ctx->cfg) + e->offset)));
-      mbuf_append(ctx->out, buf, len);
+      json_printf(&out, "%d", *((int *) (((char *) ctx->cfg) + e->offset)));
       break;
     }
     case CONF_TYPE_BOOL: {
@@ -236,9 +417,8 @@ static void mgos_conf_emit_entry(struct emit_ctx *ctx,
       break;
     }
     case CONF_TYPE_DOUBLE: {
-      len = snprintf(buf, sizeof(buf), "%lf",
-                     *((double *) (((char *) ctx->cfg) + e->offset)));
-      mbuf_append(ctx->out, buf, len);
+      /* Shortest form that loads back as the same value */
+      json_printf(&out, "%D", *((double *) (((char *) ctx->cfg) + e->offset)));
       break;
     }
     case CONF_TYPE_STRING: {
@@ -310,9 +490,47 @@ void mgos_conf_emit_f_cb(struct mbuf *data, void *param) {
   mbuf_remove(data, data->len);
 }
 
+struct emit_cmp_ctx {
+  FILE *fp;
+  bool eq;
+};
+
+static void mgos_conf_emit_cmp_cb(struct mbuf *data, void *param) {
+  struct emit_cmp_ctx *ctx = (struct emit_cmp_ctx *) param;
+  char buf[64];
+  size_t off = 0;
+  while (ctx->eq && off < data->len) {
+    size_t n = data->len - off;
+    if (n > sizeof(buf)) n = sizeof(buf);
+    if (fread(buf, 1, n, ctx->fp) != n || memcmp(buf, data->buf + off, n)) {
+      ctx->eq = false;
+    }
+    off += n;
+  }
+  mbuf_remove(data, data->len);
+}
+
+/* Compares emitted config with the contents of 'fname' without buffering. */
+static bool mgos_conf_emit_eq_f(const void *cfg, const void *base,
+                                const struct mgos_conf_entry *schema,
+                                bool pretty, const char *fname) {
+  struct emit_cmp_ctx ctx = {.fp = fopen(fname, "r"), .eq = true};
+  if (ctx.fp == NULL) return false;
+  mgos_conf_emit_cb(cfg, base, schema, pretty, NULL, mgos_conf_emit_cmp_cb,
+                    &ctx);
+  if (ctx.eq && fgetc(ctx.fp) != EOF) ctx.eq = false;
+  fclose(ctx.fp);
+  return ctx.eq;
+}
+
 bool mgos_conf_emit_f(const void *cfg, const void *base,
                       const struct mgos_conf_entry *schema, bool pretty,
                       const char *fname) {
+  /* Spare the flash if nothing has changed. */
+  if (mgos_conf_emit_eq_f(cfg, base, schema, pretty, fname)) {
+    LOG(LL_DEBUG, ("%s is up to date", fname));
+    return true;
+  }
   FILE *fp = fopen("tmp", "w");
   if (fp == NULL) {
     LOG(LL_ERROR, ("Error opening file for writing\n"));
@@ -335,14 +553,153 @@ void mgos_conf_free(const struct mgos_conf_entry *schema, void *cfg) {
     const struct mgos_conf_entry *e = schema + i;
     if (e->type == CONF_TYPE_STRING) {
       char **sp = ((char **) (((char *) cfg) + e->offset));
-      free(*sp);
+      if (!mgos_conf_str_is_shared(*sp)) free(*sp);
       *sp = NULL;
     }
   }
+  mgos_conf_free_arenas(cfg);
+}
+
+#define MGOS_CONF_SNAPSHOT_MAGIC 0x3153434d /* "MCS1" */
+
+/*
+ * Snapshot file layout: header, struct image with string pointers replaced
+ * by (offset + 1) into the string table (0 = NULL), string table.
+ */
+struct mgos_conf_snapshot_hdr {
+  uint32_t magic;
+  uint32_t schema_hash;
+  uint32_t tag;
+  uint32_t cfg_size;
+  uint32_t strings_size;
+  uint32_t checksum; /* Of everything after the header */
+};
+
+static uint32_t mgos_conf_fnv(uint32_t h, const void *data, size_t len) {
+  const uint8_t *p = (const uint8_t *) data;
+  size_t i;
+  for (i = 0; i < len; i++) h = (h ^ p[i]) * 16777619U;
+  return h;
+}
+
+uint32_t mgos_conf_schema_hash(const struct mgos_conf_entry *schema) {
+  uint32_t h = 2166136261U;
+  int i;
+  for (i = 0; i <= schema->num_desc; i++) {
+    const struct mgos_conf_entry *e = schema + i;
+    int v = (e->type == CONF_TYPE_OBJECT ? e->num_desc : (int) e->offset);
+    h = mgos_conf_fnv(h, &e->type, sizeof(e->type));
+    h = mgos_conf_fnv(h, e->key, strlen(e->key) + 1);
+    h = mgos_conf_fnv(h, &v, sizeof(v));
+  }
+  return h;
+}
+
+bool mgos_conf_snapshot_save(const void *cfg, size_t cfg_size,
+                             const struct mgos_conf_entry *schema,
+                             uint32_t tag, const char *fname) {
+  bool result = false;
+  struct mgos_conf_snapshot_hdr hdr;
+  struct mbuf strings;
+  char *image = (char *) malloc(cfg_size);
+  int i;
+  mbuf_init(&strings, 0);
+  if (image == NULL) goto clean;
+  memcpy(image, cfg, cfg_size);
+  for (i = 1; i <= schema->num_desc; i++) {
+    const struct mgos_conf_entry *e = schema + i;
+    if (e->type != CONF_TYPE_STRING) continue;
+    char **sp = (char **) (image + e->offset);
+    uintptr_t off = 0;
+    if (*sp != NULL) {
+      off = strings.len + 1;
+      mbuf_append(&strings, *sp, strlen(*sp) + 1);
+    }
+    memcpy(sp, &off, sizeof(off));
+  }
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.magic = MGOS_CONF_SNAPSHOT_MAGIC;
+  hdr.schema_hash = mgos_conf_schema_hash(schema);
+  hdr.tag = tag;
+  hdr.cfg_size = cfg_size;
+  hdr.strings_size = strings.len;
+  hdr.checksum = mgos_conf_fnv(2166136261U, image, cfg_size);
+  hdr.checksum = mgos_conf_fnv(hdr.checksum, strings.buf, strings.len);
+  FILE *fp = fopen("tmp", "w");
+  if (fp == NULL) goto clean;
+  result = (fwrite(&hdr, sizeof(hdr), 1, fp) == 1 &&
+            fwrite(image, cfg_size, 1, fp) == 1 &&
+            (strings.len == 0 ||
+             fwrite(strings.buf, strings.len, 1, fp) == 1));
+  if (fclose(fp) != 0) result = false;
+  remove(fname);
+  if (!result || rename("tmp", fname) != 0) {
+    LOG(LL_ERROR, ("Error writing %s", fname));
+    remove("tmp");
+    result = false;
+  }
+clean:
+  free(image);
+  mbuf_free(&strings);
+  return result;
+}
+
+bool mgos_conf_snapshot_load(const char *fname, size_t cfg_size,
+                             const struct mgos_conf_entry *schema,
+                             uint32_t tag, void *cfg) {
+  bool result = false;
+  size_t size;
+  struct mgos_conf_snapshot_hdr hdr;
+  int i;
+  char *data = cs_read_file(fname, &size);
+  if (data == NULL || size < sizeof(hdr)) goto clean;
+  memcpy(&hdr, data, sizeof(hdr));
+  const char *image = data + sizeof(hdr);
+  const char *strings = image + cfg_size;
+  if (hdr.magic != MGOS_CONF_SNAPSHOT_MAGIC || hdr.tag != tag ||
+      hdr.cfg_size != cfg_size ||
+      size != sizeof(hdr) + cfg_size + hdr.strings_size ||
+      (hdr.strings_size > 0 && strings[hdr.strings_size - 1] != '\0') ||
+      hdr.schema_hash != mgos_conf_schema_hash(schema) ||
+      hdr.checksum != mgos_conf_fnv(2166136261U, image,
+                                    cfg_size + hdr.strings_size)) {
+    LOG(LL_DEBUG, ("%s is not valid", fname));
+    goto clean;
+  }
+  for (i = 1; i <= schema->num_desc; i++) {
+    const struct mgos_conf_entry *e = schema + i;
+    uintptr_t off;
+    if (e->type != CONF_TYPE_STRING) continue;
+    memcpy(&off, image + e->offset, sizeof(off));
+    if (off > hdr.strings_size) goto clean;
+  }
+  char *arena = NULL;
+  if (hdr.strings_size > 0) {
+    arena = (char *) malloc(hdr.strings_size);
+    if (arena == NULL ||
+        !mgos_conf_add_str_region(arena, hdr.strings_size, cfg)) {
+      free(arena);
+      goto clean;
+    }
+    memcpy(arena, strings, hdr.strings_size);
+  }
+  memcpy(cfg, image, cfg_size);
+  for (i = 1; i <= schema->num_desc; i++) {
+    const struct mgos_conf_entry *e = schema + i;
+    char **sp = (char **) (((char *) cfg) + e->offset);
+    uintptr_t off;
+    if (e->type != CONF_TYPE_STRING) continue;
+    memcpy(&off, sp, sizeof(off));
+    *sp = (off > 0 ? arena + off - 1 : NULL);
+  }
+  result = true;
+clean:
+  free(data);
+  return result;
 }
 
 void mgos_conf_set_str(char **vp, const char *v) {
-  free(*vp);
+  if (!mgos_conf_str_is_shared(*vp)) free(*vp);
   if (v != NULL && *v != '\0') {
     *vp = strdup(v);
   } else {
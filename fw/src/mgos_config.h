@@ -7,6 +7,7 @@
 #define CS_FW_SRC_MGOS_CONFIG_H_
 
 #include <stdbool.h>
+#include <stdint.h>
 
 #include "common/mbuf.h"
 #include "frozen/frozen.h"
@@ -28,6 +29,33 @@ extern "C" {
 
 bool mgos_conf_check_access(const struct mg_str key, const char *acl);
 
+/*
+ * ACL compiled into a list of rules, so that checking a key does not
+ * re-parse the ACL string. Rules point into the ACL string, which must
+ * outlive the compiled ACL.
+ */
+#ifndef MGOS_CONF_ACL_MAX_RULES
+#define MGOS_CONF_ACL_MAX_RULES 8
+#endif
+
+struct mgos_conf_acl_rule {
+  struct mg_str pattern; /* Literal prefix for the non-glob kinds */
+  uint8_t kind;
+  bool allow;
+};
+
+struct mgos_conf_acl {
+  const char *acl; /* Used as is if there are too many rules */
+  int num_rules;
+  struct mgos_conf_acl_rule rules[MGOS_CONF_ACL_MAX_RULES];
+};
+
+void mgos_conf_acl_compile(const char *acl, struct mgos_conf_acl *cacl);
+
+/* Same result as mgos_conf_check_access() with the source ACL. */
+bool mgos_conf_acl_check(const struct mgos_conf_acl *cacl,
+                         const struct mg_str key);
+
 enum mgos_conf_type {
   CONF_TYPE_INT = 0,
   CONF_TYPE_BOOL = 1,
@@ -45,6 +73,29 @@ struct mgos_conf_entry {
   };
 };
 
+/*
+ * Perfect hash of the full dotted paths ("wifi.ap.ssid") of schema entries,
+ * generated by gen_sys_config.py along with the schema.
+ * Bucket = hash % num_buckets, slot = mix(hash ^ disp[bucket] * C) %
+ * num_slots; slots hold schema entry indices, 0 marks an empty slot.
+ */
+struct mgos_conf_index {
+  const struct mgos_conf_entry *schema;
+  const char *const *paths; /* Full path of each schema entry */
+  const uint16_t *disp;
+  const uint16_t *slots;
+  uint16_t num_buckets; /* Powers of 2 */
+  uint16_t num_slots;
+  /*
+   * Default values of string entries (gen_sys_config.py --c_str_defaults),
+   * NULL if not generated. str_defaults[i] is offset + 1 of the default of
+   * entry i in str_pool, 0 if it has none.
+   */
+  const char *str_pool;
+  const uint16_t *str_defaults;
+  uint32_t str_pool_size;
+};
+
 /*
  * Parses config in 'json' into 'cfg' according to rules defined in 'schema' and
  * checking keys against 'acl'.
@@ -52,6 +103,30 @@ struct mgos_conf_entry {
 bool mgos_conf_parse(const struct mg_str json, const char *acl,
                      const struct mgos_conf_entry *schema, void *cfg);
 
+/*
+ * Same as mgos_conf_parse(), keys are looked up in the index. String values
+ * equal to their defaults point to the read-only copy in the index instead
+ * of being allocated.
+ */
+bool mgos_conf_parse_index(const struct mg_str json, const char *acl,
+                           const struct mgos_conf_index *idx, void *cfg);
+
+/* Find the schema entry for a full dotted path. Return NULL if not found. */
+const struct mgos_conf_entry *mgos_conf_index_find(
+    const struct mgos_conf_index *idx, const struct mg_str path);
+
+/*
+ * Key ids are indices of entries in the schema, generated as an enum
+ * (SYS_CONFIG_KEY_WIFI_AP_SSID). For dynamic callers (FFI) that look up the
+ * same key many times, resolve the path to an id once and then use
+ * mgos_conf_key_entry(), which is a bounds-checked array access.
+ */
+int mgos_conf_key_id(const struct mgos_conf_index *idx, const char *path);
+
+/* Returns NULL if the id is out of range. */
+const struct mgos_conf_entry *mgos_conf_key_entry(
+    const struct mgos_conf_index *idx, int id);
+
 /*
  * Emit config in 'cfg' according to rules in 'schema'.
  * Keys are only emitted if their values are different from 'base'.
@@ -62,6 +137,11 @@ void mgos_conf_emit_cb(const void *cfg, const void *base,
                        const struct mgos_conf_entry *schema, bool pretty,
                        struct mbuf *out, mgos_conf_emit_cb_t cb,
                        void *cb_param);
+/*
+ * Emits config to 'fname'. The output is first compared with the current
+ * contents of the file, which is only rewritten (via a temporary file)
+ * if they differ.
+ */
 bool mgos_conf_emit_f(const void *cfg, const void *base,
                       const struct mgos_conf_entry *schema, bool pretty,
                       const char *fname);
@@ -76,6 +156,35 @@ const struct mgos_conf_entry *mgos_conf_find_schema_entry(
 
 void mgos_conf_set_str(char **vp, const char *v);
 
+/*
+ * Config strings are normally malloc()ed one by one, but may also point to
+ * shared storage: read-only defaults of an index or a per-config arena (see
+ * mgos_conf_snapshot_load()). Shared strings must not be modified or freed:
+ * mgos_conf_set_str() allocates the new value (copy on write) and
+ * mgos_conf_free() releases the arenas of the config.
+ */
+bool mgos_conf_str_is_shared(const char *s);
+
+/*
+ * Binary snapshot of a parsed config: struct image plus a string table, which
+ * loads with one read and no JSON parsing. A snapshot is only accepted for the
+ * same schema (checked by hash), struct size and 'tag', which the caller
+ * derives from whatever the config was built from.
+ */
+uint32_t mgos_conf_schema_hash(const struct mgos_conf_entry *schema);
+
+bool mgos_conf_snapshot_save(const void *cfg, size_t cfg_size,
+                             const struct mgos_conf_entry *schema,
+                             uint32_t tag, const char *fname);
+
+/*
+ * Strings are placed in one arena owned by 'cfg'.
+ * Returns false and leaves 'cfg' untouched if the snapshot is not valid.
+ */
+bool mgos_conf_snapshot_load(const char *fname, size_t cfg_size,
+                             const struct mgos_conf_entry *schema,
+                             uint32_t tag, void *cfg);
+
 /*
  * Returns a type of the value (this function is primarily for FFI)
  */
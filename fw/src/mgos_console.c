@@ -119,13 +119,17 @@ static void mgos_console_push_to_cloud(void) {
     return;
   }
   if (s_cctx.request_in_flight || !mg_rpc_can_send(c)) return;
+  /* Logs must not hold up responses and other requests. */
+  struct mg_rpc_call_opts opts;
+  memset(&opts, 0, sizeof(opts));
+  opts.prio = MG_RPC_PRIO_LOW;
 #if MGOS_ENABLE_CONSOLE_FILE_BUFFER
   /* Push backlog from the file buffer first. */
   if (s_cctx.fbuf != NULL) {
     char *msg = NULL;
     size_t len = cs_frbuf_get(s_cctx.fbuf, &msg);
     if (len > 0) {
-      if (mg_rpc_callf(c, mg_mk_str("/v1/Log.Log"), mg_rpc_cb, NULL, NULL,
+      if (mg_rpc_callf(c, mg_mk_str("/v1/Log.Log"), mg_rpc_cb, NULL, &opts,
                        "%.*s", (int) len, msg)) {
         s_cctx.request_in_flight = 1;
       }
@@ -135,8 +139,8 @@ static void mgos_console_push_to_cloud(void) {
 #endif
   int l = mgos_console_next_msg_len();
   if (l == 0) return; /* Only send full messages. */
-  if (mg_rpc_callf(c, mg_mk_str("/v1/Log.Log"), mg_rpc_cb, NULL, NULL, "%.*s",
-                   (int) (l - 1), s_cctx.buf.buf)) {
+  if (mg_rpc_callf(c, mg_mk_str("/v1/Log.Log"), mg_rpc_cb, NULL, &opts,
+                   "%.*s", (int) (l - 1), s_cctx.buf.buf)) {
     s_cctx.request_in_flight = 1;
     mbuf_remove(&s_cctx.buf, l);
   }
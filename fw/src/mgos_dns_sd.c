@@ -13,6 +13,8 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <strings.h>
 
 #include "common/cs_dbg.h"
 #include "common/platform.h"
@@ -32,6 +34,54 @@
 #define RCLASS_IN_FLUSH 0x8001
 #define SD_TYPE_ENUM_NAME "_services._dns-sd._udp" SD_DOMAIN
 
+/*
+ * Records we can answer with. A reply is a subset of them, identified by a
+ * mask; replies are serialized (with name compression) once and cached until
+ * the data they are made of changes.
+ */
+#define DNS_SD_RR_TYPE_PTR (1 << 0) /* Service type enumeration */
+#define DNS_SD_RR_SVC_PTR (1 << 1)  /* Service type -> instance */
+#define DNS_SD_RR_SRV (1 << 2)
+#define DNS_SD_RR_TXT (1 << 3)
+#define DNS_SD_RR_A (1 << 4)
+#define DNS_SD_RR_NSEC (1 << 5)
+#define DNS_SD_RR_ALL 0x3f
+
+#define DNS_SD_NUM_CACHED_REPLIES 4
+#define DNS_SD_MAX_COMPRESSED_NAMES 16
+#define DNS_SD_HEADER_SIZE 12
+
+struct dns_sd_cached_reply {
+  int mask;
+  struct mbuf pkt;
+};
+
+struct dns_sd_state {
+  bool valid;
+  /* Inputs the cache was built from, copies of the config values */
+  char *host_name_cfg;
+  char *txt_cfg;
+  char *device_id;
+  int ttl;
+  int rpc_enable;
+  uint16_t port; /* Network byte order */
+  uint32_t ip;   /* Network byte order, 0 if none */
+
+  char host_name[128];
+  char service_name[128];
+  struct dns_sd_cached_reply replies[DNS_SD_NUM_CACHED_REPLIES];
+  int next_evict;
+};
+
+static struct dns_sd_state s_dns_sd;
+
+/* Names already present in the message being built, for compression. */
+struct dns_sd_names {
+  const char *names[DNS_SD_MAX_COMPRESSED_NAMES];
+  uint16_t offsets[DNS_SD_MAX_COMPRESSED_NAMES];
+  int num;
+};
+
 static void make_host_name(char *buf, size_t buf_len) {
   snprintf(buf, buf_len, "%s%s", get_cfg()->dns_sd.host_name, SD_DOMAIN);
   buf[buf_len - 1] = '\0'; /* In case snprintf overrun */
@@ -45,58 +95,128 @@ static void make_service_name(char *buf, size_t buf_len) {
   mgos_expand_mac_address_placeholders(buf);
 }
 
-static struct mg_dns_resource_record make_dns_rr(int type, uint16_t rclass) {
-  struct mg_dns_resource_record rr = {
-      .name = mg_mk_str(""),
-      .rtype = type,
-      .rclass = rclass,
-      .ttl = get_cfg()->dns_sd.ttl,
-      .kind = MG_DNS_ANSWER,
-  };
-  return rr;
+static void dns_sd_invalidate(void) {
+  int i;
+  for (i = 0; i < DNS_SD_NUM_CACHED_REPLIES; i++) {
+    mbuf_free(&s_dns_sd.replies[i].pkt);
+    s_dns_sd.replies[i].mask = 0;
+  }
+  s_dns_sd.valid = false;
+}
+
+static bool dns_sd_str_eq(const char *a, const char *b) {
+  return (a == NULL || b == NULL ? a == b : strcmp(a, b) == 0);
+}
+
+static void dns_sd_str_set(char **dst, const char *src) {
+  free(*dst);
+  *dst = (src != NULL ? strdup(src) : NULL);
 }
 
-static void add_srv_record(const char *host_name, const char *service_name,
-                           struct mg_dns_reply *reply, struct mbuf *rdata) {
-  /* prio 0, weight 0 */
-  char rdata_header[] = {0x0, 0x0, 0x0, 0x0};
+/*
+ * Makes sure the cache matches current settings. This is called on every
+ * query, so it only compares a few values. Config strings are compared by
+ * contents: a changed value can be reallocated at the same address.
+ * IP changes are signalled by the WiFi event handler.
+ */
+static void dns_sd_check_cache(void) {
+  const struct sys_config *c = get_cfg();
   struct mg_connection *lc = mgos_get_sys_http_server();
-  uint16_t port = lc == NULL ? 80 : lc->sa.sin.sin_port;
-  struct mg_dns_resource_record rr =
-      make_dns_rr(MG_DNS_SRV_RECORD, RCLASS_IN_FLUSH);
-  rdata->len = 0;
-  mbuf_append(rdata, rdata_header, sizeof(rdata_header));
-  mbuf_append(rdata, &port, sizeof(port));
-  mg_dns_encode_name(rdata, host_name, strlen(host_name));
-  mg_dns_reply_record(reply, &rr, service_name, MG_DNS_SRV_RECORD,
-                      get_cfg()->dns_sd.ttl, rdata->buf, rdata->len);
+  uint16_t port = (lc == NULL ? htons(80) : lc->sa.sin.sin_port);
+#if MGOS_ENABLE_RPC
+  int rpc_enable = c->rpc.enable;
+#else
+  int rpc_enable = -1;
+#endif
+  if (s_dns_sd.valid && s_dns_sd.ttl == c->dns_sd.ttl &&
+      s_dns_sd.rpc_enable == rpc_enable && s_dns_sd.port == port &&
+      dns_sd_str_eq(s_dns_sd.host_name_cfg, c->dns_sd.host_name) &&
+      dns_sd_str_eq(s_dns_sd.txt_cfg, c->dns_sd.txt) &&
+      dns_sd_str_eq(s_dns_sd.device_id, c->device.id)) {
+    return;
+  }
+  dns_sd_invalidate();
+  dns_sd_str_set(&s_dns_sd.host_name_cfg, c->dns_sd.host_name);
+  dns_sd_str_set(&s_dns_sd.txt_cfg, c->dns_sd.txt);
+  dns_sd_str_set(&s_dns_sd.device_id, c->device.id);
+  s_dns_sd.ttl = c->dns_sd.ttl;
+  s_dns_sd.rpc_enable = rpc_enable;
+  s_dns_sd.port = port;
+  make_host_name(s_dns_sd.host_name, sizeof(s_dns_sd.host_name));
+  make_service_name(s_dns_sd.service_name, sizeof(s_dns_sd.service_name));
+  {
+    char *ip = mgos_wifi_get_sta_ip();
+    if (ip == NULL) ip = mgos_wifi_get_ap_ip();
+    s_dns_sd.ip = (ip != NULL ? inet_addr(ip) : 0);
+    free(ip);
+  }
+  s_dns_sd.valid = true;
 }
 
-// This record contains negative answer for the IPv6 AAAA question
-static void add_nsec_record(const char *name, struct mg_dns_reply *reply,
-                            struct mbuf *rdata) {
-  struct mg_dns_resource_record rr =
-      make_dns_rr(MG_DNS_NSEC_RECORD, RCLASS_IN_FLUSH);
-  rdata->len = 0;
-  mg_dns_encode_name(rdata, name, strlen(name));
-  mbuf_append(rdata, "\x00\x01\x40", 3); /* Only A record is present */
-  mg_dns_encode_record(reply->io, &rr, name, strlen(name), rdata->buf,
-                       rdata->len);
-  reply->msg->num_answers++;
+static void put_u16(struct mbuf *m, uint16_t v) {
+  v = htons(v);
+  mbuf_append(m, &v, sizeof(v));
 }
 
-static void add_a_record(const char *name, struct mg_dns_reply *reply) {
-  char *ip = mgos_wifi_get_sta_ip();
-  if (ip == NULL) ip = mgos_wifi_get_ap_ip();
-  if (ip != NULL) {
-    uint32_t addr = inet_addr(ip);
-    struct mg_dns_resource_record rr =
-        make_dns_rr(MG_DNS_A_RECORD, RCLASS_IN_FLUSH);
-    mg_dns_encode_record(reply->io, &rr, name, strlen(name), &addr,
-                         sizeof(addr));
-    reply->msg->num_answers++;
+static void put_name(struct mbuf *m, struct dns_sd_names *names,
+                     const char *name) {
+  const char *s = name;
+  while (*s != '\0') {
+    const char *dot = strchr(s, '.');
+    size_t len = (dot != NULL ? (size_t)(dot - s) : strlen(s));
+    uint8_t llen = (len > 63 ? 63 : len);
+    int i;
+    for (i = 0; i < names->num; i++) {
+      if (strcasecmp(names->names[i], s) == 0) {
+        put_u16(m, 0xc000 | names->offsets[i]);
+        return;
+      }
+    }
+    if (names->num < DNS_SD_MAX_COMPRESSED_NAMES && m->len < 0x3fff) {
+      names->names[names->num] = s;
+      names->offsets[names->num++] = m->len;
+    }
+    mbuf_append(m, &llen, sizeof(llen));
+    mbuf_append(m, s, llen);
+    s += len;
+    if (*s == '.') s++;
   }
-  free(ip);
+  mbuf_append(m, "", 1);
+}
+
+/* Writes record header, returns offset of the rdata length to fill later. */
+static size_t put_rr_header(struct mbuf *m, struct dns_sd_names *names,
+                            const char *name, uint16_t type, uint16_t rclass) {
+  uint32_t ttl = htonl(s_dns_sd.ttl);
+  put_name(m, names, name);
+  put_u16(m, type);
+  put_u16(m, rclass);
+  mbuf_append(m, &ttl, sizeof(ttl));
+  put_u16(m, 0);
+  return m->len - 2;
+}
+
+static void end_rr(struct mbuf *m, size_t rdlen_off) {
+  uint16_t len = htons(m->len - rdlen_off - 2);
+  memcpy(m->buf + rdlen_off, &len, sizeof(len));
+}
+
+static void put_ptr_record(struct mbuf *m, struct dns_sd_names *names,
+                           const char *name, const char *domain) {
+  size_t off = put_rr_header(m, names, name, MG_DNS_PTR_RECORD,
+                             RCLASS_IN_NOFLUSH);
+  put_name(m, names, domain);
+  end_rr(m, off);
+}
+
+static void put_srv_record(struct mbuf *m, struct dns_sd_names *names) {
+  size_t off = put_rr_header(m, names, s_dns_sd.service_name,
+                             MG_DNS_SRV_RECORD, RCLASS_IN_FLUSH);
+  put_u16(m, 0); /* Priority */
+  put_u16(m, 0); /* Weight */
+  mbuf_append(m, &s_dns_sd.port, sizeof(s_dns_sd.port));
+  put_name(m, names, s_dns_sd.host_name);
+  end_rr(m, off);
 }
 
 static void append_label(struct mbuf *m, struct mg_str key, struct mg_str val) {
@@ -107,56 +227,151 @@ static void append_label(struct mbuf *m, struct mg_str key, struct mg_str val) {
   mbuf_append(m, buf, len);
 }
 
-static void add_txt_record(const char *name, struct mg_dns_reply *reply,
-                           struct mbuf *rdata) {
+static void put_txt_record(struct mbuf *m, struct dns_sd_names *names) {
   const struct sys_ro_vars *v = get_ro_vars();
   const struct sys_config *c = get_cfg();
-  struct mg_dns_resource_record rr =
-      make_dns_rr(MG_DNS_TXT_RECORD, RCLASS_IN_FLUSH);
-  rdata->len = 0;
-  append_label(rdata, mg_mk_str("id"), mg_mk_str(c->device.id));
-  append_label(rdata, mg_mk_str("fw_id"), mg_mk_str(v->fw_id));
-  append_label(rdata, mg_mk_str("arch"), mg_mk_str(v->arch));
+  size_t off = put_rr_header(m, names, s_dns_sd.service_name,
+                             MG_DNS_TXT_RECORD, RCLASS_IN_FLUSH);
+  append_label(m, mg_mk_str("id"), mg_mk_str(c->device.id));
+  append_label(m, mg_mk_str("fw_id"), mg_mk_str(v->fw_id));
+  append_label(m, mg_mk_str("arch"), mg_mk_str(v->arch));
 #if MGOS_ENABLE_RPC
-  append_label(rdata, mg_mk_str("rpc"),
+  append_label(m, mg_mk_str("rpc"),
                c->rpc.enable ? mg_mk_str("enabled") : mg_mk_str("disabled"));
 #else
-  append_label(rdata, mg_mk_str("rpc"), mg_mk_str("n/a"));
+  append_label(m, mg_mk_str("rpc"), mg_mk_str("n/a"));
 #endif
 
   /* Append extra labels from config */
   const char *p = c->dns_sd.txt;
   struct mg_str key, val;
   while ((p = mg_next_comma_list_entry(p, &key, &val)) != NULL) {
-    append_label(rdata, key, val);
+    append_label(m, key, val);
+  }
+  end_rr(m, off);
+}
+
+static void put_a_record(struct mbuf *m, struct dns_sd_names *names) {
+  size_t off = put_rr_header(m, names, s_dns_sd.host_name, MG_DNS_A_RECORD,
+                             RCLASS_IN_FLUSH);
+  mbuf_append(m, &s_dns_sd.ip, sizeof(s_dns_sd.ip));
+  end_rr(m, off);
+}
+
+// This record contains negative answer for the IPv6 AAAA question
+static void put_nsec_record(struct mbuf *m, struct dns_sd_names *names) {
+  size_t off = put_rr_header(m, names, s_dns_sd.host_name, MG_DNS_NSEC_RECORD,
+                             RCLASS_IN_FLUSH);
+  put_name(m, names, s_dns_sd.host_name);
+  mbuf_append(m, "\x00\x01\x40", 3); /* Only A record is present */
+  end_rr(m, off);
+}
+
+static void build_reply(int mask, struct mbuf *m) {
+  struct dns_sd_names names;
+  uint16_t num_answers = 0;
+  names.num = 0;
+  mbuf_init(m, 256);
+  put_u16(m, 0);      /* Transaction id */
+  put_u16(m, 0x8400); /* Authoritative answer */
+  put_u16(m, 0);      /* Questions */
+  put_u16(m, 0);      /* Answers, filled in below */
+  put_u16(m, 0);      /* Authority */
+  put_u16(m, 0);      /* Additional */
+  if (mask & DNS_SD_RR_TYPE_PTR) {
+    put_ptr_record(m, &names, SD_TYPE_ENUM_NAME, MGOS_DNS_SD_HTTP_TYPE_FULL);
+    num_answers++;
+  }
+  if (mask & DNS_SD_RR_SVC_PTR) {
+    put_ptr_record(m, &names, MGOS_DNS_SD_HTTP_TYPE_FULL,
+                   s_dns_sd.service_name);
+    num_answers++;
+  }
+  if (mask & DNS_SD_RR_SRV) {
+    put_srv_record(m, &names);
+    num_answers++;
+  }
+  if (mask & DNS_SD_RR_TXT) {
+    put_txt_record(m, &names);
+    num_answers++;
+  }
+  if ((mask & DNS_SD_RR_A) && s_dns_sd.ip != 0) {
+    put_a_record(m, &names);
+    num_answers++;
   }
+  if (mask & DNS_SD_RR_NSEC) {
+    put_nsec_record(m, &names);
+    num_answers++;
+  }
+  num_answers = htons(num_answers);
+  memcpy(m->buf + 6, &num_answers, sizeof(num_answers));
+  mbuf_trim(m);
+}
+
+static const struct mbuf *get_reply(int mask) {
+  struct dns_sd_cached_reply *r;
+  int i;
+  for (i = 0; i < DNS_SD_NUM_CACHED_REPLIES; i++) {
+    if (s_dns_sd.replies[i].mask == mask) return &s_dns_sd.replies[i].pkt;
+  }
+  r = &s_dns_sd.replies[s_dns_sd.next_evict];
+  s_dns_sd.next_evict = (s_dns_sd.next_evict + 1) % DNS_SD_NUM_CACHED_REPLIES;
+  mbuf_free(&r->pkt);
+  build_reply(mask, &r->pkt);
+  r->mask = mask;
+  LOG(LL_DEBUG, ("built reply 0x%x, size %d", mask, (int) r->pkt.len));
+  return &r->pkt;
+}
 
-  mg_dns_encode_record(reply->io, &rr, name, strlen(name), rdata->buf,
-                       rdata->len);
-  reply->msg->num_answers++;
+static void send_reply(struct mg_connection *nc, int mask, uint16_t id) {
+  const struct mbuf *pkt = get_reply(mask);
+  if (id == 0) {
+    mg_send(nc, pkt->buf, pkt->len);
+  } else {
+    /* Unicast replies carry the query's id */
+    char *buf = (char *) malloc(pkt->len);
+    if (buf == NULL) return;
+    memcpy(buf, pkt->buf, pkt->len);
+    id = htons(id);
+    memcpy(buf, &id, sizeof(id));
+    mg_send(nc, buf, pkt->len);
+    free(buf);
+  }
 }
 
-static void add_ptr_record(const char *name, const char *domain,
-                           struct mg_dns_reply *reply, struct mbuf *rdata) {
-  struct mg_dns_resource_record rr =
-      make_dns_rr(MG_DNS_PTR_RECORD, RCLASS_IN_NOFLUSH);
-  rdata->len = 0;
-  mg_dns_encode_name(rdata, domain, strlen(domain));
-  mg_dns_encode_record(reply->io, &rr, name, strlen(name), rdata->buf,
-                       rdata->len);
-  reply->msg->num_answers++;
+/* Returns the set of records that answer the question. */
+static int answer_mask(const char *name, int rtype) {
+  switch (rtype) {
+    case MG_DNS_PTR_RECORD:
+      if (strcasecmp(name, SD_TYPE_ENUM_NAME) == 0 ||
+          strcasecmp(name, MGOS_DNS_SD_HTTP_TYPE_FULL) == 0) {
+        return DNS_SD_RR_ALL;
+      }
+      if (strcasecmp(name, s_dns_sd.service_name) == 0) {
+        return DNS_SD_RR_SVC_PTR | DNS_SD_RR_A | DNS_SD_RR_NSEC;
+      }
+      break;
+    case MG_DNS_SRV_RECORD:
+      if (strcasecmp(name, s_dns_sd.service_name) == 0) return DNS_SD_RR_SRV;
+      break;
+    case MG_DNS_TXT_RECORD:
+      if (strcasecmp(name, s_dns_sd.service_name) == 0) return DNS_SD_RR_TXT;
+      break;
+    case MG_DNS_A_RECORD:
+    case MG_DNS_AAAA_RECORD:
+      if (strcasecmp(name, s_dns_sd.host_name) == 0) {
+        return DNS_SD_RR_A | DNS_SD_RR_NSEC;
+      }
+      break;
+  }
+  return 0;
 }
 
-static void advertise_type(struct mg_dns_reply *reply, struct mbuf *rdata) {
-  char host_name[128], service_name[128];
-  make_service_name(service_name, sizeof(service_name));
-  make_host_name(host_name, sizeof(host_name));
-  add_ptr_record(SD_TYPE_ENUM_NAME, MGOS_DNS_SD_HTTP_TYPE, reply, rdata);
-  add_ptr_record(MGOS_DNS_SD_HTTP_TYPE_FULL, service_name, reply, rdata);
-  add_srv_record(host_name, service_name, reply, rdata);
-  add_txt_record(service_name, reply, rdata);
-  add_a_record(host_name, reply);
-  add_nsec_record(host_name, reply, rdata);
+static bool question_filter(const char *name, int rtype, void *ud) {
+  if (!get_cfg()->dns_sd.enable) return false;
+  dns_sd_check_cache();
+  (void) ud;
+  return (answer_mask(name, rtype) != 0);
 }
 
 static void handler(struct mg_connection *nc, int ev, void *ev_data,
@@ -165,32 +380,20 @@ static void handler(struct mg_connection *nc, int ev, void *ev_data,
 
   switch (ev) {
     case MG_DNS_MESSAGE: {
-      int i;
+      int i, mask = 0;
       struct mg_dns_message *msg = (struct mg_dns_message *) ev_data;
-      struct mg_dns_reply reply;
-      struct mbuf rdata;
-      struct mbuf reply_mbuf;
       /* the reply goes either to the sender or to a multicast dest */
       struct mg_connection *reply_conn = nc;
-      char host[128], srv[128];
       char *peer = inet_ntoa(nc->sa.sin.sin_addr);
 
       LOG(LL_DEBUG, ("---- DNS packet from %s (%d questions, %d answers)", peer,
                      msg->num_questions, msg->num_answers));
-      make_host_name(host, sizeof(host));
-      make_service_name(srv, sizeof(srv));
-
-      mbuf_init(&rdata, 0);
-      mbuf_init(&reply_mbuf, 512);
-      int tmp = msg->num_questions;
-      msg->num_questions = 0;
-      reply = mg_dns_create_reply(&reply_mbuf, msg);
-      msg->num_questions = tmp;
-      int question_a_answered = 0; /* MG_DNS_A_RECORD answer is sent */
+      dns_sd_check_cache();
 
       for (i = 0; i < msg->num_questions; i++) {
         char name[256];
         struct mg_dns_resource_record *rr = &msg->questions[i];
+        int rr_mask;
         mg_dns_uncompress_name(msg, &rr->name, name, sizeof(name) - 1);
         int is_unicast = (rr->rclass & MGOS_MDNS_QUERY_UNICAST);
 
@@ -198,6 +401,13 @@ static void handler(struct mg_connection *nc, int ev, void *ev_data,
                        rr->rtype, name, (is_unicast ? "QU" : "QM"), peer,
                        (rr->rclass & MGOS_MDNS_QUERY_UNICAST)));
 
+        rr_mask = answer_mask(name, rr->rtype);
+        if (rr_mask == 0) {
+          LOG(LL_DEBUG, (" --- ignoring: name=%s, type=%d", name, rr->rtype));
+          continue;
+        }
+        mask |= rr_mask;
+
         /*
          * If there is at least one question that requires a multicast answer
          * the whole reply goes to a multicast destination
@@ -206,52 +416,17 @@ static void handler(struct mg_connection *nc, int ev, void *ev_data,
           /* our listener connection has the mcast address in its nc->sa */
           reply_conn = nc->listener;
         }
-
-        /*
-         * MSB in rclass is used to mean QU/QM in queries and cache flush in
-         * reply. Set cache flush bit by default; enumeration replies will
-         * remove it as needed.
-         */
-        rr->rclass |= MGOS_MDNS_CACHE_FLUSH;
-
-        if (rr->rtype == MG_DNS_PTR_RECORD &&
-            (strcmp(name, SD_TYPE_ENUM_NAME) == 0 ||
-             strcmp(name, MGOS_DNS_SD_HTTP_TYPE_FULL) == 0)) {
-          advertise_type(&reply, &rdata);
-        } else if (rr->rtype == MG_DNS_PTR_RECORD && strcmp(name, srv) == 0) {
-          add_ptr_record(MGOS_DNS_SD_HTTP_TYPE_FULL, name, &reply, &rdata);
-          if (!question_a_answered) {
-            add_a_record(host, &reply);
-            add_nsec_record(host, &reply, &rdata);
-            question_a_answered++;
-          }
-        } else if (rr->rtype == MG_DNS_SRV_RECORD && strcmp(name, srv) == 0) {
-          add_srv_record(host, srv, &reply, &rdata);
-        } else if (rr->rtype == MG_DNS_TXT_RECORD && strcmp(name, srv) == 0) {
-          add_txt_record(name, &reply, &rdata);
-        } else if (!question_a_answered && (rr->rtype == MG_DNS_A_RECORD ||
-                                            rr->rtype == MG_DNS_AAAA_RECORD) &&
-                   strcmp(host, name) == 0) {
-          add_a_record(host, &reply);
-          add_nsec_record(host, &reply, &rdata);
-          question_a_answered++;
-        } else {
-          LOG(LL_DEBUG, (" --- ignoring: name=%s, type=%d", name, rr->rtype));
-        }
       }
 
-      if (msg->num_answers > 0) {
-        LOG(LL_DEBUG, ("sending reply as %s, size %d",
-                       (reply_conn == nc ? "unicast" : "multicast"),
-                       (int) reply.io->len));
-        msg->num_questions = 0;
-        msg->flags = 0x8400; /* Authoritative answer */
-        mg_dns_send_reply(reply_conn, &reply);
+      if (mask != 0) {
+        LOG(LL_DEBUG, ("sending reply 0x%x as %s", mask,
+                       (reply_conn == nc ? "unicast" : "multicast")));
+        /* Multicast responses must have zero id (RFC 6762, 18.1) */
+        send_reply(reply_conn, mask,
+                   (reply_conn == nc ? msg->transaction_id : 0));
       } else {
         LOG(LL_DEBUG, ("not sending reply, closing"));
       }
-      mbuf_free(&rdata);
-      mbuf_free(&reply_mbuf);
       break;
     }
   }
@@ -260,22 +435,9 @@ static void handler(struct mg_connection *nc, int ev, void *ev_data,
 }
 
 static void dns_sd_advertise(struct mg_connection *c) {
-  struct mbuf mbuf1, mbuf2;
-  struct mg_dns_message msg;
-  struct mg_dns_reply reply;
   LOG(LL_DEBUG, ("advertising types"));
-  mbuf_init(&mbuf1, 0);
-  mbuf_init(&mbuf2, 0);
-  memset(&msg, 0, sizeof(msg));
-  msg.flags = 0x8400;
-  reply = mg_dns_create_reply(&mbuf1, &msg);
-  advertise_type(&reply, &mbuf2);
-  if (msg.num_answers > 0) {
-    LOG(LL_DEBUG, ("sending adv as M, size %d", (int) reply.io->len));
-    mg_dns_send_reply(c, &reply);
-  }
-  mbuf_free(&mbuf1);
-  mbuf_free(&mbuf2);
+  dns_sd_check_cache();
+  send_reply(c, DNS_SD_RR_ALL, 0);
 }
 
 static void dns_sd_timer_cb(void *arg) {
@@ -289,6 +451,8 @@ static void dns_sd_timer_cb(void *arg) {
 static void dns_sd_wifi_ev_handler(enum mgos_wifi_status event, void *data) {
   struct mg_connection *c = mgos_mdns_get_listener();
   LOG(LL_DEBUG, ("ev %d, data %p, mdns_listener %p", event, data, c));
+  /* IP address may have changed */
+  dns_sd_invalidate();
   if (event == MGOS_WIFI_IP_ACQUIRED && c != NULL) {
     dns_sd_advertise(c);
     mgos_set_timer(1000, 0, dns_sd_timer_cb, 0); /* By RFC, repeat */
@@ -309,7 +473,7 @@ enum mgos_init_result mgos_dns_sd_init(void) {
     LOG(LL_ERROR, ("MDNS wants HTTP enabled"));
     return MGOS_INIT_MDNS_FAILED;
   }
-  mgos_mdns_add_handler(handler, NULL);
+  mgos_mdns_add_question_handler(handler, question_filter, NULL);
   mgos_wifi_add_on_change_cb(dns_sd_wifi_ev_handler, NULL);
   mgos_set_timer(c->dns_sd.ttl * 1000 / 2 + 1, 1, dns_sd_timer_cb, 0);
   LOG(LL_INFO, ("MDNS initialized, host %s, ttl %d", c->dns_sd.host_name,
@@ -110,6 +110,10 @@
 #define MGOS_ENABLE_HTTP_SERVER 1
 #endif
 
+#ifndef MGOS_ENABLE_CONFIG_SNAPSHOT
+#define MGOS_ENABLE_CONFIG_SNAPSHOT 1
+#endif
+
 #ifndef MGOS_ENABLE_TUNNEL
 #define MGOS_ENABLE_TUNNEL 0
 #endif
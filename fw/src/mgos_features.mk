@@ -6,6 +6,7 @@ MGOS_ENABLE_BITBANG ?= 1
 MGOS_ENABLE_CONSOLE ?= 0
 MGOS_ENABLE_CONSOLE_FILE_BUFFER ?= 0
 MGOS_ENABLE_CONFIG_SERVICE ?= 1
+MGOS_ENABLE_CONFIG_SNAPSHOT ?= 1
 MGOS_ENABLE_DEBUG_UDP ?= 1
 MGOS_ENABLE_DNS_SD ?= 1
 MGOS_ENABLE_FILE_UPLOAD ?= 0
@@ -22,6 +23,7 @@ MGOS_ENABLE_RPC_CHANNEL_LOOPBACK ?= 1
 MGOS_ENABLE_RPC_CHANNEL_MQTT ?= 1
 MGOS_ENABLE_RPC_CHANNEL_UART ?= 1
 MGOS_ENABLE_RPC_CHANNEL_WS ?= 1
+MGOS_ENABLE_RPC_UBJSON ?= 1
 MGOS_ENABLE_SNTP ?= 1
 MGOS_ENABLE_SYS_SERVICE ?= 1
 MGOS_ENABLE_UPDATER ?= 1
@@ -154,6 +156,10 @@ ifeq "$(MGOS_ENABLE_RPC_CHANNEL_WS)" "1"
 else
   MGOS_FEATURES += -DMGOS_ENABLE_RPC_CHANNEL_WS=0
 endif
+ifeq "$(MGOS_ENABLE_RPC_UBJSON)" "1"
+  MGOS_SRCS += ubjson.c
+  MGOS_FEATURES += -DCS_ENABLE_UBJSON=1
+endif
 
 endif # MGOS_ENABLE_RPC
 
@@ -216,6 +222,12 @@ else
   MGOS_FEATURES += -DMGOS_ENABLE_HTTP_SERVER=1
 endif
 
+ifeq "$(MGOS_ENABLE_CONFIG_SNAPSHOT)" "0"
+  MGOS_FEATURES += -DMGOS_ENABLE_CONFIG_SNAPSHOT=0
+else
+  MGOS_FEATURES += -DMGOS_ENABLE_CONFIG_SNAPSHOT=1
+endif
+
 ifeq "$(MGOS_ENABLE_WEB_CONFIG)" "1"
   MGOS_FEATURES += -DMGOS_ENABLE_WEB_CONFIG=1
 endif
@@ -236,6 +248,7 @@ export MGOS_ENABLE_ATCA_SERVICE
 export MGOS_ENABLE_AWS_SHADOW
 export MGOS_ENABLE_BITBANG
 export MGOS_ENABLE_CONFIG_SERVICE
+export MGOS_ENABLE_CONFIG_SNAPSHOT
 export MGOS_ENABLE_CONSOLE
 export MGOS_ENABLE_DEBUG_UDP
 export MGOS_ENABLE_DNS_SD
@@ -249,6 +262,7 @@ export MGOS_ENABLE_RPC_CHANNEL_HTTP
 export MGOS_ENABLE_RPC_CHANNEL_LOOPBACK
 export MGOS_ENABLE_RPC_CHANNEL_MQTT
 export MGOS_ENABLE_RPC_CHANNEL_UART
+export MGOS_ENABLE_RPC_UBJSON
 export MGOS_ENABLE_SNTP
 export MGOS_ENABLE_SYS_SERVICE
 export MGOS_ENABLE_UPDATER
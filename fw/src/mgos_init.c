@@ -51,6 +51,8 @@ enum mgos_init_result mgos_init(void) {
   r = mgos_sys_config_init_platform(get_cfg());
   if (r != MGOS_INIT_OK) return r;
 
+  mgos_tls_session_cache_init();
+
 #if MGOS_ENABLE_MDNS
   r = mgos_mdns_init(); /* Before dns_sd init, after
                            mgos_sys_config_init_platform */
@@ -6,6 +6,7 @@
 #include "fw/src/mgos_mdns.h"
 
 #include <stdlib.h>
+#include <string.h>
 
 #include "common/platform.h"
 #include "common/cs_dbg.h"
@@ -21,10 +22,17 @@
 #define MDNS_MCAST_GROUP "224.0.0.251"
 #define MDNS_PORT 5353
 
+/* Flags field of the DNS header: response bit */
+#define MDNS_FLAG_QR 0x8000
+#define MDNS_HEADER_SIZE 12
+#define MDNS_MAX_POINTERS 16
+
 struct mdns_handler {
   SLIST_ENTRY(mdns_handler) entries;
   mg_event_handler_t handler;
+  mgos_mdns_question_filter_t filter;
   void *ud;
+  bool wanted; /* Whether the current packet is of interest */
 };
 
 static struct mg_connection *s_listening_mdns_conn;
@@ -35,14 +43,21 @@ struct mg_connection *mgos_mdns_get_listener(void) {
   return s_listening_mdns_conn;
 }
 
-void mgos_mdns_add_handler(mg_event_handler_t handler, void *ud) {
+void mgos_mdns_add_question_handler(mg_event_handler_t handler,
+                                    mgos_mdns_question_filter_t filter,
+                                    void *ud) {
   struct mdns_handler *e = calloc(1, sizeof(*e));
   if (e == NULL) return;
   e->handler = handler;
+  e->filter = filter;
   e->ud = ud;
   SLIST_INSERT_HEAD(&s_mdns_handlers, e, entries);
 }
 
+void mgos_mdns_add_handler(mg_event_handler_t handler, void *ud) {
+  mgos_mdns_add_question_handler(handler, NULL, ud);
+}
+
 void mgos_mdns_remove_handler(mg_event_handler_t handler, void *ud) {
   struct mdns_handler *e;
   SLIST_FOREACH(e, &s_mdns_handlers, entries) {
@@ -53,14 +68,104 @@ void mgos_mdns_remove_handler(mg_event_handler_t handler, void *ud) {
   }
 }
 
+static uint16_t mdns_get_u16(const char *p) {
+  return ((uint16_t)(uint8_t) p[0] << 8) | (uint8_t) p[1];
+}
+
+/*
+ * Decodes the name at `*pos` into a dotted string, following compression
+ * pointers, and advances `*pos` past it. Returns false if the name is
+ * malformed or does not fit.
+ */
+static bool mdns_get_name(struct mg_str pkt, size_t *pos, char *dst,
+                          size_t dst_len) {
+  size_t p = *pos, n = 0;
+  int hops = 0;
+  bool jumped = false;
+  while (p < pkt.len) {
+    uint8_t len = (uint8_t) pkt.p[p];
+    if (len == 0) {
+      if (!jumped) *pos = p + 1;
+      if (n > 0) n--; /* Trailing dot */
+      dst[n] = '\0';
+      return true;
+    } else if ((len & 0xc0) == 0xc0) {
+      if (p + 1 >= pkt.len || ++hops > MDNS_MAX_POINTERS) return false;
+      if (!jumped) *pos = p + 2;
+      jumped = true;
+      p = mdns_get_u16(pkt.p + p) & 0x3fff;
+    } else if ((len & 0xc0) != 0 || p + 1 + len > pkt.len ||
+               n + len + 1 >= dst_len) {
+      return false;
+    } else {
+      memcpy(dst + n, pkt.p + p + 1, len);
+      n += len;
+      dst[n++] = '.';
+      p += 1 + len;
+    }
+  }
+  return false;
+}
+
+/*
+ * Runs question filters over the raw packet and marks the handlers that want
+ * it. Returns true if the packet needs to be parsed.
+ */
+static bool mdns_prefilter(struct mg_str pkt) {
+  struct mdns_handler *e;
+  bool any_filter = false, want = false;
+  int i, num_questions;
+  size_t pos = MDNS_HEADER_SIZE;
+  SLIST_FOREACH(e, &s_mdns_handlers, entries) {
+    e->wanted = (e->filter == NULL);
+    if (e->filter == NULL) {
+      want = true;
+    } else {
+      any_filter = true;
+    }
+  }
+  if (!any_filter || pkt.len < MDNS_HEADER_SIZE) return want;
+  if (mdns_get_u16(pkt.p + 2) & MDNS_FLAG_QR) return want;
+  num_questions = mdns_get_u16(pkt.p + 4);
+  for (i = 0; i < num_questions; i++) {
+    char name[256];
+    int rtype;
+    if (!mdns_get_name(pkt, &pos, name, sizeof(name)) || pos + 4 > pkt.len) {
+      break;
+    }
+    rtype = mdns_get_u16(pkt.p + pos);
+    pos += 4; /* Type and class */
+    SLIST_FOREACH(e, &s_mdns_handlers, entries) {
+      if (!e->wanted && e->filter != NULL && e->filter(name, rtype, e->ud)) {
+        e->wanted = want = true;
+      }
+    }
+  }
+  return want;
+}
+
+/*
+ * mDNS traffic is mostly irrelevant to us, so instead of letting the DNS
+ * protocol handler parse every packet, look at the questions first.
+ */
 static void handler(struct mg_connection *nc, int ev, void *ev_data,
                     void *user_data) {
   struct mdns_handler *e;
-  (void) ev_data;
   (void) user_data;
   SLIST_FOREACH(e, &s_mdns_handlers, entries) {
     e->handler(nc, ev, ev_data, e->ud);
   }
+  if (ev == MG_EV_RECV) {
+    struct mbuf *io = &nc->recv_mbuf;
+    struct mg_dns_message msg;
+    if (mdns_prefilter(mg_mk_str_n(io->buf, io->len)) &&
+        mg_parse_dns(io->buf, io->len, &msg) == 0) {
+      SLIST_FOREACH(e, &s_mdns_handlers, entries) {
+        if (e->wanted) e->handler(nc, MG_DNS_MESSAGE, &msg, e->ud);
+      }
+    }
+    mbuf_remove(io, io->len);
+  }
 }
 
 enum mgos_init_result mgos_mdns_init(void) {
@@ -78,8 +183,6 @@ enum mgos_init_result mgos_mdns_init(void) {
     return MGOS_INIT_MDNS_FAILED;
   }
 
-  mg_set_protocol_dns(s_listening_mdns_conn);
-
   /*
    * we had to bind on 0.0.0.0, but now we can store our mdns dest here
    * so we don't need to create a new connection in order to send outbound
@@ -6,6 +6,8 @@
 #ifndef CS_FW_SRC_MGOS_MDNS_H_
 #define CS_FW_SRC_MGOS_MDNS_H_
 
+#include <stdbool.h>
+
 #include "fw/src/mgos_init.h"
 #include "fw/src/mgos_mongoose.h"
 
@@ -20,6 +22,24 @@ enum mgos_init_result mgos_mdns_init(void);
 /* registers a mongoose handler to be invoked on the mDNS socket */
 void mgos_mdns_add_handler(mg_event_handler_t handler, void *ud);
 
+/*
+ * Question filter: returns true if the handler wants to see a query that
+ * contains a question for `name` (dotted, without the trailing dot) of type
+ * `rtype`.
+ */
+typedef bool (*mgos_mdns_question_filter_t)(const char *name, int rtype,
+                                            void *ud);
+
+/*
+ * Like mgos_mdns_add_handler, but the handler is only invoked with
+ * MG_DNS_MESSAGE for queries for which the filter returns true.
+ * Questions are examined directly in the received packet, so irrelevant
+ * traffic is dropped without being parsed. Responses are not delivered.
+ */
+void mgos_mdns_add_question_handler(mg_event_handler_t handler,
+                                    mgos_mdns_question_filter_t filter,
+                                    void *ud);
+
 /* unregisters a mongoose handler */
 void mgos_mdns_remove_handler(mg_event_handler_t handler, void *ud);
 
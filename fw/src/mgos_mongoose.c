@@ -5,11 +5,15 @@
 
 #include "fw/src/mgos_mongoose.h"
 
+#include <stdio.h>
+
 #include "common/cs_dbg.h"
+#include "common/cs_file.h"
 #include "common/queue.h"
 
 #include "fw/src/mgos_hal.h"
 #include "fw/src/mgos_sys_config.h"
+#include "fw/src/mgos_timers.h"
 #include "fw/src/mgos_utils.h"
 #include "fw/src/mgos_wifi.h"
 
@@ -94,6 +98,56 @@ void mgos_set_enable_min_heap_free_reporting(bool enable) {
   s_min_free_heap_size = (enable ? mgos_get_min_free_heap_size() : 0);
 }
 
+#if MG_ENABLE_SSL && MG_SSL_IF_SESSION_CACHE_SIZE > 0 && \
+    (MG_SSL_IF == MG_SSL_IF_OPENSSL || MG_SSL_IF == MG_SSL_IF_MBEDTLS)
+static unsigned int s_tls_sessions_gen;
+
+static void tls_session_cache_save_cb(void *arg) {
+  const char *fname = get_cfg()->sys.tls_session_cache_file;
+  unsigned int gen = mg_ssl_if_session_cache_generation();
+  struct mbuf data;
+  FILE *fp;
+  if (gen == s_tls_sessions_gen || fname == NULL) return;
+  mbuf_init(&data, 0);
+  mg_ssl_if_session_cache_export(&data);
+  /* Write to a temp file first, a failed write must not clobber the old one. */
+  fp = fopen("tmp", "w");
+  if (fp != NULL) {
+    bool ok = (fwrite(data.buf, 1, data.len, fp) == data.len);
+    if (fclose(fp) != 0) ok = false;
+    /* SPIFFS does not rename over an existing file. */
+    if (ok) remove(fname);
+    if (ok && rename("tmp", fname) == 0) {
+      s_tls_sessions_gen = gen;
+      LOG(LL_DEBUG, ("Saved TLS sessions to %s (%d)", fname, (int) data.len));
+    } else {
+      remove("tmp");
+    }
+  }
+  mbuf_free(&data);
+  (void) arg;
+}
+
+void mgos_tls_session_cache_init(void) {
+  const char *fname = get_cfg()->sys.tls_session_cache_file;
+  size_t size;
+  char *data;
+  if (fname == NULL || fname[0] == '\0') return;
+  data = cs_read_file(fname, &size);
+  if (data != NULL) {
+    int n = mg_ssl_if_session_cache_import(data, size);
+    LOG(LL_INFO, ("Loaded %d TLS sessions from %s", n, fname));
+    free(data);
+  }
+  s_tls_sessions_gen = mg_ssl_if_session_cache_generation();
+  /* Flash is precious, write no more often than once in 10 seconds. */
+  mgos_set_timer(10000, true /* repeat */, tls_session_cache_save_cb, NULL);
+}
+#else
+void mgos_tls_session_cache_init(void) {
+}
+#endif
+
 static void oplya(struct mg_connection *c, int ev, void *ev_data,
                   void *user_data) {
   mg_event_handler_t f = (mg_event_handler_t) c->priv_1.f;
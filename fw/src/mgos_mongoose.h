@@ -36,6 +36,16 @@ void mgos_wdt_set_feed_on_poll(bool enable);
 
 void mgos_set_enable_min_heap_free_reporting(bool enable);
 
+/*
+ * Load saved TLS client sessions from sys.tls_session_cache_file and keep
+ * the file up to date as new sessions are established.
+ *
+ * Note: the file holds session master secrets in plaintext. Anyone who can
+ * read it can decrypt recorded traffic of those sessions and resume them
+ * until they expire, so only enable it where the filesystem is trusted.
+ */
+void mgos_tls_session_cache_init(void);
+
 char *mgos_get_nameserver(void);
 
 /* HAL */
@@ -25,6 +25,7 @@ struct topic_handler {
   mg_event_handler_t handler;
   void *user_data;
   uint16_t sub_id;
+  bool subscribed; /* SUBACK received, server keeps it in the session */
   SLIST_ENTRY(topic_handler) entries;
 };
 
@@ -37,6 +38,8 @@ struct global_handler {
 static int s_reconnect_timeout_ms = 0;
 static mgos_timer_id s_reconnect_timer_id = MGOS_INVALID_TIMER_ID;
 static struct mg_connection *s_conn = NULL;
+static bool s_connected = false;
+static uint16_t s_sub_id = 0;
 static mgos_mqtt_auth_callback_t s_auth_cb = NULL;
 static void *s_auth_cb_arg = NULL;
 
@@ -45,6 +48,15 @@ SLIST_HEAD(global_handlers, global_handler) s_global_handlers;
 
 static void mqtt_global_reconnect(void);
 
+static void mqtt_subscribe_th(struct mg_connection *nc,
+                              struct topic_handler *th) {
+  struct mg_mqtt_topic_expression te = {.topic = th->topic.p, .qos = 0};
+  if (++s_sub_id == 0) s_sub_id++;
+  th->sub_id = s_sub_id;
+  mg_mqtt_subscribe(nc, &te, 1 /* len */, th->sub_id);
+  LOG(LL_INFO, ("Subscribing to '%s'", te.topic));
+}
+
 static bool call_topic_handler(struct mg_connection *nc, int ev, void *ev_data,
                                void *user_data) {
   struct mg_mqtt_message *msg = (struct mg_mqtt_message *) ev_data;
@@ -96,6 +108,9 @@ static void mgos_mqtt_ev(struct mg_connection *nc, int ev, void *ev_data,
       if (mcfg->clean_session) {
         opts.flags |= MG_MQTT_CLEAN_SESSION;
       }
+      opts.protocol_version = mcfg->protocol_version;
+      opts.session_expiry_interval = mcfg->session_expiry;
+      opts.topic_alias_max = mcfg->topic_alias_max;
       opts.keep_alive = mcfg->keep_alive;
       opts.will_topic = mcfg->will_topic;
       opts.will_message = mcfg->will_message;
@@ -109,6 +124,7 @@ static void mgos_mqtt_ev(struct mg_connection *nc, int ev, void *ev_data,
     case MG_EV_CLOSE: {
       LOG(LL_INFO, ("MQTT Disconnect"));
       s_conn = NULL;
+      s_connected = false;
       call_global_handlers(nc, ev, NULL, user_data);
       mqtt_global_reconnect();
       break;
@@ -132,17 +148,21 @@ static void mgos_mqtt_ev(struct mg_connection *nc, int ev, void *ev_data,
     }
     case MG_EV_MQTT_CONNACK: {
       struct topic_handler *th;
-      uint16_t sub_id = 1;
-      int code = ((struct mg_mqtt_message *) ev_data)->connack_ret_code;
-      LOG((code == 0 ? LL_INFO : LL_ERROR), ("MQTT CONNACK %d", code));
+      struct mg_mqtt_message *msg = (struct mg_mqtt_message *) ev_data;
+      int code = msg->connack_ret_code;
+      LOG((code == 0 ? LL_INFO : LL_ERROR),
+          ("MQTT CONNACK %d, session present: %d", code, msg->session_present));
       if (code == 0) {
         s_reconnect_timeout_ms = 0;
+        s_connected = true;
         call_global_handlers(nc, ev, ev_data, user_data);
+        /*
+         * If the server has resumed our session, it still has subscriptions
+         * that were acknowledged before, no need to send them again.
+         */
         SLIST_FOREACH(th, &s_topic_handlers, entries) {
-          struct mg_mqtt_topic_expression te = {.topic = th->topic.p, .qos = 0};
-          th->sub_id = sub_id++;
-          mg_mqtt_subscribe(nc, &te, 1 /* len */, th->sub_id);
-          LOG(LL_INFO, ("Subscribing to '%s'", te.topic));
+          if (!msg->session_present) th->subscribed = false;
+          if (!th->subscribed) mqtt_subscribe_th(nc, th);
         }
       } else {
         nc->flags |= MG_F_CLOSE_IMMEDIATELY;
@@ -150,7 +170,21 @@ static void mgos_mqtt_ev(struct mg_connection *nc, int ev, void *ev_data,
       break;
     }
     /* Delegate almost all MQTT events to the user's handler */
-    case MG_EV_MQTT_SUBACK:
+    case MG_EV_MQTT_SUBACK: {
+      struct mg_mqtt_message *msg = (struct mg_mqtt_message *) ev_data;
+      struct topic_handler *th;
+      SLIST_FOREACH(th, &s_topic_handlers, entries) {
+        if (th->sub_id != msg->message_id) continue;
+        /* We subscribe to one topic at a time, one return code. */
+        if (msg->payload.len > 0 &&
+            !(msg->payload.p[0] & MG_MQTT_SUBACK_FAILURE)) {
+          th->subscribed = true;
+        } else {
+          LOG(LL_ERROR, ("Subscription to '%s' rejected", th->topic.p));
+        }
+      }
+    }
+    /* fall through */
     case MG_EV_MQTT_PUBLISH:
       if (call_topic_handler(nc, ev, ev_data, user_data)) break;
     /* fall through */
@@ -310,7 +344,10 @@ void mgos_mqtt_sub(const char *topic, sub_handler_t handler, void *user_data) {
   sd->handler = handler;
   sd->user_data = user_data;
   mgos_mqtt_global_subscribe(mg_mk_str(topic), mqttsubtrampoline, sd);
-  if (s_conn != NULL) s_conn->flags |= MG_F_CLOSE_IMMEDIATELY;  // Reconnect
+  /* Subscribe right away if connected, otherwise it'll happen on CONNACK. */
+  if (s_conn != NULL && s_connected) {
+    mqtt_subscribe_th(s_conn, SLIST_FIRST(&s_topic_handlers));
+  }
 }
 
 #endif /* MGOS_ENABLE_MQTT */
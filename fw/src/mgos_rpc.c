@@ -39,6 +39,8 @@ struct mg_rpc_cfg *mgos_rpc_cfg_from_sys(const struct sys_config *scfg) {
   mgos_conf_set_str(&ccfg->id, scfg->device.id);
   mgos_conf_set_str(&ccfg->psk, scfg->device.password);
   ccfg->max_queue_size = scfg->rpc.max_queue_size;
+  ccfg->max_queue_bytes = scfg->rpc.max_queue_bytes;
+  ccfg->default_out_timeout = scfg->rpc.default_out_timeout;
   return ccfg;
 }
 
@@ -160,6 +162,10 @@ static void mgos_sys_get_info_handler(struct mg_rpc_request_info *ri,
 }
 #endif
 
+static void mgos_rpc_timeouts_cb(void *arg) {
+  mg_rpc_check_timeouts((struct mg_rpc *) arg);
+}
+
 enum mgos_init_result mgos_rpc_init(void) {
   const struct sys_config_rpc *sccfg = &get_cfg()->rpc;
   if (!sccfg->enable) return MGOS_INIT_OK;
@@ -237,6 +243,7 @@ enum mgos_init_result mgos_rpc_init(void) {
 
   mg_rpc_add_list_handler(c);
   s_global_mg_rpc = c;
+  mgos_set_timer(1000, true /* repeat */, mgos_rpc_timeouts_cb, c);
 
 #if MGOS_ENABLE_SYS_SERVICE
   mg_rpc_add_handler(c, "Sys.Reboot", "{delay_ms: %d}", mgos_sys_reboot_handler,
@@ -374,6 +381,7 @@ bool mg_rpc_call(const char *dst, const char *method, const char *args_json,
   oplya_arg->cb_arg = cb_arg;
 
   struct mg_rpc_call_opts opts;
+  memset(&opts, 0, sizeof(opts));
   opts.dst = mg_mk_str(dst);
 
   return mg_rpc_callf(s_global_mg_rpc, mg_mk_str(method), mgos_rpc_call_oplya,
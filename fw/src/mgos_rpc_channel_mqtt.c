@@ -131,6 +131,10 @@ struct mg_rpc_channel *mg_rpc_channel_mqtt(const struct mg_str device_id) {
   ch->ch_close = mg_rpc_channel_mqtt_ch_close;
   ch->get_type = mg_rpc_channel_mqtt_get_type;
   ch->is_persistent = mg_rpc_channel_mqtt_is_persistent;
+  /*
+   * No is_stream_ok: FRAME_SENT is reported as soon as the message is queued,
+   * not when it is delivered, so a stream would not be paced at all.
+   */
 
   /* subscribe on both wildcard topic, and bare /rpc topic */
   mgos_mqtt_global_subscribe(mg_mk_str(topic), mgos_rpc_mqtt_sub_handler, ch);
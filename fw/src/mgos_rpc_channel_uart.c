@@ -213,6 +213,11 @@ static bool mg_rpc_channel_uart_is_persistent(struct mg_rpc_channel *ch) {
   return true;
 }
 
+static bool mg_rpc_channel_uart_is_stream_ok(struct mg_rpc_channel *ch) {
+  (void) ch;
+  return true;
+}
+
 struct mg_rpc_channel *mg_rpc_channel_uart(int uart_no,
                                            bool wait_for_start_frame) {
   struct mg_rpc_channel *ch = (struct mg_rpc_channel *) calloc(1, sizeof(*ch));
@@ -221,6 +226,7 @@ struct mg_rpc_channel *mg_rpc_channel_uart(int uart_no,
   ch->ch_close = mg_rpc_channel_uart_ch_close;
   ch->get_type = mg_rpc_channel_uart_get_type;
   ch->is_persistent = mg_rpc_channel_uart_is_persistent;
+  ch->is_stream_ok = mg_rpc_channel_uart_is_stream_ok;
   struct mg_rpc_channel_uart_data *chd =
       (struct mg_rpc_channel_uart_data *) calloc(1, sizeof(*chd));
   chd->uart_no = uart_no;
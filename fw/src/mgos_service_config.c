@@ -37,7 +37,7 @@ static void mgos_config_get_handler(struct mg_rpc_request_info *ri,
   char *key = NULL;
   json_scanf(args.p, args.len, ri->args_fmt, &key);
   if (key != NULL) {
-    schema = mgos_conf_find_schema_entry(key, sys_config_schema());
+    schema = mgos_conf_index_find(sys_config_index(), mg_mk_str(key));
     free(key);
     if (schema == NULL) {
       mg_rpc_send_errorf(ri, 404, "invalid config key");
@@ -69,7 +69,8 @@ static void set_handler(const char *str, int len, void *user_data) {
   struct sys_config *cfg = get_cfg();
   /* Make a temporary copy, in case it gets overridden while loading. */
   char *acl_copy = (cfg->conf_acl != NULL ? strdup(cfg->conf_acl) : NULL);
-  mgos_conf_parse(mg_mk_str_n(str, len), acl_copy, sys_config_schema(), cfg);
+  mgos_conf_parse_index(mg_mk_str_n(str, len), acl_copy, sys_config_index(),
+                        cfg);
   free(acl_copy);
 
   (void) user_data;
@@ -91,12 +91,65 @@ static void mgos_fs_list_ext_handler(struct mg_rpc_request_info *ri,
 }
 #endif /* MG_ENABLE_DIRECTORY_LISTING */
 
+#define MGOS_FS_GET_CHUNK_SIZE 1024
+#define MGOS_FS_GET_MAX_CHUNK_SIZE 8192
+
+/* State of a streamed FS.Get: the file is sent one chunk at a time. */
+struct mgos_fs_get_stream {
+  FILE *fp;
+  long offset, left;
+  long chunk_size;
+  char *buf;
+};
+
+static void mgos_fs_get_stream_cb(struct mg_rpc_request_info *ri,
+                                  void *cb_arg, bool ok) {
+  struct mgos_fs_get_stream *gs = (struct mgos_fs_get_stream *) cb_arg;
+  long n = (gs->left < gs->chunk_size ? gs->left : gs->chunk_size);
+
+  if (!ok) {
+    mg_rpc_free_request_info(ri);
+    ri = NULL;
+    goto clean;
+  }
+
+  if ((long) fread(gs->buf, 1, n, gs->fp) != n) {
+    mg_rpc_send_errorf(ri, 500, "fread");
+    ri = NULL;
+    goto clean;
+  }
+  gs->offset += n;
+  gs->left -= n;
+
+  if (gs->left > 0) {
+    if (!mg_rpc_send_response_chunkf(ri, mg_mk_str_n(gs->buf, n),
+                                     "{offset: %ld, left: %ld}",
+                                     gs->offset - n, gs->left)) {
+      mg_rpc_send_errorf(ri, 500, "send failed");
+      ri = NULL;
+      goto clean;
+    }
+    return;
+  }
+
+  mg_rpc_send_response_binf(ri, mg_mk_str_n(gs->buf, n),
+                            "{offset: %ld, left: %ld}", gs->offset - n, 0L);
+  ri = NULL;
+
+clean:
+  fclose(gs->fp);
+  free(gs->buf);
+  free(gs);
+}
+
 static void mgos_fs_get_handler(struct mg_rpc_request_info *ri, void *cb_arg,
                                 struct mg_rpc_frame_info *fi,
                                 struct mg_str args) {
   char *filename = NULL;
   long offset = 0, len = -1;
   long file_size = 0;
+  long chunk_size = MGOS_FS_GET_CHUNK_SIZE;
+  int stream = 0;
   FILE *fp = NULL;
   char *data = NULL;
 
@@ -106,7 +159,8 @@ static void mgos_fs_get_handler(struct mg_rpc_request_info *ri, void *cb_arg,
     goto clean;
   }
 
-  json_scanf(args.p, args.len, ri->args_fmt, &filename, &offset, &len);
+  json_scanf(args.p, args.len, ri->args_fmt, &filename, &offset, &len,
+             &stream, &chunk_size);
 
   /* check arguments */
   if (filename == NULL) {
@@ -148,22 +202,53 @@ static void mgos_fs_get_handler(struct mg_rpc_request_info *ri, void *cb_arg,
     len = file_size - offset;
   }
 
-  if (len > 0) {
-    /* try to allocate the chunk of needed size */
-    data = (char *) malloc(len);
-    if (data == NULL) {
+  if (offset == 0) {
+    LOG(LL_INFO, ("Sending %s", filename));
+  }
+
+  if (fseek(fp, offset, SEEK_SET)) {
+    mg_rpc_send_errorf(ri, 500, "fseek");
+    ri = NULL;
+    goto clean;
+  }
+
+  if (stream) {
+    /*
+     * Send the whole range in chunks as partial results with binary data,
+     * each one read when the channel is ready for it.
+     */
+    struct mgos_fs_get_stream *gs =
+        (struct mgos_fs_get_stream *) calloc(1, sizeof(*gs));
+    if (chunk_size <= 0 || chunk_size > MGOS_FS_GET_MAX_CHUNK_SIZE) {
+      chunk_size = MGOS_FS_GET_CHUNK_SIZE;
+    }
+    if (gs != NULL) gs->buf = (char *) malloc(chunk_size);
+    if (gs == NULL || gs->buf == NULL) {
+      free(gs);
       mg_rpc_send_errorf(ri, 500, "out of memory");
       ri = NULL;
       goto clean;
     }
-
-    if (offset == 0) {
-      LOG(LL_INFO, ("Sending %s", filename));
+    gs->fp = fp;
+    gs->offset = offset;
+    gs->left = len;
+    gs->chunk_size = chunk_size;
+    if (mg_rpc_stream_response(ri, mgos_fs_get_stream_cb, gs)) {
+      /* The stream owns the file now. */
+      fp = NULL;
+      ri = NULL;
+      goto clean;
     }
+    /* Channel cannot stream (e.g. HTTP), send the range in one response. */
+    free(gs->buf);
+    free(gs);
+  }
 
-    /* seek & read the data */
-    if (fseek(fp, offset, SEEK_SET)) {
-      mg_rpc_send_errorf(ri, 500, "fseek");
+  if (len > 0) {
+    /* try to allocate the chunk of needed size */
+    data = (char *) malloc(len);
+    if (data == NULL) {
+      mg_rpc_send_errorf(ri, 500, "out of memory");
       ri = NULL;
       goto clean;
     }
@@ -208,6 +293,7 @@ static void mgos_fs_put_handler(struct mg_rpc_request_info *ri, void *cb_arg,
   int append = 0;
   FILE *fp = NULL;
   struct put_data data = {NULL, 0};
+  struct mg_str bin = fi->bin;
 
   if (!fi->channel_is_trusted) {
     mg_rpc_send_errorf(ri, 403, "unauthorized");
@@ -238,7 +324,10 @@ static void mgos_fs_put_handler(struct mg_rpc_request_info *ri, void *cb_arg,
     LOG(LL_INFO, ("Receiving %s", filename));
   }
 
-  if (fwrite(data.p, 1, data.len, fp) != (size_t) data.len) {
+  /* Data comes either base64-encoded in args or as the binary payload. */
+  if (data.p != NULL) bin = mg_mk_str_n(data.p, data.len);
+
+  if (fwrite(bin.p, 1, bin.len, fp) != bin.len) {
     mg_rpc_send_errorf(ri, 500, "failed to write data");
     ri = NULL;
     goto clean;
@@ -309,7 +398,9 @@ enum mgos_init_result mgos_service_filesystem_init(void) {
   mg_rpc_add_handler(c, "FS.List", "", mgos_fs_list_handler, NULL);
   mg_rpc_add_handler(c, "FS.ListExt", "", mgos_fs_list_ext_handler, NULL);
 #endif
-  mg_rpc_add_handler(c, "FS.Get", "{filename: %Q, offset: %ld, len: %ld}",
+  mg_rpc_add_handler(c, "FS.Get",
+                     "{filename: %Q, offset: %ld, len: %ld, stream: %B, "
+                     "chunk_size: %ld}",
                      mgos_fs_get_handler, NULL);
   mg_rpc_add_handler(c, "FS.Put", "{filename: %Q, data: %V, append: %B}",
                      mgos_fs_put_handler, NULL);
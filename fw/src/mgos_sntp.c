@@ -5,8 +5,10 @@
 
 #include "fw/src/mgos_sntp.h"
 
+#include <math.h>
 #include <stdbool.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "fw/src/mgos_mongoose.h"
 #include "fw/src/mgos_sys_config.h"
@@ -20,17 +22,69 @@ struct time_change_cb {
   SLIST_ENTRY(time_change_cb) entries;
 };
 
+/* Interval between samples sent to the same server, seconds. */
+#define MGOS_SNTP_SAMPLE_INTERVAL 1.0
+/* Slew timer period and maximum rate of the offset correction. */
+#define MGOS_SNTP_SLEW_INTERVAL_MS 10000
+#define MGOS_SNTP_MAX_SLEW_PPM 500
+#define MGOS_SNTP_MAX_DRIFT_PPM 500
+
+/* One server in a multi-server round. */
+struct mgos_sntp_peer {
+  struct mg_connection *nc;
+  const char *server;
+  int num_sent;
+  int num_received;
+  /* Best (lowest delay) sample so far. */
+  double offset;
+  double delay;
+  double root_distance;
+};
+
 struct mgos_sntp_state {
   struct mg_connection *nc;
   bool synced;
   int retry_timeout_ms;
   mgos_timer_id retry_timer_id;
   SLIST_HEAD(time_change_cbs, time_change_cb) time_change_cbs;
+
+  /* Multi-server round in progress, if any. */
+  struct mgos_sntp_peer *peers;
+  int num_peers;
+  int num_active;
+  char *servers;
+  mgos_timer_id round_timer_id;
+
+  /* Clock discipline: offset still to be slewed and estimated drift (s/s). */
+  double slew_remaining;
+  double drift;
+  double last_sync_time;
+  mgos_timer_id slew_timer_id;
 };
 
 static struct mgos_sntp_state s_state;
 static void mgos_sntp_retry(void);
 
+static bool mgos_sntp_set_time(double delta) {
+  double t = mg_time() + delta;
+  struct timeval tv;
+  tv.tv_sec = (time_t) t;
+  tv.tv_usec = (t - tv.tv_sec) * 1000000;
+  return (settimeofday(&tv, NULL) == 0);
+}
+
+/* Steps the clock and lets everyone who keeps absolute time know. */
+static void mgos_sntp_step(double delta) {
+  if (mgos_sntp_set_time(delta)) {
+    struct time_change_cb *tccb;
+    SLIST_FOREACH(tccb, &s_state.time_change_cbs, entries) {
+      tccb->cb(tccb->cb_arg, delta);
+    }
+  } else {
+    LOG(LL_ERROR, ("Failed to set time"));
+  }
+}
+
 static void mgos_sntp_ev(struct mg_connection *nc, int ev, void *ev_data,
                          void *user_data) {
   switch (ev) {
@@ -47,17 +101,7 @@ static void mgos_sntp_ev(struct mg_connection *nc, int ev, void *ev_data,
       mg_sock_addr_to_str(&nc->sa, addr, sizeof(addr), MG_SOCK_STRINGIFY_IP);
       LOG(LL_INFO, ("SNTP reply from %s: time %lf, local %lf, delta %lf", addr,
                     m->time, now, delta));
-      struct timeval tv;
-      tv.tv_sec = (time_t) m->time;
-      tv.tv_usec = (m->time - tv.tv_sec) * 1000000;
-      if (settimeofday(&tv, NULL) == 0) {
-        struct time_change_cb *tccb;
-        SLIST_FOREACH(tccb, &s_state.time_change_cbs, entries) {
-          tccb->cb(tccb->cb_arg, delta);
-        }
-      } else {
-        LOG(LL_ERROR, ("Failed to set time"));
-      }
+      mgos_sntp_step(delta);
       s_state.retry_timeout_ms = 0;
       s_state.synced = true;
       nc->flags |= MG_F_CLOSE_IMMEDIATELY;
@@ -94,9 +138,265 @@ static bool mgos_sntp_query(const char *server) {
   return (s_state.nc != NULL);
 }
 
+/*
+ * Multi-server mode.
+ *
+ * Each round queries all of sntp.servers in parallel, taking sntp.samples
+ * samples from each and keeping the one with the lowest round-trip delay
+ * (it is the least affected by queueing). The per-server results are then
+ * intersected (Marzullo's algorithm) to weed out falsetickers, and the
+ * survivors' offsets are combined. Large offsets are stepped, small ones are
+ * slewed gradually, so timers and uptime do not jump on every update.
+ */
+
+/*
+ * Slew tick: applies the estimated drift for the period plus a rate-limited
+ * portion of the outstanding offset. These adjustments are well below timer
+ * resolution, so time change callbacks are not invoked.
+ */
+static void mgos_sntp_slew_timer_cb(void *arg) {
+  const double period = MGOS_SNTP_SLEW_INTERVAL_MS / 1000.0;
+  const double max_step = period * MGOS_SNTP_MAX_SLEW_PPM / 1e6;
+  double adj = s_state.slew_remaining;
+  if (adj > max_step) adj = max_step;
+  if (adj < -max_step) adj = -max_step;
+  s_state.slew_remaining -= adj;
+  adj += s_state.drift * period;
+  if (adj != 0 && !mgos_sntp_set_time(adj)) {
+    LOG(LL_ERROR, ("Failed to set time"));
+  }
+  (void) arg;
+}
+
+static void mgos_sntp_apply_offset(double offset) {
+  const struct sys_config_sntp *scfg = &get_cfg()->sntp;
+  double now = mg_time();
+  if (!s_state.synced || fabs(offset) > scfg->step_threshold) {
+    LOG(LL_INFO, ("SNTP step %lf", offset));
+    mgos_sntp_step(offset);
+    s_state.slew_remaining = 0;
+  } else {
+    /*
+     * Whatever was not explained by the pending correction has accumulated
+     * since the last sync because of the clock running fast or slow.
+     */
+    if (s_state.last_sync_time > 0 && now > s_state.last_sync_time) {
+      const double max_drift = MGOS_SNTP_MAX_DRIFT_PPM / 1e6;
+      double residual = offset - s_state.slew_remaining;
+      double drift = s_state.drift +
+                     0.5 * residual / (now - s_state.last_sync_time);
+      if (drift > max_drift) drift = max_drift;
+      if (drift < -max_drift) drift = -max_drift;
+      s_state.drift = drift;
+    }
+    /* The new measurement supersedes what was left of the previous one. */
+    s_state.slew_remaining = offset;
+    LOG(LL_INFO, ("SNTP slew %lf, drift %.1lf ppm", offset,
+                  s_state.drift * 1e6));
+  }
+  s_state.last_sync_time = mg_time();
+  if (s_state.slew_timer_id == MGOS_INVALID_TIMER_ID) {
+    s_state.slew_timer_id = mgos_set_timer(MGOS_SNTP_SLEW_INTERVAL_MS, 1,
+                                           mgos_sntp_slew_timer_cb, NULL);
+  }
+}
+
+struct mgos_sntp_edge {
+  double value;
+  int type; /* +1 for interval start, -1 for end */
+};
+
+static int mgos_sntp_edge_cmp(const void *a, const void *b) {
+  const struct mgos_sntp_edge *ea = (const struct mgos_sntp_edge *) a;
+  const struct mgos_sntp_edge *eb = (const struct mgos_sntp_edge *) b;
+  if (ea->value < eb->value) return -1;
+  if (ea->value > eb->value) return 1;
+  /* Starts go first so that touching intervals intersect. */
+  return eb->type - ea->type;
+}
+
+/*
+ * Finds the offset agreed upon by the majority of peers. Each peer's
+ * correctness interval is offset +/- (delay / 2 + root distance); the
+ * intersection of the largest number of them is located and the peers that
+ * contain it are averaged, weighted by their precision.
+ */
+static bool mgos_sntp_select(double *offset) {
+  struct mgos_sntp_edge *edges;
+  int i, n = 0, cnt = 0, best = 0;
+  double lo = 0, hi = 0, mid, sum = 0, wsum = 0;
+  edges = (struct mgos_sntp_edge *) calloc(s_state.num_peers * 2,
+                                           sizeof(*edges));
+  if (edges == NULL) return false;
+  for (i = 0; i < s_state.num_peers; i++) {
+    const struct mgos_sntp_peer *p = &s_state.peers[i];
+    double r;
+    if (p->num_received == 0) continue;
+    r = p->delay / 2 + p->root_distance;
+    edges[n].value = p->offset - r;
+    edges[n++].type = 1;
+    edges[n].value = p->offset + r;
+    edges[n++].type = -1;
+  }
+  qsort(edges, n, sizeof(*edges), mgos_sntp_edge_cmp);
+  for (i = 0; i < n; i++) {
+    cnt += edges[i].type;
+    if (cnt > best) {
+      best = cnt;
+      lo = edges[i].value;
+      hi = edges[i + 1].value; /* A start is always followed by an edge. */
+    }
+  }
+  free(edges);
+  /* Each peer contributed two edges. */
+  if (best == 0 || best * 2 <= n / 2) {
+    LOG(LL_ERROR, ("SNTP: no majority agreement (%d of %d)", best, n / 2));
+    return false;
+  }
+  mid = (lo + hi) / 2;
+  for (i = 0; i < s_state.num_peers; i++) {
+    const struct mgos_sntp_peer *p = &s_state.peers[i];
+    double r, w;
+    if (p->num_received == 0) continue;
+    r = p->delay / 2 + p->root_distance;
+    if (p->offset - r > mid || p->offset + r < mid) continue;
+    w = 1.0 / (r > 1e-6 ? r : 1e-6);
+    sum += p->offset * w;
+    wsum += w;
+    LOG(LL_DEBUG, ("SNTP %s: offset %lf delay %lf", p->server, p->offset,
+                   p->delay));
+  }
+  if (wsum == 0) return false;
+  *offset = sum / wsum;
+  return true;
+}
+
+static void mgos_sntp_finish_round(void) {
+  double offset;
+  int i;
+  if (s_state.round_timer_id != MGOS_INVALID_TIMER_ID) {
+    mgos_clear_timer(s_state.round_timer_id);
+    s_state.round_timer_id = MGOS_INVALID_TIMER_ID;
+  }
+  /* Connections may outlive the round (e.g. still resolving), detach them. */
+  for (i = 0; i < s_state.num_peers; i++) {
+    struct mg_connection *nc = s_state.peers[i].nc;
+    if (nc == NULL) continue;
+    nc->user_data = NULL;
+    nc->flags |= MG_F_CLOSE_IMMEDIATELY;
+  }
+  if (mgos_sntp_select(&offset)) {
+    mgos_sntp_apply_offset(offset);
+    s_state.retry_timeout_ms = 0;
+    s_state.synced = true;
+  }
+  free(s_state.peers);
+  free(s_state.servers);
+  s_state.peers = NULL;
+  s_state.servers = NULL;
+  s_state.num_peers = s_state.num_active = 0;
+  mgos_sntp_retry();
+}
+
+static void mgos_sntp_multi_ev(struct mg_connection *nc, int ev, void *ev_data,
+                               void *user_data) {
+  struct mgos_sntp_peer *p = (struct mgos_sntp_peer *) user_data;
+  if (p == NULL) {
+    nc->flags |= MG_F_CLOSE_IMMEDIATELY;
+    return;
+  }
+  switch (ev) {
+    case MG_EV_CONNECT: {
+      if (*((int *) ev_data) != 0) break;
+    } /* fall through */
+    case MG_EV_TIMER: {
+      const struct sys_config_sntp *scfg = &get_cfg()->sntp;
+      if (p->num_sent >= scfg->samples) {
+        nc->flags |= MG_F_CLOSE_IMMEDIATELY;
+        break;
+      }
+      mg_sntp_send_request(nc);
+      p->num_sent++;
+      mg_set_timer(nc, mg_time() + MGOS_SNTP_SAMPLE_INTERVAL);
+      break;
+    }
+    case MG_SNTP_REPLY: {
+      const struct mg_sntp_message *m = (struct mg_sntp_message *) ev_data;
+      if (m->kiss_of_death) {
+        LOG(LL_ERROR, ("SNTP: %s asked us to go away", p->server));
+        nc->flags |= MG_F_CLOSE_IMMEDIATELY;
+        break;
+      }
+      if (p->num_received == 0 || m->delay < p->delay) {
+        p->offset = m->offset;
+        p->delay = m->delay;
+        p->root_distance = m->root_distance;
+      }
+      p->num_received++;
+      if (p->num_received >= get_cfg()->sntp.samples) {
+        nc->flags |= MG_F_CLOSE_IMMEDIATELY;
+      }
+      break;
+    }
+    case MG_SNTP_MALFORMED_REPLY:
+    case MG_SNTP_FAILED:
+      LOG(LL_ERROR, ("SNTP error from %s: %d", p->server, ev));
+      nc->flags |= MG_F_CLOSE_IMMEDIATELY;
+      break;
+    case MG_EV_CLOSE:
+      p->nc = NULL;
+      if (--s_state.num_active == 0) mgos_sntp_finish_round();
+      break;
+  }
+}
+
+/* Deadline for the round, in case some of the servers never respond. */
+static void mgos_sntp_round_timer_cb(void *arg) {
+  s_state.round_timer_id = MGOS_INVALID_TIMER_ID;
+  mgos_sntp_finish_round();
+  (void) arg;
+}
+
+static void mgos_sntp_start_round(const char *servers) {
+  const struct sys_config_sntp *scfg = &get_cfg()->sntp;
+  const char *s;
+  char *tok, *saveptr = NULL;
+  int i, n = 1;
+  if (s_state.peers != NULL) return; /* Previous round still running. */
+  for (s = servers; *s != '\0'; s++) {
+    if (*s == ',') n++;
+  }
+  s_state.servers = strdup(servers);
+  s_state.peers = (struct mgos_sntp_peer *) calloc(n, sizeof(*s_state.peers));
+  if (s_state.servers == NULL || s_state.peers == NULL) {
+    mgos_sntp_finish_round();
+    return;
+  }
+  for (tok = strtok_r(s_state.servers, ", ", &saveptr); tok != NULL;
+       tok = strtok_r(NULL, ", ", &saveptr)) {
+    s_state.peers[s_state.num_peers++].server = tok;
+  }
+  s_state.round_timer_id =
+      mgos_set_timer((int) ((scfg->samples + 2) * MGOS_SNTP_SAMPLE_INTERVAL *
+                            1000),
+                     0, mgos_sntp_round_timer_cb, NULL);
+  for (i = 0; i < s_state.num_peers; i++) {
+    struct mgos_sntp_peer *p = &s_state.peers[i];
+    p->nc = mg_sntp_connect(mgos_get_mgr(), mgos_sntp_multi_ev, p, p->server);
+    if (p->nc != NULL) s_state.num_active++;
+  }
+  LOG(LL_INFO, ("SNTP query to %s (%d servers)", servers, s_state.num_active));
+  if (s_state.num_active == 0) mgos_sntp_finish_round();
+}
+
 static void mgos_sntp_retry_timer_cb(void *user_data) {
   const struct sys_config_sntp *scfg = &get_cfg()->sntp;
   s_state.retry_timer_id = MGOS_INVALID_TIMER_ID;
+  if (scfg->servers != NULL && scfg->servers[0] != '\0') {
+    /* Round always reschedules when it is done. */
+    mgos_sntp_start_round(scfg->servers);
+    return;
+  }
   mgos_sntp_query(scfg->server);
   /*
    * Response may never arrive, so we schedule a retry immediately.
@@ -159,7 +459,8 @@ static void mgos_sntp_wifi_ready(enum mgos_wifi_status event, void *arg) {
 enum mgos_init_result mgos_sntp_init(void) {
   struct sys_config_sntp *scfg = &get_cfg()->sntp;
   if (!scfg->enable) return MGOS_INIT_OK;
-  if (scfg->server == NULL) {
+  if (scfg->server == NULL &&
+      (scfg->servers == NULL || scfg->servers[0] == '\0')) {
     LOG(LL_ERROR, ("sntp.server is required"));
     return MGOS_INIT_SNTP_INIT_FAILED;
   }
@@ -9,6 +9,7 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "common/cs_crc32.h"
 #include "common/cs_file.h"
 #include "common/json_utils.h"
 #include "common/str_util.h"
@@ -34,6 +35,9 @@
 #define CONF_USER_FILE_OLD "conf.json"
 #define CONF_VENDOR_FILE "conf_vendor.json"
 
+/* Merged defaults (levels 0 - 8), see load_config_defaults(). */
+#define CONF_DEFAULTS_SNAPSHOT_FILE "conf_defaults.bin"
+
 /* Must be provided externally, usually auto-generated. */
 extern const char *build_id;
 extern const char *build_timestamp;
@@ -79,7 +83,42 @@ void mgos_expand_mac_address_placeholders(char *str) {
   }
 }
 
-static bool load_config_defaults(struct sys_config *cfg) {
+#if MGOS_ENABLE_CONFIG_SNAPSHOT
+static uint32_t config_defaults_tag_file(uint32_t crc, const char *fname) {
+  char buf[128];
+  size_t n;
+  uint32_t fcrc = 0xffffffff; /* Missing file */
+  FILE *fp = fopen(fname, "r");
+  if (fp != NULL) {
+    fcrc = 0;
+    while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+      fcrc = cs_crc32(fcrc, buf, n);
+    }
+    fclose(fp);
+  }
+  crc = cs_crc32(crc, fname, strlen(fname));
+  return cs_crc32(crc, &fcrc, sizeof(fcrc));
+}
+
+/*
+ * Fingerprint of everything the defaults are built from: the firmware build
+ * and contents of each layer file. Not all filesystems keep mtime, so the
+ * files are checksummed, which is still much cheaper than parsing them.
+ */
+static uint32_t config_defaults_tag(void) {
+  int i;
+  char fname[sizeof(CONF_USER_FILE)];
+  memcpy(fname, CONF_USER_FILE, sizeof(fname));
+  uint32_t crc = cs_crc32(0, build_id, strlen(build_id));
+  for (i = 0; i < MGOS_CONFIG_LEVEL_USER; i++) {
+    fname[CONF_USER_FILE_NUM_IDX] = '0' + i;
+    crc = config_defaults_tag_file(crc, fname);
+  }
+  return config_defaults_tag_file(crc, CONF_VENDOR_FILE);
+}
+#endif
+
+static bool load_config_defaults_json(struct sys_config *cfg) {
   int i;
   char fname[sizeof(CONF_USER_FILE)];
   memset(cfg, 0, sizeof(*cfg));
@@ -101,6 +140,30 @@ static bool load_config_defaults(struct sys_config *cfg) {
   return true;
 }
 
+/*
+ * Loads levels 0 - 8. Parsing them is the bulk of config loading, so the
+ * result is cached in a binary snapshot which is rebuilt when any of the
+ * layers changes.
+ */
+static bool load_config_defaults(struct sys_config *cfg) {
+#if MGOS_ENABLE_CONFIG_SNAPSHOT
+  uint32_t tag = config_defaults_tag();
+  memset(cfg, 0, sizeof(*cfg));
+  if (mgos_conf_snapshot_load(CONF_DEFAULTS_SNAPSHOT_FILE, sizeof(*cfg),
+                              sys_config_schema(), tag, cfg)) {
+    return true;
+  }
+  if (!load_config_defaults_json(cfg)) return false;
+  if (mgos_conf_snapshot_save(cfg, sizeof(*cfg), sys_config_schema(), tag,
+                              CONF_DEFAULTS_SNAPSHOT_FILE)) {
+    LOG(LL_INFO, ("Saved %s", CONF_DEFAULTS_SNAPSHOT_FILE));
+  }
+  return true;
+#else
+  return load_config_defaults_json(cfg);
+#endif
+}
+
 bool save_cfg(const struct sys_config *cfg, char **msg) {
   bool result = false;
   struct sys_config defaults;
@@ -176,7 +239,8 @@ static void conf_handler(struct mg_connection *c, int ev, void *p,
     memset(&tmp, 0, sizeof(tmp));
     if (load_config_defaults(&tmp)) {
       char *acl_copy = (tmp.conf_acl == NULL ? NULL : strdup(tmp.conf_acl));
-      if (mgos_conf_parse(hm->body, acl_copy, sys_config_schema(), &tmp)) {
+      if (mgos_conf_parse_index(hm->body, acl_copy, sys_config_index(),
+                                &tmp)) {
         status = (save_cfg(&tmp, &msg) ? 0 : -10);
       } else {
         status = -11;
@@ -455,8 +519,8 @@ static int load_config_file(const char *filename, const char *acl,
   }
   /* Make a temporary copy, in case it gets overridden while loading. */
   acl_copy = (acl != NULL ? strdup(acl) : NULL);
-  if (!mgos_conf_parse(mg_mk_str_n(data, size), acl_copy, sys_config_schema(),
-                       cfg)) {
+  if (!mgos_conf_parse_index(mg_mk_str_n(data, size), acl_copy,
+                             sys_config_index(), cfg)) {
     LOG(LL_ERROR, ("Failed to parse %s", filename));
     result = 0;
     goto clean;
@@ -550,6 +614,10 @@ enum mgos_init_result mgos_sys_config_init(void) {
     return MGOS_INIT_OUT_OF_MEMORY;
   }
   LOG(LL_INFO, ("MAC: %s", s_ro_vars.mac_address));
+  /* Expanded in place, so make sure it's a private copy. */
+  if (mgos_conf_str_is_shared(s_cfg.device.id)) {
+    s_cfg.device.id = strdup(s_cfg.device.id);
+  }
   mgos_expand_mac_address_placeholders(s_cfg.device.id);
 
   LOG(LL_INFO, ("WDT: %d seconds", s_cfg.sys.wdt_timeout));
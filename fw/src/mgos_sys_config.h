@@ -40,6 +40,8 @@ struct sys_config *get_cfg(void);
 
 /*
  * Save config. Performs diff against defaults and only saves diffs.
+ * The whole config is validated and emitted on every save; the file is only
+ * rewritten if the emitted diff differs from what is already stored.
  * Reboot is required to reload the config.
  * If return value is false, a message may be provided in *msg.
  * If non-NULL, it must be free()d.
@@ -14,7 +14,7 @@ SYS_RO_VARS_SCHEMA_JSON ?=
 $(SYS_CONFIG_C) $(SYS_CONFIG_SCHEMA_JSON): $(SYS_CONF_SCHEMA) $(APP_CONF_SCHEMA) $(GSC_TOOL)
 	$(vecho) "GEN   $@"
 	$(Q) $(PYTHON) $(GSC_TOOL) \
-	  --c_name=sys_config \
+	  --c_name=sys_config --c_str_defaults=true \
 	  --dest_dir=$(dir $@) $(SYS_CONF_SCHEMA) $(APP_CONF_SCHEMA)
 
 $(SYS_RO_VARS_C) $(SYS_RO_VARS_SCHEMA_JSON): $(SYS_RO_VARS_SCHEMA) $(GSC_TOOL)
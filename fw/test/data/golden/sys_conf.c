@@ -25,3 +25,58 @@ const struct mgos_conf_entry sys_conf_schema_[16] = {
 const struct mgos_conf_entry *sys_conf_schema() {
   return sys_conf_schema_;
 }
+
+static const char *const sys_conf_paths_[16] = {
+  "",
+  "wifi",
+  "wifi.sta",
+  "wifi.sta.ssid",
+  "wifi.sta.pass",
+  "wifi.ap",
+  "wifi.ap.ssid",
+  "wifi.ap.pass",
+  "wifi.ap.channel",
+  "wifi.ap.dhcp_end",
+  "http",
+  "http.enable",
+  "http.port",
+  "debug",
+  "debug.level",
+  "debug.dest",
+};
+
+static const uint16_t sys_conf_disp_[4] = {
+  9, 4, 0, 29,
+};
+
+static const uint16_t sys_conf_slots_[16] = {
+  0, 11, 7, 1, 5, 12, 13, 2, 8, 6, 14, 15,
+  9, 10, 4, 3,
+};
+
+static const char sys_conf_str_pool_[41] =
+  "FW_XXXXXX\0"
+  "Elduderino\0"
+  "192.168.4.200\0"
+  "uart1\0";
+
+static const uint16_t sys_conf_str_defaults_[16] = {
+  0, 0, 0, 0, 0, 0, 1, 11, 0, 22, 0, 0,
+  0, 0, 0, 36,
+};
+
+const struct mgos_conf_index sys_conf_index_ = {
+  .schema = sys_conf_schema_,
+  .paths = sys_conf_paths_,
+  .disp = sys_conf_disp_,
+  .slots = sys_conf_slots_,
+  .num_buckets = 4,
+  .num_slots = 16,
+  .str_pool = sys_conf_str_pool_,
+  .str_defaults = sys_conf_str_defaults_,
+  .str_pool_size = 41,
+};
+
+const struct mgos_conf_index *sys_conf_index() {
+  return &sys_conf_index_;
+}
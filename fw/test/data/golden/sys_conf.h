@@ -28,6 +28,27 @@ struct sys_conf {
   } debug;
 };
 
+/* Ids for mgos_conf_key_entry(), same as indices in the schema. */
+enum sys_conf_key {
+  SYS_CONF_KEY_WIFI = 1,
+  SYS_CONF_KEY_WIFI_STA,
+  SYS_CONF_KEY_WIFI_STA_SSID,
+  SYS_CONF_KEY_WIFI_STA_PASS,
+  SYS_CONF_KEY_WIFI_AP,
+  SYS_CONF_KEY_WIFI_AP_SSID,
+  SYS_CONF_KEY_WIFI_AP_PASS,
+  SYS_CONF_KEY_WIFI_AP_CHANNEL,
+  SYS_CONF_KEY_WIFI_AP_DHCP_END,
+  SYS_CONF_KEY_HTTP,
+  SYS_CONF_KEY_HTTP_ENABLE,
+  SYS_CONF_KEY_HTTP_PORT,
+  SYS_CONF_KEY_DEBUG,
+  SYS_CONF_KEY_DEBUG_LEVEL,
+  SYS_CONF_KEY_DEBUG_DEST,
+  SYS_CONF_NUM_KEYS
+};
+
 const struct mgos_conf_entry *sys_conf_schema();
+const struct mgos_conf_index *sys_conf_index();
 
 #endif /* SYS_CONF_H_ */
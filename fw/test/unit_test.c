@@ -46,6 +46,180 @@ static const char *test_config(void) {
   return NULL;
 }
 
+static const char *test_config_index(void) {
+  size_t size;
+  char *json1 = cs_read_file(".build/sys_conf_defaults.json", &size);
+  char *json2 = cs_read_file("data/overrides.json", &size);
+  const struct mgos_conf_index *idx = sys_conf_index();
+  const struct mgos_conf_entry *schema = sys_conf_schema();
+  struct sys_conf conf;
+
+  memset(&conf, 0, sizeof(conf));
+  ASSERT(json1 != NULL);
+  ASSERT(json2 != NULL);
+  cs_log_set_level(LL_NONE);
+
+  ASSERT(mgos_conf_index_find(idx, mg_mk_str("wifi.ap.channel")) ==
+         mgos_conf_find_schema_entry("wifi.ap.channel", schema));
+  ASSERT(mgos_conf_index_find(idx, mg_mk_str("wifi.sta")) ==
+         mgos_conf_find_schema_entry("wifi.sta", schema));
+  ASSERT(mgos_conf_index_find(idx, mg_mk_str("wifi.ap.nope")) == NULL);
+  ASSERT(mgos_conf_index_find(idx, mg_mk_str("wifi.ap.chan")) == NULL);
+  ASSERT(mgos_conf_index_find(idx, mg_mk_str("")) == NULL);
+
+  ASSERT_EQ(mgos_conf_key_id(idx, "wifi.ap.channel"),
+            SYS_CONF_KEY_WIFI_AP_CHANNEL);
+  ASSERT_EQ(mgos_conf_key_id(idx, "debug"), SYS_CONF_KEY_DEBUG);
+  ASSERT_EQ(mgos_conf_key_id(idx, "wifi.ap.nope"), -1);
+  ASSERT_EQ(SYS_CONF_NUM_KEYS, schema->num_desc + 1);
+  ASSERT(mgos_conf_key_entry(idx, SYS_CONF_KEY_HTTP_PORT) ==
+         mgos_conf_find_schema_entry("http.port", schema));
+  ASSERT(mgos_conf_key_entry(idx, 0) == NULL);
+  ASSERT(mgos_conf_key_entry(idx, SYS_CONF_NUM_KEYS) == NULL);
+
+  ASSERT_EQ(mgos_conf_parse_index(mg_mk_str(json1), "*", idx, &conf), true);
+  ASSERT_EQ(conf.wifi.ap.channel, 6);
+  ASSERT_EQ(mgos_conf_value_int(
+                &conf, mgos_conf_key_entry(idx, SYS_CONF_KEY_WIFI_AP_CHANNEL)),
+            6);
+  /* Defaults point to the read-only copies */
+  ASSERT_STREQ(conf.wifi.ap.pass, "Elduderino");
+  ASSERT(mgos_conf_str_is_shared(conf.wifi.ap.pass));
+  ASSERT_EQ(mgos_conf_parse_index(mg_mk_str(json2), "*", idx, &conf), true);
+  ASSERT_STREQ(conf.wifi.sta.ssid, "cookadoodadoo");
+  ASSERT(!mgos_conf_str_is_shared(conf.wifi.sta.ssid));
+  ASSERT_EQ(conf.debug.level, 1);
+  ASSERT(conf.wifi.ap.pass == NULL);
+  ASSERT(mgos_conf_str_is_shared(conf.wifi.ap.dhcp_end));
+  mgos_conf_set_str(&conf.wifi.ap.dhcp_end, "192.168.4.100");
+  ASSERT(!mgos_conf_str_is_shared(conf.wifi.ap.dhcp_end));
+  ASSERT_STREQ(conf.wifi.ap.dhcp_end, "192.168.4.100");
+
+  /* Compiled ACL must agree with mgos_conf_check_access() */
+  const char *acls[] = {"*", "wifi.*", "-wifi.ap.pass,wifi.ap.*", "debug.level",
+                        "+http.*,-*", "wifi.a?.ssid", "w*", NULL};
+  const char *keys[] = {"wifi.ap.pass", "wifi.ap.ssid", "debug.level",
+                        "http.port", "wifi", NULL};
+  int i, j;
+  for (i = 0; acls[i] != NULL; i++) {
+    struct mgos_conf_acl cacl;
+    mgos_conf_acl_compile(acls[i], &cacl);
+    for (j = 0; keys[j] != NULL; j++) {
+      struct mg_str key = mg_mk_str(keys[j]);
+      ASSERT_EQ(mgos_conf_acl_check(&cacl, key),
+                mgos_conf_check_access(key, acls[i]));
+    }
+  }
+
+  mgos_conf_free(schema, &conf);
+  free(json1);
+  free(json2);
+
+  return NULL;
+}
+
+static const char *test_config_snapshot(void) {
+  size_t size;
+  char *json1 = cs_read_file(".build/sys_conf_defaults.json", &size);
+  char *json2 = cs_read_file("data/overrides.json", &size);
+  const struct mgos_conf_entry *schema = sys_conf_schema();
+  const char *fname = ".build/conf.bin";
+  struct sys_conf conf, conf2;
+  struct mbuf m1, m2;
+
+  memset(&conf, 0, sizeof(conf));
+  memset(&conf2, 0, sizeof(conf2));
+  mbuf_init(&m1, 0);
+  mbuf_init(&m2, 0);
+  ASSERT(json1 != NULL);
+  ASSERT(json2 != NULL);
+  cs_log_set_level(LL_NONE);
+
+  ASSERT_EQ(mgos_conf_parse(mg_mk_str(json1), "*", schema, &conf), true);
+  ASSERT_EQ(mgos_conf_parse(mg_mk_str(json2), "*", schema, &conf), true);
+  ASSERT_EQ(mgos_conf_snapshot_save(&conf, sizeof(conf), schema, 123, fname),
+            true);
+  ASSERT_EQ(mgos_conf_snapshot_load(fname, sizeof(conf), schema, 124, &conf2),
+            false);
+  ASSERT(conf2.wifi.sta.ssid == NULL);
+  ASSERT_EQ(mgos_conf_snapshot_load(fname, sizeof(conf), schema + 1, 123,
+                                    &conf2),
+            false);
+  ASSERT_EQ(mgos_conf_snapshot_load(fname, sizeof(conf), schema, 123, &conf2),
+            true);
+  ASSERT(conf2.wifi.sta.ssid != conf.wifi.sta.ssid);
+  ASSERT(mgos_conf_str_is_shared(conf2.wifi.sta.ssid));
+  ASSERT_STREQ(conf2.wifi.sta.ssid, "cookadoodadoo");
+  ASSERT(conf2.wifi.ap.pass == NULL);
+  ASSERT_EQ(conf2.debug.level, 1);
+  mgos_conf_emit_cb(&conf, NULL, schema, false, &m1, NULL, NULL);
+  mgos_conf_emit_cb(&conf2, NULL, schema, false, &m2, NULL, NULL);
+  ASSERT_EQ(m1.len, m2.len);
+  ASSERT(memcmp(m1.buf, m2.buf, m1.len) == 0);
+
+  /* Truncated snapshot is rejected */
+  char *data = cs_read_file(fname, &size);
+  ASSERT(data != NULL);
+  FILE *fp = fopen(fname, "w");
+  ASSERT(fp != NULL);
+  ASSERT_EQ(fwrite(data, size - 1, 1, fp), 1);
+  fclose(fp);
+  mgos_conf_free(schema, &conf2);
+  ASSERT_EQ(mgos_conf_snapshot_load(fname, sizeof(conf), schema, 123, &conf2),
+            false);
+
+  remove(fname);
+  mgos_conf_free(schema, &conf);
+  mbuf_free(&m1);
+  mbuf_free(&m2);
+  free(data);
+  free(json1);
+  free(json2);
+
+  return NULL;
+}
+
+static const char *test_config_save(void) {
+  size_t size;
+  char *json1 = cs_read_file(".build/sys_conf_defaults.json", &size);
+  const struct mgos_conf_entry *schema = sys_conf_schema();
+  const char *fname = ".build/conf9.json";
+  struct sys_conf defaults, conf;
+  struct stat st1, st2;
+
+  memset(&defaults, 0, sizeof(defaults));
+  memset(&conf, 0, sizeof(conf));
+  ASSERT(json1 != NULL);
+  cs_log_set_level(LL_NONE);
+
+  ASSERT_EQ(mgos_conf_parse(mg_mk_str(json1), "*", schema, &defaults), true);
+  ASSERT_EQ(mgos_conf_parse(mg_mk_str(json1), "*", schema, &conf), true);
+  conf.http.port = 8080;
+
+  /* Unchanged file is not rewritten */
+  remove(fname);
+  ASSERT_EQ(mgos_conf_emit_f(&conf, &defaults, schema, true, fname), true);
+  ASSERT_EQ(stat(fname, &st1), 0);
+  ASSERT_EQ(mgos_conf_emit_f(&conf, &defaults, schema, true, fname), true);
+  ASSERT_EQ(stat(fname, &st2), 0);
+  ASSERT(st1.st_ino == st2.st_ino);
+  conf.http.port = 8081;
+  ASSERT_EQ(mgos_conf_emit_f(&conf, &defaults, schema, true, fname), true);
+  ASSERT_EQ(stat(fname, &st2), 0);
+  ASSERT(st1.st_ino != st2.st_ino);
+  char *json2 = cs_read_file(fname, &size);
+  ASSERT(json2 != NULL);
+  ASSERT(strstr(json2, "8081") != NULL);
+
+  remove(fname);
+  mgos_conf_free(schema, &conf);
+  mgos_conf_free(schema, &defaults);
+  free(json1);
+  free(json2);
+
+  return NULL;
+}
+
 static const char *test_json_scanf(void) {
   int a = 0;
   bool b = false;
@@ -62,9 +236,141 @@ static const char *test_json_scanf(void) {
   return NULL;
 }
 
+static void scan_nested(const char *str, int len, void *user_data) {
+  static const char *fmts[] = {"{k:%d}",   "{k: %d}",   "{k:%d }",
+                               "{k : %d}", "{ k:%d}",   "{k:%d,}",
+                               "{ k: %d}", "{k:  %d}",  "{k :%d}"};
+  int *n = (int *) user_data;
+  size_t i;
+  for (i = 0; i < sizeof(fmts) / sizeof(fmts[0]); i++) {
+    int k = 0;
+    if (json_scanf(str, len, fmts[i], &k) == 1 && k == 1) (*n)++;
+  }
+}
+
+static const char *test_json_scanf_plan(void) {
+  int a = 0, i;
+  char *s = NULL;
+  struct json_token t = JSON_INVALID_TOKEN;
+  const char *str = "{\"x\":{\"y\":[1,{\"z\":3}]},\"s\":\"hi\",\"a\":2}";
+  struct json_scanf_plan *plan = json_scanf_compile("{a:%d, x:{y:%T}, s:%Q}");
+  ASSERT(plan != NULL);
+  ASSERT_EQ(json_scanf_with_plan(str, strlen(str), plan, &a, &t, &s), 3);
+  ASSERT_EQ(a, 2);
+  ASSERT_EQ(t.type, JSON_TYPE_ARRAY_END);
+  ASSERT_STREQ(s, "hi");
+  free(s);
+  json_scanf_plan_free(plan);
+
+  /* Second time around the plan comes from the cache */
+  for (i = 0; i < 2; i++) {
+    a = 0;
+    ASSERT_EQ(json_scanf(str, strlen(str), "{x:{y:%T}, a:%d}", &t, &a), 2);
+    ASSERT_EQ(a, 2);
+  }
+
+  /* Nested calls with more formats than the cache holds */
+  for (i = 0; i < 2; i++) {
+    int n = 0;
+    a = 0;
+    str = "{\"m\":{\"k\":1},\"a\":2}";
+    ASSERT_EQ(json_scanf(str, strlen(str), "{m:%M, a:%d}", scan_nested, &n,
+                         &a),
+              2);
+    ASSERT_EQ(n, 9);
+    ASSERT_EQ(a, 2);
+  }
+
+  return NULL;
+}
+
+static const char *test_json_tape(void) {
+  int v = 0;
+  struct json_token t = JSON_INVALID_TOKEN;
+  struct json_tape_tok toks[4];
+  struct json_tape tape = JSON_TAPE(toks);
+  const char *str = "{\"state\":{\"a\":[1,{\"b\":true}],\"c\":\"x\"},\"v\":7}";
+  ASSERT_EQ(json_tape_parse(&tape, str, strlen(str)), JSON_TAPE_OVERFLOW);
+  ASSERT_EQ(json_tape_parse_dyn(&tape, str, strlen(str)), 8);
+  ASSERT_EQ(json_tape_scanf(&tape, "{v:%d, state:{c:%T}}", &v, &t), 2);
+  ASSERT_EQ(v, 7);
+  ASSERT_EQ(t.len, 1);
+  ASSERT_EQ(json_tape_token(&tape, json_tape_find(&tape, 0, ".state.a[1].b"),
+                            &t),
+            1);
+  ASSERT_EQ(t.type, JSON_TYPE_TRUE);
+  ASSERT_EQ(json_tape_find(&tape, 0, ".state.a[2]"), -1);
+  json_tape_free(&tape);
+  return NULL;
+}
+
+static const char *test_json_printf(void) {
+  int i;
+  char buf[100];
+  const char *fmt = "{id: %lld, value: %d, d: %D, s: %Q}";
+  for (i = 0; i < 2; i++) {
+    struct json_out out = JSON_OUT_BUF(buf, sizeof(buf));
+    ASSERT_EQ(json_printf(&out, fmt, (int64_t) -12345678901LL, -7, 0.1,
+                          "a\"b"),
+              56);
+    ASSERT_STREQ(buf,
+                 "{\"id\": -12345678901, \"value\": -7, \"d\": 0.1, "
+                 "\"s\": \"a\\\"b\"}");
+  }
+  return NULL;
+}
+
+struct push_test_info {
+  int num_events;
+  char version[8];
+};
+
+static void push_test_cb(void *data, const char *name, size_t name_len,
+                         const char *path, const struct json_token *token) {
+  struct push_test_info *info = (struct push_test_info *) data;
+  info->num_events++;
+  if (strcmp(path, ".parts.fw.version") == 0) {
+    snprintf(info->version, sizeof(info->version), "%.*s", (int) token->len,
+             token->ptr);
+  }
+  (void) name;
+  (void) name_len;
+}
+
+static const char *test_json_push(void) {
+  const char *str =
+      "{\"name\": \"x\", \"parts\": {\"fw\": {\"version\": \"1.2\"}}, "
+      "\"size\": 12345}";
+  struct push_test_info info;
+  struct json_push_parser p;
+  char buf[16];
+  size_t i;
+  memset(&info, 0, sizeof(info));
+  json_push_init(&p, buf, sizeof(buf), push_test_cb, &info);
+  /* One byte at a time, every token spans chunks */
+  for (i = 0; i < strlen(str); i++) {
+    ASSERT_EQ(json_push_feed(&p, str + i, 1), 1);
+  }
+  ASSERT_EQ(json_push_end(&p), 0);
+  ASSERT_EQ(info.num_events, 9);
+  ASSERT_STREQ(info.version, "1.2");
+
+  json_push_init(&p, buf, sizeof(buf), NULL, NULL);
+  ASSERT_EQ(json_push_feed(&p, "[1, 2", 5), 5);
+  ASSERT_EQ(json_push_end(&p), JSON_STRING_INCOMPLETE);
+  return NULL;
+}
+
 static const char *run_tests(const char *filter, double *total_elapsed) {
   RUN_TEST(test_config);
+  RUN_TEST(test_config_index);
+  RUN_TEST(test_config_snapshot);
+  RUN_TEST(test_config_save);
   RUN_TEST(test_json_scanf);
+  RUN_TEST(test_json_scanf_plan);
+  RUN_TEST(test_json_tape);
+  RUN_TEST(test_json_printf);
+  RUN_TEST(test_json_push);
   return NULL;
 }
 
@@ -63,6 +63,7 @@ import sys
 parser = argparse.ArgumentParser(description="Create C config boilerplate from a YAML schema")
 parser.add_argument("--c_name", required=True, help="name of the top-level C struct")
 parser.add_argument("--c_const_char", type=bool, default=False, help="Generate const char members for strings")
+parser.add_argument("--c_str_defaults", type=bool, default=False, help="Generate read-only copies of default string values, used instead of allocating them")
 parser.add_argument("--dest_dir", default=".", help="base path of generated files")
 parser.add_argument("schema_files", nargs="+", help="YAML schema files")
 
@@ -223,19 +224,30 @@ class HWriter(object):
         self._struct_name = struct_name
         self._const_char = const_char
         self._lines = []
+        self._keys = []
         self._indent = 2
 
     def _Indent(self):
         return " " * self._indent
 
+    # Key ids are schema indices, entry 0 being the root.
+    def _AddKey(self, e):
+        key = "%s_KEY_%s" % (self._struct_name.upper(),
+                             e.path.replace(".", "_").upper())
+        if key in self._keys:
+            raise ValueError("%s: Duplicate key id %s" % (e.path, key))
+        self._keys.append(key)
+
     def ObjectStart(self, e):
         self._lines.append(
             (" " * self._indent) +
             ("struct %s_%s {" % (self._struct_name, e.path.replace(".", "_"))))
         self._indent += 2
+        self._AddKey(e)
 
     def Value(self, e):
         key = e.key
+        self._AddKey(e)
         if e.vtype in (SchemaEntry.V_BOOL, SchemaEntry.V_INT):
             self._lines.append(self._Indent() + ("int %s;" % key))
         elif e.vtype == SchemaEntry.V_DOUBLE:
@@ -263,12 +275,90 @@ struct {name} {{
 {lines}
 }};
 
+/* Ids for mgos_conf_key_entry(), same as indices in the schema. */
+enum {name}_key {{
+{keys}
+}};
+
 const struct mgos_conf_entry *{name}_schema();
+const struct mgos_conf_index *{name}_index();
 
 #endif /* {name_uc}_H_ */
 """.format(name=self._struct_name,
            name_uc=self._struct_name.upper(),
-           lines="\n".join(self._lines))
+           lines="\n".join(self._lines),
+           keys="\n".join(
+               ["  %s = 1," % k for k in self._keys[:1]] +
+               ["  %s," % k for k in self._keys[1:]] +
+               ["  %s_NUM_KEYS" % self._struct_name.upper() +
+                ("" if self._keys else " = 1")]))
+
+
+# Perfect hash of full entry paths ("hash and displace"), see
+# struct mgos_conf_index in mgos_config.h. Sizes are powers of 2 so that
+# lookups need no division.
+class PerfectHash(object):
+    def __init__(self, paths):
+        # paths[i] is the path of schema entry i, entry 0 (root) is not hashed.
+        keys = [(i, self._Hash(p)) for i, p in enumerate(paths) if i > 0]
+        hashes = set()
+        for _, h in keys:
+            if h in hashes:
+                raise ValueError("Path hash collision, change _Hash()")
+            hashes.add(h)
+        self.num_buckets = self._Pow2(max(1, len(keys) // 4))
+        self.num_slots = self._Pow2(max(1, len(keys)))
+        while not self._Build(keys):
+            self.num_slots *= 2
+
+    @staticmethod
+    def _Pow2(n):
+        p = 1
+        while p < n:
+            p *= 2
+        return p
+
+    # Must match mgos_conf_index_find().
+    @staticmethod
+    def _Hash(s):
+        h = 2166136261
+        for c in bytearray(s.encode("utf-8")):
+            h = ((h ^ c) * 16777619) & 0xffffffff
+        return h
+
+    # Must match mgos_conf_index_slot().
+    @staticmethod
+    def _Slot(h, d, num_slots):
+        x = h ^ ((d * 0x9e3779b9) & 0xffffffff)
+        x ^= x >> 16
+        x = (x * 0x85ebca6b) & 0xffffffff
+        x ^= x >> 13
+        x = (x * 0xc2b2ae35) & 0xffffffff
+        x ^= x >> 16
+        return x & (num_slots - 1)
+
+    def _Build(self, keys):
+        buckets = [[] for _ in range(self.num_buckets)]
+        for i, h in keys:
+            buckets[h & (self.num_buckets - 1)].append((i, h))
+        self.disp = [0] * self.num_buckets
+        self.slots = [0] * self.num_slots
+        # Largest buckets first, while there is most room.
+        order = sorted(range(self.num_buckets), key=lambda b: -len(buckets[b]))
+        for b in order:
+            if not buckets[b]:
+                continue
+            for d in range(1 << 16):
+                pos = [self._Slot(h, d, self.num_slots) for _, h in buckets[b]]
+                if (len(set(pos)) == len(pos) and
+                        all(self.slots[p] == 0 for p in pos)):
+                    break
+            else:
+                return False
+            self.disp[b] = d
+            for (i, _), p in zip(buckets[b], pos):
+                self.slots[p] = i
+        return True
 
 
 # Writes C source file with schema definition.
@@ -280,19 +370,71 @@ class CWriter(object):
         SchemaEntry.V_STRING: "CONF_TYPE_STRING",
     }
 
-    def __init__(self, struct_name):
+    def __init__(self, struct_name, str_defaults):
         self._struct_name = struct_name
         self._lines = []
+        self._paths = [""]
         self._start_indices = []
+        self._str_defaults = ([None] if str_defaults else None)
 
-    def ObjectStart(self, _e):
+    def ObjectStart(self, e):
         self._start_indices.append(len(self._lines))
         self._lines.append(None)  # Placeholder
+        self._paths.append(e.path)
+        if self._str_defaults is not None:
+            self._str_defaults.append(None)
 
     def Value(self, e):
         self._lines.append(
             '  {.type = %s, .key = "%s", .offset = offsetof(struct %s, %s)},'
             % (self._CONF_TYPES[e.vtype], e.key, self._struct_name, e.path))
+        self._paths.append(e.path)
+        if self._str_defaults is not None:
+            self._str_defaults.append(
+                e.default if e.vtype == SchemaEntry.V_STRING and e.default
+                else None)
+
+    @staticmethod
+    def _CStr(s):
+        res = []
+        for c in bytearray(s.encode("utf-8")):
+            if 32 <= c < 127 and chr(c) not in "\\\"?":
+                res.append(chr(c))
+            else:
+                res.append("\\%03o" % c)
+        return "".join(res)
+
+    # Pool of unique default strings and per-entry offset + 1 into it.
+    def _StrDefaults(self):
+        pool, offsets, lines = {}, [], []
+        size = 0
+        for v in self._str_defaults:
+            if v is None:
+                offsets.append(0)
+                continue
+            if v not in pool:
+                pool[v] = size
+                lines.append('  "%s\\0"' % self._CStr(v))
+                size += len(v.encode("utf-8")) + 1
+            offsets.append(pool[v] + 1)
+        if size >= 0xffff:
+            raise ValueError("Default strings are too long")
+        return """
+static const char {name}_str_pool_[{size}] =
+{lines};
+
+static const uint16_t {name}_str_defaults_[{num_entries}] = {{
+{offsets}
+}};
+""".format(name=self._struct_name, size=max(size, 1),
+           lines="\n".join(lines) if lines else '  ""',
+           num_entries=len(offsets), offsets=self._Ints(offsets)), size
+
+    @staticmethod
+    def _Ints(values):
+        return "\n".join(
+            "  %s," % ", ".join(str(v) for v in values[i:i + 12])
+            for i in range(0, len(values), 12))
 
     def ObjectEnd(self, e):
         si = self._start_indices.pop()
@@ -302,6 +444,14 @@ class CWriter(object):
             % (e.key, num_desc))
 
     def __str__(self):
+        ph = PerfectHash(self._paths)
+        str_defaults, str_fields = "", ""
+        if self._str_defaults is not None:
+            str_defaults, size = self._StrDefaults()
+            str_fields = """
+  .str_pool = {name}_str_pool_,
+  .str_defaults = {name}_str_defaults_,
+  .str_pool_size = {size},""".format(name=self._struct_name, size=size)
         return """\
 /* Generated file - do not edit. */
 
@@ -316,10 +466,42 @@ const struct mgos_conf_entry {name}_schema_[{num_entries}] = {{
 const struct mgos_conf_entry *{name}_schema() {{
   return {name}_schema_;
 }}
+
+static const char *const {name}_paths_[{num_entries}] = {{
+{paths}
+}};
+
+static const uint16_t {name}_disp_[{num_buckets}] = {{
+{disp}
+}};
+
+static const uint16_t {name}_slots_[{num_slots}] = {{
+{slots}
+}};
+{str_defaults}
+const struct mgos_conf_index {name}_index_ = {{
+  .schema = {name}_schema_,
+  .paths = {name}_paths_,
+  .disp = {name}_disp_,
+  .slots = {name}_slots_,
+  .num_buckets = {num_buckets},
+  .num_slots = {num_slots},{str_fields}
+}};
+
+const struct mgos_conf_index *{name}_index() {{
+  return &{name}_index_;
+}}
 """.format(name=self._struct_name,
            num_entries=len(self._lines) + 1,
            num_desc=len(self._lines),
-           lines="\n".join(self._lines))
+           lines="\n".join(self._lines),
+           paths="\n".join('  "%s",' % p for p in self._paths),
+           num_buckets=ph.num_buckets,
+           disp=self._Ints(ph.disp),
+           num_slots=ph.num_slots,
+           slots=self._Ints(ph.slots),
+           str_defaults=str_defaults,
+           str_fields=str_fields)
 
 
 @contextlib. contextmanager
@@ -375,7 +557,7 @@ if __name__ == "__main__":
     with open_with_temp(hfn) as hf:
         hf.write(str(hw))
 
-    cw = CWriter(args.c_name)
+    cw = CWriter(args.c_name, args.c_str_defaults)
     schema.Walk(cw)
     cfn = os.path.join(args.dest_dir, "%s.c" % args.c_name)
     with open_with_temp(cfn) as cf:
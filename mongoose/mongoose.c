@@ -66,11 +66,40 @@ struct ctl_msg {
   char message[MG_CTL_MSG_MESSAGE_SIZE];
 };
 
+#if MG_ENABLE_ASYNC_RESOLVER
+MG_INTERNAL int mg_resolve_from_cache(struct mg_mgr *mgr, const char *name,
+                                      union socket_address *sa);
+MG_INTERNAL void mg_resolve_cache_free(struct mg_mgr *mgr);
+MG_INTERNAL void mg_resolve_async_set_timer(struct mg_mgr *mgr, void *data,
+                                            double timestamp);
+MG_INTERNAL void mg_resolve_async_poll(struct mg_mgr *mgr);
+MG_INTERNAL void mg_resolve_async_cancel(struct mg_mgr *mgr);
+#endif
+
 #if MG_ENABLE_MQTT
 struct mg_mqtt_message;
 MG_INTERNAL int parse_mqtt(struct mbuf *io, struct mg_mqtt_message *mm);
 #endif
 
+#if MG_ENABLE_SSL && MG_SSL_IF == MG_SSL_IF_OPENSSL
+/* Tells Krypton (KR_VERSION), which cannot export sessions, from OpenSSL. */
+#include <openssl/ssl.h>
+#endif
+
+#if MG_ENABLE_SSL && MG_SSL_IF_SESSION_CACHE_SIZE > 0 && \
+    !defined(KR_VERSION) &&                            \
+    (MG_SSL_IF == MG_SSL_IF_OPENSSL || MG_SSL_IF == MG_SSL_IF_MBEDTLS)
+#define MG_SSL_IF_ENABLE_SESSION_CACHE 1
+/* Session cache is generic, sessions themselves are backend-specific. */
+MG_INTERNAL void *mg_ssl_if_session_cache_get(const char *key);
+MG_INTERNAL void mg_ssl_if_session_cache_put(const char *key, void *sess);
+MG_INTERNAL void mg_ssl_if_session_free(void *sess);
+MG_INTERNAL int mg_ssl_if_session_save(void *sess, struct mbuf *out);
+MG_INTERNAL void *mg_ssl_if_session_load(const char *data, size_t len);
+#else
+#define MG_SSL_IF_ENABLE_SESSION_CACHE 0
+#endif
+
 /* Forward declarations for testing. */
 extern void *(*test_malloc)(size_t size);
 extern void *(*test_calloc)(size_t count, size_t size);
@@ -355,28 +384,28 @@ void cs_log_set_level(enum cs_log_level level) {
 
 /* Amalgamated: #include "common/cs_dbg.h" */
 
-/* ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/ */
+#if !CS_BASE64_DISABLE_SIMD && (defined(__clang__) || __GNUC__ >= 5) && \
+    (defined(__x86_64__) || defined(__i386__))
+#define CS_BASE64_SSSE3 1
+#include <immintrin.h>
+#endif
+
+#if !CS_BASE64_DISABLE_SIMD && defined(__aarch64__) && defined(__ARM_NEON)
+#define CS_BASE64_NEON 1
+#include <arm_neon.h>
+#endif
+
+static const char s_b64_chars[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
 
-#define NUM_UPPERCASES ('Z' - 'A' + 1)
-#define NUM_LETTERS (NUM_UPPERCASES * 2)
-#define NUM_DIGITS ('9' - '0' + 1)
 
 /*
  * Emit a base64 code char.
  *
- * Doesn't use memory, thus it's safe to use to safely dump memory in crashdumps
+ * Doesn't allocate memory, thus it's safe to use to dump memory in crashdumps
  */
 static void cs_base64_emit_code(struct cs_base64_ctx *ctx, int v) {
-  if (v < NUM_UPPERCASES) {
-    ctx->b64_putc(v + 'A', ctx->user_data);
-  } else if (v < (NUM_LETTERS)) {
-    ctx->b64_putc(v - NUM_UPPERCASES + 'a', ctx->user_data);
-  } else if (v < (NUM_LETTERS + NUM_DIGITS)) {
-    ctx->b64_putc(v - NUM_LETTERS + '0', ctx->user_data);
-  } else {
-    ctx->b64_putc(v - NUM_LETTERS - NUM_DIGITS == 0 ? '+' : '/',
-                  ctx->user_data);
-  }
+  ctx->b64_putc(s_b64_chars[v], ctx->user_data);
 }
 
 static void cs_base64_emit_chunk(struct cs_base64_ctx *ctx) {
@@ -426,6 +455,121 @@ void cs_base64_finish(struct cs_base64_ctx *ctx) {
   }
 }
 
+#ifdef CS_BASE64_SSSE3
+/*
+ * 12 input bytes -> 16 output chars per iteration. See Wojciech Mula,
+ * "Base64 encoding with SIMD instructions".
+ */
+__attribute__((target("ssse3"))) static size_t cs_base64_encode_ssse3(
+    const unsigned char *src, size_t len, char *dst) {
+  const __m128i shuf =
+      _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1);
+  const __m128i lut = _mm_setr_epi8(65, 71, -4, -4, -4, -4, -4, -4, -4, -4, -4,
+                                    -4, -19, -16, 0, 0);
+  size_t n = 0;
+  /* Loads are 16 bytes wide, only 12 are consumed. */
+  while (len - n >= 16) {
+    __m128i in = _mm_loadu_si128((const __m128i *) (src + n)), t0, t1, idx;
+    /* Split 3 bytes into 4 6-bit indices, one per output byte. */
+    in = _mm_shuffle_epi8(in, shuf);
+    t0 = _mm_mulhi_epu16(_mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00)),
+                         _mm_set1_epi32(0x04000040));
+    t1 = _mm_mullo_epi16(_mm_and_si128(in, _mm_set1_epi32(0x003f03f0)),
+                         _mm_set1_epi32(0x01000010));
+    in = _mm_or_si128(t0, t1);
+    /* Map indices to ASCII by adding a per-range offset. */
+    idx = _mm_subs_epu8(in, _mm_set1_epi8(51));
+    idx = _mm_sub_epi8(idx, _mm_cmpgt_epi8(in, _mm_set1_epi8(25)));
+    in = _mm_add_epi8(in, _mm_shuffle_epi8(lut, idx));
+    _mm_storeu_si128((__m128i *) dst, in);
+    dst += 16;
+    n += 12;
+  }
+  return n;
+}
+
+static int cs_base64_have_ssse3(void) {
+  static int s_have = -1;
+  if (s_have < 0) {
+    __builtin_cpu_init();
+    s_have = __builtin_cpu_supports("ssse3");
+  }
+  return s_have;
+}
+#endif /* CS_BASE64_SSSE3 */
+
+#ifdef CS_BASE64_NEON
+/* 48 input bytes -> 64 output chars per iteration. */
+static size_t cs_base64_encode_neon(const unsigned char *src, size_t len,
+                                    char *dst) {
+  const uint8x16_t mask = vdupq_n_u8(0x3F);
+  uint8x16x4_t tbl, out;
+  size_t n = 0;
+  tbl.val[0] = vld1q_u8((const uint8_t *) s_b64_chars);
+  tbl.val[1] = vld1q_u8((const uint8_t *) s_b64_chars + 16);
+  tbl.val[2] = vld1q_u8((const uint8_t *) s_b64_chars + 32);
+  tbl.val[3] = vld1q_u8((const uint8_t *) s_b64_chars + 48);
+  while (len - n >= 48) {
+    uint8x16x3_t in = vld3q_u8(src + n);
+    out.val[0] = vshrq_n_u8(in.val[0], 2);
+    out.val[1] = vandq_u8(
+        vorrq_u8(vshrq_n_u8(in.val[1], 4), vshlq_n_u8(in.val[0], 4)), mask);
+    out.val[2] = vandq_u8(
+        vorrq_u8(vshrq_n_u8(in.val[2], 6), vshlq_n_u8(in.val[1], 2)), mask);
+    out.val[3] = vandq_u8(in.val[2], mask);
+    out.val[0] = vqtbl4q_u8(tbl, out.val[0]);
+    out.val[1] = vqtbl4q_u8(tbl, out.val[1]);
+    out.val[2] = vqtbl4q_u8(tbl, out.val[2]);
+    out.val[3] = vqtbl4q_u8(tbl, out.val[3]);
+    vst4q_u8((uint8_t *) dst, out);
+    dst += 64;
+    n += 48;
+  }
+  return n;
+}
+#endif /* CS_BASE64_NEON */
+
+size_t cs_base64_encode_block(const unsigned char *src, size_t src_len,
+                              char *dst) {
+  char *p = dst;
+  size_t i = 0;
+
+#if defined(CS_BASE64_SSSE3)
+  if (src_len >= 16 && cs_base64_have_ssse3()) {
+    i = cs_base64_encode_ssse3(src, src_len, p);
+    p += i / 3 * 4;
+  }
+#elif defined(CS_BASE64_NEON)
+  i = cs_base64_encode_neon(src, src_len, p);
+  p += i / 3 * 4;
+#endif
+
+  for (; i + 3 <= src_len; i += 3) {
+    uint32_t v = (uint32_t) src[i] << 16 | (uint32_t) src[i + 1] << 8 |
+                 src[i + 2];
+    p[0] = s_b64_chars[v >> 18];
+    p[1] = s_b64_chars[(v >> 12) & 63];
+    p[2] = s_b64_chars[(v >> 6) & 63];
+    p[3] = s_b64_chars[v & 63];
+    p += 4;
+  }
+  if (i < src_len) {
+    uint32_t v = (uint32_t) src[i] << 16 |
+                 (i + 1 < src_len ? (uint32_t) src[i + 1] << 8 : 0);
+    p[0] = s_b64_chars[v >> 18];
+    p[1] = s_b64_chars[(v >> 12) & 63];
+    p[2] = (i + 1 < src_len ? s_b64_chars[(v >> 6) & 63] : '=');
+    p[3] = '=';
+    p += 4;
+  }
+
+  return p - dst;
+}
+
+void cs_base64_encode(const unsigned char *src, int src_len, char *dst) {
+  dst[cs_base64_encode_block(src, src_len, dst)] = '\0';
+}
+
 #define BASE64_ENCODE_BODY                                                \
   static const char *b64 =                                                \
       "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/"; \
@@ -451,23 +595,6 @@ void cs_base64_finish(struct cs_base64_ctx *ctx) {
   }                                                                       \
   BASE64_FLUSH()
 
-#define BASE64_OUT(ch) \
-  do {                 \
-    dst[j++] = (ch);   \
-  } while (0)
-
-#define BASE64_FLUSH() \
-  do {                 \
-    dst[j++] = '\0';   \
-  } while (0)
-
-void cs_base64_encode(const unsigned char *src, int src_len, char *dst) {
-  BASE64_ENCODE_BODY;
-}
-
-#undef BASE64_OUT
-#undef BASE64_FLUSH
-
 #if CS_ENABLE_STDIO
 #define BASE64_OUT(ch)      \
   do {                      \
@@ -485,65 +612,110 @@ void cs_fprint_base64(FILE *f, const unsigned char *src, int src_len) {
 #undef BASE64_FLUSH
 #endif /* CS_ENABLE_STDIO */
 
-/* Convert one byte of encoded base64 input stream to 6-bit chunk */
-static unsigned char from_b64(unsigned char ch) {
-  /* Inverse lookup map */
-  static const unsigned char tab[128] = {
-      255, 255, 255, 255,
-      255, 255, 255, 255, /*  0 */
-      255, 255, 255, 255,
-      255, 255, 255, 255, /*  8 */
-      255, 255, 255, 255,
-      255, 255, 255, 255, /*  16 */
-      255, 255, 255, 255,
-      255, 255, 255, 255, /*  24 */
-      255, 255, 255, 255,
-      255, 255, 255, 255, /*  32 */
-      255, 255, 255, 62,
-      255, 255, 255, 63, /*  40 */
-      52,  53,  54,  55,
-      56,  57,  58,  59, /*  48 */
-      60,  61,  255, 255,
-      255, 200, 255, 255, /*  56   '=' is 200, on index 61 */
-      255, 0,   1,   2,
-      3,   4,   5,   6, /*  64 */
-      7,   8,   9,   10,
-      11,  12,  13,  14, /*  72 */
-      15,  16,  17,  18,
-      19,  20,  21,  22, /*  80 */
-      23,  24,  25,  255,
-      255, 255, 255, 255, /*  88 */
-      255, 26,  27,  28,
-      29,  30,  31,  32, /*  96 */
-      33,  34,  35,  36,
-      37,  38,  39,  40, /*  104 */
-      41,  42,  43,  44,
-      45,  46,  47,  48, /*  112 */
-      49,  50,  51,  255,
-      255, 255, 255, 255, /*  120 */
-  };
-  return tab[ch & 127];
+/*
+ * Inverse lookup map: 6-bit value of a base64 char, 200 for '=' and 255 for
+ * anything else.
+ */
+static const unsigned char s_b64_rev[256] = {
+      255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+      255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+      255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,  62, 255, 255, 255,  63,
+       52,  53,  54,  55,  56,  57,  58,  59,  60,  61, 255, 255, 255, 200, 255, 255,
+      255,   0,   1,   2,   3,   4,   5,   6,   7,   8,   9,  10,  11,  12,  13,  14,
+       15,  16,  17,  18,  19,  20,  21,  22,  23,  24,  25, 255, 255, 255, 255, 255,
+      255,  26,  27,  28,  29,  30,  31,  32,  33,  34,  35,  36,  37,  38,  39,  40,
+       41,  42,  43,  44,  45,  46,  47,  48,  49,  50,  51, 255, 255, 255, 255, 255,
+      255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+      255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+      255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+      255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+      255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+      255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+      255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+      255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+};
+
+#ifdef CS_BASE64_SSSE3
+/*
+ * 16 input chars -> 12 output bytes per iteration; stops at the first block
+ * that contains anything but the 64 base64 chars, which is then left to the
+ * scalar loop. See Wojciech Mula, "Base64 decoding with SIMD instructions".
+ */
+__attribute__((target("ssse3"))) static size_t cs_base64_decode_ssse3(
+    const unsigned char *s, size_t len, char *dst) {
+  const __m128i lut_lo = _mm_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+                                       0x11, 0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B,
+                                       0x1B, 0x1A);
+  const __m128i lut_hi = _mm_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04,
+                                       0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+                                       0x10, 0x10);
+  const __m128i lut_roll =
+      _mm_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+  const __m128i mask_2f = _mm_set1_epi8(0x2f);
+  const __m128i pack = _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1,
+                                     -1, -1, -1);
+  size_t n = 0;
+  /*
+   * Stores are 16 bytes wide, only 12 are produced; the 8 chars required to
+   * follow guarantee there's room for the extra 4 in the output.
+   */
+  while (len - n >= 24) {
+    __m128i in = _mm_loadu_si128((const __m128i *) (s + n));
+    __m128i hi_nibbles = _mm_and_si128(_mm_srli_epi32(in, 4), mask_2f);
+    __m128i lo = _mm_shuffle_epi8(lut_lo, _mm_and_si128(in, mask_2f));
+    __m128i hi = _mm_shuffle_epi8(lut_hi, hi_nibbles);
+    __m128i roll = _mm_shuffle_epi8(
+        lut_roll, _mm_add_epi8(_mm_cmpeq_epi8(in, mask_2f), hi_nibbles));
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(lo, hi),
+                                         _mm_setzero_si128())) != 0xFFFF) {
+      break;
+    }
+    in = _mm_add_epi8(in, roll);
+    /* Pack 4 6-bit values into 3 bytes. */
+    in = _mm_maddubs_epi16(in, _mm_set1_epi32(0x01400140));
+    in = _mm_madd_epi16(in, _mm_set1_epi32(0x00011000));
+    _mm_storeu_si128((__m128i *) dst, _mm_shuffle_epi8(in, pack));
+    dst += 12;
+    n += 16;
+  }
+  return n;
 }
+#endif /* CS_BASE64_SSSE3 */
 
-int cs_base64_decode(const unsigned char *s, int len, char *dst, int *dec_len) {
+size_t cs_base64_decode_block(const unsigned char *s, size_t len, char *dst,
+                              size_t *dec_len) {
   unsigned char a, b, c, d;
-  int orig_len = len;
-  char *orig_dst = dst;
-  while (len >= 4 && (a = from_b64(s[0])) != 255 &&
-         (b = from_b64(s[1])) != 255 && (c = from_b64(s[2])) != 255 &&
-         (d = from_b64(s[3])) != 255) {
-    s += 4;
-    len -= 4;
+  size_t i = 0;
+  char *p = dst;
+
+#ifdef CS_BASE64_SSSE3
+  if (len >= 24 && cs_base64_have_ssse3()) {
+    i = cs_base64_decode_ssse3(s, len, p);
+    p += i / 4 * 3;
+  }
+#endif
+
+  while (len - i >= 4 && (a = s_b64_rev[s[i]]) != 255 &&
+         (b = s_b64_rev[s[i + 1]]) != 255 &&
+         (c = s_b64_rev[s[i + 2]]) != 255 &&
+         (d = s_b64_rev[s[i + 3]]) != 255) {
+    i += 4;
     if (a == 200 || b == 200) break; /* '=' can't be there */
-    *dst++ = a << 2 | b >> 4;
+    *p++ = a << 2 | b >> 4;
     if (c == 200) break;
-    *dst++ = b << 4 | c >> 2;
+    *p++ = b << 4 | c >> 2;
     if (d == 200) break;
-    *dst++ = c << 6 | d;
+    *p++ = c << 6 | d;
   }
-  *dst = 0;
-  if (dec_len != NULL) *dec_len = (dst - orig_dst);
-  return orig_len - len;
+  if (dec_len != NULL) *dec_len = p - dst;
+  return i;
+}
+
+int cs_base64_decode(const unsigned char *s, int len, char *dst, int *dec_len) {
+  size_t n, consumed = cs_base64_decode_block(s, len, dst, &n);
+  dst[n] = '\0';
+  if (dec_len != NULL) *dec_len = (int) n;
+  return (int) consumed;
 }
 
 #endif /* EXCLUDE_COMMON */
@@ -997,6 +1169,16 @@ void cs_md5_final(unsigned char digest[16], cs_md5_ctx *ctx) {
 /* Amalgamated: #include "common/solarisfixes.h" */
 #endif
 
+#if !CS_DISABLE_SHA1_ACCEL && (defined(__clang__) || __GNUC__ >= 5) && \
+    (defined(__x86_64__) || defined(__i386__))
+#define CS_SHA1_SHANI 1
+#include <cpuid.h>
+#include <immintrin.h>
+#elif !CS_DISABLE_SHA1_ACCEL && defined(__ARM_FEATURE_CRYPTO)
+#define CS_SHA1_ARM 1
+#include <arm_neon.h>
+#endif
+
 union char64long16 {
   unsigned char c[64];
   uint32_t l[16];
@@ -1147,6 +1329,319 @@ void cs_sha1_transform(uint32_t state[5], const unsigned char buffer[64]) {
   (void) e;
 }
 
+#ifdef CS_SHA1_SHANI
+/* SHA extensions (SHA-NI), 4 rounds per sha1rnds4. */
+__attribute__((target("sha,ssse3,sse4.1"))) static void cs_sha1_blocks_shani(
+    uint32_t state[5], const unsigned char *data, uint32_t num_blocks) {
+  const __m128i mask =
+      _mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+  __m128i abcd, abcd_save, e0, e0_save, e1, msg0, msg1, msg2, msg3;
+
+  abcd = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) state), 0x1B);
+  e0 = _mm_set_epi32((int) state[4], 0, 0, 0);
+
+  while (num_blocks-- > 0) {
+    abcd_save = abcd;
+    e0_save = e0;
+    msg0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) data), mask);
+    msg1 =
+        _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (data + 16)), mask);
+    msg2 =
+        _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (data + 32)), mask);
+    msg3 =
+        _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (data + 48)), mask);
+    e0 = _mm_add_epi32(e0, msg0);
+    e1 = abcd;
+    abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+    e1 = _mm_sha1nexte_epu32(e1, msg1);
+    e0 = abcd;
+    abcd = _mm_sha1rnds4_epu32(abcd, e1, 0);
+    msg0 = _mm_sha1msg1_epu32(msg0, msg1);
+    e0 = _mm_sha1nexte_epu32(e0, msg2);
+    e1 = abcd;
+    abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+    msg1 = _mm_sha1msg1_epu32(msg1, msg2);
+    msg0 = _mm_xor_si128(msg0, msg2);
+    e1 = _mm_sha1nexte_epu32(e1, msg3);
+    e0 = abcd;
+    msg0 = _mm_sha1msg2_epu32(msg0, msg3);
+    abcd = _mm_sha1rnds4_epu32(abcd, e1, 0);
+    msg2 = _mm_sha1msg1_epu32(msg2, msg3);
+    msg1 = _mm_xor_si128(msg1, msg3);
+    e0 = _mm_sha1nexte_epu32(e0, msg0);
+    e1 = abcd;
+    msg1 = _mm_sha1msg2_epu32(msg1, msg0);
+    abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+    msg3 = _mm_sha1msg1_epu32(msg3, msg0);
+    msg2 = _mm_xor_si128(msg2, msg0);
+    e1 = _mm_sha1nexte_epu32(e1, msg1);
+    e0 = abcd;
+    msg2 = _mm_sha1msg2_epu32(msg2, msg1);
+    abcd = _mm_sha1rnds4_epu32(abcd, e1, 1);
+    msg0 = _mm_sha1msg1_epu32(msg0, msg1);
+    msg3 = _mm_xor_si128(msg3, msg1);
+    e0 = _mm_sha1nexte_epu32(e0, msg2);
+    e1 = abcd;
+    msg3 = _mm_sha1msg2_epu32(msg3, msg2);
+    abcd = _mm_sha1rnds4_epu32(abcd, e0, 1);
+    msg1 = _mm_sha1msg1_epu32(msg1, msg2);
+    msg0 = _mm_xor_si128(msg0, msg2);
+    e1 = _mm_sha1nexte_epu32(e1, msg3);
+    e0 = abcd;
+    msg0 = _mm_sha1msg2_epu32(msg0, msg3);
+    abcd = _mm_sha1rnds4_epu32(abcd, e1, 1);
+    msg2 = _mm_sha1msg1_epu32(msg2, msg3);
+    msg1 = _mm_xor_si128(msg1, msg3);
+    e0 = _mm_sha1nexte_epu32(e0, msg0);
+    e1 = abcd;
+    msg1 = _mm_sha1msg2_epu32(msg1, msg0);
+    abcd = _mm_sha1rnds4_epu32(abcd, e0, 1);
+    msg3 = _mm_sha1msg1_epu32(msg3, msg0);
+    msg2 = _mm_xor_si128(msg2, msg0);
+    e1 = _mm_sha1nexte_epu32(e1, msg1);
+    e0 = abcd;
+    msg2 = _mm_sha1msg2_epu32(msg2, msg1);
+    abcd = _mm_sha1rnds4_epu32(abcd, e1, 1);
+    msg0 = _mm_sha1msg1_epu32(msg0, msg1);
+    msg3 = _mm_xor_si128(msg3, msg1);
+    e0 = _mm_sha1nexte_epu32(e0, msg2);
+    e1 = abcd;
+    msg3 = _mm_sha1msg2_epu32(msg3, msg2);
+    abcd = _mm_sha1rnds4_epu32(abcd, e0, 2);
+    msg1 = _mm_sha1msg1_epu32(msg1, msg2);
+    msg0 = _mm_xor_si128(msg0, msg2);
+    e1 = _mm_sha1nexte_epu32(e1, msg3);
+    e0 = abcd;
+    msg0 = _mm_sha1msg2_epu32(msg0, msg3);
+    abcd = _mm_sha1rnds4_epu32(abcd, e1, 2);
+    msg2 = _mm_sha1msg1_epu32(msg2, msg3);
+    msg1 = _mm_xor_si128(msg1, msg3);
+    e0 = _mm_sha1nexte_epu32(e0, msg0);
+    e1 = abcd;
+    msg1 = _mm_sha1msg2_epu32(msg1, msg0);
+    abcd = _mm_sha1rnds4_epu32(abcd, e0, 2);
+    msg3 = _mm_sha1msg1_epu32(msg3, msg0);
+    msg2 = _mm_xor_si128(msg2, msg0);
+    e1 = _mm_sha1nexte_epu32(e1, msg1);
+    e0 = abcd;
+    msg2 = _mm_sha1msg2_epu32(msg2, msg1);
+    abcd = _mm_sha1rnds4_epu32(abcd, e1, 2);
+    msg0 = _mm_sha1msg1_epu32(msg0, msg1);
+    msg3 = _mm_xor_si128(msg3, msg1);
+    e0 = _mm_sha1nexte_epu32(e0, msg2);
+    e1 = abcd;
+    msg3 = _mm_sha1msg2_epu32(msg3, msg2);
+    abcd = _mm_sha1rnds4_epu32(abcd, e0, 2);
+    msg1 = _mm_sha1msg1_epu32(msg1, msg2);
+    msg0 = _mm_xor_si128(msg0, msg2);
+    e1 = _mm_sha1nexte_epu32(e1, msg3);
+    e0 = abcd;
+    msg0 = _mm_sha1msg2_epu32(msg0, msg3);
+    abcd = _mm_sha1rnds4_epu32(abcd, e1, 3);
+    msg2 = _mm_sha1msg1_epu32(msg2, msg3);
+    msg1 = _mm_xor_si128(msg1, msg3);
+    e0 = _mm_sha1nexte_epu32(e0, msg0);
+    e1 = abcd;
+    msg1 = _mm_sha1msg2_epu32(msg1, msg0);
+    abcd = _mm_sha1rnds4_epu32(abcd, e0, 3);
+    msg3 = _mm_sha1msg1_epu32(msg3, msg0);
+    msg2 = _mm_xor_si128(msg2, msg0);
+    e1 = _mm_sha1nexte_epu32(e1, msg1);
+    e0 = abcd;
+    msg2 = _mm_sha1msg2_epu32(msg2, msg1);
+    abcd = _mm_sha1rnds4_epu32(abcd, e1, 3);
+    msg3 = _mm_xor_si128(msg3, msg1);
+    e0 = _mm_sha1nexte_epu32(e0, msg2);
+    e1 = abcd;
+    msg3 = _mm_sha1msg2_epu32(msg3, msg2);
+    abcd = _mm_sha1rnds4_epu32(abcd, e0, 3);
+    e1 = _mm_sha1nexte_epu32(e1, msg3);
+    e0 = abcd;
+    abcd = _mm_sha1rnds4_epu32(abcd, e1, 3);
+    e0 = _mm_sha1nexte_epu32(e0, e0_save);
+    abcd = _mm_add_epi32(abcd, abcd_save);
+    data += 64;
+  }
+
+  _mm_storeu_si128((__m128i *) state, _mm_shuffle_epi32(abcd, 0x1B));
+  state[4] = (uint32_t) _mm_extract_epi32(e0, 3);
+}
+
+static int cs_sha1_have_shani(void) {
+  static int s_have = -1;
+  if (s_have < 0) {
+    unsigned int eax, ebx = 0, ecx, edx;
+    /* CPUID leaf 7: EBX bit 29 is SHA. */
+    if (__get_cpuid_max(0, NULL) >= 7) {
+      __cpuid_count(7, 0, eax, ebx, ecx, edx);
+    }
+    (void) eax;
+    (void) ecx;
+    (void) edx;
+    __builtin_cpu_init();
+    s_have = ((ebx >> 29) & 1) && __builtin_cpu_supports("sse4.1");
+  }
+  return s_have;
+}
+#endif /* CS_SHA1_SHANI */
+
+#ifdef CS_SHA1_ARM
+/* ARMv8 Cryptography Extensions. */
+static void cs_sha1_blocks_arm(uint32_t state[5], const unsigned char *data,
+                               uint32_t num_blocks) {
+  const uint32x4_t k0 = vdupq_n_u32(0x5A827999);
+  const uint32x4_t k1 = vdupq_n_u32(0x6ED9EBA1);
+  const uint32x4_t k2 = vdupq_n_u32(0x8F1BBCDC);
+  const uint32x4_t k3 = vdupq_n_u32(0xCA62C1D6);
+  uint32x4_t abcd, abcd_save, tmp0, tmp1, msg0, msg1, msg2, msg3;
+  uint32_t e0, e0_save, e1;
+
+  abcd = vld1q_u32(state);
+  e0 = state[4];
+
+  while (num_blocks-- > 0) {
+    abcd_save = abcd;
+    e0_save = e0;
+    msg0 = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data)));
+    msg1 = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data + 16)));
+    msg2 = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data + 32)));
+    msg3 = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data + 48)));
+    tmp0 = vaddq_u32(msg0, k0);
+    tmp1 = vaddq_u32(msg1, k0);
+    e1 = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+    abcd = vsha1cq_u32(abcd, e0, tmp0);
+    tmp0 = vaddq_u32(msg2, k0);
+    msg0 = vsha1su0q_u32(msg0, msg1, msg2);
+    e0 = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+    abcd = vsha1cq_u32(abcd, e1, tmp1);
+    tmp1 = vaddq_u32(msg3, k0);
+    msg0 = vsha1su1q_u32(msg0, msg3);
+    msg1 = vsha1su0q_u32(msg1, msg2, msg3);
+    e1 = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+    abcd = vsha1cq_u32(abcd, e0, tmp0);
+    tmp0 = vaddq_u32(msg0, k0);
+    msg1 = vsha1su1q_u32(msg1, msg0);
+    msg2 = vsha1su0q_u32(msg2, msg3, msg0);
+    e0 = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+    abcd = vsha1cq_u32(abcd, e1, tmp1);
+    tmp1 = vaddq_u32(msg1, k1);
+    msg2 = vsha1su1q_u32(msg2, msg1);
+    msg3 = vsha1su0q_u32(msg3, msg0, msg1);
+    e1 = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+    abcd = vsha1cq_u32(abcd, e0, tmp0);
+    tmp0 = vaddq_u32(msg2, k1);
+    msg3 = vsha1su1q_u32(msg3, msg2);
+    msg0 = vsha1su0q_u32(msg0, msg1, msg2);
+    e0 = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+    abcd = vsha1pq_u32(abcd, e1, tmp1);
+    tmp1 = vaddq_u32(msg3, k1);
+    msg0 = vsha1su1q_u32(msg0, msg3);
+    msg1 = vsha1su0q_u32(msg1, msg2, msg3);
+    e1 = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+    abcd = vsha1pq_u32(abcd, e0, tmp0);
+    tmp0 = vaddq_u32(msg0, k1);
+    msg1 = vsha1su1q_u32(msg1, msg0);
+    msg2 = vsha1su0q_u32(msg2, msg3, msg0);
+    e0 = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+    abcd = vsha1pq_u32(abcd, e1, tmp1);
+    tmp1 = vaddq_u32(msg1, k1);
+    msg2 = vsha1su1q_u32(msg2, msg1);
+    msg3 = vsha1su0q_u32(msg3, msg0, msg1);
+    e1 = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+    abcd = vsha1pq_u32(abcd, e0, tmp0);
+    tmp0 = vaddq_u32(msg2, k2);
+    msg3 = vsha1su1q_u32(msg3, msg2);
+    msg0 = vsha1su0q_u32(msg0, msg1, msg2);
+    e0 = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+    abcd = vsha1pq_u32(abcd, e1, tmp1);
+    tmp1 = vaddq_u32(msg3, k2);
+    msg0 = vsha1su1q_u32(msg0, msg3);
+    msg1 = vsha1su0q_u32(msg1, msg2, msg3);
+    e1 = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+    abcd = vsha1mq_u32(abcd, e0, tmp0);
+    tmp0 = vaddq_u32(msg0, k2);
+    msg1 = vsha1su1q_u32(msg1, msg0);
+    msg2 = vsha1su0q_u32(msg2, msg3, msg0);
+    e0 = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+    abcd = vsha1mq_u32(abcd, e1, tmp1);
+    tmp1 = vaddq_u32(msg1, k2);
+    msg2 = vsha1su1q_u32(msg2, msg1);
+    msg3 = vsha1su0q_u32(msg3, msg0, msg1);
+    e1 = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+    abcd = vsha1mq_u32(abcd, e0, tmp0);
+    tmp0 = vaddq_u32(msg2, k2);
+    msg3 = vsha1su1q_u32(msg3, msg2);
+    msg0 = vsha1su0q_u32(msg0, msg1, msg2);
+    e0 = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+    abcd = vsha1mq_u32(abcd, e1, tmp1);
+    tmp1 = vaddq_u32(msg3, k3);
+    msg0 = vsha1su1q_u32(msg0, msg3);
+    msg1 = vsha1su0q_u32(msg1, msg2, msg3);
+    e1 = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+    abcd = vsha1mq_u32(abcd, e0, tmp0);
+    tmp0 = vaddq_u32(msg0, k3);
+    msg1 = vsha1su1q_u32(msg1, msg0);
+    msg2 = vsha1su0q_u32(msg2, msg3, msg0);
+    e0 = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+    abcd = vsha1pq_u32(abcd, e1, tmp1);
+    tmp1 = vaddq_u32(msg1, k3);
+    msg2 = vsha1su1q_u32(msg2, msg1);
+    msg3 = vsha1su0q_u32(msg3, msg0, msg1);
+    e1 = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+    abcd = vsha1pq_u32(abcd, e0, tmp0);
+    tmp0 = vaddq_u32(msg2, k3);
+    msg3 = vsha1su1q_u32(msg3, msg2);
+    e0 = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+    abcd = vsha1pq_u32(abcd, e1, tmp1);
+    tmp1 = vaddq_u32(msg3, k3);
+    e1 = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+    abcd = vsha1pq_u32(abcd, e0, tmp0);
+    e0 = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+    abcd = vsha1pq_u32(abcd, e1, tmp1);
+    e0 += e0_save;
+    abcd = vaddq_u32(abcd, abcd_save);
+    data += 64;
+  }
+
+  vst1q_u32(state, abcd);
+  state[4] = e0;
+}
+#endif /* CS_SHA1_ARM */
+
+static void cs_sha1_blocks_scalar(uint32_t state[5], const unsigned char *data,
+                                  uint32_t num_blocks) {
+  while (num_blocks-- > 0) {
+    cs_sha1_transform(state, data);
+    data += 64;
+  }
+}
+
+#ifdef CS_HASH_BENCH
+/* Lets the benchmark time the portable kernel through the full API. */
+static int s_sha1_force_scalar;
+#endif
+
+/* Processes num_blocks consecutive 64-byte blocks. */
+static void cs_sha1_blocks(uint32_t state[5], const unsigned char *data,
+                           uint32_t num_blocks) {
+#ifdef CS_HASH_BENCH
+  if (s_sha1_force_scalar) {
+    cs_sha1_blocks_scalar(state, data, num_blocks);
+    return;
+  }
+#endif
+#if defined(CS_SHA1_SHANI)
+  if (cs_sha1_have_shani()) {
+    cs_sha1_blocks_shani(state, data, num_blocks);
+    return;
+  }
+#elif defined(CS_SHA1_ARM)
+  cs_sha1_blocks_arm(state, data, num_blocks);
+  return;
+#endif
+  cs_sha1_blocks_scalar(state, data, num_blocks);
+}
+
 void cs_sha1_init(cs_sha1_ctx *context) {
   context->state[0] = 0x67452301;
   context->state[1] = 0xEFCDAB89;
@@ -1166,10 +1661,9 @@ void cs_sha1_update(cs_sha1_ctx *context, const unsigned char *data,
   j = (j >> 3) & 63;
   if ((j + len) > 63) {
     memcpy(&context->buffer[j], data, (i = 64 - j));
-    cs_sha1_transform(context->state, context->buffer);
-    for (; i + 63 < len; i += 64) {
-      cs_sha1_transform(context->state, &data[i]);
-    }
+    cs_sha1_blocks(context->state, context->buffer, 1);
+    cs_sha1_blocks(context->state, &data[i], (len - i) / 64);
+    i += (len - i) & ~63U;
     j = 0;
   } else
     i = 0;
@@ -1872,10 +2366,26 @@ int mg_avprintf(char **buf, size_t size, const char *fmt, va_list ap) {
 #endif
 
 #define MG_TUN_PROTO_NAME "mg_tun"
+/* Same, with per-stream flow control. Offered first, dispatcher chooses. */
+#define MG_TUN_PROTO_NAME_FC "mg_tun.fc"
 
 #define MG_TUN_DATA_FRAME 0x0
+/* Body is a 32-bit big-endian number of bytes the receiver has consumed. */
+#define MG_TUN_WINDOW_UPDATE_FRAME 0x1
 #define MG_TUN_F_END_STREAM 0x1
 
+/*
+ * With flow control, a side may have at most this many bytes sent but not
+ * yet consumed by the other side, per stream.
+ */
+#ifndef MG_TUN_STREAM_WINDOW
+#define MG_TUN_STREAM_WINDOW 16384
+#endif
+
+#ifndef MG_TUN_STREAM_TABLE_SIZE
+#define MG_TUN_STREAM_TABLE_SIZE 16
+#endif
+
 /*
  * MG TUN frame format is loosely based on HTTP/2.
  * However since the communication happens via WebSocket
@@ -1901,6 +2411,15 @@ struct mg_tun_ssl_opts {
 #endif
 };
 
+/* Tunneled connection state, `mgr_data` of the connection points to it. */
+struct mg_tun_stream {
+  uint32_t stream_id;
+  struct mg_connection *nc;
+  struct mg_tun_stream *next; /* Hash bucket linkage */
+  size_t send_window;         /* How much more we can send */
+  size_t recv_consumed;       /* Consumed, not yet reported to the peer */
+};
+
 struct mg_tun_client {
   struct mg_mgr *mgr;
   struct mg_iface *iface;
@@ -1908,6 +2427,8 @@ struct mg_tun_client {
   struct mg_tun_ssl_opts ssl;
 
   uint32_t last_stream_id; /* stream id of most recently accepted connection */
+  int flow_control;        /* Dispatcher speaks MG_TUN_PROTO_NAME_FC */
+  struct mg_tun_stream *streams[MG_TUN_STREAM_TABLE_SIZE];
 
   struct mg_connection *disp;
   struct mg_connection *listener;
@@ -1974,12 +2495,14 @@ void mg_tun_destroy_client(struct mg_tun_client *client);
 /* Which flags can be pre-set by the user at connection creation time. */
 #define _MG_ALLOWED_CONNECT_FLAGS_MASK                                   \
   (MG_F_USER_1 | MG_F_USER_2 | MG_F_USER_3 | MG_F_USER_4 | MG_F_USER_5 | \
-   MG_F_USER_6 | MG_F_WEBSOCKET_NO_DEFRAG | MG_F_ENABLE_BROADCAST)
+   MG_F_USER_6 | MG_F_WEBSOCKET_NO_DEFRAG | MG_F_ENABLE_BROADCAST |      \
+   MG_F_COAP_NO_OPTION_LIST)
 /* Which flags should be modifiable by user's callbacks. */
 #define _MG_CALLBACK_MODIFIABLE_FLAGS_MASK                               \
   (MG_F_USER_1 | MG_F_USER_2 | MG_F_USER_3 | MG_F_USER_4 | MG_F_USER_5 | \
    MG_F_USER_6 | MG_F_WEBSOCKET_NO_DEFRAG | MG_F_SEND_AND_CLOSE |        \
-   MG_F_CLOSE_IMMEDIATELY | MG_F_IS_WEBSOCKET | MG_F_DELETE_CHUNK)
+   MG_F_CLOSE_IMMEDIATELY | MG_F_IS_WEBSOCKET | MG_F_DELETE_CHUNK |      \
+   MG_F_COAP_NO_OPTION_LIST)
 
 #ifndef intptr_t
 #define intptr_t long
@@ -2202,6 +2725,10 @@ void mg_mgr_free(struct mg_mgr *m) {
     mg_close_conn(conn);
   }
 
+#if MG_ENABLE_ASYNC_RESOLVER
+  mg_resolve_async_cancel(m);
+#endif
+
   {
     int i;
     for (i = 0; i < m->num_ifaces; i++) {
@@ -2212,6 +2739,9 @@ void mg_mgr_free(struct mg_mgr *m) {
   }
 
   MG_FREE((char *) m->nameserver);
+#if MG_ENABLE_ASYNC_RESOLVER
+  mg_resolve_cache_free(m);
+#endif
 }
 
 time_t mg_mgr_poll(struct mg_mgr *m, int timeout_ms) {
@@ -2223,6 +2753,10 @@ time_t mg_mgr_poll(struct mg_mgr *m, int timeout_ms) {
     return 0;
   }
 
+#if MG_ENABLE_ASYNC_RESOLVER
+  mg_resolve_async_poll(m);
+#endif
+
   for (i = 0; i < m->num_ifaces; i++) {
     now = m->ifaces[i]->vtable->poll(m->ifaces[i], timeout_ms);
   }
@@ -2622,7 +3156,6 @@ static void resolve_cb(struct mg_dns_message *msg, void *data,
       if (msg->answers[i].rtype == MG_DNS_A_RECORD) {
         /*
          * Async resolver guarantees that there is at least one answer.
-         * TODO(lsm): handle IPv6 answers too
          */
         mg_dns_parse_record_data(msg, &msg->answers[i], &nc->sa.sin.sin_addr,
                                  4);
@@ -2630,6 +3163,17 @@ static void resolve_cb(struct mg_dns_message *msg, void *data,
                       &nc->sa);
         return;
       }
+#if MG_ENABLE_IPV6
+      /* Only delivered if there were no A records, see parallel_aaaa. */
+      if (msg->answers[i].rtype == MG_DNS_AAAA_RECORD) {
+        nc->sa.sin6.sin6_family = AF_INET6;
+        mg_dns_parse_record_data(msg, &msg->answers[i],
+                                 &nc->sa.sin6.sin6_addr, 16);
+        mg_do_connect(nc, nc->flags & MG_F_UDP ? SOCK_DGRAM : SOCK_STREAM,
+                      &nc->sa);
+        return;
+      }
+#endif
     }
   }
 
@@ -2695,6 +3239,8 @@ struct mg_connection *mg_connect_opt(struct mg_mgr *mgr, const char *address,
       opts.ssl_psk_identity != NULL) {
     const char *err_msg = NULL;
     struct mg_ssl_if_conn_params params;
+    char skbuf[100], *sk = skbuf;
+    enum mg_ssl_if_result res;
     if (nc->flags & MG_F_UDP) {
       MG_SET_PTRPTR(opts.error_string, "SSL for UDP is not supported");
       mg_destroy_conn(nc, 1 /* destroy_if */);
@@ -2716,7 +3262,20 @@ struct mg_connection *mg_connect_opt(struct mg_mgr *mgr, const char *address,
         params.server_name = host;
       }
     }
-    if (mg_ssl_if_conn_init(nc, &params, &err_msg) != MG_SSL_OK) {
+    /*
+     * A session is only offered to a connection with the same verification
+     * settings and identity, otherwise a session established without
+     * verification (ca_cert "*") would let a verifying one skip it.
+     */
+    mg_asprintf(&sk, sizeof(skbuf), "%s|%s|%s|%s|%s", address,
+                (params.ca_cert ? params.ca_cert : ""),
+                (params.server_name ? params.server_name : ""),
+                (params.cert ? params.cert : ""),
+                (params.psk_identity ? params.psk_identity : ""));
+    params.session_key = sk;
+    res = mg_ssl_if_conn_init(nc, &params, &err_msg);
+    if (sk != skbuf) MG_FREE(sk);
+    if (res != MG_SSL_OK) {
       MG_SET_PTRPTR(opts.error_string, err_msg);
       mg_destroy_conn(nc, 1 /* destroy_if */);
       return NULL;
@@ -2731,18 +3290,20 @@ struct mg_connection *mg_connect_opt(struct mg_mgr *mgr, const char *address,
      * DNS resolution is required for host.
      * mg_parse_address() fills port in nc->sa, which we pass to resolve_cb()
      */
-    struct mg_connection *dns_conn = NULL;
     struct mg_resolve_async_opts o;
+    /* Recently resolved? Connect right away, no round trip. */
+    if (mg_resolve_from_cache(nc->mgr, host, &nc->sa)) {
+      return mg_do_connect(nc, proto, &nc->sa);
+    }
     memset(&o, 0, sizeof(o));
-    o.dns_conn = &dns_conn;
     o.nameserver = opts.nameserver;
+    o.parallel_aaaa = MG_ENABLE_IPV6;
     if (mg_resolve_async_opt(nc->mgr, host, MG_DNS_A_RECORD, resolve_cb, nc,
                              o) != 0) {
       MG_SET_PTRPTR(opts.error_string, "cannot schedule DNS lookup");
       mg_destroy_conn(nc, 1 /* destroy_if */);
       return NULL;
     }
-    nc->priv_2 = dns_conn;
     nc->flags |= MG_F_RESOLVING;
     return nc;
 #else
@@ -2928,14 +3489,16 @@ double mg_set_timer(struct mg_connection *c, double timestamp) {
   c->ev_timer_time = timestamp;
   /*
    * If this connection is resolving, it's not in the list of active
-   * connections, so not processed yet. It has a DNS resolver connection
-   * linked to it. Set up a timer for the DNS connection.
+   * connections, so not processed yet. The resolver keeps the timer for it
+   * and delivers MG_EV_TIMER along with the lookup failure.
    */
-  DBG(("%p %p %d -> %lu", c, c->priv_2, c->flags & MG_F_RESOLVING,
+  DBG(("%p %d -> %lu", c, c->flags & MG_F_RESOLVING,
        (unsigned long) timestamp));
-  if ((c->flags & MG_F_RESOLVING) && c->priv_2 != NULL) {
-    ((struct mg_connection *) c->priv_2)->ev_timer_time = timestamp;
+#if MG_ENABLE_ASYNC_RESOLVER
+  if (c->flags & MG_F_RESOLVING) {
+    mg_resolve_async_set_timer(c->mgr, c, timestamp);
   }
+#endif
   return result;
 }
 
@@ -3031,6 +3594,13 @@ extern const struct mg_iface_vtable mg_tun_iface_vtable;
 struct mg_connection *mg_tun_if_find_conn(struct mg_tun_client *client,
                                           uint32_t stream_id);
 
+/* Returns existing stream or NULL, does not accept new streams. */
+struct mg_tun_stream *mg_tun_if_find_stream(struct mg_tun_client *client,
+                                            uint32_t stream_id);
+
+/* Sends as much of the connection's `send_mbuf` as the window allows. */
+void mg_tun_if_flush(struct mg_connection *nc);
+
 #ifdef __cplusplus
 }
 #endif /* __cplusplus */
@@ -3871,17 +4441,37 @@ int mg_tun_if_listen_udp(struct mg_connection *nc, union socket_address *sa) {
   return -1;
 }
 
-void mg_tun_if_tcp_send(struct mg_connection *nc, const void *buf, size_t len) {
+void mg_tun_if_flush(struct mg_connection *nc) {
   struct mg_tun_client *client = (struct mg_tun_client *) nc->iface->data;
-  uint32_t stream_id = (uint32_t)(uintptr_t) nc->mgr_data;
-  struct mg_str msg = {(char *) buf, len};
+  struct mg_tun_stream *s = (struct mg_tun_stream *) nc->mgr_data;
+
+  while (client != NULL && client->disp != NULL && s != NULL &&
+         nc->send_mbuf.len > 0) {
+    size_t len = nc->send_mbuf.len;
+    struct mg_str msg;
+    if (client->flow_control) {
+      if (s->send_window == 0) break;
+      if (len > s->send_window) len = s->send_window;
+      s->send_window -= len;
+    }
+    msg = mg_mk_str_n(nc->send_mbuf.buf, len);
 #if MG_ENABLE_HEXDUMP
-  char hex[512];
-  mg_hexdump(buf, len, hex, sizeof(hex));
-  LOG(LL_DEBUG, ("sending to stream %zu:\n%s", stream_id, hex));
+    {
+      char hex[512];
+      mg_hexdump(msg.p, msg.len, hex, sizeof(hex));
+      LOG(LL_DEBUG, ("sending to stream %zu:\n%s", s->stream_id, hex));
+    }
 #endif
+    mg_tun_send_frame(client->disp, s->stream_id, MG_TUN_DATA_FRAME, 0, msg);
+    /* May re-enter via MG_EV_SEND, `s` stays valid until conn is destroyed */
+    mg_if_sent_cb(nc, (int) len);
+  }
+}
 
-  mg_tun_send_frame(client->disp, stream_id, MG_TUN_DATA_FRAME, 0, msg);
+void mg_tun_if_tcp_send(struct mg_connection *nc, const void *buf, size_t len) {
+  /* Buffered like a socket would, so SEND_AND_CLOSE and MG_EV_SEND work */
+  mbuf_append(&nc->send_mbuf, buf, len);
+  mg_tun_if_flush(nc);
 }
 
 void mg_tun_if_udp_send(struct mg_connection *nc, const void *buf, size_t len) {
@@ -3891,8 +4481,20 @@ void mg_tun_if_udp_send(struct mg_connection *nc, const void *buf, size_t len) {
 }
 
 void mg_tun_if_recved(struct mg_connection *nc, size_t len) {
-  (void) nc;
-  (void) len;
+  struct mg_tun_client *client = (struct mg_tun_client *) nc->iface->data;
+  struct mg_tun_stream *s = (struct mg_tun_stream *) nc->mgr_data;
+  uint32_t n;
+  if (client == NULL || !client->flow_control || client->disp == NULL ||
+      s == NULL) {
+    return;
+  }
+  /* Batch updates, but don't let the peer stall waiting for one. */
+  s->recv_consumed += len;
+  if (s->recv_consumed < MG_TUN_STREAM_WINDOW / 2) return;
+  n = htonl((uint32_t) s->recv_consumed);
+  mg_tun_send_frame(client->disp, s->stream_id, MG_TUN_WINDOW_UPDATE_FRAME, 0,
+                    mg_mk_str_n((char *) &n, sizeof(n)));
+  s->recv_consumed = 0;
 }
 
 int mg_tun_if_create_conn(struct mg_connection *nc) {
@@ -3902,16 +4504,24 @@ int mg_tun_if_create_conn(struct mg_connection *nc) {
 
 void mg_tun_if_destroy_conn(struct mg_connection *nc) {
   struct mg_tun_client *client = (struct mg_tun_client *) nc->iface->data;
+  struct mg_tun_stream *s = (struct mg_tun_stream *) nc->mgr_data;
 
   if (nc->flags & MG_F_LISTENING) {
     mg_tun_destroy_client(client);
-  } else if (client->disp) {
-    uint32_t stream_id = (uint32_t)(uintptr_t) nc->mgr_data;
+  } else if (s != NULL) {
+    struct mg_tun_stream **ps =
+        &client->streams[s->stream_id % MG_TUN_STREAM_TABLE_SIZE];
     struct mg_str msg = {NULL, 0};
 
-    LOG(LL_DEBUG, ("closing %zu:", stream_id));
-    mg_tun_send_frame(client->disp, stream_id, MG_TUN_DATA_FRAME,
-                      MG_TUN_F_END_STREAM, msg);
+    if (client->disp) {
+      LOG(LL_DEBUG, ("closing %zu:", s->stream_id));
+      mg_tun_send_frame(client->disp, s->stream_id, MG_TUN_DATA_FRAME,
+                        MG_TUN_F_END_STREAM, msg);
+    }
+    while (*ps != s) ps = &(*ps)->next;
+    *ps = s->next;
+    nc->mgr_data = NULL;
+    MG_FREE(s);
   }
 }
 
@@ -3950,24 +4560,41 @@ void mg_tun_if_get_conn_addr(struct mg_connection *nc, int remote,
   (void) sa;
 }
 
+struct mg_tun_stream *mg_tun_if_find_stream(struct mg_tun_client *client,
+                                            uint32_t stream_id) {
+  struct mg_tun_stream *s;
+  for (s = client->streams[stream_id % MG_TUN_STREAM_TABLE_SIZE]; s != NULL;
+       s = s->next) {
+    if (s->stream_id == stream_id) return s;
+  }
+  return NULL;
+}
+
 struct mg_connection *mg_tun_if_find_conn(struct mg_tun_client *client,
                                           uint32_t stream_id) {
   struct mg_connection *nc = NULL;
+  struct mg_tun_stream *s = mg_tun_if_find_stream(client, stream_id);
 
-  for (nc = client->mgr->active_connections; nc != NULL; nc = nc->next) {
-    if (nc->iface != client->iface || (nc->flags & MG_F_LISTENING)) {
-      continue;
-    }
-    if (stream_id == (uint32_t)(uintptr_t) nc->mgr_data) {
-      return nc;
-    }
+  if (s != NULL) {
+    return s->nc;
   }
 
   if (stream_id > client->last_stream_id) {
     /* create a new connection */
     LOG(LL_DEBUG, ("new stream 0x%lx, accepting", stream_id));
+    s = (struct mg_tun_stream *) MG_CALLOC(1, sizeof(*s));
+    if (s == NULL) return NULL;
     nc = mg_if_accept_new_conn(client->listener);
-    nc->mgr_data = (void *) (uintptr_t) stream_id;
+    if (nc == NULL) {
+      MG_FREE(s);
+      return NULL;
+    }
+    s->stream_id = stream_id;
+    s->nc = nc;
+    s->send_window = MG_TUN_STREAM_WINDOW;
+    s->next = client->streams[stream_id % MG_TUN_STREAM_TABLE_SIZE];
+    client->streams[stream_id % MG_TUN_STREAM_TABLE_SIZE] = s;
+    nc->mgr_data = s;
     client->last_stream_id = stream_id;
   } else {
     LOG(LL_DEBUG, ("Ignoring stream 0x%lx (last_stream_id 0x%lx)", stream_id,
@@ -4003,6 +4630,129 @@ const struct mg_iface_vtable mg_tun_iface_vtable = MG_TUN_IFACE_VTABLE;
 
 #endif /* MG_ENABLE_TUN */
 #ifdef MG_MODULE_LINES
+#line 1 "mongoose/src/ssl_if_session_cache.c"
+#endif
+/*
+ * Copyright (c) 2014-2016 Cesanta Software Limited
+ * All rights reserved
+ */
+
+/* Amalgamated: #include "mongoose/src/internal.h" */
+/* Amalgamated: #include "mongoose/src/ssl_if.h" */
+
+#if MG_SSL_IF_ENABLE_SESSION_CACHE
+
+struct mg_ssl_if_session_cache_entry {
+  char *key;
+  void *sess;
+  unsigned int last_used;
+};
+
+static struct mg_ssl_if_session_cache_entry
+    s_ssl_sessions[MG_SSL_IF_SESSION_CACHE_SIZE];
+static unsigned int s_ssl_sessions_gen;
+static unsigned int s_ssl_sessions_clock;
+
+static struct mg_ssl_if_session_cache_entry *mg_ssl_if_session_cache_find(
+    const char *key) {
+  int i;
+  for (i = 0; i < MG_SSL_IF_SESSION_CACHE_SIZE; i++) {
+    struct mg_ssl_if_session_cache_entry *e = &s_ssl_sessions[i];
+    if (e->key != NULL && strcmp(e->key, key) == 0) return e;
+  }
+  return NULL;
+}
+
+MG_INTERNAL void *mg_ssl_if_session_cache_get(const char *key) {
+  struct mg_ssl_if_session_cache_entry *e = mg_ssl_if_session_cache_find(key);
+  if (e == NULL) return NULL;
+  e->last_used = ++s_ssl_sessions_clock;
+  return e->sess;
+}
+
+MG_INTERNAL void mg_ssl_if_session_cache_put(const char *key, void *sess) {
+  struct mg_ssl_if_session_cache_entry *e = mg_ssl_if_session_cache_find(key);
+  if (e == NULL) {
+    /* Take a free slot or evict the least recently used one. */
+    int i;
+    e = &s_ssl_sessions[0];
+    for (i = 0; i < MG_SSL_IF_SESSION_CACHE_SIZE; i++) {
+      struct mg_ssl_if_session_cache_entry *ei = &s_ssl_sessions[i];
+      if (ei->key == NULL) {
+        e = ei;
+        break;
+      }
+      if (ei->last_used < e->last_used) e = ei;
+    }
+    MG_FREE(e->key);
+    e->key = strdup(key);
+    if (e->key == NULL) {
+      mg_ssl_if_session_free(sess);
+      sess = NULL;
+    }
+  }
+  if (e->sess != NULL && e->sess != sess) mg_ssl_if_session_free(e->sess);
+  e->sess = sess;
+  e->last_used = ++s_ssl_sessions_clock;
+  s_ssl_sessions_gen++;
+}
+
+int mg_ssl_if_session_cache_export(struct mbuf *out) {
+  int i, n = 0;
+  for (i = 0; i < MG_SSL_IF_SESSION_CACHE_SIZE; i++) {
+    struct mg_ssl_if_session_cache_entry *e = &s_ssl_sessions[i];
+    size_t off = out->len;
+    uint16_t kl, sl;
+    if (e->key == NULL || e->sess == NULL) continue;
+    kl = htons((uint16_t) strlen(e->key));
+    mbuf_append(out, &kl, 2);
+    mbuf_append(out, e->key, strlen(e->key));
+    mbuf_append(out, &sl, 2); /* Placeholder */
+    if (!mg_ssl_if_session_save(e->sess, out) ||
+        out->len - off - 4 - strlen(e->key) > 0xffff) {
+      out->len = off;
+      continue;
+    }
+    sl = htons((uint16_t)(out->len - off - 4 - strlen(e->key)));
+    memcpy(out->buf + off + 2 + strlen(e->key), &sl, 2);
+    n++;
+  }
+  return n;
+}
+
+int mg_ssl_if_session_cache_import(const char *data, size_t len) {
+  const char *p = data, *end = data + len;
+  int n = 0;
+  while (p < end) {
+    char *key;
+    uint16_t kl, sl;
+    void *sess;
+    if (p + 2 > end) return -1;
+    kl = ((uint8_t) p[0] << 8) | (uint8_t) p[1];
+    if (p + 2 + kl + 2 > end) return -1;
+    sl = ((uint8_t) p[2 + kl] << 8) | (uint8_t) p[2 + kl + 1];
+    if (p + 4 + kl + sl > end) return -1;
+    if ((key = (char *) MG_MALLOC(kl + 1)) != NULL) {
+      memcpy(key, p + 2, kl);
+      key[kl] = '\0';
+      sess = mg_ssl_if_session_load(p + 4 + kl, sl);
+      if (sess != NULL) {
+        mg_ssl_if_session_cache_put(key, sess);
+        n++;
+      }
+      MG_FREE(key);
+    }
+    p += 4 + kl + sl;
+  }
+  return n;
+}
+
+unsigned int mg_ssl_if_session_cache_generation(void) {
+  return s_ssl_sessions_gen;
+}
+
+#endif /* MG_SSL_IF_ENABLE_SESSION_CACHE */
+#ifdef MG_MODULE_LINES
 #line 1 "mongoose/src/ssl_if_openssl.c"
 #endif
 /*
@@ -4023,6 +4773,7 @@ struct mg_ssl_if_ctx {
   SSL_CTX *ssl_ctx;
   struct mbuf psk;
   size_t identity_len;
+  char *session_key;
 };
 
 void mg_ssl_if_init() {
@@ -4050,6 +4801,9 @@ static enum mg_ssl_if_result mg_set_cipher_list(SSL_CTX *ctx, const char *cl);
 static enum mg_ssl_if_result mg_ssl_if_ossl_set_psk(struct mg_ssl_if_ctx *ctx,
                                                     const char *identity,
                                                     const char *key_str);
+#if MG_SSL_IF_ENABLE_SESSION_CACHE
+static int mg_ssl_if_ossl_new_session_cb(SSL *ssl, SSL_SESSION *sess);
+#endif
 
 enum mg_ssl_if_result mg_ssl_if_conn_init(
     struct mg_connection *nc, const struct mg_ssl_if_conn_params *params,
@@ -4112,6 +4866,31 @@ enum mg_ssl_if_result mg_ssl_if_conn_init(
     return MG_SSL_ERROR;
   }
 
+#ifndef KR_VERSION
+  if (nc->flags & MG_F_LISTENING) {
+    /* Server side: session cache (on by default) and tickets. */
+    static const unsigned char sid_ctx[] = "mongoose";
+    SSL_CTX_set_session_id_context(ctx->ssl_ctx, sid_ctx, sizeof(sid_ctx) - 1);
+    SSL_CTX_set_timeout(ctx->ssl_ctx, MG_SSL_IF_SESSION_TICKET_LIFETIME);
+  }
+#endif
+#if MG_SSL_IF_ENABLE_SESSION_CACHE
+  if (!(nc->flags & MG_F_LISTENING) && params->session_key != NULL) {
+    SSL_SESSION *sess =
+        (SSL_SESSION *) mg_ssl_if_session_cache_get(params->session_key);
+    ctx->session_key = strdup(params->session_key);
+    if (sess != NULL) SSL_set_session(ctx->ssl, sess);
+    /*
+     * With TLS 1.3 the ticket arrives after the handshake, so we can't just
+     * grab the session once connected - let the library tell us instead.
+     */
+    SSL_set_app_data(ctx->ssl, ctx);
+    SSL_CTX_set_session_cache_mode(
+        ctx->ssl_ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(ctx->ssl_ctx, mg_ssl_if_ossl_new_session_cb);
+  }
+#endif
+
   nc->flags |= MG_F_SSL;
 
   return MG_SSL_OK;
@@ -4138,9 +4917,58 @@ enum mg_ssl_if_result mg_ssl_if_handshake(struct mg_connection *nc) {
   }
   res = server_side ? SSL_accept(ctx->ssl) : SSL_connect(ctx->ssl);
   if (res != 1) return mg_ssl_if_ssl_err(nc, res);
+#if MG_SSL_IF_ENABLE_SESSION_CACHE
+  DBG(("%p session reused: %d", nc, (int) SSL_session_reused(ctx->ssl)));
+#endif
   return MG_SSL_OK;
 }
 
+#if MG_SSL_IF_ENABLE_SESSION_CACHE
+static int mg_ssl_if_ossl_new_session_cb(SSL *ssl, SSL_SESSION *sess) {
+  struct mg_ssl_if_ctx *ctx = (struct mg_ssl_if_ctx *) SSL_get_app_data(ssl);
+  if (ctx == NULL || ctx->session_key == NULL) return 0;
+  mg_ssl_if_session_cache_put(ctx->session_key, sess);
+  return 1; /* We took ownership. */
+}
+
+MG_INTERNAL void mg_ssl_if_session_free(void *sess) {
+  SSL_SESSION_free((SSL_SESSION *) sess);
+}
+
+MG_INTERNAL int mg_ssl_if_session_save(void *sess, struct mbuf *out) {
+  int len = i2d_SSL_SESSION((SSL_SESSION *) sess, NULL);
+  unsigned char *p;
+  if (len <= 0) return 0;
+  mbuf_resize(out, out->len + len);
+  if (out->size < out->len + len) return 0;
+  p = (unsigned char *) out->buf + out->len;
+  if (i2d_SSL_SESSION((SSL_SESSION *) sess, &p) != len) return 0;
+  out->len += len;
+  return 1;
+}
+
+MG_INTERNAL void *mg_ssl_if_session_load(const char *data, size_t len) {
+  const unsigned char *p = (const unsigned char *) data;
+  return d2i_SSL_SESSION(NULL, &p, (long) len);
+}
+#elif MG_SSL_IF_SESSION_CACHE_SIZE > 0
+/* Krypton does not implement session export, there is nothing to cache. */
+int mg_ssl_if_session_cache_export(struct mbuf *out) {
+  (void) out;
+  return 0;
+}
+
+int mg_ssl_if_session_cache_import(const char *data, size_t len) {
+  (void) data;
+  (void) len;
+  return 0;
+}
+
+unsigned int mg_ssl_if_session_cache_generation(void) {
+  return 0;
+}
+#endif
+
 int mg_ssl_if_read(struct mg_connection *nc, void *buf, size_t buf_size) {
   struct mg_ssl_if_ctx *ctx = (struct mg_ssl_if_ctx *) nc->ssl_if_data;
   int n = SSL_read(ctx->ssl, buf, buf_size);
@@ -4171,6 +4999,7 @@ void mg_ssl_if_conn_free(struct mg_connection *nc) {
   if (ctx->ssl != NULL) SSL_free(ctx->ssl);
   if (ctx->ssl_ctx != NULL && nc->listener == NULL) SSL_CTX_free(ctx->ssl_ctx);
   mbuf_free(&ctx->psk);
+  MG_FREE(ctx->session_key);
   memset(ctx, 0, sizeof(*ctx));
   MG_FREE(ctx);
 }
@@ -4399,7 +5228,14 @@ const char *mg_set_ssl(struct mg_connection *nc, const char *cert,
 #include <mbedtls/ecp.h>
 #include <mbedtls/platform.h>
 #include <mbedtls/ssl.h>
+#include <mbedtls/version.h>
 #include <mbedtls/x509_crt.h>
+#ifdef MBEDTLS_SSL_CACHE_C
+#include <mbedtls/ssl_cache.h>
+#endif
+#ifdef MBEDTLS_SSL_TICKET_C
+#include <mbedtls/ssl_ticket.h>
+#endif
 
 static void mg_ssl_mbed_log(void *ctx, int level, const char *file, int line,
                             const char *str) {
@@ -4428,6 +5264,13 @@ struct mg_ssl_if_ctx {
   mbedtls_pk_context *key;
   mbedtls_x509_crt *ca_cert;
   struct mbuf cipher_suites;
+  char *session_key;
+#ifdef MBEDTLS_SSL_CACHE_C
+  mbedtls_ssl_cache_context *cache; /* Server side session cache */
+#endif
+#ifdef MBEDTLS_SSL_TICKET_C
+  mbedtls_ssl_ticket_context *ticket; /* Server side ticket keys */
+#endif
 };
 
 /* Must be provided by the platform. ctx is struct mg_connection. */
@@ -4525,6 +5368,41 @@ enum mg_ssl_if_result mg_ssl_if_conn_init(
         mbedtls_ssl_set_hostname(ctx->ssl, params->server_name) != 0) {
       return MG_SSL_ERROR;
     }
+#if MG_SSL_IF_ENABLE_SESSION_CACHE
+    if (params->session_key != NULL) {
+      mbedtls_ssl_session *sess = (mbedtls_ssl_session *)
+          mg_ssl_if_session_cache_get(params->session_key);
+      ctx->session_key = strdup(params->session_key);
+      if (sess != NULL) mbedtls_ssl_set_session(ctx->ssl, sess);
+    }
+#endif
+  } else {
+#ifdef MBEDTLS_SSL_CACHE_C
+    ctx->cache =
+        (mbedtls_ssl_cache_context *) MG_CALLOC(1, sizeof(*ctx->cache));
+    if (ctx->cache != NULL) {
+      mbedtls_ssl_cache_init(ctx->cache);
+      mbedtls_ssl_cache_set_timeout(ctx->cache,
+                                    MG_SSL_IF_SESSION_TICKET_LIFETIME);
+      mbedtls_ssl_conf_session_cache(ctx->conf, ctx->cache,
+                                     mbedtls_ssl_cache_get,
+                                     mbedtls_ssl_cache_set);
+    }
+#endif
+#ifdef MBEDTLS_SSL_TICKET_C
+    ctx->ticket =
+        (mbedtls_ssl_ticket_context *) MG_CALLOC(1, sizeof(*ctx->ticket));
+    if (ctx->ticket != NULL) {
+      mbedtls_ssl_ticket_init(ctx->ticket);
+      if (mbedtls_ssl_ticket_setup(ctx->ticket, mg_ssl_if_mbed_random, nc,
+                                   MBEDTLS_CIPHER_AES_128_GCM,
+                                   MG_SSL_IF_SESSION_TICKET_LIFETIME) == 0) {
+        mbedtls_ssl_conf_session_tickets_cb(ctx->conf, mbedtls_ssl_ticket_write,
+                                            mbedtls_ssl_ticket_parse,
+                                            ctx->ticket);
+      }
+    }
+#endif
   }
 
 #ifdef MG_SSL_IF_MBEDTLS_MAX_FRAG_LEN
@@ -4612,6 +5490,28 @@ enum mg_ssl_if_result mg_ssl_if_handshake(struct mg_connection *nc) {
   }
   err = mbedtls_ssl_handshake(ctx->ssl);
   if (err != 0) return mg_ssl_if_mbed_err(nc, err);
+#if MG_SSL_IF_ENABLE_SESSION_CACHE
+  if (ctx->session_key != NULL) {
+    mbedtls_ssl_session *sess =
+        (mbedtls_ssl_session *) MG_CALLOC(1, sizeof(*sess));
+    if (sess != NULL) {
+      mbedtls_ssl_session_init(sess);
+      if (mbedtls_ssl_get_session(ctx->ssl, sess) == 0) {
+#if defined(MG_SSL_IF_MBEDTLS_FREE_CERTS) && defined(MBEDTLS_X509_CRT_PARSE_C) && \
+    (MBEDTLS_VERSION_NUMBER < 0x02100000 ||                              \
+     defined(MBEDTLS_SSL_KEEP_PEER_CERTIFICATE))
+        /* Peer cert is not needed to resume, don't keep a copy. */
+        mbedtls_x509_crt_free(sess->peer_cert);
+        mbedtls_free(sess->peer_cert);
+        sess->peer_cert = NULL;
+#endif
+        mg_ssl_if_session_cache_put(ctx->session_key, sess);
+      } else {
+        mg_ssl_if_session_free(sess);
+      }
+    }
+  }
+#endif
 #ifdef MG_SSL_IF_MBEDTLS_FREE_CERTS
   /*
    * Free the peer certificate, we don't need it after handshake.
@@ -4670,11 +5570,71 @@ void mg_ssl_if_conn_free(struct mg_connection *nc) {
     mbedtls_ssl_config_free(ctx->conf);
     MG_FREE(ctx->conf);
   }
+#ifdef MBEDTLS_SSL_CACHE_C
+  if (ctx->cache != NULL) {
+    mbedtls_ssl_cache_free(ctx->cache);
+    MG_FREE(ctx->cache);
+  }
+#endif
+#ifdef MBEDTLS_SSL_TICKET_C
+  if (ctx->ticket != NULL) {
+    mbedtls_ssl_ticket_free(ctx->ticket);
+    MG_FREE(ctx->ticket);
+  }
+#endif
   mbuf_free(&ctx->cipher_suites);
+  MG_FREE(ctx->session_key);
   memset(ctx, 0, sizeof(*ctx));
   MG_FREE(ctx);
 }
 
+#if MG_SSL_IF_ENABLE_SESSION_CACHE
+MG_INTERNAL void mg_ssl_if_session_free(void *sess) {
+  mbedtls_ssl_session_free((mbedtls_ssl_session *) sess);
+  MG_FREE(sess);
+}
+
+/* Session (de)serialization appeared in mbedTLS 2.19. */
+MG_INTERNAL int mg_ssl_if_session_save(void *sess, struct mbuf *out) {
+#if MBEDTLS_VERSION_NUMBER >= 0x02130000
+  size_t len = 0;
+  mbedtls_ssl_session_save((mbedtls_ssl_session *) sess, NULL, 0, &len);
+  if (len == 0) return 0;
+  mbuf_resize(out, out->len + len);
+  if (out->size < out->len + len) return 0;
+  if (mbedtls_ssl_session_save((mbedtls_ssl_session *) sess,
+                               (unsigned char *) out->buf + out->len, len,
+                               &len) != 0) {
+    return 0;
+  }
+  out->len += len;
+  return 1;
+#else
+  (void) sess;
+  (void) out;
+  return 0;
+#endif
+}
+
+MG_INTERNAL void *mg_ssl_if_session_load(const char *data, size_t len) {
+#if MBEDTLS_VERSION_NUMBER >= 0x02130000
+  mbedtls_ssl_session *sess =
+      (mbedtls_ssl_session *) MG_CALLOC(1, sizeof(*sess));
+  if (sess == NULL) return NULL;
+  mbedtls_ssl_session_init(sess);
+  if (mbedtls_ssl_session_load(sess, (const unsigned char *) data, len) != 0) {
+    mg_ssl_if_session_free(sess);
+    return NULL;
+  }
+  return sess;
+#else
+  (void) data;
+  (void) len;
+  return NULL;
+#endif
+}
+#endif /* MG_SSL_IF_ENABLE_SESSION_CACHE */
+
 static enum mg_ssl_if_result mg_use_ca_cert(struct mg_ssl_if_ctx *ctx,
                                             const char *ca_cert) {
   if (ca_cert == NULL || strcmp(ca_cert, "*") == 0) {
@@ -5801,12 +6761,12 @@ void mg_http_handler(struct mg_connection *nc, int ev,
              mg_get_http_header(hm, "Sec-WebSocket-Accept")) {
       /* We're websocket client, got handshake response from server. */
       /* TODO(lsm): check the validity of accept Sec-WebSocket-Accept */
-      mbuf_remove(io, req_len);
       nc->proto_handler = mg_ws_handler;
       nc->flags |= MG_F_IS_WEBSOCKET;
       mg_call(nc, nc->handler, nc->user_data, MG_EV_WEBSOCKET_HANDSHAKE_DONE,
-              NULL);
-      mg_ws_handler(nc, MG_EV_RECV, ev_data MG_UD_ARG(user_data));
+              hm);
+      mbuf_remove(io, req_len);
+      mg_ws_handler(nc, MG_EV_RECV, ev_data MG_UD_ARG(user_data));
     } else if (nc->listener != NULL &&
                (vec = mg_get_http_header(hm, "Sec-WebSocket-Key")) != NULL) {
       struct mg_http_endpoint *ep;
@@ -9775,10 +10735,10 @@ void mg_mbuf_append_base64_putc(char ch, void *user_data) {
 }
 
 void mg_mbuf_append_base64(struct mbuf *mbuf, const void *data, size_t len) {
-  struct cs_base64_ctx ctx;
-  cs_base64_init(&ctx, mg_mbuf_append_base64_putc, mbuf);
-  cs_base64_update(&ctx, (const char *) data, len);
-  cs_base64_finish(&ctx);
+  size_t off = mbuf->len, n = CS_BASE64_ENCODED_LEN(len);
+  if (mbuf_append(mbuf, NULL, n) == n) {
+    cs_base64_encode_block((const unsigned char *) data, len, mbuf->buf + off);
+  }
 }
 
 void mg_basic_auth_header(const struct mg_str user, const struct mg_str pass,
@@ -9819,12 +10779,60 @@ static uint16_t getu16(const char *p) {
   return (up[0] << 8) + up[1];
 }
 
+static uint32_t getu32(const char *p) {
+  const uint8_t *up = (const uint8_t *) p;
+  return ((uint32_t) up[0] << 24) + ((uint32_t) up[1] << 16) +
+         ((uint32_t) up[2] << 8) + up[3];
+}
+
 static const char *scanto(const char *p, struct mg_str *s) {
   s->len = getu16(p);
   s->p = p + 2;
   return s->p + s->len;
 }
 
+/*
+ * Decodes MQTT variable byte integer. Returns number of bytes consumed,
+ * 0 if there is not enough data or the encoding is invalid.
+ */
+static size_t mg_mqtt_get_varint(const char *p, const char *end,
+                                 uint32_t *val) {
+  size_t n = 0;
+  unsigned char lc;
+  *val = 0;
+  do {
+    if (p + n >= end || n >= 4) return 0;
+    lc = (unsigned char) p[n];
+    *val += (uint32_t)(lc & 0x7f) << (7 * n);
+    n++;
+  } while (lc & 0x80);
+  return n;
+}
+
+static size_t mg_mqtt_put_varint(uint8_t *buf, uint32_t val) {
+  size_t n = 0;
+  do {
+    buf[n] = val % 0x80;
+    val /= 0x80;
+    if (val > 0) buf[n] |= 0x80;
+    n++;
+  } while (val > 0);
+  return n;
+}
+
+/* Scans MQTT 5 property block, if the protocol calls for it. */
+static const char *scan_props(const char *p, const char *end,
+                              struct mg_mqtt_message *mm) {
+  uint32_t len;
+  size_t n;
+  if (mm->protocol_version < MG_MQTT_PROTO_VERSION_5 || p >= end) return p;
+  n = mg_mqtt_get_varint(p, end, &len);
+  if (n == 0 || p + n + len > end) return end;
+  mm->properties.p = p + n;
+  mm->properties.len = len;
+  return p + n + len;
+}
+
 MG_INTERNAL int parse_mqtt(struct mbuf *io, struct mg_mqtt_message *mm) {
   uint8_t header;
   size_t len = 0, len_len = 0;
@@ -9853,6 +10861,7 @@ MG_INTERNAL int parse_mqtt(struct mbuf *io, struct mg_mqtt_message *mm) {
 
   mm->cmd = cmd;
   mm->qos = MG_MQTT_GET_QOS(header);
+  mm->flags = header & 0x0f;
 
   switch (cmd) {
     case MG_MQTT_CMD_CONNECT: {
@@ -9861,7 +10870,14 @@ MG_INTERNAL int parse_mqtt(struct mbuf *io, struct mg_mqtt_message *mm) {
       mm->connect_flags = *(uint8_t *) p++;
       mm->keep_alive_timer = getu16(p);
       p += 2;
+      p = scan_props(p, end, mm);
       if (p < end) p = scanto(p, &mm->client_id);
+      if (p < end && (mm->connect_flags & MG_MQTT_HAS_WILL)) {
+        /* Will properties are not exposed, skip them. */
+        struct mg_mqtt_message wm;
+        wm.protocol_version = mm->protocol_version;
+        p = scan_props(p, end, &wm);
+      }
       if (p < end && (mm->connect_flags & MG_MQTT_HAS_WILL))
         p = scanto(p, &mm->will_topic);
       if (p < end && (mm->connect_flags & MG_MQTT_HAS_WILL))
@@ -9883,14 +10899,24 @@ MG_INTERNAL int parse_mqtt(struct mbuf *io, struct mg_mqtt_message *mm) {
       break;
     }
     case MG_MQTT_CMD_CONNACK:
+      mm->session_present = p[0] & 1;
       mm->connack_ret_code = p[1];
+      scan_props(p + 2, end, mm);
       break;
     case MG_MQTT_CMD_PUBACK:
     case MG_MQTT_CMD_PUBREC:
     case MG_MQTT_CMD_PUBREL:
     case MG_MQTT_CMD_PUBCOMP:
+      mm->message_id = getu16(p);
+      /* MQTT 5 reason code and properties are optional here. */
+      if (p + 2 < end) scan_props(p + 3, end, mm);
+      break;
     case MG_MQTT_CMD_SUBACK:
       mm->message_id = getu16(p);
+      p = scan_props(p + 2, end, mm);
+      /* Granted QoS levels (reason codes) */
+      mm->payload.p = p;
+      mm->payload.len = end - p;
       break;
     case MG_MQTT_CMD_PUBLISH: {
       p = scanto(p, &mm->topic);
@@ -9898,13 +10924,14 @@ MG_INTERNAL int parse_mqtt(struct mbuf *io, struct mg_mqtt_message *mm) {
         mm->message_id = getu16(p);
         p += 2;
       }
+      p = scan_props(p, end, mm);
       mm->payload.p = p;
       mm->payload.len = end - p;
       break;
     }
     case MG_MQTT_CMD_SUBSCRIBE:
       mm->message_id = getu16(p);
-      p += 2;
+      p = scan_props(p + 2, end, mm);
       /*
        * topic expressions are left in the payload and can be parsed with
        * `mg_mqtt_next_subscribe_topic`
@@ -9920,28 +10947,326 @@ MG_INTERNAL int parse_mqtt(struct mbuf *io, struct mg_mqtt_message *mm) {
   return end - io->buf;
 }
 
+int mg_mqtt_next_prop(struct mg_mqtt_message *msg, uint8_t *id, uint32_t *ival,
+                      struct mg_str *sval, int pos) {
+  const char *p = msg->properties.p + pos;
+  const char *end = msg->properties.p + msg->properties.len;
+  struct mg_str unused;
+  size_t n;
+
+  if (p >= end) return -1;
+  *id = *(uint8_t *) p++;
+  *ival = 0;
+  sval->p = NULL;
+  sval->len = 0;
+  switch (*id) {
+    case 0x01: /* Payload format indicator */
+    case 0x17: /* Request problem information */
+    case 0x19: /* Request response information */
+    case 0x24: /* Maximum QoS */
+    case 0x25: /* Retain available */
+    case 0x28: /* Wildcard subscription available */
+    case 0x29: /* Subscription identifier available */
+    case 0x2a: /* Shared subscription available */
+      if (p + 1 > end) return -1;
+      *ival = *(uint8_t *) p++;
+      break;
+    case MG_MQTT_PROP_SERVER_KEEP_ALIVE:
+    case MG_MQTT_PROP_RECEIVE_MAXIMUM:
+    case MG_MQTT_PROP_TOPIC_ALIAS_MAXIMUM:
+    case MG_MQTT_PROP_TOPIC_ALIAS:
+      if (p + 2 > end) return -1;
+      *ival = getu16(p);
+      p += 2;
+      break;
+    case 0x02: /* Message expiry interval */
+    case MG_MQTT_PROP_SESSION_EXPIRY_INTERVAL:
+    case 0x18: /* Will delay interval */
+    case 0x27: /* Maximum packet size */
+      if (p + 4 > end) return -1;
+      *ival = getu32(p);
+      p += 4;
+      break;
+    case 0x0b: /* Subscription identifier */
+      n = mg_mqtt_get_varint(p, end, ival);
+      if (n == 0) return -1;
+      p += n;
+      break;
+    case MG_MQTT_PROP_USER_PROPERTY:
+      if (p + 2 > end) return -1;
+      p = scanto(p, sval);
+      if (p + 2 > end) return -1;
+      p = scanto(p, &unused);
+      break;
+    default: /* All the rest are strings or binary data */
+      if (p + 2 > end) return -1;
+      p = scanto(p, sval);
+      break;
+  }
+  if (p > end) return -1;
+  return p - msg->properties.p;
+}
+
+static uint32_t mg_mqtt_get_int_prop(struct mg_mqtt_message *mm, uint8_t id) {
+  uint8_t pid;
+  uint32_t ival;
+  struct mg_str sval;
+  int pos = 0;
+  while ((pos = mg_mqtt_next_prop(mm, &pid, &ival, &sval, pos)) != -1) {
+    if (pid == id) return ival;
+  }
+  return 0;
+}
+
+/*
+ * Resolves topic alias of an incoming MQTT 5 PUBLISH, registering a new
+ * mapping if the topic is present. Returns 0 if alias is not known.
+ */
+static int mg_mqtt_rx_topic_alias(struct mg_mqtt_proto_data *pd,
+                                  struct mg_mqtt_message *mm) {
+  uint32_t alias = mg_mqtt_get_int_prop(mm, MG_MQTT_PROP_TOPIC_ALIAS);
+  char **tp;
+  if (alias == 0) return 1;
+  if (alias > pd->topic_alias_max || pd->rx_aliases == NULL) return 0;
+  tp = &pd->rx_aliases[alias - 1];
+  if (mm->topic.len > 0) {
+    MG_FREE(*tp);
+    *tp = (char *) MG_MALLOC(mm->topic.len + 1);
+    if (*tp == NULL) return 0;
+    memcpy(*tp, mm->topic.p, mm->topic.len);
+    (*tp)[mm->topic.len] = '\0';
+  } else if (*tp != NULL) {
+    mm->topic = mg_mk_str(*tp);
+  } else {
+    return 0;
+  }
+  return 1;
+}
+
+static void mg_mqtt_free_aliases(char **aliases, uint16_t num) {
+  uint16_t i;
+  if (aliases == NULL) return;
+  for (i = 0; i < num; i++) MG_FREE(aliases[i]);
+  MG_FREE(aliases);
+}
+
+/*
+ * Peer's Topic Alias Maximum (from CONNECT or CONNACK) determines how many
+ * aliases we can send.
+ */
+static void mg_mqtt_set_tx_aliases(struct mg_mqtt_proto_data *pd,
+                                   struct mg_mqtt_message *mm) {
+  uint32_t max = mg_mqtt_get_int_prop(mm, MG_MQTT_PROP_TOPIC_ALIAS_MAXIMUM);
+  if (max > pd->topic_alias_max) max = pd->topic_alias_max;
+  mg_mqtt_free_aliases(pd->tx_aliases, pd->topic_alias_max_tx);
+  pd->tx_aliases = NULL;
+  pd->topic_alias_max_tx = 0;
+  if (max > 0) {
+    pd->tx_aliases = (char **) MG_CALLOC(max, sizeof(*pd->tx_aliases));
+    if (pd->tx_aliases != NULL) pd->topic_alias_max_tx = max;
+  }
+}
+
+/*
+ * Returns full length of the frame at `p`, 0 if the fixed header is not
+ * fully buffered yet, -1 if it's malformed.
+ */
+static int mg_mqtt_frame_len(const char *p, size_t avail) {
+  uint32_t len;
+  size_t n;
+  if (avail < 2) return 0;
+  n = mg_mqtt_get_varint(p + 1, p + avail, &len);
+  if (n == 0) return (avail > 5 ? -1 : 0);
+  return 1 + n + len;
+}
+
+/*
+ * Parses variable header of a PUBLISH frame which may be buffered only
+ * partially. Returns the offset of the payload, 0 if more data is needed.
+ */
+static size_t mg_mqtt_parse_publish_header(const char *buf, size_t avail,
+                                           struct mg_mqtt_message *mm) {
+  const char *p, *end = buf + avail;
+  uint32_t len, plen;
+  size_t n, n0;
+  n0 = mg_mqtt_get_varint(buf + 1, end, &len);
+  p = buf + 1 + n0;
+  mm->cmd = MG_MQTT_CMD_PUBLISH;
+  mm->flags = buf[0] & 0x0f;
+  mm->qos = MG_MQTT_GET_QOS(buf[0]);
+  if (p + 2 > end || p + 2 + getu16(p) > end) return 0;
+  p = scanto(p, &mm->topic);
+  if (mm->qos > 0) {
+    if (p + 2 > end) return 0;
+    mm->message_id = getu16(p);
+    p += 2;
+  }
+  if (mm->protocol_version >= MG_MQTT_PROTO_VERSION_5) {
+    n = mg_mqtt_get_varint(p, end, &plen);
+    if (n == 0 || p + n + plen > end) return 0;
+    mm->properties.p = p + n;
+    mm->properties.len = plen;
+    p += n + plen;
+  }
+  mm->payload_total_len = (buf + 1 + n0 + len) - p;
+  return p - buf;
+}
+
+static void mg_mqtt_stream_chunk(struct mg_connection *nc,
+                                 const char *data,
+                                 size_t len MG_UD_ARG(void *user_data)) {
+  struct mg_mqtt_proto_data *pd = (struct mg_mqtt_proto_data *) nc->proto_data;
+  struct mg_mqtt_message mm;
+  memset(&mm, 0, sizeof(mm));
+  mm.cmd = MG_MQTT_CMD_PUBLISH;
+  mm.flags = pd->stream_flags;
+  mm.qos = MG_MQTT_GET_QOS(pd->stream_flags);
+  mm.message_id = pd->stream_message_id;
+  mm.protocol_version = pd->protocol_version;
+  mm.topic = mg_mk_str(pd->stream_topic);
+  mm.payload.p = data;
+  mm.payload.len = len;
+  mm.payload_total_len = pd->stream_total;
+  mm.payload_offset = pd->stream_total - pd->stream_left;
+  pd->stream_left -= len;
+  nc->handler(nc, MG_EV_MQTT_PUBLISH_CHUNK, &mm MG_UD_ARG(user_data));
+  if (pd->stream_left == 0) {
+    MG_FREE(pd->stream_topic);
+    pd->stream_topic = NULL;
+  }
+}
+
+/*
+ * Starts streaming of a PUBLISH frame that can't be buffered in full.
+ * Returns number of bytes consumed, 0 if variable header is not there yet.
+ */
+static size_t mg_mqtt_stream_start(struct mg_connection *nc, const char *buf,
+                                   size_t avail MG_UD_ARG(void *user_data)) {
+  struct mg_mqtt_proto_data *pd = (struct mg_mqtt_proto_data *) nc->proto_data;
+  struct mg_mqtt_message mm;
+  size_t hlen;
+  memset(&mm, 0, sizeof(mm));
+  mm.protocol_version = pd->protocol_version;
+  hlen = mg_mqtt_parse_publish_header(buf, avail, &mm);
+  if (hlen == 0) return 0;
+  if (mm.protocol_version >= MG_MQTT_PROTO_VERSION_5 &&
+      !mg_mqtt_rx_topic_alias(pd, &mm)) {
+    return 0;
+  }
+  if (mm.payload_total_len == 0) {
+    /* Nothing to stream, deliver the header as a single empty chunk. */
+    pd->frame_len = 0;
+    nc->handler(nc, MG_EV_MQTT_PUBLISH_CHUNK, &mm MG_UD_ARG(user_data));
+    return hlen;
+  }
+  pd->stream_topic = (char *) MG_MALLOC(mm.topic.len + 1);
+  if (pd->stream_topic == NULL) return 0;
+  memcpy(pd->stream_topic, mm.topic.p, mm.topic.len);
+  pd->stream_topic[mm.topic.len] = '\0';
+  pd->stream_flags = mm.flags;
+  pd->stream_message_id = mm.message_id;
+  pd->stream_total = pd->stream_left = mm.payload_total_len;
+  pd->frame_len = 0;
+  avail -= hlen;
+  if (avail > pd->stream_left) avail = pd->stream_left;
+  if (avail > 0) {
+    mg_mqtt_stream_chunk(nc, buf + hlen, avail MG_UD_ARG(user_data));
+  }
+  return hlen + avail;
+}
+
 static void mqtt_handler(struct mg_connection *nc, int ev,
                          void *ev_data MG_UD_ARG(void *user_data)) {
   struct mbuf *io = &nc->recv_mbuf;
+  struct mg_mqtt_proto_data *pd = (struct mg_mqtt_proto_data *) nc->proto_data;
   struct mg_mqtt_message mm;
-  memset(&mm, 0, sizeof(mm));
+  size_t off = 0;
 
   nc->handler(nc, ev, ev_data MG_UD_ARG(user_data));
 
-  switch (ev) {
-    case MG_EV_RECV:
-      /* There can be multiple messages in the buffer, process them all. */
-      while (1) {
-        int len = parse_mqtt(io, &mm);
-        if (len == -1) break; /* not fully buffered */
-        nc->handler(nc, MG_MQTT_EVENT_BASE + mm.cmd, &mm MG_UD_ARG(user_data));
-        mbuf_remove(io, len);
+  if (ev != MG_EV_RECV) return;
+
+  /*
+   * There can be multiple messages in the buffer, process them all and then
+   * remove them in one go. Frame length is decoded once, after that we just
+   * wait until that many bytes are buffered.
+   */
+  while (off < io->len && !(nc->flags & MG_F_CLOSE_IMMEDIATELY)) {
+    const char *buf = io->buf + off;
+    size_t avail = io->len - off;
+    struct mbuf frame;
+    int len;
+
+    if (pd->stream_left > 0) {
+      size_t n = (avail < pd->stream_left ? avail : pd->stream_left);
+      mg_mqtt_stream_chunk(nc, buf, n MG_UD_ARG(user_data));
+      off += n;
+      continue;
+    }
+
+    if (pd->frame_len == 0) {
+      len = mg_mqtt_frame_len(buf, avail);
+      if (len == 0) break;
+      if (len < 0) {
+        LOG(LL_ERROR, ("%p malformed MQTT frame", nc));
+        nc->flags |= MG_F_CLOSE_IMMEDIATELY;
+        break;
       }
-      break;
+      pd->frame_len = len;
+    }
+
+    if (avail < pd->frame_len) {
+      size_t n;
+      if (pd->frame_len <= nc->recv_mbuf_limit ||
+          (buf[0] >> 4) != MG_MQTT_CMD_PUBLISH) {
+        break; /* not fully buffered */
+      }
+      /* This one will never fit, deliver it in chunks. */
+      n = mg_mqtt_stream_start(nc, buf, avail MG_UD_ARG(user_data));
+      if (n == 0) break;
+      off += n;
+      continue;
+    }
+
+    /* Frame is fully buffered, parse it in place. */
+    frame.buf = (char *) buf;
+    frame.len = frame.size = pd->frame_len;
+    memset(&mm, 0, sizeof(mm));
+    mm.protocol_version = pd->protocol_version;
+    len = parse_mqtt(&frame, &mm);
+    off += pd->frame_len;
+    pd->frame_len = 0;
+    if (len == -1) continue;
+    if (mm.protocol_version >= MG_MQTT_PROTO_VERSION_5) {
+      if (mm.cmd == MG_MQTT_CMD_CONNECT) {
+        pd->protocol_version = mm.protocol_version;
+        mg_mqtt_set_tx_aliases(pd, &mm);
+      } else if (mm.cmd == MG_MQTT_CMD_CONNACK) {
+        mg_mqtt_set_tx_aliases(pd, &mm);
+      } else if (mm.cmd == MG_MQTT_CMD_PUBLISH &&
+                 !mg_mqtt_rx_topic_alias(pd, &mm)) {
+        LOG(LL_ERROR, ("%p invalid topic alias", nc));
+        nc->flags |= MG_F_CLOSE_IMMEDIATELY;
+        break;
+      }
+    }
+    nc->handler(nc, MG_MQTT_EVENT_BASE + mm.cmd, &mm MG_UD_ARG(user_data));
+  }
+
+  mbuf_remove(io, off);
+
+  if (pd->frame_len > 0 && io->len >= nc->recv_mbuf_limit) {
+    /* Buffer is full and we can't make progress. */
+    LOG(LL_ERROR, ("%p MQTT frame too big (%d)", nc, (int) pd->frame_len));
+    nc->flags |= MG_F_CLOSE_IMMEDIATELY;
   }
 }
 
 static void mg_mqtt_proto_data_destructor(void *proto_data) {
+  struct mg_mqtt_proto_data *pd = (struct mg_mqtt_proto_data *) proto_data;
+  mg_mqtt_free_aliases(pd->rx_aliases, pd->topic_alias_max);
+  mg_mqtt_free_aliases(pd->tx_aliases, pd->topic_alias_max_tx);
+  MG_FREE(pd->stream_topic);
   MG_FREE(proto_data);
 }
 
@@ -9972,9 +11297,24 @@ int mg_mqtt_vmatch_topic_expression(const char *exp, struct mg_str topic) {
 }
 
 void mg_set_protocol_mqtt(struct mg_connection *nc) {
+  struct mg_mqtt_proto_data *pd;
   nc->proto_handler = mqtt_handler;
-  nc->proto_data = MG_CALLOC(1, sizeof(struct mg_mqtt_proto_data));
+  nc->proto_data = pd = (struct mg_mqtt_proto_data *) MG_CALLOC(1, sizeof(*pd));
   nc->proto_data_destructor = mg_mqtt_proto_data_destructor;
+  pd->protocol_version = MG_MQTT_PROTO_VERSION_311;
+}
+
+static int mg_mqtt_is_v5(struct mg_connection *nc) {
+  struct mg_mqtt_proto_data *pd = (struct mg_mqtt_proto_data *) nc->proto_data;
+  return pd != NULL && pd->protocol_version >= MG_MQTT_PROTO_VERSION_5;
+}
+
+/* Sends an empty MQTT 5 property list, if required by the protocol. */
+static size_t mg_mqtt_send_no_props(struct mg_connection *nc) {
+  uint8_t zero = 0;
+  if (!mg_mqtt_is_v5(nc)) return 0;
+  mg_send(nc, &zero, 1);
+  return 1;
 }
 
 static void mg_mqtt_prepend_header(struct mg_connection *nc, uint8_t cmd,
@@ -9983,21 +11323,13 @@ static void mg_mqtt_prepend_header(struct mg_connection *nc, uint8_t cmd,
   uint8_t header = cmd << 4 | (uint8_t) flags;
 
   uint8_t buf[1 + sizeof(size_t)];
-  uint8_t *vlen = &buf[1];
 
   assert(nc->send_mbuf.len >= len);
 
   buf[0] = header;
 
-  /* mqtt variable length encoding */
-  do {
-    *vlen = len % 0x80;
-    len /= 0x80;
-    if (len > 0) *vlen |= 0x80;
-    vlen++;
-  } while (len > 0);
-
-  mbuf_insert(&nc->send_mbuf, off, buf, vlen - buf);
+  mbuf_insert(&nc->send_mbuf, off, buf,
+              1 + mg_mqtt_put_varint(buf + 1, (uint32_t) len));
 }
 
 void mg_send_mqtt_handshake(struct mg_connection *nc, const char *client_id) {
@@ -10010,7 +11342,27 @@ void mg_send_mqtt_handshake_opt(struct mg_connection *nc, const char *client_id,
   uint16_t hlen, nlen, rem_len = 0;
   struct mg_mqtt_proto_data *pd = (struct mg_mqtt_proto_data *) nc->proto_data;
 
-  mg_send(nc, "\00\04MQTT\04", 7);
+  if (opts.protocol_version == 0) {
+    opts.protocol_version = MG_MQTT_PROTO_VERSION_311;
+  }
+  if (pd != NULL) {
+    pd->protocol_version = opts.protocol_version;
+    mg_mqtt_free_aliases(pd->rx_aliases, pd->topic_alias_max);
+    pd->rx_aliases = NULL;
+    pd->topic_alias_max = 0;
+    if (opts.protocol_version >= MG_MQTT_PROTO_VERSION_5 &&
+        opts.topic_alias_max > 0) {
+      pd->rx_aliases =
+          (char **) MG_CALLOC(opts.topic_alias_max, sizeof(*pd->rx_aliases));
+      if (pd->rx_aliases != NULL) pd->topic_alias_max = opts.topic_alias_max;
+    }
+    /* Only advertise what we can actually handle. */
+    opts.topic_alias_max = pd->topic_alias_max;
+  } else {
+    opts.topic_alias_max = 0;
+  }
+  mg_send(nc, "\00\04MQTT", 6);
+  mg_send(nc, &opts.protocol_version, 1);
   rem_len += 7;
 
   if (opts.user_name != NULL) {
@@ -10033,6 +11385,25 @@ void mg_send_mqtt_handshake_opt(struct mg_connection *nc, const char *client_id,
   mg_send(nc, &nlen, 2);
   rem_len += 2;
 
+  if (opts.protocol_version >= MG_MQTT_PROTO_VERSION_5) {
+    uint8_t props[1 + 5 + 3], *pp = props + 1;
+    if (opts.session_expiry_interval > 0) {
+      uint32_t sei = htonl(opts.session_expiry_interval);
+      *pp++ = MG_MQTT_PROP_SESSION_EXPIRY_INTERVAL;
+      memcpy(pp, &sei, 4);
+      pp += 4;
+    }
+    if (opts.topic_alias_max > 0) {
+      nlen = htons(opts.topic_alias_max);
+      *pp++ = MG_MQTT_PROP_TOPIC_ALIAS_MAXIMUM;
+      memcpy(pp, &nlen, 2);
+      pp += 2;
+    }
+    props[0] = (uint8_t)(pp - props - 1);
+    mg_send(nc, props, pp - props);
+    rem_len += pp - props;
+  }
+
   hlen = strlen(client_id);
   nlen = htons((uint16_t) hlen);
   mg_send(nc, &nlen, 2);
@@ -10040,6 +11411,11 @@ void mg_send_mqtt_handshake_opt(struct mg_connection *nc, const char *client_id,
   rem_len += 2 + hlen;
 
   if (opts.flags & MG_MQTT_HAS_WILL) {
+    if (opts.protocol_version >= MG_MQTT_PROTO_VERSION_5) {
+      uint8_t zero = 0; /* No will properties */
+      mg_send(nc, &zero, 1);
+      rem_len += 1;
+    }
     hlen = strlen(opts.will_topic);
     nlen = htons((uint16_t) hlen);
     mg_send(nc, &nlen, 2);
@@ -10075,19 +11451,55 @@ void mg_send_mqtt_handshake_opt(struct mg_connection *nc, const char *client_id,
   }
 }
 
+/*
+ * Picks a topic alias for an outgoing MQTT 5 PUBLISH. Returns 0 if aliases
+ * are not available. `*known` is set if the peer already knows the alias.
+ */
+static uint16_t mg_mqtt_tx_topic_alias(struct mg_connection *nc,
+                                       const char *topic, int *known) {
+  struct mg_mqtt_proto_data *pd = (struct mg_mqtt_proto_data *) nc->proto_data;
+  uint16_t i;
+  *known = 0;
+  if (!mg_mqtt_is_v5(nc) || pd->tx_aliases == NULL) return 0;
+  for (i = 0; i < pd->topic_alias_max_tx; i++) {
+    if (pd->tx_aliases[i] == NULL) {
+      pd->tx_aliases[i] = strdup(topic);
+      return pd->tx_aliases[i] != NULL ? i + 1 : 0;
+    }
+    if (strcmp(pd->tx_aliases[i], topic) == 0) {
+      *known = 1;
+      return i + 1;
+    }
+  }
+  /* Table is full, send this one in full. */
+  return 0;
+}
+
 void mg_mqtt_publish(struct mg_connection *nc, const char *topic,
                      uint16_t message_id, int flags, const void *data,
                      size_t len) {
   size_t old_len = nc->send_mbuf.len;
+  int known;
+  uint16_t alias = mg_mqtt_tx_topic_alias(nc, topic, &known);
 
-  uint16_t topic_len = htons((uint16_t) strlen(topic));
+  uint16_t topic_len = htons((uint16_t)(known ? 0 : strlen(topic)));
   uint16_t message_id_net = htons(message_id);
 
   mg_send(nc, &topic_len, 2);
-  mg_send(nc, topic, strlen(topic));
+  if (!known) mg_send(nc, topic, strlen(topic));
   if (MG_MQTT_GET_QOS(flags) > 0) {
     mg_send(nc, &message_id_net, 2);
   }
+  if (alias > 0) {
+    uint8_t props[4];
+    uint16_t alias_net = htons(alias);
+    props[0] = 3;
+    props[1] = MG_MQTT_PROP_TOPIC_ALIAS;
+    memcpy(props + 2, &alias_net, 2);
+    mg_send(nc, props, sizeof(props));
+  } else {
+    mg_mqtt_send_no_props(nc);
+  }
   mg_send(nc, data, len);
 
   mg_mqtt_prepend_header(nc, MG_MQTT_CMD_PUBLISH, flags,
@@ -10103,6 +11515,7 @@ void mg_mqtt_subscribe(struct mg_connection *nc,
   size_t i;
 
   mg_send(nc, (char *) &message_id_n, 2);
+  mg_mqtt_send_no_props(nc);
   for (i = 0; i < topics_len; i++) {
     uint16_t topic_len_n = htons((uint16_t) strlen(topics[i].topic));
     mg_send(nc, &topic_len_n, 2);
@@ -10136,6 +11549,7 @@ void mg_mqtt_unsubscribe(struct mg_connection *nc, char **topics,
   size_t i;
 
   mg_send(nc, (char *) &message_id_n, 2);
+  mg_mqtt_send_no_props(nc);
   for (i = 0; i < topics_len; i++) {
     uint16_t topic_len_n = htons((uint16_t) strlen(topics[i]));
     mg_send(nc, &topic_len_n, 2);
@@ -10147,10 +11561,16 @@ void mg_mqtt_unsubscribe(struct mg_connection *nc, char **topics,
 }
 
 void mg_mqtt_connack(struct mg_connection *nc, uint8_t return_code) {
-  uint8_t unused = 0;
-  mg_send(nc, &unused, 1);
+  mg_mqtt_connack_opt(nc, return_code, 0);
+}
+
+void mg_mqtt_connack_opt(struct mg_connection *nc, uint8_t return_code,
+                         int session_present) {
+  uint8_t flags = (session_present ? 1 : 0);
+  mg_send(nc, &flags, 1);
   mg_send(nc, &return_code, 1);
-  mg_mqtt_prepend_header(nc, MG_MQTT_CMD_CONNACK, 0, 2);
+  mg_mqtt_prepend_header(nc, MG_MQTT_CMD_CONNACK, 0,
+                         2 + mg_mqtt_send_no_props(nc));
 }
 
 /*
@@ -10184,13 +11604,15 @@ void mg_mqtt_pubcomp(struct mg_connection *nc, uint16_t message_id) {
 
 void mg_mqtt_suback(struct mg_connection *nc, uint8_t *qoss, size_t qoss_len,
                     uint16_t message_id) {
-  size_t i;
+  size_t i, props_len;
   uint16_t message_id_net = htons(message_id);
   mg_send(nc, &message_id_net, 2);
+  props_len = mg_mqtt_send_no_props(nc);
   for (i = 0; i < qoss_len; i++) {
     mg_send(nc, &qoss[i], 1);
   }
-  mg_mqtt_prepend_header(nc, MG_MQTT_CMD_SUBACK, MG_MQTT_QOS(1), 2 + qoss_len);
+  mg_mqtt_prepend_header(nc, MG_MQTT_CMD_SUBACK, MG_MQTT_QOS(1),
+                         2 + props_len + qoss_len);
 }
 
 void mg_mqtt_unsuback(struct mg_connection *nc, uint16_t message_id) {
@@ -10230,6 +11652,8 @@ static void mg_mqtt_session_init(struct mg_mqtt_broker *brk,
   s->subscriptions = NULL;
   s->num_subscriptions = 0;
   s->nc = nc;
+  STAILQ_INIT(&s->queue);
+  mbuf_init(&s->chunked, 0);
 }
 
 static void mg_mqtt_add_session(struct mg_mqtt_session *s) {
@@ -10240,12 +11664,38 @@ static void mg_mqtt_remove_session(struct mg_mqtt_session *s) {
   LIST_REMOVE(s, link);
 }
 
+static struct mg_mqtt_stored_message *mg_mqtt_store_message(
+    const struct mg_str topic, const struct mg_str payload, uint8_t qos) {
+  struct mg_mqtt_stored_message *m = (struct mg_mqtt_stored_message *)
+      MG_MALLOC(sizeof(*m) + topic.len + 1 + payload.len);
+  if (m == NULL) return NULL;
+  m->topic = (char *) (m + 1);
+  memcpy(m->topic, topic.p, topic.len);
+  m->topic[topic.len] = '\0';
+  m->payload.p = m->topic + topic.len + 1;
+  memcpy((char *) m->payload.p, payload.p, payload.len);
+  m->payload.len = payload.len;
+  m->message_id = 0;
+  m->qos = qos;
+  return m;
+}
+
+static size_t mg_mqtt_stored_message_size(struct mg_mqtt_stored_message *m) {
+  return sizeof(*m) + strlen(m->topic) + 1 + m->payload.len;
+}
+
 static void mg_mqtt_destroy_session(struct mg_mqtt_session *s) {
   size_t i;
+  struct mg_mqtt_stored_message *m, *tmp;
   for (i = 0; i < s->num_subscriptions; i++) {
     MG_FREE((void *) s->subscriptions[i].topic);
   }
+  STAILQ_FOREACH_SAFE(m, &s->queue, link, tmp) {
+    MG_FREE(m);
+  }
+  mbuf_free(&s->chunked);
   MG_FREE(s->subscriptions);
+  MG_FREE(s->client_id);
   MG_FREE(s);
 }
 
@@ -10256,13 +11706,109 @@ static void mg_mqtt_close_session(struct mg_mqtt_session *s) {
 
 void mg_mqtt_broker_init(struct mg_mqtt_broker *brk, void *user_data) {
   LIST_INIT(&brk->sessions);
+  STAILQ_INIT(&brk->retained);
+  brk->retained_size = 0;
   brk->user_data = user_data;
 }
 
+void mg_mqtt_broker_free(struct mg_mqtt_broker *brk) {
+  struct mg_mqtt_session *s;
+  struct mg_mqtt_stored_message *m, *tmp;
+  while ((s = LIST_FIRST(&brk->sessions)) != NULL) {
+    if (s->nc != NULL) s->nc->user_data = NULL;
+    mg_mqtt_close_session(s);
+  }
+  STAILQ_FOREACH_SAFE(m, &brk->retained, link, tmp) {
+    MG_FREE(m);
+  }
+  STAILQ_INIT(&brk->retained);
+  brk->retained_size = 0;
+}
+
+/*
+ * Makes room for a new persistent session by dropping the least recently
+ * added offline one. Returns 0 if all persistent sessions are online.
+ */
+static int mg_mqtt_make_room_for_session(struct mg_mqtt_broker *brk) {
+  struct mg_mqtt_session *s, *victim = NULL;
+  size_t num_persistent = 0;
+  for (s = mg_mqtt_next(brk, NULL); s != NULL; s = mg_mqtt_next(brk, s)) {
+    if (!s->persistent) continue;
+    num_persistent++;
+    /* New sessions go to the head, so the last offline one is the oldest. */
+    if (s->nc == NULL) victim = s;
+  }
+  if (num_persistent < MG_MQTT_MAX_PERSISTENT_SESSIONS) return 1;
+  if (victim == NULL) return 0;
+  LOG(LL_INFO, ("Dropping offline session %s", victim->client_id));
+  mg_mqtt_close_session(victim);
+  return 1;
+}
+
+static struct mg_mqtt_session *mg_mqtt_find_persistent_session(
+    struct mg_mqtt_broker *brk, const struct mg_str client_id) {
+  struct mg_mqtt_session *s;
+  for (s = mg_mqtt_next(brk, NULL); s != NULL; s = mg_mqtt_next(brk, s)) {
+    if (s->persistent && mg_vcmp(&client_id, s->client_id) == 0) return s;
+  }
+  return NULL;
+}
+
+/* Sends a queued message that has not been sent yet, or resends one. */
+static void mg_mqtt_send_stored(struct mg_mqtt_session *s,
+                                struct mg_mqtt_stored_message *m, int dup) {
+  if (m->message_id == 0) {
+    if (++s->last_message_id == 0) s->last_message_id++;
+    m->message_id = s->last_message_id;
+  }
+  mg_mqtt_publish(s->nc, m->topic, m->message_id,
+                  MG_MQTT_QOS(m->qos) | (dup ? MG_MQTT_DUP : 0), m->payload.p,
+                  m->payload.len);
+}
+
+static void mg_mqtt_flush_queue(struct mg_mqtt_session *s) {
+  struct mg_mqtt_stored_message *m;
+  if (s->nc == NULL) return;
+  STAILQ_FOREACH(m, &s->queue, link) {
+    mg_mqtt_send_stored(s, m, m->message_id != 0);
+  }
+}
+
 static void mg_mqtt_broker_handle_connect(struct mg_mqtt_broker *brk,
-                                          struct mg_connection *nc) {
-  struct mg_mqtt_session *s =
-      (struct mg_mqtt_session *) MG_CALLOC(1, sizeof *s);
+                                          struct mg_connection *nc,
+                                          struct mg_mqtt_message *msg) {
+  struct mg_mqtt_session *s = NULL;
+  int persistent = !(msg->connect_flags & MG_MQTT_CLEAN_SESSION) &&
+                   msg->client_id.len > 0;
+
+  if (msg->client_id.len > 0) {
+    s = mg_mqtt_find_persistent_session(brk, msg->client_id);
+    if (s != NULL && !persistent) {
+      /* Client asked for a clean session, forget the old one. */
+      if (s->nc != NULL) {
+        s->nc->user_data = NULL;
+        s->nc->flags |= MG_F_SEND_AND_CLOSE;
+      }
+      mg_mqtt_close_session(s);
+      s = NULL;
+    }
+  }
+
+  if (s != NULL) {
+    /* Resume the session, taking it over from an old connection, if any. */
+    if (s->nc != NULL) {
+      s->nc->user_data = NULL;
+      s->nc->flags |= MG_F_SEND_AND_CLOSE;
+    }
+    s->nc = nc;
+    s->user_data = nc->user_data;
+    nc->user_data = s;
+    mg_mqtt_connack_opt(nc, MG_EV_MQTT_CONNACK_ACCEPTED, 1);
+    mg_mqtt_flush_queue(s);
+    return;
+  }
+
+  s = (struct mg_mqtt_session *) MG_CALLOC(1, sizeof *s);
   if (s == NULL) {
     /* LCOV_EXCL_START */
     mg_mqtt_connack(nc, MG_EV_MQTT_CONNACK_SERVER_UNAVAILABLE);
@@ -10273,6 +11819,18 @@ static void mg_mqtt_broker_handle_connect(struct mg_mqtt_broker *brk,
   /* TODO(mkm): check header (magic and version) */
 
   mg_mqtt_session_init(brk, s, nc);
+  if (persistent && !mg_mqtt_make_room_for_session(brk)) {
+    LOG(LL_ERROR, ("%p too many persistent sessions, using a clean one", nc));
+    persistent = 0;
+  }
+  if (persistent) {
+    s->client_id = (char *) MG_MALLOC(msg->client_id.len + 1);
+    if (s->client_id != NULL) {
+      memcpy(s->client_id, msg->client_id.p, msg->client_id.len);
+      s->client_id[msg->client_id.len] = '\0';
+      s->persistent = 1;
+    }
+  }
   s->user_data = nc->user_data;
   nc->user_data = s;
   mg_mqtt_add_session(s);
@@ -10280,45 +11838,181 @@ static void mg_mqtt_broker_handle_connect(struct mg_mqtt_broker *brk,
   mg_mqtt_connack(nc, MG_EV_MQTT_CONNACK_ACCEPTED);
 }
 
+static void mg_mqtt_send_retained(struct mg_mqtt_broker *brk,
+                                  struct mg_connection *nc,
+                                  const struct mg_str exp) {
+  struct mg_mqtt_stored_message *m;
+  STAILQ_FOREACH(m, &brk->retained, link) {
+    if (mg_mqtt_match_topic_expression(exp, mg_mk_str(m->topic))) {
+      mg_mqtt_publish(nc, m->topic, 0, MG_MQTT_RETAIN, m->payload.p,
+                      m->payload.len);
+    }
+  }
+}
+
+static struct mg_mqtt_topic_expression *mg_mqtt_find_subscription(
+    struct mg_mqtt_session *s, const struct mg_str topic) {
+  size_t i;
+  for (i = 0; i < s->num_subscriptions; i++) {
+    if (mg_vcmp(&topic, s->subscriptions[i].topic) == 0) {
+      return &s->subscriptions[i];
+    }
+  }
+  return NULL;
+}
+
 static void mg_mqtt_broker_handle_subscribe(struct mg_connection *nc,
                                             struct mg_mqtt_message *msg) {
   struct mg_mqtt_session *ss = (struct mg_mqtt_session *) nc->user_data;
-  uint8_t qoss[512];
-  size_t qoss_len = 0;
+  uint8_t qoss[MG_MQTT_MAX_SESSION_SUBSCRIPTIONS];
+  size_t qoss_len = 0, num_new = 0, i;
   struct mg_str topic;
   uint8_t qos;
   int pos;
   struct mg_mqtt_topic_expression *te;
 
-  for (pos = 0;
-       (pos = mg_mqtt_next_subscribe_topic(msg, &topic, &qos, pos)) != -1;) {
-    qoss[qoss_len++] = qos;
+  if (ss == NULL) {
+    /* No CONNECT yet, or the session was taken over by another connection. */
+    nc->flags |= MG_F_CLOSE_IMMEDIATELY;
+    return;
   }
 
-  ss->subscriptions = (struct mg_mqtt_topic_expression *) MG_REALLOC(
-      ss->subscriptions, sizeof(*ss->subscriptions) * qoss_len);
   for (pos = 0;
-       (pos = mg_mqtt_next_subscribe_topic(msg, &topic, &qos, pos)) != -1;
-       ss->num_subscriptions++) {
-    te = &ss->subscriptions[ss->num_subscriptions];
-    te->topic = (char *) MG_MALLOC(topic.len + 1);
-    te->qos = qos;
-    strncpy((char *) te->topic, topic.p, topic.len + 1);
+       (pos = mg_mqtt_next_subscribe_topic(msg, &topic, &qos, pos)) != -1 &&
+       qoss_len < sizeof(qoss);) {
+    /* MQTT 5 keeps subscription options in the upper bits. */
+    qoss[qoss_len++] = qos & 3;
+    if (mg_mqtt_find_subscription(ss, topic) == NULL) num_new++;
+  }
+
+  if (ss->num_subscriptions + num_new > MG_MQTT_MAX_SESSION_SUBSCRIPTIONS) {
+    LOG(LL_ERROR, ("%p too many subscriptions", nc));
+    nc->flags |= MG_F_CLOSE_IMMEDIATELY;
+    return;
+  }
+
+  if (num_new > 0) {
+    te = (struct mg_mqtt_topic_expression *) MG_REALLOC(
+        ss->subscriptions,
+        sizeof(*ss->subscriptions) * (ss->num_subscriptions + num_new));
+    if (te == NULL) {
+      nc->flags |= MG_F_CLOSE_IMMEDIATELY; /* LCOV_EXCL_LINE */
+      return;                              /* LCOV_EXCL_LINE */
+    }
+    ss->subscriptions = te;
+  }
+  for (pos = 0, i = 0;
+       (pos = mg_mqtt_next_subscribe_topic(msg, &topic, &qos, pos)) != -1 &&
+       i < qoss_len;
+       i++) {
+    /* A repeated filter replaces the existing subscription. */
+    te = mg_mqtt_find_subscription(ss, topic);
+    if (te == NULL) {
+      te = &ss->subscriptions[ss->num_subscriptions++];
+      te->topic = (char *) MG_MALLOC(topic.len + 1);
+      memcpy((char *) te->topic, topic.p, topic.len);
+      ((char *) te->topic)[topic.len] = '\0';
+    }
+    te->qos = qos & 3;
   }
 
   mg_mqtt_suback(nc, qoss, qoss_len, msg->message_id);
+
+  for (pos = 0;
+       (pos = mg_mqtt_next_subscribe_topic(msg, &topic, &qos, pos)) != -1;) {
+    mg_mqtt_send_retained(ss->brk, nc, topic);
+  }
+}
+
+static void mg_mqtt_broker_handle_puback(struct mg_connection *nc,
+                                         struct mg_mqtt_message *msg) {
+  struct mg_mqtt_session *s = (struct mg_mqtt_session *) nc->user_data;
+  struct mg_mqtt_stored_message *m;
+  if (s == NULL) return;
+  STAILQ_FOREACH(m, &s->queue, link) {
+    if (m->message_id == msg->message_id) {
+      STAILQ_REMOVE(&s->queue, m, mg_mqtt_stored_message, link);
+      s->queue_size -= mg_mqtt_stored_message_size(m);
+      MG_FREE(m);
+      break;
+    }
+  }
+}
+
+/*
+ * Queues a QoS 1 message for the session, dropping the oldest ones if
+ * the session goes over its memory limit.
+ */
+static void mg_mqtt_enqueue(struct mg_mqtt_session *s,
+                            struct mg_mqtt_message *msg, uint8_t qos) {
+  struct mg_mqtt_stored_message *m =
+      mg_mqtt_store_message(msg->topic, msg->payload, qos);
+  size_t size;
+  if (m == NULL) return;
+  size = mg_mqtt_stored_message_size(m);
+  if (size > MG_MQTT_MAX_SESSION_QUEUE_SIZE) {
+    MG_FREE(m);
+    return;
+  }
+  while (s->queue_size + size > MG_MQTT_MAX_SESSION_QUEUE_SIZE) {
+    struct mg_mqtt_stored_message *old = STAILQ_FIRST(&s->queue);
+    STAILQ_REMOVE_HEAD(&s->queue, link);
+    s->queue_size -= mg_mqtt_stored_message_size(old);
+    MG_FREE(old);
+  }
+  STAILQ_INSERT_TAIL(&s->queue, m, link);
+  s->queue_size += size;
+  if (s->nc != NULL) mg_mqtt_send_stored(s, m, 0);
+}
+
+static void mg_mqtt_broker_retain(struct mg_mqtt_broker *brk,
+                                  struct mg_mqtt_message *msg) {
+  struct mg_mqtt_stored_message *m;
+  size_t size;
+  STAILQ_FOREACH(m, &brk->retained, link) {
+    if (mg_vcmp(&msg->topic, m->topic) == 0) {
+      STAILQ_REMOVE(&brk->retained, m, mg_mqtt_stored_message, link);
+      brk->retained_size -= mg_mqtt_stored_message_size(m);
+      MG_FREE(m);
+      break;
+    }
+  }
+  /* Empty payload just removes the retained message. */
+  if (msg->payload.len == 0) return;
+  m = mg_mqtt_store_message(msg->topic, msg->payload, 0);
+  if (m == NULL) return;
+  size = mg_mqtt_stored_message_size(m);
+  if (brk->retained_size + size > MG_MQTT_MAX_RETAINED_SIZE) {
+    LOG(LL_ERROR, ("Retained store is full, dropping [%.*s]",
+                   (int) msg->topic.len, msg->topic.p));
+    MG_FREE(m);
+    return;
+  }
+  STAILQ_INSERT_TAIL(&brk->retained, m, link);
+  brk->retained_size += size;
 }
 
 static void mg_mqtt_broker_handle_publish(struct mg_mqtt_broker *brk,
+                                          struct mg_connection *nc,
                                           struct mg_mqtt_message *msg) {
   struct mg_mqtt_session *s;
   size_t i;
 
+  if (msg->qos == 1) mg_mqtt_puback(nc, msg->message_id);
+  if (msg->flags & MG_MQTT_RETAIN) mg_mqtt_broker_retain(brk, msg);
+
   for (s = mg_mqtt_next(brk, NULL); s != NULL; s = mg_mqtt_next(brk, s)) {
     for (i = 0; i < s->num_subscriptions; i++) {
       if (mg_mqtt_vmatch_topic_expression(s->subscriptions[i].topic,
                                           msg->topic)) {
+        uint8_t qos = MIN(msg->qos, s->subscriptions[i].qos);
         char buf[100], *p = buf;
+        if (qos > 0) {
+          /* Queued until acked, or until the client comes back. */
+          if (s->nc != NULL || s->persistent) mg_mqtt_enqueue(s, msg, 1);
+          break;
+        }
+        if (s->nc == NULL) break;
         mg_asprintf(&p, sizeof(buf), "%.*s", (int) msg->topic.len,
                     msg->topic.p);
         if (p == NULL) {
@@ -10334,6 +12028,34 @@ static void mg_mqtt_broker_handle_publish(struct mg_mqtt_broker *brk,
   }
 }
 
+/*
+ * Reassembles a PUBLISH that arrives in chunks and routes it once complete.
+ * Messages over MG_MQTT_MAX_CHUNKED_PUBLISH_SIZE are acknowledged and dropped.
+ */
+static void mg_mqtt_broker_handle_publish_chunk(struct mg_mqtt_broker *brk,
+                                                struct mg_connection *nc,
+                                                struct mg_mqtt_message *msg) {
+  struct mg_mqtt_session *s = (struct mg_mqtt_session *) nc->user_data;
+  struct mg_mqtt_message m;
+  if (s == NULL) return;
+  if (msg->payload_offset == 0) s->chunked.len = 0;
+  if (msg->payload_total_len <= MG_MQTT_MAX_CHUNKED_PUBLISH_SIZE) {
+    mbuf_append(&s->chunked, msg->payload.p, msg->payload.len);
+  }
+  if (msg->payload_offset + msg->payload.len < msg->payload_total_len) return;
+  if (s->chunked.len == msg->payload_total_len) {
+    m = *msg;
+    m.payload = mg_mk_str_n(s->chunked.buf, s->chunked.len);
+    mg_mqtt_broker_handle_publish(brk, nc, &m);
+  } else {
+    LOG(LL_ERROR, ("%p dropping PUBLISH to [%.*s], %d bytes", nc,
+                   (int) msg->topic.len, msg->topic.p,
+                   (int) msg->payload_total_len));
+    if (msg->qos == 1) mg_mqtt_puback(nc, msg->message_id);
+  }
+  mbuf_free(&s->chunked);
+}
+
 void mg_mqtt_broker(struct mg_connection *nc, int ev, void *data) {
   struct mg_mqtt_message *msg = (struct mg_mqtt_message *) data;
   struct mg_mqtt_broker *brk;
@@ -10350,17 +12072,29 @@ void mg_mqtt_broker(struct mg_connection *nc, int ev, void *data) {
       nc->user_data = NULL; /* Clear up the inherited pointer to broker */
       break;
     case MG_EV_MQTT_CONNECT:
-      mg_mqtt_broker_handle_connect(brk, nc);
+      mg_mqtt_broker_handle_connect(brk, nc, msg);
       break;
     case MG_EV_MQTT_SUBSCRIBE:
       mg_mqtt_broker_handle_subscribe(nc, msg);
       break;
     case MG_EV_MQTT_PUBLISH:
-      mg_mqtt_broker_handle_publish(brk, msg);
+      mg_mqtt_broker_handle_publish(brk, nc, msg);
+      break;
+    case MG_EV_MQTT_PUBLISH_CHUNK:
+      mg_mqtt_broker_handle_publish_chunk(brk, nc, msg);
+      break;
+    case MG_EV_MQTT_PUBACK:
+      mg_mqtt_broker_handle_puback(nc, msg);
       break;
     case MG_EV_CLOSE:
       if (nc->listener && nc->user_data != NULL) {
-        mg_mqtt_close_session((struct mg_mqtt_session *) nc->user_data);
+        struct mg_mqtt_session *s = (struct mg_mqtt_session *) nc->user_data;
+        if (s->persistent) {
+          /* Keep the session, unacked messages will be resent. */
+          s->nc = NULL;
+        } else {
+          mg_mqtt_close_session(s);
+        }
       }
       break;
   }
@@ -10836,20 +12570,188 @@ int mg_dns_reply_record(struct mg_dns_reply *reply,
 #define MG_DEFAULT_NAMESERVER "8.8.8.8"
 #endif
 
-struct mg_resolve_async_request {
-  char name[1024];
-  int query;
-  mg_resolve_callback_t callback;
-  void *data;
-  time_t timeout;
-  int max_retries;
+#ifndef MG_RESOLVE_CACHE_SIZE
+#define MG_RESOLVE_CACHE_SIZE 8
+#endif
+
+#ifndef MG_RESOLVE_CACHE_MAX_TTL
+#define MG_RESOLVE_CACHE_MAX_TTL 3600
+#endif
+
+/* How long to remember that a name does not resolve. */
+#ifndef MG_RESOLVE_NEGATIVE_TTL
+#define MG_RESOLVE_NEGATIVE_TTL 10
+#endif
+
+/* Callback waiting for the result of a request, in the order of arrival. */
+struct mg_resolve_waiter {
+  mg_resolve_callback_t callback;
+  void *data;
+  double timer; /* Give up on the request at this time, see mg_set_timer() */
+  struct mg_resolve_waiter *next;
+};
+
+struct mg_resolve_async_request {
+  char name[1024];
+  int query;
+  time_t timeout;
+  int max_retries;
   enum mg_resolve_err err;
 
   /* state */
   time_t last_time;
   int retries;
+
+  char nameserver_url[26];
+  int parallel_aaaa;
+  uint16_t tid; /* Transaction id of the last query sent */
+  struct mg_resolve_waiter *waiters;
+  struct mg_connection *nc; /* NULL if answered from the cache */
+  struct mg_resolve_async_request *next; /* mg_mgr::dns_pending linkage */
+  /* A query and its parallel AAAA query point at each other until done. */
+  struct mg_resolve_async_request *sibling;
+  /* Cached or AAAA reply, used if there is no answer of our own. */
+  struct mbuf fallback_reply;
+  int from_cache; /* Answer is known, 2 - complete on this poll */
 };
 
+struct mg_resolve_cache_entry {
+  struct mg_resolve_cache_entry *next;
+  char *name;
+  int query;
+  double expire, last_used;
+  char *pkt; /* NULL for a negative entry */
+  int pkt_len;
+};
+
+static struct mg_resolve_cache_entry *mg_resolve_cache_find(
+    struct mg_mgr *mgr, const char *name, int query) {
+  struct mg_resolve_cache_entry **pe = &mgr->dns_cache, *e;
+  double now = mg_time();
+  while ((e = *pe) != NULL) {
+    if (e->expire <= now) {
+      *pe = e->next;
+      MG_FREE(e->name);
+      MG_FREE(e->pkt);
+      MG_FREE(e);
+      continue;
+    }
+    if (e->query == query && mg_casecmp(e->name, name) == 0) {
+      e->last_used = now;
+      return e;
+    }
+    pe = &e->next;
+  }
+  return NULL;
+}
+
+static void mg_resolve_cache_add(struct mg_mgr *mgr, const char *name,
+                                 int query, struct mg_dns_message *msg) {
+  struct mg_resolve_cache_entry *e, *lru = NULL;
+  int i, ttl = MG_RESOLVE_CACHE_MAX_TTL, n = 0;
+  if (MG_RESOLVE_CACHE_SIZE <= 0) return;
+  if (msg->num_answers > 0) {
+    for (i = 0; i < msg->num_answers; i++) {
+      if (msg->answers[i].ttl < ttl) ttl = msg->answers[i].ttl;
+    }
+  } else {
+    ttl = MG_RESOLVE_NEGATIVE_TTL;
+  }
+  if (ttl <= 0) return;
+  if ((e = mg_resolve_cache_find(mgr, name, query)) == NULL) {
+    for (e = mgr->dns_cache; e != NULL; e = e->next, n++) {
+      if (lru == NULL || e->last_used < lru->last_used) lru = e;
+    }
+    if (n >= MG_RESOLVE_CACHE_SIZE) {
+      e = lru;
+      MG_FREE(e->name);
+    } else {
+      e = (struct mg_resolve_cache_entry *) MG_CALLOC(1, sizeof(*e));
+      if (e == NULL) return;
+      e->next = mgr->dns_cache;
+      mgr->dns_cache = e;
+    }
+    e->name = strdup(name);
+    e->query = query;
+  }
+  MG_FREE(e->pkt);
+  e->pkt = NULL;
+  e->pkt_len = 0;
+  if (msg->num_answers > 0 &&
+      (e->pkt = (char *) MG_MALLOC(msg->pkt.len)) != NULL) {
+    memcpy(e->pkt, msg->pkt.p, msg->pkt.len);
+    e->pkt_len = msg->pkt.len;
+  }
+  e->last_used = mg_time();
+  e->expire = e->last_used + ttl;
+  if (e->name == NULL || (msg->num_answers > 0 && e->pkt == NULL)) {
+    e->expire = 0; /* Out of memory, let the next lookup reap it. */
+  }
+}
+
+/* Returns the cache entry that answers the question, NULL if none does. */
+static struct mg_resolve_cache_entry *mg_resolve_cache_lookup(
+    struct mg_mgr *mgr, const char *name, int query, int parallel_aaaa) {
+  struct mg_resolve_cache_entry *e = mg_resolve_cache_find(mgr, name, query);
+  if (e != NULL && e->pkt == NULL && parallel_aaaa &&
+      query == MG_DNS_A_RECORD) {
+    /* No A records, the answer is whatever AAAA lookup says. */
+    e = mg_resolve_cache_find(mgr, name, MG_DNS_AAAA_RECORD);
+  }
+  return e;
+}
+
+/*
+ * Fills `sa` with a cached address of `name`. Returns 1 if there was one.
+ * Failures are not reported here, they go through mg_resolve_async_opt().
+ */
+MG_INTERNAL int mg_resolve_from_cache(struct mg_mgr *mgr, const char *name,
+                                      union socket_address *sa) {
+  int i, qi, queries[] = {MG_DNS_A_RECORD, MG_DNS_AAAA_RECORD};
+  int result = 0;
+  for (qi = 0; qi < (MG_ENABLE_IPV6 ? 2 : 1); qi++) {
+    struct mg_resolve_cache_entry *e =
+        mg_resolve_cache_find(mgr, name, queries[qi]);
+    struct mg_dns_message *msg;
+    if (e == NULL) break;
+    if (e->pkt == NULL) continue;
+    msg = (struct mg_dns_message *) MG_MALLOC(sizeof(*msg));
+    if (msg == NULL || mg_parse_dns(e->pkt, e->pkt_len, msg) != 0) {
+      MG_FREE(msg);
+      return 0;
+    }
+    for (i = 0; i < msg->num_answers; i++) {
+      struct mg_dns_resource_record *rr = &msg->answers[i];
+      if (rr->rtype == MG_DNS_A_RECORD &&
+          mg_dns_parse_record_data(msg, rr, &sa->sin.sin_addr, 4) == 0) {
+        sa->sin.sin_family = AF_INET;
+        break;
+      }
+#if MG_ENABLE_IPV6
+      if (rr->rtype == MG_DNS_AAAA_RECORD &&
+          mg_dns_parse_record_data(msg, rr, &sa->sin6.sin6_addr, 16) == 0) {
+        sa->sin6.sin6_family = AF_INET6;
+        break;
+      }
+#endif
+    }
+    result = (i < msg->num_answers);
+    MG_FREE(msg);
+    if (result) break;
+  }
+  return result;
+}
+
+MG_INTERNAL void mg_resolve_cache_free(struct mg_mgr *mgr) {
+  struct mg_resolve_cache_entry *e;
+  while ((e = mgr->dns_cache) != NULL) {
+    mgr->dns_cache = e->next;
+    MG_FREE(e->name);
+    MG_FREE(e->pkt);
+    MG_FREE(e);
+  }
+}
+
 /*
  * Find what nameserver to use.
  *
@@ -10929,21 +12831,56 @@ static int mg_get_ip_address_of_nameserver(char *name, size_t name_len) {
   return ret;
 }
 
-int mg_resolve_from_hosts_file(const char *name, union socket_address *usa) {
 #if MG_ENABLE_FILESYSTEM && defined(MG_HOSTS_FILE_NAME)
-  /* TODO(mkm) cache /etc/hosts */
+static char *s_hosts_data;
+static time_t s_hosts_mtime;
+
+/* Returns contents of the hosts file, re-reading it only if it changed. */
+static const char *mg_hosts_file_data(void) {
+  cs_stat_t st;
   FILE *fp;
+  if (mg_stat(MG_HOSTS_FILE_NAME, &st) != 0) {
+    MG_FREE(s_hosts_data);
+    s_hosts_data = NULL;
+    return NULL;
+  }
+  if (s_hosts_data != NULL && st.st_mtime == s_hosts_mtime) {
+    return s_hosts_data;
+  }
+  MG_FREE(s_hosts_data);
+  s_hosts_data = NULL;
+  if ((fp = mg_fopen(MG_HOSTS_FILE_NAME, "r")) == NULL) return NULL;
+  if ((s_hosts_data = (char *) MG_MALLOC((size_t) st.st_size + 1)) != NULL) {
+    size_t n = fread(s_hosts_data, 1, (size_t) st.st_size, fp);
+    s_hosts_data[n] = '\0';
+    s_hosts_mtime = st.st_mtime;
+  }
+  fclose(fp);
+  return s_hosts_data;
+}
+#endif
+
+int mg_resolve_from_hosts_file(const char *name, union socket_address *usa) {
+#if MG_ENABLE_FILESYSTEM && defined(MG_HOSTS_FILE_NAME)
+  const char *data = mg_hosts_file_data(), *eol;
   char line[1024];
   char *p;
   char alias[256];
   unsigned int a, b, c, d;
   int len = 0;
 
-  if ((fp = mg_fopen(MG_HOSTS_FILE_NAME, "r")) == NULL) {
+  if (data == NULL) {
     return -1;
   }
 
-  for (; fgets(line, sizeof(line), fp) != NULL;) {
+  for (; *data != '\0'; data = (*eol == '\0' ? eol : eol + 1)) {
+    size_t line_len;
+    if ((eol = strchr(data, '\n')) == NULL) eol = data + strlen(data);
+    line_len = eol - data;
+    if (line_len >= sizeof(line)) line_len = sizeof(line) - 1;
+    memcpy(line, data, line_len);
+    line[line_len] = '\0';
+
     if (line[0] == '#') continue;
 
     if (sscanf(line, "%u.%u.%u.%u%n", &a, &b, &c, &d, &len) == 0) {
@@ -10953,13 +12890,10 @@ int mg_resolve_from_hosts_file(const char *name, union socket_address *usa) {
     for (p = line + len; sscanf(p, "%s%n", alias, &len) == 1; p += len) {
       if (strcmp(alias, name) == 0) {
         usa->sin.sin_addr.s_addr = htonl(a << 24 | b << 16 | c << 8 | d);
-        fclose(fp);
         return 0;
       }
     }
   }
-
-  fclose(fp);
 #else
   (void) name;
   (void) usa;
@@ -10968,6 +12902,183 @@ int mg_resolve_from_hosts_file(const char *name, union socket_address *usa) {
   return -1;
 }
 
+static void mg_resolve_async_free(struct mg_resolve_async_request *req) {
+  struct mg_resolve_waiter *w;
+  while ((w = req->waiters) != NULL) {
+    req->waiters = w->next;
+    MG_FREE(w);
+  }
+  mbuf_free(&req->fallback_reply);
+  MG_FREE(req);
+}
+
+static void mg_resolve_async_notify(struct mg_resolve_async_request *req,
+                                    struct mg_dns_message *msg,
+                                    enum mg_resolve_err err) {
+  struct mg_resolve_waiter *w;
+  for (w = req->waiters; w != NULL; w = w->next) {
+    w->callback(msg, w->data, err);
+  }
+}
+
+/* Arms the DNS connection timer for the earliest waiter timer, if any. */
+static void mg_resolve_async_arm_timer(struct mg_resolve_async_request *req) {
+  struct mg_resolve_waiter *w;
+  double t = 0;
+  if (req->nc == NULL) return; /* Cached, completes on the next poll. */
+  for (w = req->waiters; w != NULL; w = w->next) {
+    if (w->timer > 0 && (t == 0 || w->timer < t)) t = w->timer;
+  }
+  req->nc->ev_timer_time = t;
+}
+
+MG_INTERNAL void mg_resolve_async_set_timer(struct mg_mgr *mgr, void *data,
+                                            double timestamp) {
+  struct mg_resolve_async_request *req;
+  struct mg_resolve_waiter *w;
+  for (req = mgr->dns_pending; req != NULL; req = req->next) {
+    for (w = req->waiters; w != NULL; w = w->next) {
+      if (w->data == data) {
+        w->timer = timestamp;
+        mg_resolve_async_arm_timer(req);
+        return;
+      }
+    }
+  }
+}
+
+/*
+ * Fails the waiters whose timers have expired. The request itself is
+ * abandoned when nobody is waiting for it anymore.
+ */
+static void mg_resolve_async_expire(struct mg_connection *nc,
+                                    struct mg_resolve_async_request *req,
+                                    double now) {
+  struct mg_resolve_waiter **pw = &req->waiters, *w;
+  while ((w = *pw) != NULL) {
+    if (w->timer > 0 && w->timer <= now) {
+      *pw = w->next;
+      w->callback(NULL, w->data, MG_RESOLVE_TIMEOUT);
+      MG_FREE(w);
+      pw = &req->waiters; /* The callback may have added waiters. */
+    } else {
+      pw = &w->next;
+    }
+  }
+  if (req->waiters == NULL) {
+    req->err = MG_RESOLVE_TIMEOUT;
+    nc->flags |= MG_F_CLOSE_IMMEDIATELY;
+  } else {
+    mg_resolve_async_arm_timer(req);
+  }
+}
+
+/*
+ * Completes the request: caches the reply, hands the callbacks over to the
+ * parallel AAAA query if the A query came up empty, and notifies.
+ * `msg` is NULL if there was no usable reply.
+ */
+static void mg_resolve_async_done(struct mg_mgr *mgr,
+                                  struct mg_resolve_async_request *req,
+                                  struct mg_dns_message *msg,
+                                  enum mg_resolve_err err) {
+  struct mg_resolve_async_request **prq, *sib = req->sibling;
+  int ok = (msg != NULL && msg->num_answers > 0);
+
+  if (req->nc != NULL) req->nc->user_data = NULL;
+  for (prq = &mgr->dns_pending; *prq != NULL; prq = &(*prq)->next) {
+    if (*prq == req) {
+      *prq = req->next;
+      break;
+    }
+  }
+  if (msg != NULL) mg_resolve_cache_add(mgr, req->name, req->query, msg);
+
+  if (sib != NULL) {
+    sib->sibling = NULL;
+    if (req->query == MG_DNS_AAAA_RECORD) {
+      /* Keep the answer around in case the A query fails. */
+      if (ok) mbuf_append(&sib->fallback_reply, msg->pkt.p, msg->pkt.len);
+    } else if (!ok && err != MG_RESOLVE_TIMEOUT) {
+      /* No A records, let the AAAA query deliver whatever it gets. */
+      struct mg_resolve_waiter **pw = &sib->waiters;
+      while (*pw != NULL) pw = &(*pw)->next;
+      *pw = req->waiters;
+      req->waiters = NULL;
+      mg_resolve_async_arm_timer(sib);
+      mg_resolve_async_free(req);
+      return;
+    }
+  } else if (!ok && req->fallback_reply.len > 0) {
+    struct mg_dns_message *msg6 =
+        (struct mg_dns_message *) MG_MALLOC(sizeof(*msg6));
+    if (msg6 != NULL && mg_parse_dns(req->fallback_reply.buf,
+                                     req->fallback_reply.len, msg6) == 0) {
+      mg_resolve_async_notify(req, msg6, MG_RESOLVE_OK);
+      MG_FREE(msg6);
+      mg_resolve_async_free(req);
+      return;
+    }
+    MG_FREE(msg6);
+  }
+
+  if (!ok) {
+#ifdef MG_LOG_DNS_FAILURES
+    LOG(LL_ERROR, ("Failed to resolve '%s', server %s", req->name,
+                   req->nameserver_url));
+#endif
+    msg = NULL;
+  }
+  mg_resolve_async_notify(req, msg, ok ? MG_RESOLVE_OK : err);
+  mg_resolve_async_free(req);
+}
+
+/*
+ * Completes the lookups answered from the cache. Ones started by callbacks
+ * run from here wait for the next poll, like they would for a server.
+ */
+MG_INTERNAL void mg_resolve_async_poll(struct mg_mgr *mgr) {
+  struct mg_resolve_async_request *req;
+  for (req = mgr->dns_pending; req != NULL; req = req->next) {
+    if (req->from_cache) req->from_cache = 2;
+  }
+  for (req = mgr->dns_pending; req != NULL;) {
+    if (req->from_cache == 2) {
+      mg_resolve_async_done(mgr, req, NULL, MG_RESOLVE_NO_ANSWERS);
+      req = mgr->dns_pending; /* Callbacks may have changed the list. */
+    } else {
+      req = req->next;
+    }
+  }
+}
+
+/*
+ * Fails the lookups that are still pending once all connections are closed,
+ * i.e. the ones answered from the cache, which have no DNS connection.
+ */
+MG_INTERNAL void mg_resolve_async_cancel(struct mg_mgr *mgr) {
+  struct mg_resolve_async_request *req;
+  while ((req = mgr->dns_pending) != NULL) {
+    mbuf_free(&req->fallback_reply);
+    mg_resolve_async_done(mgr, req, NULL, req->err);
+  }
+}
+
+/* Is `msg` the answer to the query we sent last, and not a stray packet? */
+static int mg_resolve_async_is_reply(struct mg_resolve_async_request *req,
+                                     struct mg_dns_message *msg) {
+  struct mg_dns_resource_record *q = &msg->questions[0];
+  char name[256];
+  size_t n;
+  if (msg->transaction_id != req->tid || !(msg->flags & 0x8000) ||
+      msg->num_questions != 1 || q->rtype != req->query) {
+    return 0;
+  }
+  n = mg_dns_uncompress_name(msg, &q->name, name, sizeof(name) - 1);
+  name[n] = '\0';
+  return mg_casecmp(name, req->name) == 0;
+}
+
 static void mg_resolve_async_eh(struct mg_connection *nc, int ev,
                                 void *data MG_UD_ARG(void *user_data)) {
   time_t now = (time_t) mg_time();
@@ -10999,19 +13110,24 @@ static void mg_resolve_async_eh(struct mg_connection *nc, int ev,
       }
       if (first || now - req->last_time >= req->timeout) {
         mg_send_dns_query(nc, req->name, req->query);
+        req->tid = (uint16_t) mg_dns_tid;
         req->last_time = now;
         req->retries++;
       }
       break;
     case MG_EV_RECV:
       msg = (struct mg_dns_message *) MG_MALLOC(sizeof(*msg));
-      if (mg_parse_dns(nc->recv_mbuf.buf, *(int *) data, msg) == 0 &&
-          msg->num_answers > 0) {
-        req->callback(msg, req->data, MG_RESOLVE_OK);
-        nc->user_data = NULL;
-        MG_FREE(req);
+      if (msg == NULL) {
+        req->err = MG_RESOLVE_NO_ANSWERS; /* LCOV_EXCL_LINE */
+      } else if (mg_parse_dns(nc->recv_mbuf.buf, *(int *) data, msg) != 0 ||
+                 !mg_resolve_async_is_reply(req, msg)) {
+        /* Garbage or a spoofing attempt, must not get into the cache. */
+        DBG(("%p ignoring DNS packet for '%s'", nc, req->name));
+        mbuf_remove(&nc->recv_mbuf, nc->recv_mbuf.len);
+        MG_FREE(msg);
+        break;
       } else {
-        req->err = MG_RESOLVE_NO_ANSWERS;
+        mg_resolve_async_done(nc->mgr, req, msg, MG_RESOLVE_NO_ANSWERS);
       }
       MG_FREE(msg);
       nc->flags |= MG_F_CLOSE_IMMEDIATELY;
@@ -11025,21 +13141,11 @@ static void mg_resolve_async_eh(struct mg_connection *nc, int ev,
       mbuf_remove(&nc->send_mbuf, nc->send_mbuf.len);
       break;
     case MG_EV_TIMER:
-      req->err = MG_RESOLVE_TIMEOUT;
-      nc->flags |= MG_F_CLOSE_IMMEDIATELY;
+      mg_resolve_async_expire(nc, req, *(double *) data);
       break;
     case MG_EV_CLOSE:
       /* If we got here with request still not done, fire an error callback. */
-      if (req != NULL) {
-        char addr[32];
-        mg_sock_addr_to_str(&nc->sa, addr, sizeof(addr), MG_SOCK_STRINGIFY_IP);
-#ifdef MG_LOG_DNS_FAILURES
-        LOG(LL_ERROR, ("Failed to resolve '%s', server %s", req->name, addr));
-#endif
-        req->callback(NULL, req->data, req->err);
-        nc->user_data = NULL;
-        MG_FREE(req);
-      }
+      mg_resolve_async_done(nc->mgr, req, NULL, req->err);
       break;
   }
 }
@@ -11051,11 +13157,46 @@ int mg_resolve_async(struct mg_mgr *mgr, const char *name, int query,
   return mg_resolve_async_opt(mgr, name, query, cb, data, opts);
 }
 
+/* Creates a request. `url` is the nameserver, NULL to not ask anyone. */
+static struct mg_resolve_async_request *mg_resolve_async_start(
+    struct mg_mgr *mgr, const char *name, int query, const char *url,
+    struct mg_resolve_async_opts *opts) {
+  struct mg_resolve_async_request *req;
+  struct mg_connection *dns_nc;
+
+  req = (struct mg_resolve_async_request *) MG_CALLOC(1, sizeof(*req));
+  if (req == NULL) {
+    return NULL;
+  }
+
+  strncpy(req->name, name, sizeof(req->name) - 1);
+  req->query = query;
+  /* TODO(mkm): parse defaults out of resolve.conf */
+  req->max_retries = opts->max_retries ? opts->max_retries : 2;
+  req->timeout = opts->timeout ? opts->timeout : 5;
+  mbuf_init(&req->fallback_reply, 0);
+
+  if (url != NULL) {
+    snprintf(req->nameserver_url, sizeof(req->nameserver_url), "%s", url);
+    dns_nc = mg_connect(mgr, url, MG_CB(mg_resolve_async_eh, NULL));
+    if (dns_nc == NULL) {
+      mg_resolve_async_free(req);
+      return NULL;
+    }
+    dns_nc->user_data = req;
+    req->nc = dns_nc;
+  }
+  req->next = mgr->dns_pending;
+  mgr->dns_pending = req;
+  return req;
+}
+
 int mg_resolve_async_opt(struct mg_mgr *mgr, const char *name, int query,
                          mg_resolve_callback_t cb, void *data,
                          struct mg_resolve_async_opts opts) {
   struct mg_resolve_async_request *req;
-  struct mg_connection *dns_nc;
+  struct mg_resolve_waiter *w, **pw;
+  struct mg_resolve_cache_entry *e;
   const char *nameserver = opts.nameserver;
   char dns_server_buff[17], nameserver_url[26];
 
@@ -11065,19 +13206,14 @@ int mg_resolve_async_opt(struct mg_mgr *mgr, const char *name, int query,
 
   DBG(("%s %d %p", name, query, opts.dns_conn));
 
-  /* resolve with DNS */
-  req = (struct mg_resolve_async_request *) MG_CALLOC(1, sizeof(*req));
-  if (req == NULL) {
-    return -1;
+  if (opts.dns_conn != NULL) {
+    *opts.dns_conn = NULL;
   }
 
-  strncpy(req->name, name, sizeof(req->name));
-  req->query = query;
-  req->callback = cb;
-  req->data = data;
-  /* TODO(mkm): parse defaults out of resolve.conf */
-  req->max_retries = opts.max_retries ? opts.max_retries : 2;
-  req->timeout = opts.timeout ? opts.timeout : 5;
+  w = (struct mg_resolve_waiter *) MG_CALLOC(1, sizeof(*w));
+  if (w == NULL) return -1;
+  w->callback = cb;
+  w->data = data;
 
   /* Lazily initialize dns server */
   if (nameserver == NULL) {
@@ -11091,14 +13227,51 @@ int mg_resolve_async_opt(struct mg_mgr *mgr, const char *name, int query,
 
   snprintf(nameserver_url, sizeof(nameserver_url), "udp://%s:53", nameserver);
 
-  dns_nc = mg_connect(mgr, nameserver_url, MG_CB(mg_resolve_async_eh, NULL));
-  if (dns_nc == NULL) {
-    MG_FREE(req);
-    return -1;
+  /* Is the same question already being asked? Then just wait for the answer. */
+  for (req = mgr->dns_pending; req != NULL; req = req->next) {
+    if (req->query == query &&
+        req->parallel_aaaa == opts.parallel_aaaa &&
+        strcmp(req->nameserver_url, nameserver_url) == 0 &&
+        mg_casecmp(req->name, name) == 0) {
+      break;
+    }
   }
-  dns_nc->user_data = req;
+
+  if (req == NULL) {
+    /* A cached answer is delivered on the next poll, with no DNS traffic. */
+    e = mg_resolve_cache_lookup(mgr, name, query, opts.parallel_aaaa);
+    req = mg_resolve_async_start(mgr, name, query,
+                                 (e == NULL ? nameserver_url : NULL), &opts);
+    if (req == NULL) {
+      MG_FREE(w);
+      return -1;
+    }
+    snprintf(req->nameserver_url, sizeof(req->nameserver_url), "%s",
+             nameserver_url);
+    req->parallel_aaaa = opts.parallel_aaaa;
+    if (e != NULL) {
+      req->from_cache = 1;
+      if (e->pkt != NULL) {
+        mbuf_append(&req->fallback_reply, e->pkt, e->pkt_len);
+      }
+    } else if (opts.parallel_aaaa && query == MG_DNS_A_RECORD) {
+      e = mg_resolve_cache_find(mgr, name, MG_DNS_AAAA_RECORD);
+      if (e == NULL) {
+        /* Failure to start the AAAA query is not fatal. */
+        req->sibling = mg_resolve_async_start(mgr, name, MG_DNS_AAAA_RECORD,
+                                              nameserver_url, &opts);
+        if (req->sibling != NULL) req->sibling->sibling = req;
+      } else if (e->pkt != NULL) {
+        mbuf_append(&req->fallback_reply, e->pkt, e->pkt_len);
+      }
+    }
+  }
+
+  pw = &req->waiters;
+  while (*pw != NULL) pw = &(*pw)->next;
+  *pw = w;
   if (opts.dns_conn != NULL) {
-    *opts.dns_conn = dns_nc;
+    *opts.dns_conn = req->nc;
   }
 
   return 0;
@@ -11198,9 +13371,9 @@ struct mg_coap_option *mg_coap_add_option(struct mg_coap_message *cm,
  *
  * Helper function.
  */
-static char *coap_parse_header(char *ptr, struct mbuf *io,
-                               struct mg_coap_message *cm) {
-  if (io->len < sizeof(uint32_t)) {
+static const char *coap_parse_header(const char *ptr, const char *end,
+                                     struct mg_coap_message *cm) {
+  if (end - ptr < (int) sizeof(uint32_t)) {
     cm->flags |= MG_COAP_NOT_ENOUGH_DATA;
     return NULL;
   }
@@ -11262,10 +13435,10 @@ static char *coap_parse_header(char *ptr, struct mbuf *io,
  *
  * Helper function.
  */
-static char *coap_get_token(char *ptr, struct mbuf *io,
-                            struct mg_coap_message *cm) {
+static const char *coap_get_token(const char *ptr, const char *end,
+                                  struct mg_coap_message *cm) {
   if (cm->token.len != 0) {
-    if (ptr + cm->token.len > io->buf + io->len) {
+    if (ptr + cm->token.len > end) {
       cm->flags |= MG_COAP_NOT_ENOUGH_DATA;
       return NULL;
     } else {
@@ -11283,7 +13456,8 @@ static char *coap_get_token(char *ptr, struct mbuf *io,
  *
  * Helper function.
  */
-static int coap_get_ext_opt(char *ptr, struct mbuf *io, uint16_t *opt_info) {
+static int coap_get_ext_opt(const char *ptr, const char *end,
+                            uint32_t *opt_info) {
   int ret = 0;
 
   if (*opt_info == 13) {
@@ -11291,7 +13465,7 @@ static int coap_get_ext_opt(char *ptr, struct mbuf *io, uint16_t *opt_info) {
      * 13:  An 8-bit unsigned integer follows the initial byte and
      * indicates the Option Delta/Length minus 13.
      */
-    if (ptr < io->buf + io->len) {
+    if (ptr < end) {
       *opt_info = (uint8_t) *ptr + 13;
       ret = sizeof(uint8_t);
     } else {
@@ -11302,7 +13476,7 @@ static int coap_get_ext_opt(char *ptr, struct mbuf *io, uint16_t *opt_info) {
      * 14:  A 16-bit unsigned integer in network byte order follows the
      * initial byte and indicates the Option Delta/Length minus 269.
      */
-    if (ptr + sizeof(uint8_t) < io->buf + io->len) {
+    if (ptr + sizeof(uint8_t) < end) {
       *opt_info = ((uint8_t) *ptr << 8 | (uint8_t) * (ptr + 1)) + 269;
       ret = sizeof(uint16_t);
     } else {
@@ -11314,7 +13488,7 @@ static int coap_get_ext_opt(char *ptr, struct mbuf *io, uint16_t *opt_info) {
 }
 
 /*
- * Fills options in mg_coap_message.
+ * Decodes one option, returns pointer to its value or NULL on error.
  *
  * Helper function.
  *
@@ -11329,81 +13503,81 @@ static int coap_get_ext_opt(char *ptr, struct mbuf *io, uint16_t *opt_info) {
  * \         Option Value          \  0 or more bytes
  * +-------------------------------+
  */
-static char *coap_get_options(char *ptr, struct mbuf *io,
-                              struct mg_coap_message *cm) {
-  uint16_t prev_opt = 0;
+static const char *coap_decode_option(const char *ptr, const char *end,
+                                      uint32_t *delta, uint32_t *len,
+                                      uint32_t *flags) {
+  int optinfo_len;
 
-  if (ptr == io->buf + io->len) {
-    /* end of packet, ok */
+  /* Option Delta:  4-bit unsigned integer */
+  *delta = ((uint8_t) *ptr & 0xF0) >> 4;
+  /* Option Length:  4-bit unsigned integer */
+  *len = *ptr & 0x0F;
+
+  if (*delta == 15 || *len == 15) {
+    /*
+     * 15:  Reserved for future use.  If the field is set to this value,
+     * it MUST be processed as a message format error
+     */
+    *flags |= MG_COAP_FORMAT_ERROR;
     return NULL;
   }
 
-  /* 0xFF is payload marker */
-  while (ptr < io->buf + io->len && (uint8_t) *ptr != 0xFF) {
-    uint16_t option_delta, option_lenght;
-    int optinfo_len;
-
-    /* Option Delta:  4-bit unsigned integer */
-    option_delta = ((uint8_t) *ptr & 0xF0) >> 4;
-    /* Option Length:  4-bit unsigned integer */
-    option_lenght = *ptr & 0x0F;
-
-    if (option_delta == 15 || option_lenght == 15) {
-      /*
-       * 15:  Reserved for future use.  If the field is set to this value,
-       * it MUST be processed as a message format error
-       */
-      cm->flags |= MG_COAP_FORMAT_ERROR;
-      break;
-    }
-
-    ptr++;
-
-    /* check for extended option delta */
-    optinfo_len = coap_get_ext_opt(ptr, io, &option_delta);
-    if (optinfo_len == -1) {
-      cm->flags |= MG_COAP_NOT_ENOUGH_DATA; /* LCOV_EXCL_LINE */
-      break;                                /* LCOV_EXCL_LINE */
-    }
+  ptr++;
 
-    ptr += optinfo_len;
+  /* check for extended option delta */
+  optinfo_len = coap_get_ext_opt(ptr, end, delta);
+  if (optinfo_len == -1) {
+    *flags |= MG_COAP_NOT_ENOUGH_DATA; /* LCOV_EXCL_LINE */
+    return NULL;                       /* LCOV_EXCL_LINE */
+  }
 
-    /* check or extended option lenght */
-    optinfo_len = coap_get_ext_opt(ptr, io, &option_lenght);
-    if (optinfo_len == -1) {
-      cm->flags |= MG_COAP_NOT_ENOUGH_DATA; /* LCOV_EXCL_LINE */
-      break;                                /* LCOV_EXCL_LINE */
-    }
+  ptr += optinfo_len;
 
-    ptr += optinfo_len;
+  /* check or extended option lenght */
+  optinfo_len = coap_get_ext_opt(ptr, end, len);
+  if (optinfo_len == -1) {
+    *flags |= MG_COAP_NOT_ENOUGH_DATA; /* LCOV_EXCL_LINE */
+    return NULL;                       /* LCOV_EXCL_LINE */
+  }
 
-    /*
-     * Instead of specifying the Option Number directly, the instances MUST
-     * appear in order of their Option Numbers and a delta encoding is used
-     * between them.
-     */
-    option_delta += prev_opt;
+  ptr += optinfo_len;
 
-    mg_coap_add_option(cm, option_delta, ptr, option_lenght);
+  if (*len > (size_t)(end - ptr)) {
+    *flags |= MG_COAP_NOT_ENOUGH_DATA; /* LCOV_EXCL_LINE */
+    return NULL;                       /* LCOV_EXCL_LINE */
+  }
 
-    prev_opt = option_delta;
+  return ptr;
+}
 
-    if (ptr + option_lenght > io->buf + io->len) {
-      cm->flags |= MG_COAP_NOT_ENOUGH_DATA; /* LCOV_EXCL_LINE */
-      break;                                /* LCOV_EXCL_LINE */
-    }
+/*
+ * Validates options and stores their location in mg_coap_message.
+ *
+ * Helper function.
+ */
+static const char *coap_get_options(const char *ptr, const char *end,
+                                    struct mg_coap_message *cm) {
+  const char *start = ptr;
 
-    ptr += option_lenght;
+  if (ptr == end) {
+    /* end of packet, ok */
+    return NULL;
   }
 
-  if ((cm->flags & MG_COAP_ERROR) != 0) {
-    mg_coap_free_options(cm);
-    return NULL;
+  /* 0xFF is payload marker */
+  while (ptr < end && (uint8_t) *ptr != 0xFF) {
+    uint32_t delta, len;
+    if ((ptr = coap_decode_option(ptr, end, &delta, &len, &cm->flags)) ==
+        NULL) {
+      return NULL;
+    }
+    ptr += len;
   }
 
+  cm->raw_options = mg_mk_str_n(start, ptr - start);
   cm->flags |= MG_COAP_OPTIOMG_FIELD;
 
-  if (ptr == io->buf + io->len) {
+  if (ptr == end) {
     /* end of packet, ok */
     return NULL;
   }
@@ -11413,25 +13587,25 @@ static char *coap_get_options(char *ptr, struct mbuf *io,
   return ptr;
 }
 
-uint32_t mg_coap_parse(struct mbuf *io, struct mg_coap_message *cm) {
-  char *ptr;
+uint32_t mg_coap_parse_str(struct mg_str buf, struct mg_coap_message *cm) {
+  const char *ptr, *end = buf.p + buf.len;
 
   memset(cm, 0, sizeof(*cm));
 
-  if ((ptr = coap_parse_header(io->buf, io, cm)) == NULL) {
+  if ((ptr = coap_parse_header(buf.p, end, cm)) == NULL) {
     return cm->flags;
   }
 
-  if ((ptr = coap_get_token(ptr, io, cm)) == NULL) {
+  if ((ptr = coap_get_token(ptr, end, cm)) == NULL) {
     return cm->flags;
   }
 
-  if ((ptr = coap_get_options(ptr, io, cm)) == NULL) {
+  if ((ptr = coap_get_options(ptr, end, cm)) == NULL) {
     return cm->flags;
   }
 
   /* the rest is payload */
-  cm->payload.len = io->len - (ptr - io->buf);
+  cm->payload.len = end - ptr;
   if (cm->payload.len != 0) {
     cm->payload.p = ptr;
     cm->flags |= MG_COAP_PAYLOAD_FIELD;
@@ -11440,6 +13614,94 @@ uint32_t mg_coap_parse(struct mbuf *io, struct mg_coap_message *cm) {
   return cm->flags;
 }
 
+int mg_coap_next_option(struct mg_coap_message *cm, struct mg_coap_option *opt,
+                        int pos) {
+  const char *ptr, *end = cm->raw_options.p + cm->raw_options.len;
+  uint32_t delta, len, flags = 0;
+
+  if (pos < 0 || (size_t) pos >= cm->raw_options.len) return -1;
+  ptr = coap_decode_option(cm->raw_options.p + pos, end, &delta, &len, &flags);
+  if (ptr == NULL) return -1;
+
+  opt->number += delta;
+  opt->value.p = ptr;
+  opt->value.len = len;
+
+  return (int)(ptr + len - cm->raw_options.p);
+}
+
+int mg_coap_get_option(struct mg_coap_message *cm, uint32_t number,
+                       struct mg_str *value) {
+  struct mg_coap_option opt;
+  int pos = 0;
+
+  memset(&opt, 0, sizeof(opt));
+  while ((pos = mg_coap_next_option(cm, &opt, pos)) >= 0 &&
+         opt.number <= number) {
+    if (opt.number == number) {
+      *value = opt.value;
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+int mg_coap_get_uint_option(struct mg_coap_message *cm, uint32_t number,
+                            uint32_t *value) {
+  struct mg_str v;
+  size_t i;
+
+  if (!mg_coap_get_option(cm, number, &v) || v.len > sizeof(*value)) {
+    return 0;
+  }
+  for (*value = 0, i = 0; i < v.len; i++) {
+    *value = (*value << 8) | (uint8_t) v.p[i];
+  }
+
+  return 1;
+}
+
+int mg_coap_get_block(struct mg_coap_message *cm, uint32_t number,
+                      uint32_t *num, int *more, size_t *size) {
+  uint32_t v;
+
+  /* NUM: 4-20 bits, M: 1 bit, SZX: 3 bits; SZX 7 is reserved. */
+  if (!mg_coap_get_uint_option(cm, number, &v) || v > 0xFFFFFF ||
+      (v & 7) == 7) {
+    return 0;
+  }
+  *num = v >> 4;
+  *more = (v >> 3) & 1;
+  *size = (size_t) 16 << (v & 7);
+
+  return 1;
+}
+
+/*
+ * Builds cm->options out of cm->raw_options.
+ *
+ * Helper function.
+ */
+static void coap_build_option_list(struct mg_coap_message *cm) {
+  struct mg_coap_option opt;
+  int pos = 0;
+
+  memset(&opt, 0, sizeof(opt));
+  while ((pos = mg_coap_next_option(cm, &opt, pos)) >= 0) {
+    mg_coap_add_option(cm, opt.number, (char *) opt.value.p, opt.value.len);
+  }
+}
+
+uint32_t mg_coap_parse(struct mbuf *io, struct mg_coap_message *cm) {
+  mg_coap_parse_str(mg_mk_str_n(io->buf, io->len), cm);
+  if ((cm->flags & MG_COAP_ERROR) == 0) {
+    coap_build_option_list(cm);
+  }
+
+  return cm->flags;
+}
+
 /*
  * Calculates extended size of given Opt Number/Length in coap message.
  *
@@ -11563,75 +13825,149 @@ static uint32_t coap_calculate_packet_size(struct mg_coap_message *cm,
   return 0;
 }
 
-uint32_t mg_coap_compose(struct mg_coap_message *cm, struct mbuf *io) {
-  struct mg_coap_option *opt;
-  uint32_t res, prev_opt_number;
-  size_t prev_io_len, packet_size;
-  char *ptr;
+void mg_coap_writer_init(struct mg_coap_writer *w, char *buf, size_t size,
+                         const struct mg_coap_message *cm) {
+  memset(w, 0, sizeof(*w));
+  w->buf = buf;
+  w->size = size;
 
-  res = coap_calculate_packet_size(cm, &packet_size);
-  if (res != 0) {
-    return res;
+  if (cm->msg_type > MG_COAP_MSG_MAX) {
+    w->err = MG_COAP_ERROR | MG_COAP_MSG_TYPE_FIELD;
+  } else if (cm->token.len > 8) {
+    w->err = MG_COAP_ERROR | MG_COAP_TOKEN_FIELD;
+  } else if (cm->code_class > 7) {
+    w->err = MG_COAP_ERROR | MG_COAP_CODE_CLASS_FIELD;
+  } else if (cm->code_detail > 31) {
+    w->err = MG_COAP_ERROR | MG_COAP_CODE_DETAIL_FIELD;
+  } else if (size < 4 + cm->token.len) {
+    w->err = MG_COAP_NOT_ENOUGH_DATA;
+  } else {
+    char *ptr = buf;
+    /* ver: 2 bits, msg_type: 2 bits, toklen: 4 bits */
+    *ptr++ = (1 << 6) | (cm->msg_type << 4) | (uint8_t)(cm->token.len);
+    /* code class: 3 bits, code detail: 5 bits */
+    *ptr++ = (cm->code_class << 5) | (cm->code_detail);
+    ptr = coap_add_uint16(ptr, cm->msg_id);
+    if (cm->token.len != 0) {
+      memcpy(ptr, cm->token.p, cm->token.len);
+    }
+    w->len = 4 + cm->token.len;
   }
+}
 
-  /* saving previous lenght to handle non-empty mbuf */
-  prev_io_len = io->len;
-  mbuf_append(io, NULL, packet_size);
-  ptr = io->buf + prev_io_len;
+void mg_coap_write_option(struct mg_coap_writer *w, uint32_t number,
+                          const void *value, size_t len) {
+  uint8_t delta_base = 0, length_base = 0;
+  uint16_t delta_ext = 0, length_ext = 0;
+  size_t opt_delta_len, opt_lenght_len;
+  char *ptr;
 
-  /*
-   * since cm is verified, it is possible to use bits shift operator
-   * without additional zeroing of unused bits
-   */
+  if (w->err != 0) return;
+  if (number < w->last_option || number - w->last_option > 0xFFFF + 269 ||
+      len > 0xFFFF + 269) {
+    w->err = MG_COAP_ERROR | MG_COAP_OPTIOMG_FIELD;
+    return;
+  }
 
-  /* ver: 2 bits, msg_type: 2 bits, toklen: 4 bits */
-  *ptr = (1 << 6) | (cm->msg_type << 4) | (uint8_t)(cm->token.len);
-  ptr++;
+  opt_delta_len =
+      coap_split_opt(number - w->last_option, &delta_base, &delta_ext);
+  opt_lenght_len = coap_split_opt((uint32_t) len, &length_base, &length_ext);
+  if (w->size - w->len < 1 + opt_delta_len + opt_lenght_len + len) {
+    w->err = MG_COAP_NOT_ENOUGH_DATA;
+    return;
+  }
 
-  /* code class: 3 bits, code detail: 5 bits */
-  *ptr = (cm->code_class << 5) | (cm->code_detail);
-  ptr++;
+  ptr = w->buf + w->len;
+  *ptr++ = (delta_base << 4) | length_base;
+  ptr = coap_add_opt_info(ptr, delta_ext, opt_delta_len);
+  ptr = coap_add_opt_info(ptr, length_ext, opt_lenght_len);
+  if (len != 0) {
+    memcpy(ptr, value, len);
+    ptr += len;
+  }
 
-  ptr = coap_add_uint16(ptr, cm->msg_id);
+  w->len = ptr - w->buf;
+  w->last_option = number;
+}
 
-  if (cm->token.len != 0) {
-    memcpy(ptr, cm->token.p, cm->token.len);
-    ptr += cm->token.len;
+void mg_coap_write_uint_option(struct mg_coap_writer *w, uint32_t number,
+                               uint32_t value) {
+  char buf[4];
+  size_t i, len = 0;
+
+  /* uint options are encoded with the minimal number of bytes, 0 is empty */
+  while (len < sizeof(buf) && (value >> (8 * len)) != 0) len++;
+  for (i = 0; i < len; i++) {
+    buf[i] = (char)(value >> (8 * (len - 1 - i)));
   }
 
-  opt = cm->options;
-  prev_opt_number = 0;
-  while (opt != NULL) {
-    uint8_t delta_base = 0, length_base = 0;
-    uint16_t delta_ext = 0, length_ext = 0;
+  mg_coap_write_option(w, number, buf, len);
+}
 
-    size_t opt_delta_len =
-        coap_split_opt(opt->number - prev_opt_number, &delta_base, &delta_ext);
-    size_t opt_lenght_len =
-        coap_split_opt((uint32_t) opt->value.len, &length_base, &length_ext);
+uint32_t mg_coap_write_payload(struct mg_coap_writer *w, const void *payload,
+                               size_t len) {
+  if (w->err != 0 || len == 0) return w->err;
+  if (w->size - w->len < len + 1) {
+    w->err = MG_COAP_NOT_ENOUGH_DATA;
+    return w->err;
+  }
 
-    *ptr = (delta_base << 4) | length_base;
-    ptr++;
+  w->buf[w->len++] = (char) -1;
+  memcpy(w->buf + w->len, payload, len);
+  w->len += len;
+
+  return 0;
+}
 
-    ptr = coap_add_opt_info(ptr, delta_ext, opt_delta_len);
-    ptr = coap_add_opt_info(ptr, length_ext, opt_lenght_len);
+/*
+ * Writes options from the list merged with uint options from `extra`,
+ * given as sorted (number, value) pairs. Extra options replace list options
+ * with the same number.
+ *
+ * Helper function.
+ */
+static void coap_write_options(struct mg_coap_writer *w,
+                               struct mg_coap_option *opt,
+                               const uint32_t *extra, size_t num_extra) {
+  size_t i = 0, j;
 
-    if (opt->value.len != 0) {
-      memcpy(ptr, opt->value.p, opt->value.len);
-      ptr += opt->value.len;
+  for (; opt != NULL; opt = opt->next) {
+    for (; i < num_extra && extra[2 * i] <= opt->number; i++) {
+      mg_coap_write_uint_option(w, extra[2 * i], extra[2 * i + 1]);
     }
+    for (j = 0; j < num_extra && extra[2 * j] != opt->number; j++) {
+    }
+    if (j == num_extra) {
+      mg_coap_write_option(w, opt->number, opt->value.p, opt->value.len);
+    }
+  }
+  for (; i < num_extra; i++) {
+    mg_coap_write_uint_option(w, extra[2 * i], extra[2 * i + 1]);
+  }
+}
 
-    prev_opt_number = opt->number;
-    opt = opt->next;
+uint32_t mg_coap_compose(struct mg_coap_message *cm, struct mbuf *io) {
+  struct mg_coap_writer w;
+  uint32_t res;
+  size_t prev_io_len, packet_size;
+
+  res = coap_calculate_packet_size(cm, &packet_size);
+  if (res != 0) {
+    return res;
   }
 
-  if (cm->payload.len != 0) {
-    *ptr = (char) -1;
-    ptr++;
-    memcpy(ptr, cm->payload.p, cm->payload.len);
+  /* saving previous lenght to handle non-empty mbuf */
+  prev_io_len = io->len;
+  mbuf_append(io, NULL, packet_size);
+
+  mg_coap_writer_init(&w, io->buf + prev_io_len, packet_size, cm);
+  coap_write_options(&w, cm->options, NULL, 0);
+  res = mg_coap_write_payload(&w, cm->payload.p, cm->payload.len);
+  if (res != 0) {
+    io->len = prev_io_len; /* LCOV_EXCL_LINE */
   }
 
-  return 0;
+  return res;
 }
 
 uint32_t mg_coap_send_message(struct mg_connection *nc,
@@ -11660,6 +13996,290 @@ uint32_t mg_coap_send_ack(struct mg_connection *nc, uint16_t msg_id) {
   return mg_coap_send_message(nc, &cm);
 }
 
+/*
+ * Observation of a resource by a peer (RFC 7641). Observers live in a hash
+ * table attached to the listener and in a per-peer chain attached to the
+ * accepted UDP connection, so that either side can go away first.
+ */
+struct mg_coap_observer {
+  LIST_ENTRY(mg_coap_observer) entries;
+  struct mg_coap_observer *next_of_peer;
+  struct mg_connection *nc;
+  uint32_t hash;
+  uint16_t last_msg_id;
+  uint8_t token_len;
+  char token[8];
+  size_t resource_len;
+  char resource[1];
+};
+
+LIST_HEAD(mg_coap_observer_list, mg_coap_observer);
+
+struct mg_coap_observe_registry {
+  struct mg_coap_observer_list buckets[MG_COAP_OBSERVE_TABLE_SIZE];
+  uint32_t seq;
+  uint16_t next_msg_id;
+};
+
+static uint32_t coap_hash(struct mg_str s) {
+  uint32_t h = 2166136261U;
+  size_t i;
+  for (i = 0; i < s.len; i++) {
+    h = (h ^ (uint8_t) s.p[i]) * 16777619U;
+  }
+  return h;
+}
+
+static void coap_observe_registry_free(void *proto_data) {
+  struct mg_coap_observe_registry *reg =
+      (struct mg_coap_observe_registry *) proto_data;
+  int i;
+  for (i = 0; i < MG_COAP_OBSERVE_TABLE_SIZE; i++) {
+    struct mg_coap_observer *obs;
+    while ((obs = LIST_FIRST(&reg->buckets[i])) != NULL) {
+      LIST_REMOVE(obs, entries);
+      obs->nc->proto_data = NULL;
+      obs->nc->proto_data_destructor = NULL;
+      MG_FREE(obs);
+    }
+  }
+  MG_FREE(reg);
+}
+
+static void coap_observer_chain_free(void *proto_data) {
+  struct mg_coap_observer *obs = (struct mg_coap_observer *) proto_data;
+  while (obs != NULL) {
+    struct mg_coap_observer *next = obs->next_of_peer;
+    LIST_REMOVE(obs, entries);
+    MG_FREE(obs);
+    obs = next;
+  }
+}
+
+static void coap_observer_remove(struct mg_coap_observer *obs) {
+  struct mg_connection *nc = obs->nc;
+  struct mg_coap_observer *o = (struct mg_coap_observer *) nc->proto_data,
+                          *prev = NULL;
+  for (; o != NULL && o != obs; prev = o, o = o->next_of_peer) {
+  }
+  if (o == NULL) return;
+  if (prev == NULL) {
+    nc->proto_data = obs->next_of_peer;
+  } else {
+    prev->next_of_peer = obs->next_of_peer;
+  }
+  if (nc->proto_data == NULL) {
+    /* Nothing to observe anymore, back to the transactional default. */
+    nc->proto_data_destructor = NULL;
+    nc->flags |= MG_F_SEND_AND_CLOSE;
+  }
+  LIST_REMOVE(obs, entries);
+  MG_FREE(obs);
+}
+
+int mg_coap_observe(struct mg_connection *nc, struct mg_coap_message *req,
+                    struct mg_str resource) {
+  struct mg_connection *lc = nc->listener;
+  struct mg_coap_observe_registry *reg;
+  struct mg_coap_observer *obs;
+  uint32_t observe;
+  int registering;
+
+  if (lc == NULL || (nc->flags & MG_F_UDP) == 0 ||
+      (nc->proto_data != NULL &&
+       nc->proto_data_destructor != coap_observer_chain_free)) {
+    return -1;
+  }
+  registering = mg_coap_get_uint_option(req, MG_COAP_OPT_OBSERVE, &observe) &&
+                observe == 0;
+
+  /* The token identifies the observation, see RFC 7641 section 3.1. */
+  for (obs = (struct mg_coap_observer *) nc->proto_data; obs != NULL;
+       obs = obs->next_of_peer) {
+    if (obs->token_len == req->token.len &&
+        memcmp(obs->token, req->token.p, req->token.len) == 0 &&
+        mg_strcmp(mg_mk_str_n(obs->resource, obs->resource_len), resource) ==
+            0) {
+      break;
+    }
+  }
+
+  if (!registering) {
+    if (obs != NULL) coap_observer_remove(obs);
+    return 0;
+  }
+  if (obs != NULL) return 1; /* Re-registration */
+
+  if (lc->proto_data != NULL &&
+      lc->proto_data_destructor != coap_observe_registry_free) {
+    return -1;
+  }
+  reg = (struct mg_coap_observe_registry *) lc->proto_data;
+  if (reg == NULL) {
+    reg = (struct mg_coap_observe_registry *) MG_CALLOC(1, sizeof(*reg));
+    if (reg == NULL) return -1;
+    reg->next_msg_id = (uint16_t) mg_time();
+    lc->proto_data = reg;
+    lc->proto_data_destructor = coap_observe_registry_free;
+  }
+
+  obs = (struct mg_coap_observer *) MG_CALLOC(1, sizeof(*obs) + resource.len);
+  if (obs == NULL) return -1;
+  obs->nc = nc;
+  obs->hash = coap_hash(resource);
+  obs->token_len = (uint8_t) req->token.len;
+  memcpy(obs->token, req->token.p, req->token.len);
+  obs->resource_len = resource.len;
+  memcpy(obs->resource, resource.p, resource.len);
+  LIST_INSERT_HEAD(&reg->buckets[obs->hash % MG_COAP_OBSERVE_TABLE_SIZE], obs,
+                   entries);
+  obs->next_of_peer = (struct mg_coap_observer *) nc->proto_data;
+  nc->proto_data = obs;
+  nc->proto_data_destructor = coap_observer_chain_free;
+  nc->flags &= ~MG_F_SEND_AND_CLOSE;
+
+  return 1;
+}
+
+int mg_coap_notify(struct mg_connection *nc, struct mg_str resource,
+                   struct mg_coap_message *cm) {
+  struct mg_connection *lc = (nc->listener != NULL ? nc->listener : nc);
+  struct mg_coap_observe_registry *reg =
+      (struct mg_coap_observe_registry *) lc->proto_data;
+  struct mg_coap_observer *obs;
+  struct mg_coap_message hdr;
+  struct mg_coap_writer w;
+  uint32_t hash, extra[2];
+  size_t size;
+  char *buf;
+  int n = 0;
+
+  if (reg == NULL || lc->proto_data_destructor != coap_observe_registry_free ||
+      coap_calculate_packet_size(cm, &size) != 0) {
+    return 0;
+  }
+
+  /*
+   * Options and payload are the same for all observers, so they are composed
+   * once; only the header and the token are written per observer.
+   */
+  size += 8; /* Observe option */
+  if ((buf = (char *) MG_MALLOC(size)) == NULL) return 0;
+  reg->seq = (reg->seq + 1) & 0xFFFFFF;
+  extra[0] = MG_COAP_OPT_OBSERVE;
+  extra[1] = reg->seq;
+  memset(&hdr, 0, sizeof(hdr));
+  mg_coap_writer_init(&w, buf, size, &hdr);
+  coap_write_options(&w, cm->options, extra, 1);
+  if (mg_coap_write_payload(&w, cm->payload.p, cm->payload.len) != 0) {
+    MG_FREE(buf); /* LCOV_EXCL_LINE */
+    return 0;     /* LCOV_EXCL_LINE */
+  }
+
+  hdr = *cm;
+  hash = coap_hash(resource);
+  LIST_FOREACH(obs, &reg->buckets[hash % MG_COAP_OBSERVE_TABLE_SIZE],
+               entries) {
+    struct mg_coap_writer hw;
+    char hbuf[12];
+    if (obs->hash != hash || obs->resource_len != resource.len ||
+        memcmp(obs->resource, resource.p, resource.len) != 0 ||
+        obs->nc->send_mbuf.len > 0 ||
+        (obs->nc->flags & MG_F_CLOSE_IMMEDIATELY)) {
+      continue;
+    }
+    hdr.token = mg_mk_str_n(obs->token, obs->token_len);
+    hdr.msg_id = obs->last_msg_id = reg->next_msg_id++;
+    mg_coap_writer_init(&hw, hbuf, sizeof(hbuf), &hdr);
+    if (hw.err != 0) break;
+    /* Both parts end up in the same datagram, see the check above. */
+    mg_send(obs->nc, hbuf, (int) hw.len);
+    mg_send(obs->nc, buf + 4, (int)(w.len - 4));
+    n++;
+  }
+  MG_FREE(buf);
+
+  return n;
+}
+
+/*
+ * Handles RST in response to a notification: the observer is gone.
+ *
+ * Helper function.
+ */
+static void coap_observe_handle_rst(struct mg_connection *nc,
+                                    struct mg_coap_message *cm) {
+  struct mg_coap_observer *obs, *next;
+  if (nc->listener == NULL ||
+      nc->proto_data_destructor != coap_observer_chain_free) {
+    return;
+  }
+  for (obs = (struct mg_coap_observer *) nc->proto_data; obs != NULL;
+       obs = next) {
+    next = obs->next_of_peer;
+    if (obs->last_msg_id == cm->msg_id) {
+      coap_observer_remove(obs);
+    }
+  }
+}
+
+uint32_t mg_coap_send_block2(struct mg_connection *nc,
+                             struct mg_coap_message *req,
+                             struct mg_coap_message *resp, struct mg_str body,
+                             size_t max_block_size) {
+  struct mg_coap_message m = *resp;
+  struct mg_coap_writer w;
+  struct mbuf out;
+  uint32_t num = 0, szx = 6, extra[4], res;
+  size_t req_size, offset = 0, size;
+  int more;
+
+  if (max_block_size == 0) max_block_size = MG_COAP_DEFAULT_BLOCK_SIZE;
+  while (szx > 0 && ((size_t) 16 << szx) > max_block_size) szx--;
+  if (mg_coap_get_block(req, MG_COAP_OPT_BLOCK2, &num, &more, &req_size)) {
+    /* Client's block size is a power of two too; the smaller one wins. */
+    offset = (size_t) num * req_size;
+    while (((size_t) 16 << szx) > req_size) szx--;
+    num = (uint32_t)(offset / ((size_t) 16 << szx));
+  }
+
+  m.msg_id = req->msg_id;
+  m.token = req->token;
+  if (offset > body.len || (offset == body.len && body.len > 0)) {
+    /* Block past the end of the representation. */
+    m.code_class = MG_COAP_CODECLASS_CLIENT_ERR;
+    m.code_detail = 2; /* 4.02 Bad Option */
+    m.options = NULL;
+    m.payload = mg_mk_str_n(NULL, 0);
+    return mg_coap_send_message(nc, &m);
+  }
+
+  m.payload.p = body.p + offset;
+  m.payload.len = body.len - offset;
+  if (m.payload.len > ((size_t) 16 << szx)) m.payload.len = (size_t) 16 << szx;
+  more = (offset + m.payload.len < body.len);
+
+  res = coap_calculate_packet_size(&m, &size);
+  if (res != 0) return res;
+  size += 16; /* Block2 and Size2 options */
+
+  extra[0] = MG_COAP_OPT_BLOCK2;
+  extra[1] = (num << 4) | (more << 3) | szx;
+  extra[2] = MG_COAP_OPT_SIZE2;
+  extra[3] = (uint32_t) body.len;
+
+  mbuf_init(&out, size);
+  mg_coap_writer_init(&w, out.buf, out.size, &m);
+  coap_write_options(&w, m.options, extra, num == 0 && more ? 2 : 1);
+  res = mg_coap_write_payload(&w, m.payload.p, m.payload.len);
+  if (res == 0) {
+    mg_send(nc, out.buf, (int) w.len);
+  }
+  mbuf_free(&out);
+
+  return res;
+}
+
 static void coap_handler(struct mg_connection *nc, int ev,
                          void *ev_data MG_UD_ARG(void *user_data)) {
   struct mbuf *io = &nc->recv_mbuf;
@@ -11672,7 +14292,12 @@ static void coap_handler(struct mg_connection *nc, int ev,
 
   switch (ev) {
     case MG_EV_RECV:
-      parse_res = mg_coap_parse(io, &cm);
+      parse_res = mg_coap_parse_str(mg_mk_str_n(io->buf, io->len), &cm);
+      if ((parse_res & MG_COAP_ERROR) == 0 &&
+          ((nc->flags | (nc->listener != NULL ? nc->listener->flags : 0)) &
+           MG_F_COAP_NO_OPTION_LIST) == 0) {
+        coap_build_option_list(&cm);
+      }
       if ((parse_res & MG_COAP_IGNORE) == 0) {
         if ((cm.flags & MG_COAP_NOT_ENOUGH_DATA) != 0) {
           /*
@@ -11683,6 +14308,9 @@ static void coap_handler(struct mg_connection *nc, int ev,
         }                                   /* LCOV_EXCL_LINE */
         nc->handler(nc, MG_COAP_EVENT_BASE + cm.msg_type,
                     &cm MG_UD_ARG(user_data));
+        if (cm.msg_type == MG_COAP_MSG_RST) {
+          coap_observe_handle_rst(nc, &cm);
+        }
       }
 
       mg_coap_free_options(&cm);
@@ -11739,6 +14367,8 @@ static void mg_tun_init_client(struct mg_tun_client *client, struct mg_mgr *mgr,
   client->iface = iface;
   client->disp_url = dispatcher;
   client->last_stream_id = 0;
+  client->flow_control = 0;
+  memset(client->streams, 0, sizeof(client->streams));
   client->ssl = ssl;
 
   client->disp = NULL;      /* will be set by mg_tun_reconnect */
@@ -11763,16 +14393,27 @@ void mg_tun_log_frame(struct mg_tun_frame *frame) {
 }
 
 static void mg_tun_close_all(struct mg_tun_client *client) {
-  struct mg_connection *nc;
-  for (nc = client->mgr->active_connections; nc != NULL; nc = nc->next) {
-    if (nc->iface == client->iface && !(nc->flags & MG_F_LISTENING)) {
-      LOG(LL_DEBUG, ("Closing tunneled connection %p", nc));
-      nc->flags |= MG_F_CLOSE_IMMEDIATELY;
+  int i;
+  struct mg_tun_stream *s;
+  for (i = 0; i < MG_TUN_STREAM_TABLE_SIZE; i++) {
+    for (s = client->streams[i]; s != NULL; s = s->next) {
+      LOG(LL_DEBUG, ("Closing tunneled connection %p", s->nc));
+      s->nc->flags |= MG_F_CLOSE_IMMEDIATELY;
       /* mg_close_conn(nc); */
     }
   }
 }
 
+static void mg_tun_window_update(struct mg_tun_client *client,
+                                 struct mg_tun_frame *frame) {
+  struct mg_tun_stream *s = mg_tun_if_find_stream(client, frame->stream_id);
+  uint32_t n;
+  if (s == NULL || frame->body.len != sizeof(n)) return;
+  memcpy(&n, frame->body.p, sizeof(n));
+  s->send_window += ntohl(n);
+  mg_tun_if_flush(s->nc);
+}
+
 static void mg_tun_client_handler(struct mg_connection *nc, int ev,
                                   void *ev_data MG_UD_ARG(void *user_data)) {
 #if !MG_ENABLE_CALLBACK_USERDATA
@@ -11803,7 +14444,13 @@ static void mg_tun_client_handler(struct mg_connection *nc, int ev,
       break;
     }
     case MG_EV_WEBSOCKET_HANDSHAKE_DONE: {
-      LOG(LL_INFO, ("Tunnel dispatcher handshake done"));
+      struct http_message *hm = (struct http_message *) ev_data;
+      struct mg_str *proto =
+          hm ? mg_get_http_header(hm, "Sec-WebSocket-Protocol") : NULL;
+      client->flow_control =
+          (proto != NULL && mg_vcmp(proto, MG_TUN_PROTO_NAME_FC) == 0);
+      LOG(LL_INFO, ("Tunnel dispatcher handshake done, flow control: %d",
+                    client->flow_control));
       break;
     }
     case MG_EV_WEBSOCKET_FRAME: {
@@ -11818,6 +14465,13 @@ static void mg_tun_client_handler(struct mg_connection *nc, int ev,
 
       mg_tun_log_frame(&frame);
 
+      if (frame.type == MG_TUN_WINDOW_UPDATE_FRAME) {
+        mg_tun_window_update(client, &frame);
+        break;
+      } else if (frame.type != MG_TUN_DATA_FRAME) {
+        break;
+      }
+
       tc = mg_tun_if_find_conn(client, frame.stream_id);
       if (tc == NULL) {
         if (frame.body.len > 0) {
@@ -11868,7 +14522,8 @@ static void mg_tun_do_reconnect(struct mg_tun_client *client) {
 #endif
   /* HTTP/Websocket listener */
   if ((dc = mg_connect_ws_opt(client->mgr, MG_CB(mg_tun_client_handler, client),
-                              opts, client->disp_url, MG_TUN_PROTO_NAME,
+                              opts, client->disp_url,
+                              MG_TUN_PROTO_NAME_FC ", " MG_TUN_PROTO_NAME,
                               NULL)) == NULL) {
     LOG(LL_ERROR,
         ("Cannot connect to WS server on addr [%s]\n", client->disp_url));
@@ -11876,6 +14531,7 @@ static void mg_tun_do_reconnect(struct mg_tun_client *client) {
   }
 
   client->disp = dc;
+  client->flow_control = 0;
 #if !MG_ENABLE_CALLBACK_USERDATA
   dc->user_data = client;
 #endif
@@ -11961,6 +14617,20 @@ void mg_tun_destroy_client(struct mg_tun_client *client) {
     client->iface->data = NULL;
   }
 
+  if (client != NULL) {
+    /* Tunneled connections outliving the client can't use their streams */
+    int i;
+    struct mg_tun_stream *s;
+    for (i = 0; i < MG_TUN_STREAM_TABLE_SIZE; i++) {
+      while ((s = client->streams[i]) != NULL) {
+        client->streams[i] = s->next;
+        s->nc->mgr_data = NULL;
+        s->nc->flags |= MG_F_CLOSE_IMMEDIATELY;
+        MG_FREE(s);
+      }
+    }
+  }
+
   MG_FREE(client);
 }
 
@@ -12053,33 +14723,19 @@ void mg_tun_send_frame(struct mg_connection *ws, uint32_t stream_id,
 #define SNTP_ATTEMPTS 3
 #endif
 
-static uint64_t mg_get_sec(uint64_t val) {
-  return (val & 0xFFFFFFFF00000000) >> 32;
-}
-
-static uint64_t mg_get_usec(uint64_t val) {
-  uint64_t tmp = (val & 0x00000000FFFFFFFF);
-  tmp *= 1000000;
-  tmp >>= 32;
-  return tmp;
+static double mg_ntp_to_double(const char *ntp) {
+  uint32_t sec, frac;
+  memcpy(&sec, ntp, sizeof(sec));
+  memcpy(&frac, ntp + 4, sizeof(frac));
+  return (double) ntohl(sec) - SNTP_TIME_OFFSET +
+         (double) ntohl(frac) / 4294967296.0;
 }
 
-static void mg_ntp_to_tv(uint64_t val, struct timeval *tv) {
-  uint64_t tmp;
-  tmp = mg_get_sec(val);
-  tmp -= SNTP_TIME_OFFSET;
-  tv->tv_sec = tmp;
-  tv->tv_usec = mg_get_usec(val);
-}
-
-static void mg_get_ntp_ts(const char *ntp, uint64_t *val) {
-  uint32_t tmp;
-  memcpy(&tmp, ntp, sizeof(tmp));
-  tmp = ntohl(tmp);
-  *val = (uint64_t) tmp << 32;
-  memcpy(&tmp, ntp + 4, sizeof(tmp));
-  tmp = ntohl(tmp);
-  *val |= tmp;
+/* NTP short format: 16.16 fixed point */
+static double mg_ntp_short_to_double(const char *ntp) {
+  uint32_t v;
+  memcpy(&v, ntp, sizeof(v));
+  return (double) ntohl(v) / 65536.0;
 }
 
 void mg_sntp_send_request(struct mg_connection *c) {
@@ -12112,32 +14768,26 @@ void mg_sntp_send_request(struct mg_connection *c) {
  * as simple timer), it is better to disable it
 */
 #ifndef MG_SNTP_NO_DELAY_CORRECTION
-  uint32_t sec;
-  sec = htonl((uint32_t)(mg_time() + SNTP_TIME_OFFSET));
-  memcpy(&buf[40], &sec, sizeof(sec));
+  {
+    /* Server echoes it back as the originate timestamp, T1. */
+    double now = mg_time() + SNTP_TIME_OFFSET;
+    uint32_t sec = (uint32_t) now;
+    uint32_t frac = (uint32_t)((now - sec) * 4294967296.0);
+    sec = htonl(sec);
+    frac = htonl(frac);
+    memcpy(&buf[40], &sec, sizeof(sec));
+    memcpy(&buf[44], &frac, sizeof(frac));
+  }
 #endif
 
   mg_send(c, buf, sizeof(buf));
 }
 
-#ifndef MG_SNTP_NO_DELAY_CORRECTION
-static uint64_t mg_calculate_delay(uint64_t t1, uint64_t t2, uint64_t t3) {
-  /* roundloop delay = (T4 - T1) - (T3 - T2) */
-  uint64_t d1 = ((mg_time() + SNTP_TIME_OFFSET) * 1000000) -
-                (mg_get_sec(t1) * 1000000 + mg_get_usec(t1));
-  uint64_t d2 = (mg_get_sec(t3) * 1000000 + mg_get_usec(t3)) -
-                (mg_get_sec(t2) * 1000000 + mg_get_usec(t2));
-
-  return (d1 > d2) ? d1 - d2 : 0;
-}
-#endif
-
 MG_INTERNAL int mg_sntp_parse_reply(const char *buf, int len,
                                     struct mg_sntp_message *msg) {
   uint8_t hdr;
-  uint64_t trsm_ts_T3, delay = 0;
+  double t3, t4 = mg_time();
   int mode;
-  struct timeval tv;
 
   if (len < 48) {
     return -1;
@@ -12158,22 +14808,28 @@ MG_INTERNAL int mg_sntp_parse_reply(const char *buf, int len,
 
   memset(msg, 0, sizeof(*msg));
 
+  msg->stratum = (uint8_t) buf[1];
   msg->kiss_of_death = (buf[1] == 0); /* Server asks to not send requests */
+  msg->root_distance = mg_ntp_short_to_double(&buf[4]) / 2 +
+                       mg_ntp_short_to_double(&buf[8]);
 
-  mg_get_ntp_ts(&buf[40], &trsm_ts_T3);
+  t3 = mg_ntp_to_double(&buf[40]);
+  msg->offset = t3 - t4;
 
 #ifndef MG_SNTP_NO_DELAY_CORRECTION
   {
-    uint64_t orig_ts_T1, recv_ts_T2;
-    mg_get_ntp_ts(&buf[24], &orig_ts_T1);
-    mg_get_ntp_ts(&buf[32], &recv_ts_T2);
-    delay = mg_calculate_delay(orig_ts_T1, recv_ts_T2, trsm_ts_T3);
+    /*
+     * T1 - request sent (local clock), T2 - request received (server clock),
+     * T3 - reply sent (server clock), T4 - reply received (local clock).
+     */
+    double t1 = mg_ntp_to_double(&buf[24]), t2 = mg_ntp_to_double(&buf[32]);
+    msg->delay = (t4 - t1) - (t3 - t2);
+    if (msg->delay < 0) msg->delay = 0;
+    msg->offset = ((t2 - t1) + (t3 - t4)) / 2;
   }
 #endif
 
-  mg_ntp_to_tv(trsm_ts_T3, &tv);
-
-  msg->time = (double) tv.tv_sec + (((double) tv.tv_usec + delay) / 1000000.0);
+  msg->time = t4 + msg->offset;
 
   return 0;
 }
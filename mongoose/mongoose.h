@@ -1687,6 +1687,11 @@ void cs_md5_final(unsigned char *md, cs_md5_ctx *c);
 #define CS_DISABLE_SHA1 0
 #endif
 
+/* Set to 1 to not use SHA-NI or ARMv8 SHA1 instructions even if available. */
+#ifndef CS_DISABLE_SHA1_ACCEL
+#define CS_DISABLE_SHA1_ACCEL 0
+#endif
+
 #if !CS_DISABLE_SHA1
 
 /* Amalgamated: #include "common/platform.h" */
@@ -1903,9 +1908,20 @@ void mbuf_trim(struct mbuf *);
 #define DISABLE_BASE64 0
 #endif
 
+/* Set to 1 to not use SSSE3 or NEON code even if available. */
+#ifndef CS_BASE64_DISABLE_SIMD
+#define CS_BASE64_DISABLE_SIMD 0
+#endif
+
 #if !DISABLE_BASE64
 
 #include <stdio.h>
+#include <stddef.h>
+
+/* Length of base64 encoding of n bytes, without the terminating NUL. */
+#define CS_BASE64_ENCODED_LEN(n) (((n) + 2) / 3 * 4)
+/* Upper bound of the length of n decoded base64 chars. */
+#define CS_BASE64_DECODED_MAX_LEN(n) ((n) / 4 * 3)
 
 #ifdef __cplusplus
 extern "C" {
@@ -1930,6 +1946,24 @@ void cs_base64_encode(const unsigned char *src, int src_len, char *dst);
 void cs_fprint_base64(FILE *f, const unsigned char *src, int src_len);
 int cs_base64_decode(const unsigned char *s, int len, char *dst, int *dec_len);
 
+/*
+ * Encodes `src_len` bytes into `dst`, which must have room for
+ * `CS_BASE64_ENCODED_LEN(src_len)` chars. The output is padded but not
+ * NUL-terminated. Returns the number of chars written.
+ */
+size_t cs_base64_encode_block(const unsigned char *src, size_t src_len,
+                              char *dst);
+
+/*
+ * Decodes `len` base64 chars into `dst`, which must have room for
+ * `CS_BASE64_DECODED_MAX_LEN(len)` bytes. Decoding stops at the first
+ * invalid char or after padding. The output is not NUL-terminated, its length
+ * is stored in `dec_len` unless it is NULL. Returns the number of chars
+ * consumed, same as `cs_base64_decode()`.
+ */
+size_t cs_base64_decode_block(const unsigned char *s, size_t len, char *dst,
+                              size_t *dec_len);
+
 #ifdef __cplusplus
 }
 #endif
@@ -3159,6 +3193,11 @@ struct mg_ssl_if_conn_params {
   const char *cipher_suites;
   const char *psk_identity;
   const char *psk_key;
+  /*
+   * Client session cache key: address plus everything that affects peer
+   * verification and our identity. NULL disables resumption.
+   */
+  const char *session_key;
 };
 
 enum mg_ssl_if_result mg_ssl_if_conn_init(
@@ -3173,6 +3212,41 @@ enum mg_ssl_if_result mg_ssl_if_handshake(struct mg_connection *nc);
 int mg_ssl_if_read(struct mg_connection *nc, void *buf, size_t buf_size);
 int mg_ssl_if_write(struct mg_connection *nc, const void *data, size_t len);
 
+/*
+ * Number of client TLS sessions kept for resumption, shared by all
+ * connections (OpenSSL and mbedTLS only). 0 disables the cache.
+ */
+#ifndef MG_SSL_IF_SESSION_CACHE_SIZE
+#define MG_SSL_IF_SESSION_CACHE_SIZE 4
+#endif
+
+/* Lifetime of session tickets issued by servers, seconds. */
+#ifndef MG_SSL_IF_SESSION_TICKET_LIFETIME
+#define MG_SSL_IF_SESSION_TICKET_LIFETIME 86400
+#endif
+
+#if MG_SSL_IF_SESSION_CACHE_SIZE > 0 && \
+    (MG_SSL_IF == MG_SSL_IF_OPENSSL || MG_SSL_IF == MG_SSL_IF_MBEDTLS)
+/*
+ * Serializes client session cache into `out`, so it can be persisted
+ * and restored with `mg_ssl_if_session_cache_import()` after reboot.
+ * Returns number of sessions exported.
+ */
+int mg_ssl_if_session_cache_export(struct mbuf *out);
+
+/*
+ * Loads sessions previously exported with `mg_ssl_if_session_cache_export()`.
+ * Returns number of sessions imported, -1 if the data is malformed.
+ */
+int mg_ssl_if_session_cache_import(const char *data, size_t len);
+
+/*
+ * Returns a number that changes every time the cache is updated.
+ * Useful to decide when to persist it.
+ */
+unsigned int mg_ssl_if_session_cache_generation(void);
+#endif
+
 #ifdef __cplusplus
 }
 #endif /* __cplusplus */
@@ -3284,6 +3358,10 @@ struct mg_mgr {
   struct v7 *v7;
 #endif
   const char *nameserver; /* DNS server to use */
+#if MG_ENABLE_ASYNC_RESOLVER
+  struct mg_resolve_cache_entry *dns_cache;     /* Recent answers */
+  struct mg_resolve_async_request *dns_pending; /* Outstanding queries */
+#endif
 };
 
 /*
@@ -3340,6 +3418,7 @@ struct mg_connection {
 #define MG_F_DELETE_CHUNK (1 << 13)         /* HTTP specific */
 #define MG_F_ENABLE_BROADCAST (1 << 14)     /* Allow broadcast address usage */
 #define MG_F_TUN_DO_NOT_RECONNECT (1 << 15) /* Don't reconnect tunnel */
+#define MG_F_COAP_NO_OPTION_LIST (1 << 16)  /* CoAP: don't build cm->options */
 
 #define MG_F_USER_1 (1 << 20) /* Flags left for application */
 #define MG_F_USER_2 (1 << 21)
@@ -4201,7 +4280,7 @@ struct mg_ssi_call_ctx {
 
 #if MG_ENABLE_HTTP_WEBSOCKET
 #define MG_EV_WEBSOCKET_HANDSHAKE_REQUEST 111 /* struct http_message * */
-#define MG_EV_WEBSOCKET_HANDSHAKE_DONE 112    /* NULL */
+#define MG_EV_WEBSOCKET_HANDSHAKE_DONE 112    /* struct http_message * or NULL */
 #define MG_EV_WEBSOCKET_FRAME 113             /* struct websocket_message * */
 #define MG_EV_WEBSOCKET_CONTROL_FRAME 114     /* struct websocket_message * */
 #endif
@@ -4240,7 +4319,8 @@ struct mg_ssi_call_ctx {
  * - MG_EV_WEBSOCKET_HANDSHAKE_REQUEST: server has received the WebSocket
  *   handshake request. `ev_data` contains parsed HTTP request.
  * - MG_EV_WEBSOCKET_HANDSHAKE_DONE: server has completed the WebSocket
- *   handshake. `ev_data` is `NULL`.
+ *   handshake. `ev_data` is `NULL` on the server side; on the client side
+ *   it is the server's handshake response (`struct http_message *`).
  * - MG_EV_WEBSOCKET_FRAME: new WebSocket frame has arrived. `ev_data` is
  *   `struct websocket_message *`
  *
@@ -5071,14 +5151,34 @@ int mg_http_create_digest_auth_header(char *buf, size_t buf_len,
 struct mg_mqtt_message {
   int cmd;
   int qos;
+  uint8_t flags; /* Fixed header flags: MG_MQTT_RETAIN, MG_MQTT_DUP, QoS */
   struct mg_str topic;
   struct mg_str payload;
 
   uint8_t connack_ret_code; /* connack */
+  uint8_t session_present;  /* connack */
   uint16_t message_id;      /* puback */
 
-  /* connect */
+  /*
+   * MQTT 5 properties of the packet, raw. Use `mg_mqtt_next_prop()` to
+   * iterate over them. Empty for MQTT 3.1.1.
+   */
+  struct mg_str properties;
+
+  /*
+   * MG_EV_MQTT_PUBLISH_CHUNK: offset of `payload` within the message payload
+   * and the full length of the latter.
+   */
+  size_t payload_offset;
+  size_t payload_total_len;
+
+  /*
+   * Protocol level. For CONNECT it's taken from the packet, for everything
+   * else it's the level negotiated for the connection.
+   */
   uint8_t protocol_version;
+
+  /* connect */
   uint8_t connect_flags;
   uint16_t keep_alive_timer;
   struct mg_str protocol_name;
@@ -5101,13 +5201,51 @@ struct mg_send_mqtt_handshake_opts {
   const char *will_message;
   const char *user_name;
   const char *password;
+  /*
+   * Protocol level: MG_MQTT_PROTO_VERSION_311 (default) or
+   * MG_MQTT_PROTO_VERSION_5. Options below are only used with MQTT 5.
+   */
+  uint8_t protocol_version;
+  /*
+   * Session expiry interval, in seconds. Together with a cleared
+   * MG_MQTT_CLEAN_SESSION flag, allows the session to be resumed later.
+   */
+  uint32_t session_expiry_interval;
+  /* Max number of topic aliases to use in each direction. */
+  uint16_t topic_alias_max;
 };
 
 /* mg_mqtt_proto_data should be in header to allow external access to it */
 struct mg_mqtt_proto_data {
   uint16_t keep_alive;
+  uint8_t protocol_version;
+  uint16_t topic_alias_max;    /* Aliases we accept from the peer */
+  uint16_t topic_alias_max_tx; /* Aliases we may send to the peer */
+  char **rx_aliases;           /* Topics received by alias, alias - 1 */
+  char **tx_aliases;           /* Topics sent by alias, alias - 1 */
+  /* Receive state */
+  size_t frame_len;   /* Length of the frame being received, 0 if unknown */
+  size_t stream_left; /* Payload bytes left of the PUBLISH being streamed */
+  size_t stream_total;
+  char *stream_topic;
+  uint16_t stream_message_id;
+  uint8_t stream_flags;
 };
 
+/* Protocol levels */
+#define MG_MQTT_PROTO_VERSION_311 4
+#define MG_MQTT_PROTO_VERSION_5 5
+
+/* MQTT 5 property identifiers (subset) */
+#define MG_MQTT_PROP_SESSION_EXPIRY_INTERVAL 0x11
+#define MG_MQTT_PROP_ASSIGNED_CLIENT_ID 0x12
+#define MG_MQTT_PROP_SERVER_KEEP_ALIVE 0x13
+#define MG_MQTT_PROP_REASON_STRING 0x1f
+#define MG_MQTT_PROP_RECEIVE_MAXIMUM 0x21
+#define MG_MQTT_PROP_TOPIC_ALIAS_MAXIMUM 0x22
+#define MG_MQTT_PROP_TOPIC_ALIAS 0x23
+#define MG_MQTT_PROP_USER_PROPERTY 0x26
+
 /* Message types */
 #define MG_MQTT_CMD_CONNECT 1
 #define MG_MQTT_CMD_CONNACK 2
@@ -5140,6 +5278,12 @@ struct mg_mqtt_proto_data {
 #define MG_EV_MQTT_PINGREQ (MG_MQTT_EVENT_BASE + MG_MQTT_CMD_PINGREQ)
 #define MG_EV_MQTT_PINGRESP (MG_MQTT_EVENT_BASE + MG_MQTT_CMD_PINGRESP)
 #define MG_EV_MQTT_DISCONNECT (MG_MQTT_EVENT_BASE + MG_MQTT_CMD_DISCONNECT)
+/*
+ * Part of a PUBLISH payload that does not fit into `recv_mbuf_limit`.
+ * Such messages are delivered as a sequence of these events instead of
+ * MG_EV_MQTT_PUBLISH, see `payload_offset` and `payload_total_len`.
+ */
+#define MG_EV_MQTT_PUBLISH_CHUNK (MG_MQTT_EVENT_BASE + 16)
 
 /* Message flags */
 #define MG_MQTT_RETAIN 0x1
@@ -5148,6 +5292,12 @@ struct mg_mqtt_proto_data {
 #define MG_MQTT_GET_QOS(flags) (((flags) &0x6) >> 1)
 #define MG_MQTT_SET_QOS(flags, qos) (flags) = ((flags) & ~0x6) | ((qos) << 1)
 
+/*
+ * SUBACK return codes (one per topic in `payload`) with this bit set mean
+ * that the subscription was rejected (0x80 in 3.1.1, reason codes in 5).
+ */
+#define MG_MQTT_SUBACK_FAILURE 0x80
+
 /* Connection flags */
 #define MG_MQTT_CLEAN_SESSION 0x02
 #define MG_MQTT_HAS_WILL 0x04
@@ -5177,6 +5327,7 @@ extern "C" {
  *
  * - MG_EV_MQTT_CONNACK
  * - MG_EV_MQTT_PUBLISH
+ * - MG_EV_MQTT_PUBLISH_CHUNK
  * - MG_EV_MQTT_PUBACK
  * - MG_EV_MQTT_PUBREC
  * - MG_EV_MQTT_PUBREL
@@ -5212,6 +5363,13 @@ void mg_mqtt_disconnect(struct mg_connection *nc);
 /* Sends a CONNACK command with a given `return_code`. */
 void mg_mqtt_connack(struct mg_connection *nc, uint8_t return_code);
 
+/*
+ * Same as `mg_mqtt_connack()`, but also allows to set the session present
+ * flag.
+ */
+void mg_mqtt_connack_opt(struct mg_connection *nc, uint8_t return_code,
+                         int session_present);
+
 /* Sends a PUBACK command with a given `message_id`. */
 void mg_mqtt_puback(struct mg_connection *nc, uint16_t message_id);
 
@@ -5250,6 +5408,18 @@ void mg_mqtt_pong(struct mg_connection *nc);
 int mg_mqtt_next_subscribe_topic(struct mg_mqtt_message *msg,
                                  struct mg_str *topic, uint8_t *qos, int pos);
 
+/*
+ * Extracts the next MQTT 5 property from `msg->properties`.
+ *
+ * Integer properties are stored in `ival`, string and binary ones in `sval`
+ * (pointing into the message buffer). For user properties (name-value pairs)
+ * `sval` holds the name, the value is skipped.
+ * Returns the pos of the next property or -1 when the list is exhausted or
+ * malformed.
+ */
+int mg_mqtt_next_prop(struct mg_mqtt_message *msg, uint8_t *id, uint32_t *ival,
+                      struct mg_str *sval, int pos);
+
 /*
  * Matches a topic against a topic expression
  *
@@ -5304,29 +5474,90 @@ int mg_mqtt_vmatch_topic_expression(const char *exp, struct mg_str topic);
 extern "C" {
 #endif /* __cplusplus */
 
-#define MG_MQTT_MAX_SESSION_SUBSCRIPTIONS 512;
+#ifndef MG_MQTT_MAX_SESSION_SUBSCRIPTIONS
+#define MG_MQTT_MAX_SESSION_SUBSCRIPTIONS 512
+#endif
+
+/* Max size of QoS 1 messages queued for one session, bytes. */
+#ifndef MG_MQTT_MAX_SESSION_QUEUE_SIZE
+#define MG_MQTT_MAX_SESSION_QUEUE_SIZE 8192
+#endif
+
+/*
+ * Max number of persistent sessions. When a new one is needed, the oldest
+ * offline session is dropped; if all are online, the client gets a clean
+ * session.
+ */
+#ifndef MG_MQTT_MAX_PERSISTENT_SESSIONS
+#define MG_MQTT_MAX_PERSISTENT_SESSIONS 32
+#endif
+
+/*
+ * Max size of a PUBLISH payload that arrives in MG_EV_MQTT_PUBLISH_CHUNK
+ * events and is reassembled by the broker for routing, bytes.
+ */
+#ifndef MG_MQTT_MAX_CHUNKED_PUBLISH_SIZE
+#define MG_MQTT_MAX_CHUNKED_PUBLISH_SIZE 16384
+#endif
+
+/* Max total size of retained messages kept by the broker, bytes. */
+#ifndef MG_MQTT_MAX_RETAINED_SIZE
+#define MG_MQTT_MAX_RETAINED_SIZE 16384
+#endif
 
 struct mg_mqtt_broker;
 
+/*
+ * A stored message: either retained by the broker or queued for delivery
+ * to a session. `topic` and `payload` point into the same allocation.
+ */
+struct mg_mqtt_stored_message {
+  STAILQ_ENTRY(mg_mqtt_stored_message) link;
+  char *topic; /* NUL-terminated */
+  struct mg_str payload;
+  uint16_t message_id; /* Non-zero once sent, until PUBACK */
+  uint8_t qos;
+};
+
+STAILQ_HEAD(mg_mqtt_stored_messages, mg_mqtt_stored_message);
+
 /* MQTT session (Broker side). */
 struct mg_mqtt_session {
   struct mg_mqtt_broker *brk;       /* Broker */
   LIST_ENTRY(mg_mqtt_session) link; /* mg_mqtt_broker::sessions linkage */
-  struct mg_connection *nc;         /* Connection with the client */
-  size_t num_subscriptions;         /* Size of `subscriptions` array */
-  void *user_data;                  /* User data */
+  /*
+   * Connection with the client. NULL for persistent sessions while
+   * the client is offline.
+   */
+  struct mg_connection *nc;
+  size_t num_subscriptions; /* Size of `subscriptions` array */
+  void *user_data;          /* User data */
   struct mg_mqtt_topic_expression *subscriptions;
+  char *client_id;   /* Set for persistent sessions */
+  int persistent;    /* Session survives disconnects */
+  uint16_t last_message_id;
+  struct mg_mqtt_stored_messages queue; /* QoS 1 messages, unsent or unacked */
+  size_t queue_size;                    /* Size of messages in `queue` */
+  struct mbuf chunked; /* PUBLISH payload being reassembled from chunks */
 };
 
 /* MQTT broker. */
 struct mg_mqtt_broker {
   LIST_HEAD(_mg_sesshead, mg_mqtt_session) sessions; /* Session list */
   void *user_data;                                   /* User data */
+  struct mg_mqtt_stored_messages retained; /* Retained messages */
+  size_t retained_size;                    /* Size of retained messages */
 };
 
 /* Initialises a MQTT broker. */
 void mg_mqtt_broker_init(struct mg_mqtt_broker *brk, void *user_data);
 
+/*
+ * Frees all persistent sessions and retained messages of the broker.
+ * Live connections must be closed before calling this.
+ */
+void mg_mqtt_broker_free(struct mg_mqtt_broker *brk);
+
 /*
  * Processes a MQTT broker message.
  *
@@ -5351,6 +5582,17 @@ void mg_mqtt_broker_init(struct mg_mqtt_broker *brk, void *user_data);
  *
  * Since only the MG_EV_ACCEPT message is processed by the listening socket,
  * for most events the `user_data` will thus point to a `mg_mqtt_session`.
+ *
+ * Clients connecting with the clean session flag cleared get a persistent
+ * session keyed by client ID: subscriptions are kept and QoS 1 messages are
+ * queued (up to MG_MQTT_MAX_SESSION_QUEUE_SIZE bytes) while they are offline.
+ * At most MG_MQTT_MAX_PERSISTENT_SESSIONS are kept, the oldest offline one
+ * is dropped to make room for a new one. Subscribing to a filter that is
+ * already subscribed replaces it.
+ * Messages published with the retain flag are stored per topic (up to
+ * MG_MQTT_MAX_RETAINED_SIZE bytes in total) and sent to new subscribers.
+ * Publishes delivered in chunks are reassembled before routing, up to
+ * MG_MQTT_MAX_CHUNKED_PUBLISH_SIZE bytes.
  */
 void mg_mqtt_broker(struct mg_connection *brk, int ev, void *data);
 
@@ -5675,7 +5917,13 @@ struct mg_resolve_async_opts {
   int timeout;        /* in seconds; defaults to 5 if zero */
   int accept_literal; /* pseudo-resolve literal ipv4 and ipv6 addrs */
   int only_literal;   /* only resolves literal addrs; sync cb invocation */
-  struct mg_connection **dns_conn; /* return DNS connection */
+  /* return DNS connection, NULL if the answer comes from the cache */
+  struct mg_connection **dns_conn;
+  /*
+   * For an A query, also send an AAAA query in parallel. Its answer is
+   * delivered if there are no A records.
+   */
+  int parallel_aaaa;
 };
 
 /* See `mg_resolve_async_opt()` */
@@ -5695,6 +5943,14 @@ void mg_set_nameserver(struct mg_mgr *mgr, const char *nameserver);
  * In case of timeout while performing the resolution the callback
  * will receive a NULL `msg`.
  *
+ * Answers are cached in the manager for as long as their TTL allows
+ * (at most `MG_RESOLVE_CACHE_MAX_TTL` seconds, `MG_RESOLVE_CACHE_SIZE` names),
+ * failures for `MG_RESOLVE_NEGATIVE_TTL` seconds. A cached answer is
+ * delivered on the next poll, without a query or a DNS connection. Lookups
+ * of a name that is already being resolved share the outstanding query and
+ * its DNS connection. Only replies that match the transaction id and the
+ * question of the query are accepted.
+ *
  * The DNS answers can be extracted with `mg_next_record` and
  * `mg_dns_parse_record_data`:
  *
@@ -5791,6 +6047,37 @@ int mg_resolve_from_hosts_file(const char *host, union socket_address *usa);
 #define MG_EV_COAP_ACK (MG_COAP_EVENT_BASE + MG_COAP_MSG_ACK)
 #define MG_EV_COAP_RST (MG_COAP_EVENT_BASE + MG_COAP_MSG_RST)
 
+/* Option numbers, RFC 7252 section 12.2, RFC 7641 and RFC 7959. */
+#define MG_COAP_OPT_IF_MATCH 1
+#define MG_COAP_OPT_URI_HOST 3
+#define MG_COAP_OPT_ETAG 4
+#define MG_COAP_OPT_IF_NONE_MATCH 5
+#define MG_COAP_OPT_OBSERVE 6
+#define MG_COAP_OPT_URI_PORT 7
+#define MG_COAP_OPT_LOCATION_PATH 8
+#define MG_COAP_OPT_URI_PATH 11
+#define MG_COAP_OPT_CONTENT_FORMAT 12
+#define MG_COAP_OPT_MAX_AGE 14
+#define MG_COAP_OPT_URI_QUERY 15
+#define MG_COAP_OPT_ACCEPT 17
+#define MG_COAP_OPT_LOCATION_QUERY 20
+#define MG_COAP_OPT_BLOCK2 23
+#define MG_COAP_OPT_BLOCK1 27
+#define MG_COAP_OPT_SIZE2 28
+#define MG_COAP_OPT_PROXY_URI 35
+#define MG_COAP_OPT_PROXY_SCHEME 39
+#define MG_COAP_OPT_SIZE1 60
+
+/* Number of hash buckets used to index observers by resource. */
+#ifndef MG_COAP_OBSERVE_TABLE_SIZE
+#define MG_COAP_OBSERVE_TABLE_SIZE 64
+#endif
+
+/* Block size used by `mg_coap_send_block2()` when the client has no say. */
+#ifndef MG_COAP_DEFAULT_BLOCK_SIZE
+#define MG_COAP_DEFAULT_BLOCK_SIZE 512
+#endif
+
 /*
  * CoAP options.
  * Use mg_coap_add_option and mg_coap_free_options
@@ -5813,6 +6100,23 @@ struct mg_coap_message {
   struct mg_coap_option *options;
   struct mg_str payload;
   struct mg_coap_option *optiomg_tail;
+  /*
+   * Encoded options as they appear in the datagram, walked by
+   * `mg_coap_next_option()`. Set by the parser; not used by the composer.
+   */
+  struct mg_str raw_options;
+};
+
+/*
+ * One-pass CoAP message writer over a caller-provided buffer.
+ * See `mg_coap_writer_init()`.
+ */
+struct mg_coap_writer {
+  char *buf;
+  size_t size;
+  size_t len;
+  uint32_t last_option;
+  uint32_t err;
 };
 
 #ifdef __cplusplus
@@ -5882,6 +6186,128 @@ uint32_t mg_coap_parse(struct mbuf *io, struct mg_coap_message *cm);
  */
 uint32_t mg_coap_compose(struct mg_coap_message *cm, struct mbuf *io);
 
+/*
+ * Parses a CoAP message in place, without allocating memory.
+ *
+ * Same as `mg_coap_parse()`, but `cm->options` is left empty: options are
+ * validated and exposed as `cm->raw_options`, to be walked with
+ * `mg_coap_next_option()`. All the strings in `cm` point into `buf`.
+ */
+uint32_t mg_coap_parse_str(struct mg_str buf, struct mg_coap_message *cm);
+
+/*
+ * Iterates over the options of a parsed message, see `mg_coap_parse_str()`.
+ *
+ * `opt` must be zeroed before the first call: option numbers are delta-encoded
+ * and `opt->number` carries the running sum between calls. `opt->next` is not
+ * used. Returns the position to pass to the next call, or -1 when there are
+ * no more options.
+ *
+ * ```c
+ * struct mg_coap_option opt;
+ * int pos = 0;
+ * memset(&opt, 0, sizeof(opt));
+ * while ((pos = mg_coap_next_option(cm, &opt, pos)) >= 0) {
+ *   if (opt.number == MG_COAP_OPT_URI_PATH) ...
+ * }
+ * ```
+ */
+int mg_coap_next_option(struct mg_coap_message *cm, struct mg_coap_option *opt,
+                        int pos);
+
+/*
+ * Finds the first option with the given number in a parsed message.
+ * Returns 1 and fills `value` if found, 0 otherwise.
+ */
+int mg_coap_get_option(struct mg_coap_message *cm, uint32_t number,
+                       struct mg_str *value);
+
+/*
+ * Same as `mg_coap_get_option()`, but decodes the value as an unsigned
+ * integer (e.g. Observe, Content-Format, Max-Age).
+ */
+int mg_coap_get_uint_option(struct mg_coap_message *cm, uint32_t number,
+                            uint32_t *value);
+
+/*
+ * Decodes a Block1 or Block2 option (RFC 7959): block number, "more" flag and
+ * block size in bytes. Returns 1 if the option is present and valid.
+ */
+int mg_coap_get_block(struct mg_coap_message *cm, uint32_t number,
+                      uint32_t *num, int *more, size_t *size);
+
+/*
+ * Starts writing a message into `buf` of `size` bytes: writes the header and
+ * the token taken from `cm`; `cm->options` and `cm->payload` are ignored.
+ *
+ * Options are then appended with `mg_coap_write_option()` in ascending order
+ * of their numbers, and the message is finished with `mg_coap_write_payload()`.
+ * The message is `w->len` bytes long. Errors are accumulated in `w->err`
+ * (same bits as `mg_coap_send_message()` returns): `MG_COAP_NOT_ENOUGH_DATA`
+ * if the buffer is too small, `MG_COAP_OPTIOMG_FIELD` if options are not
+ * ordered.
+ */
+void mg_coap_writer_init(struct mg_coap_writer *w, char *buf, size_t size,
+                         const struct mg_coap_message *cm);
+
+/* Appends an option to the message being written. */
+void mg_coap_write_option(struct mg_coap_writer *w, uint32_t number,
+                          const void *value, size_t len);
+
+/* Appends an option with an unsigned integer value, minimally encoded. */
+void mg_coap_write_uint_option(struct mg_coap_writer *w, uint32_t number,
+                               uint32_t value);
+
+/*
+ * Appends the payload marker and the payload, if `len` is not 0.
+ * Returns `w->err`, i.e. 0 if the whole message has been written.
+ */
+uint32_t mg_coap_write_payload(struct mg_coap_writer *w, const void *payload,
+                               size_t len);
+
+/*
+ * Handles the Observe option of a request received on a CoAP listener
+ * (RFC 7641): Observe 0 registers the sender as an observer of `resource`,
+ * Observe 1 deregisters it. The request token identifies the observation.
+ *
+ * Registration keeps the peer's UDP connection alive (clears
+ * `MG_F_SEND_AND_CLOSE`). The observer goes away when it deregisters, answers
+ * a notification with RST or its connection is closed.
+ *
+ * Returns 1 if the sender is now observing the resource, 0 if it is not,
+ * -1 on error. The caller still sends the response to the request itself.
+ */
+int mg_coap_observe(struct mg_connection *nc, struct mg_coap_message *req,
+                    struct mg_str resource);
+
+/*
+ * Sends a notification to every observer of `resource`. `nc` is the listener
+ * or any connection accepted by it. Message type, code, options and payload
+ * are taken from `cm`; token, message ID and the Observe option are set per
+ * observer. Returns the number of notifications sent.
+ *
+ * A peer is skipped if its previous datagram has not been flushed yet, as it
+ * would be coalesced with the notification; RFC 7641 only requires the
+ * latest state to be delivered eventually.
+ */
+int mg_coap_notify(struct mg_connection *nc, struct mg_str resource,
+                   struct mg_coap_message *cm);
+
+/*
+ * Responds to `req` with the block of `body` it asks for (RFC 7959 Block2).
+ * Type, code and options are taken from `resp`; the message ID and token
+ * are taken from `req` and Block2 (plus Size2 on the first block) is added.
+ * The block size is the smaller of the one requested by the client and
+ * `max_block_size` (rounded down to a power of two between 16 and 1024;
+ * 0 means `MG_COAP_DEFAULT_BLOCK_SIZE`).
+ *
+ * Return value: see `mg_coap_send_message()`.
+ */
+uint32_t mg_coap_send_block2(struct mg_connection *nc,
+                             struct mg_coap_message *req,
+                             struct mg_coap_message *resp, struct mg_str body,
+                             size_t max_block_size);
+
 #ifdef __cplusplus
 }
 #endif /* __cplusplus */
@@ -5921,6 +6347,13 @@ struct mg_sntp_message {
   int kiss_of_death;
   /* usual mg_time */
   double time;
+  /* Server time minus local time, seconds */
+  double offset;
+  /* Round-trip delay, excluding server processing time, seconds */
+  double delay;
+  /* Server's root delay / 2 + root dispersion: its own error bound, seconds */
+  double root_distance;
+  int stratum;
 };
 
 /* Establishes connection to given sntp server */